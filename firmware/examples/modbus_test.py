@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+"""
+Modbus TCP Test Script for Waveshare ESP32-S3 Relay Control
+
+This script exercises the Modbus TCP server: relays are coils 0-5, holding register 0 is the
+relay bitmask and input registers 0-7 carry telemetry.
+
+Usage:
+    modbus_test.py <device> [port]
+"""
+
+import sys
+import time
+
+from pymodbus.client import ModbusTcpClient
+
+NUM_RELAYS = 6
+
+
+def u32(regs, index):
+    return (regs[index] << 16) | regs[index + 1]
+
+
+def show_telemetry(client):
+    rr = client.read_input_registers(0, count=8)
+    if rr.isError():
+        print(f"Read input registers failed: {rr}")
+        return
+    regs = rr.registers
+    rssi = regs[6] - 0x10000 if regs[6] & 0x8000 else regs[6]
+    print(f"Uptime {u32(regs, 0)} s, free heap {u32(regs, 2)} B (min {u32(regs, 4)} B), "
+          f"RSSI {rssi} dBm, relay mask 0x{regs[7]:02x}")
+
+
+def show_coils(client):
+    rr = client.read_coils(0, count=NUM_RELAYS)
+    if rr.isError():
+        print(f"Read coils failed: {rr}")
+        return
+    print("Relays: " + " ".join("ON" if bit else "off" for bit in rr.bits[:NUM_RELAYS]))
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        sys.exit(1)
+
+    host = sys.argv[1]
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 502
+
+    client = ModbusTcpClient(host, port=port)
+    if not client.connect():
+        print(f"Failed to connect to {host}:{port}")
+        sys.exit(1)
+
+    try:
+        show_telemetry(client)
+        show_coils(client)
+
+        # Function 15: all six coils in one atomic relay commit
+        print("Writing alternating pattern with function 15")
+        client.write_coils(0, [True, False, True, False, True, False])
+        show_coils(client)
+
+        # Function 5: single coil
+        print("Turning relay 2 on with function 5")
+        client.write_coil(1, True)
+        show_coils(client)
+
+        # Function 6: absolute relay bitmask
+        print("Clearing all relays through holding register 0")
+        client.write_register(0, 0)
+        show_coils(client)
+
+        # Polling latency as a SCADA master would see it
+        samples = []
+        for _ in range(200):
+            start = time.perf_counter()
+            client.read_coils(0, count=NUM_RELAYS)
+            samples.append((time.perf_counter() - start) * 1000)
+        samples.sort()
+        print(f"Read coils round trip: median {samples[len(samples) // 2]:.2f} ms, "
+              f"p99 {samples[int(len(samples) * 0.99)]:.2f} ms")
+    finally:
+        client.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""
+UDP Control Client for Waveshare ESP32-S3 Relay Control
+
+This script drives the relays over the authenticated UDP listener. Enable it first:
+
+    curl -X POST http://<device>/udp -d '{"enabled": true, "key": "<32-64 hex chars>"}'
+
+Usage:
+    udp_control.py <device> <hex key> state
+    udp_control.py <device> <hex key> set <mask> [clear_mask]
+    udp_control.py <device> <hex key> bench [count]
+    udp_control.py <group addr> <hex group key> group <lead_ms> <device>:<set>:<clear> ...
+
+Group frames are multicast to all boxes that joined the group (see "group_*" in POST /udp).
+They are not answered; each box applies its own entries at now + lead_ms, so this host's
+clock must be NTP-synchronized like the boxes.
+"""
+
+import hashlib
+import hmac
+import socket
+import struct
+import sys
+import time
+
+UDP_PORT = 5005
+MAGIC = b"RU"
+VERSION = 1
+TYPE_COMMAND = 0x01
+TYPE_STATE = 0x81
+TYPE_GROUP = 0x02
+GROUP_PORT = 5006
+DEVICE_ALL = 0xFF
+MAC_LEN = 8
+
+STATUS_NAMES = ["ok", "duplicate", "stale_epoch", "replay", "invalid", "rejected"]
+
+
+class RelayUdpClient:
+    def __init__(self, host, key, port=UDP_PORT, timeout=0.5):
+        self.addr = (host, port)
+        self.key = key
+        self.epoch = 0
+        self.seq = 0
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.settimeout(timeout)
+
+    def _mac(self, data):
+        return hmac.new(self.key, data, hashlib.sha256).digest()[:MAC_LEN]
+
+    def _exchange(self, command, seq, retries=3):
+        packet = MAGIC + struct.pack("<BBII", VERSION, TYPE_COMMAND, self.epoch, seq) + command
+        packet += self._mac(packet)
+        for _ in range(retries):
+            # Retransmitting the same sequence number is safe: the device applies it once
+            self.sock.sendto(packet, self.addr)
+            try:
+                reply, _ = self.sock.recvfrom(64)
+            except socket.timeout:
+                continue
+            if len(reply) != 32 or reply[:2] != MAGIC or reply[3] != TYPE_STATE:
+                continue
+            if not hmac.compare_digest(reply[-MAC_LEN:], self._mac(reply[:-MAC_LEN])):
+                continue
+            epoch, rseq, status, mask, applied_at_us = struct.unpack_from("<IIBBxxq", reply, 4)
+            if rseq != seq:
+                continue
+            return epoch, status, mask, applied_at_us
+        raise TimeoutError("no reply from device")
+
+    def sync(self):
+        """Learn the device epoch (changes on every reboot) and restart the sequence"""
+        epoch, _, mask, _ = self._exchange(b"", 0)
+        self.epoch = epoch
+        self.seq = 0
+        return mask
+
+    def state(self):
+        return self.sync()
+
+    def command(self, set_mask, clear_mask=0):
+        if self.epoch == 0:
+            self.sync()
+        self.seq += 1
+        frame = bytes([(1 << 4) | 1, set_mask, clear_mask])
+        epoch, status, mask, applied_at_us = self._exchange(frame, self.seq)
+        if STATUS_NAMES[status] == "stale_epoch":
+            self.epoch = epoch
+            self.seq = 1
+            epoch, status, mask, applied_at_us = self._exchange(frame, self.seq)
+        return STATUS_NAMES[status] if status < len(STATUS_NAMES) else status, mask, applied_at_us
+
+
+class RelayGroupSender:
+    def __init__(self, group, key, port=GROUP_PORT, ttl=1):
+        self.addr = (group, port)
+        self.key = key
+        # Boxes only keep a replay window, so start above anything a previous run sent
+        # (assuming it averaged under 10 frames per second)
+        self.seq = int(time.time() * 10) & 0xFFFFFFFF
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, ttl)
+
+    def send(self, entries, lead_ms=50):
+        """entries: list of (device_id, set_mask, clear_mask); device 0xFF addresses every box"""
+        self.seq = (self.seq + 1) & 0xFFFFFFFF
+        apply_at_us = int(time.time() * 1_000_000) + lead_ms * 1000
+        packet = MAGIC + struct.pack("<BBIqB", VERSION, TYPE_GROUP, self.seq, apply_at_us, len(entries))
+        for device, set_mask, clear_mask in entries:
+            packet += bytes([device, set_mask, clear_mask])
+        packet += hmac.new(self.key, packet, hashlib.sha256).digest()[:MAC_LEN]
+        self.sock.sendto(packet, self.addr)
+        return apply_at_us
+
+
+def main():
+    if len(sys.argv) < 4:
+        print(__doc__)
+        sys.exit(1)
+
+    action = sys.argv[3]
+    if action == "group":
+        sender = RelayGroupSender(sys.argv[1], bytes.fromhex(sys.argv[2]))
+        entries = [tuple(int(v, 0) for v in arg.split(":")) for arg in sys.argv[5:]]
+        apply_at_us = sender.send(entries, int(sys.argv[4]))
+        print(f"Sent {len(entries)} entries, apply at {apply_at_us} us")
+        return
+
+    client = RelayUdpClient(sys.argv[1], bytes.fromhex(sys.argv[2]))
+
+    if action == "state":
+        print(f"Relay mask: 0x{client.state():02x}")
+    elif action == "set":
+        set_mask = int(sys.argv[4], 0)
+        clear_mask = int(sys.argv[5], 0) if len(sys.argv) > 5 else 0
+        status, mask, applied_at_us = client.command(set_mask, clear_mask)
+        print(f"{status}: mask 0x{mask:02x} applied at {applied_at_us} us")
+    elif action == "bench":
+        count = int(sys.argv[4]) if len(sys.argv) > 4 else 1000
+        client.sync()
+        rtts = []
+        for i in range(count):
+            start = time.perf_counter()
+            client.command(1 if i % 2 == 0 else 0, 0 if i % 2 == 0 else 1)
+            rtts.append((time.perf_counter() - start) * 1000)
+        rtts.sort()
+        print(f"{count} commands: median {rtts[len(rtts) // 2]:.2f} ms, "
+              f"p99 {rtts[int(len(rtts) * 0.99)]:.2f} ms, max {rtts[-1]:.2f} ms")
+    else:
+        print(__doc__)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -4,8 +4,10 @@
 
 #include "esp_err.h"
 #include <mqtt_client.h>
+#include <stdbool.h>
+#include <stdint.h>
 
-// MQTT Configuration
+// MQTT Configuration (defaults, overridden at runtime by the config stored in NVS)
 #define MQTT_BROKER_URL "mqtt://192.168.1.138"
 #define MQTT_BROKER_PORT 1883
 #define MQTT_CLIENT_ID "waveshare-relay-esp32s3"
@@ -17,13 +19,69 @@
 #define MQTT_TOPIC_SET "/set"
 #define MQTT_TOPIC_STATUS "/status"
 #define MQTT_TOPIC_CONFIG "/config"
+#define MQTT_TOPIC_ACK "/ack"
+#define MQTT_TOPIC_SET_BIN "/set/bin"   // Binary frame or CBOR commands
+#define MQTT_TOPIC_ACK_BIN "/ack/bin"   // CBOR acks for binary commands
+#define MQTT_TOPIC_MODE "/mode"         // Pulse, blink and auto-off (see relay_timer.h)
+#define MQTT_TOPIC_USAGE "/usage"       // Relay cycle counts and on-time
+#define MQTT_TOPIC_TRACE "/trace"       // Hot-path latency histograms (see trace.h)
+#define MQTT_TOPIC_TASKS "/tasks"       // Per-task CPU share, core load and stack (see task_stats.h)
+#define MQTT_TOPIC_HEAP "/heap"         // Heap levels, fragmentation and allocation rates (see heap_monitor.h)
+#define MQTT_TOPIC_LOG "/log"           // Forwarded log lines, newline separated (see log_forward.h)
+
+#define MQTT_DEFAULT_QOS 1
+#define MQTT_DEFAULT_KEEPALIVE 60
+
+// Protocol versions as used on the wire (CONNECT protocol level)
+#define MQTT_PROTOCOL_VERSION_311 4
+#define MQTT_PROTOCOL_VERSION_5 5
+// 3.1.1 unless a stored config says otherwise; MQTT 5 is opted into with POST /mqtt
+#define MQTT_DEFAULT_PROTOCOL_VERSION MQTT_PROTOCOL_VERSION_311
+// Connections lost in a row with an alias-only publish unacknowledged before topic aliases
+// are treated as refused by the broker and turned off until reboot
+#define MQTT5_ALIAS_MAX_DROPS 2
+
+// MQTT 5 topic aliases for frequently published topics (0 = no alias)
+#define MQTT5_TOPIC_ALIAS_STATUS 1
+#define MQTT5_TOPIC_ALIAS_ACK 2
+#define MQTT5_TOPIC_ALIAS_COUNT 2
+
+// Runtime configuration limits
+#define MQTT_MAX_BROKERS 3
+#define MQTT_URI_MAX_LEN 128
+#define MQTT_CRED_MAX_LEN 64
+#define MQTT_TOPIC_ROOT_MAX_LEN 64
+#define MQTT_TOPIC_MAX_LEN (MQTT_TOPIC_ROOT_MAX_LEN + 16)
+
+// Runtime MQTT configuration, persisted in NVS and applied without a reboot
+typedef struct {
+    bool enabled;
+    uint8_t broker_count;                           // Brokers are tried in order on failure
+    char brokers[MQTT_MAX_BROKERS][MQTT_URI_MAX_LEN];
+    char username[MQTT_CRED_MAX_LEN];
+    char password[MQTT_CRED_MAX_LEN];
+    char topic_root[MQTT_TOPIC_ROOT_MAX_LEN];
+    uint8_t qos;
+    uint16_t keepalive;
+    uint8_t protocol_version;                       // MQTT_PROTOCOL_VERSION_311 or _5
+} app_mqtt_config_t;
 
 // Function declarations
 esp_err_t mqtt_client_init(void);
 esp_err_t mqtt_client_start(void);
 esp_err_t mqtt_client_stop(void);
+bool mqtt_client_is_connected(void);
 esp_err_t mqtt_publish_status(const char* status_json);
 esp_err_t mqtt_publish_config(const char* config_json);
+esp_err_t mqtt_publish_ack(const char* ack_json);
+esp_err_t mqtt_publish_ack_binary(const uint8_t *ack, int len);
+esp_err_t mqtt_publish_usage(const char *usage_json);
+esp_err_t mqtt_publish_trace(const char *trace_json);
+esp_err_t mqtt_publish_tasks(const char *tasks_json);
+esp_err_t mqtt_publish_heap(const char *heap_json);
+esp_err_t mqtt_publish_log(const char *lines);
+void mqtt_client_get_config(app_mqtt_config_t *config);
+esp_err_t mqtt_client_set_config(const app_mqtt_config_t *config);
 
 // External variables
 extern esp_mqtt_client_handle_t mqtt_client;
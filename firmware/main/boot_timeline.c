@@ -0,0 +1,233 @@
+#include "boot_timeline.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "util.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "BOOT";
+
+static const char *boot_timeline_milestone_names[BOOT_TIMELINE_MILESTONE_COUNT] = {
+    [BOOT_TIMELINE_APP_MAIN] = "app_main",
+    [BOOT_TIMELINE_RELAYS_RESTORED] = "relays_restored",
+    [BOOT_TIMELINE_INIT_DONE] = "init_done",
+    [BOOT_TIMELINE_WIFI_CONNECTED] = "wifi_connected",
+    [BOOT_TIMELINE_MQTT_CONNECTED] = "mqtt_connected",
+    [BOOT_TIMELINE_FIRST_COMMAND] = "first_command",
+};
+
+static portMUX_TYPE boot_timeline_lock = portMUX_INITIALIZER_UNLOCKED;
+static boot_timeline_t boot_timeline;
+
+// Bit i set once milestone i is stamped, so later calls return without the lock
+static atomic_uint boot_timeline_milestone_mask = 0;
+
+// Parallel phases: the function the task runs and the event group bit set when it ends
+static boot_timeline_fn_t boot_timeline_fns[BOOT_TIMELINE_MAX_PHASES];
+static int8_t boot_timeline_bits[BOOT_TIMELINE_MAX_PHASES];
+static uint8_t boot_timeline_parallel_count = 0;
+static EventGroupHandle_t boot_timeline_events = NULL;
+
+const char *boot_timeline_milestone_name(boot_timeline_milestone_t milestone)
+{
+    return (unsigned)milestone < BOOT_TIMELINE_MILESTONE_COUNT ? boot_timeline_milestone_names[milestone]
+                                                                : "unknown";
+}
+
+// Take the next slot; -1 when the table is full (the phase still runs, untimed)
+static int boot_timeline_reserve(const char *name)
+{
+    int phase = -1;
+    portENTER_CRITICAL(&boot_timeline_lock);
+    if (boot_timeline.phase_count < BOOT_TIMELINE_MAX_PHASES) {
+        phase = boot_timeline.phase_count++;
+        boot_timeline.phases[phase].name = name;
+        boot_timeline_bits[phase] = -1;
+    }
+    portEXIT_CRITICAL(&boot_timeline_lock);
+    return phase;
+}
+
+static void boot_timeline_begin(int phase)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&boot_timeline_lock);
+    boot_timeline.phases[phase].start_us = now;
+    boot_timeline.phases[phase].core = (int8_t)xPortGetCoreID();
+    portEXIT_CRITICAL(&boot_timeline_lock);
+}
+
+static void boot_timeline_end(int phase, esp_err_t result)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&boot_timeline_lock);
+    boot_timeline.phases[phase].end_us = now > 0 ? now : 1;
+    boot_timeline.phases[phase].result = result;
+    portEXIT_CRITICAL(&boot_timeline_lock);
+
+    if (boot_timeline_bits[phase] >= 0) {
+        xEventGroupSetBits(boot_timeline_events, 1u << boot_timeline_bits[phase]);
+    }
+}
+
+// Call first thing in app_main
+esp_err_t boot_timeline_init(void)
+{
+    boot_timeline_milestone(BOOT_TIMELINE_APP_MAIN);
+    boot_timeline_events = xEventGroupCreate();
+    if (boot_timeline_events == NULL) {
+        ESP_LOGE(TAG, "Failed to create boot event group");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+// Run fn on the calling task and record it as a phase
+esp_err_t boot_timeline_run(const char *name, boot_timeline_fn_t fn)
+{
+    int phase = boot_timeline_reserve(name);
+    if (phase < 0) {
+        return fn();
+    }
+    boot_timeline_begin(phase);
+    esp_err_t ret = fn();
+    boot_timeline_end(phase, ret);
+    return ret;
+}
+
+static void boot_timeline_task(void *arg)
+{
+    int phase = (int)(intptr_t)arg;
+    boot_timeline_begin(phase);
+    boot_timeline_end(phase, boot_timeline_fns[phase]());
+    vTaskDelete(NULL);
+}
+
+// Run fn in a task of its own on the given core and return right away. Pass the result
+// to boot_timeline_wait() before using anything fn sets up. If no task can be started fn
+// runs here instead, so the caller's ordering stays correct either way.
+int boot_timeline_start(const char *name, boot_timeline_fn_t fn, BaseType_t core)
+{
+    int phase = boot_timeline_reserve(name);
+    if (phase < 0) {
+        fn();
+        return -1;
+    }
+
+    if (boot_timeline_events != NULL && boot_timeline_parallel_count < BOOT_TIMELINE_MAX_PARALLEL) {
+        boot_timeline_fns[phase] = fn;
+        boot_timeline_bits[phase] = boot_timeline_parallel_count++;
+        if (xTaskCreatePinnedToCore(boot_timeline_task, name, BOOT_TIMELINE_TASK_STACK_SIZE, (void *)(intptr_t)phase,
+                                    BOOT_TIMELINE_TASK_PRIORITY, NULL, core) == pdPASS) {
+            return phase;
+        }
+        ESP_LOGW(TAG, "Failed to create task for %s, running it inline", name);
+    }
+
+    boot_timeline_begin(phase);
+    boot_timeline_end(phase, fn());
+    return phase;
+}
+
+// Block until a phase from boot_timeline_start() has finished and return its result
+esp_err_t boot_timeline_wait(int phase)
+{
+    if (phase < 0 || phase >= BOOT_TIMELINE_MAX_PHASES) {
+        return ESP_OK;
+    }
+    if (boot_timeline_bits[phase] >= 0) {
+        xEventGroupWaitBits(boot_timeline_events, 1u << boot_timeline_bits[phase], pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+    portENTER_CRITICAL(&boot_timeline_lock);
+    esp_err_t result = boot_timeline.phases[phase].result;
+    portEXIT_CRITICAL(&boot_timeline_lock);
+    return result;
+}
+
+// Stamp a milestone the first time it is reached; cheap enough for the relay commit path
+void boot_timeline_milestone(boot_timeline_milestone_t milestone)
+{
+    if ((unsigned)milestone >= BOOT_TIMELINE_MILESTONE_COUNT) {
+        return;
+    }
+    unsigned bit = 1u << milestone;
+    if (atomic_load_explicit(&boot_timeline_milestone_mask, memory_order_relaxed) & bit) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&boot_timeline_lock);
+    if ((atomic_load_explicit(&boot_timeline_milestone_mask, memory_order_relaxed) & bit) == 0) {
+        boot_timeline.milestones_us[milestone] = now > 0 ? now : 1;
+        atomic_fetch_or_explicit(&boot_timeline_milestone_mask, bit, memory_order_relaxed);
+    }
+    portEXIT_CRITICAL(&boot_timeline_lock);
+}
+
+// End of app_main's init: stamp init_done and log each phase with its start, duration and core
+void boot_timeline_finish(void)
+{
+    boot_timeline_milestone(BOOT_TIMELINE_INIT_DONE);
+
+    // One phase at a time; app_main's stack is too small for a copy of the whole table
+    portENTER_CRITICAL(&boot_timeline_lock);
+    int64_t done = boot_timeline.milestones_us[BOOT_TIMELINE_INIT_DONE];
+    int64_t restored = boot_timeline.milestones_us[BOOT_TIMELINE_RELAYS_RESTORED];
+    int count = boot_timeline.phase_count;
+    portEXIT_CRITICAL(&boot_timeline_lock);
+    ESP_LOGI(TAG, "Init done at %" PRId64 " ms, relays restored at %" PRId64 " ms", done / 1000, restored / 1000);
+
+    for (int i = 0; i < count; i++) {
+        portENTER_CRITICAL(&boot_timeline_lock);
+        boot_timeline_phase_t p = boot_timeline.phases[i];
+        portEXIT_CRITICAL(&boot_timeline_lock);
+        int64_t duration = p.end_us - p.start_us;
+        ESP_LOGI(TAG, "  %-16s %6" PRId64 " ms  +%5" PRId64 ".%" PRId64 " ms  core %d%s%s", p.name,
+                 p.start_us / 1000, duration / 1000, duration / 100 % 10, p.core,
+                 p.result != ESP_OK ? "  " : "", p.result != ESP_OK ? esp_err_to_name(p.result) : "");
+    }
+}
+
+void boot_timeline_get(boot_timeline_t *timeline)
+{
+    portENTER_CRITICAL(&boot_timeline_lock);
+    *timeline = boot_timeline;
+    portEXIT_CRITICAL(&boot_timeline_lock);
+}
+
+int boot_timeline_format_json(char *buf, size_t buf_size)
+{
+    boot_timeline_t timeline;
+    boot_timeline_get(&timeline);
+
+    size_t len = 0;
+    len = buf_appendf(buf, buf_size, len, "{\"phases\":[");
+    for (int i = 0; i < timeline.phase_count; i++) {
+        const boot_timeline_phase_t *p = &timeline.phases[i];
+        len = buf_appendf(buf, buf_size, len, "%s{\"name\":\"%s\",\"start_us\":%" PRId64 ",", i > 0 ? "," : "",
+                          p->name, p->start_us);
+        if (p->end_us != 0) {
+            len = buf_appendf(buf, buf_size, len, "\"end_us\":%" PRId64 ",\"core\":%d,\"result\":\"%s\"}",
+                              p->end_us, p->core, esp_err_to_name(p->result));
+        } else {
+            len = buf_appendf(buf, buf_size, len, "\"end_us\":null,\"core\":%d,\"result\":null}", p->core);
+        }
+    }
+    len = buf_appendf(buf, buf_size, len, "],\"milestones\":{");
+    for (int i = 0; i < BOOT_TIMELINE_MILESTONE_COUNT; i++) {
+        if (timeline.milestones_us[i] != 0) {
+            len = buf_appendf(buf, buf_size, len, "%s\"%s\":%" PRId64, i > 0 ? "," : "",
+                              boot_timeline_milestone_names[i], timeline.milestones_us[i]);
+        } else {
+            len = buf_appendf(buf, buf_size, len, "%s\"%s\":null", i > 0 ? "," : "",
+                              boot_timeline_milestone_names[i]);
+        }
+    }
+    len = buf_appendf(buf, buf_size, len, "}}");
+    return (int)len;
+}
@@ -0,0 +1,71 @@
+#ifndef BOOT_TIMELINE_H
+#define BOOT_TIMELINE_H
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Boot timeline. Every init phase in app_main is timed (start and end in microseconds of
+// esp_timer_get_time(), i.e. since startup, the core it ran on and its result), and
+// milestones such as the first Wi-Fi connection and the first relay command are stamped
+// once. Independent phases can be started as tasks on the other core and joined later.
+#ifndef BOOT_TIMELINE_MAX_PHASES
+#define BOOT_TIMELINE_MAX_PHASES 32
+#endif
+// Phases started with boot_timeline_start(); each needs an event group bit
+#define BOOT_TIMELINE_MAX_PARALLEL 8
+// Core for phases that run alongside app_main, which is on core 0
+#ifndef BOOT_TIMELINE_PARALLEL_CORE
+#define BOOT_TIMELINE_PARALLEL_CORE (portNUM_PROCESSORS > 1 ? 1 : tskNO_AFFINITY)
+#endif
+// boot_timeline_format_json() output with the phase table full
+#ifndef BOOT_TIMELINE_JSON_MAX_LEN
+#define BOOT_TIMELINE_JSON_MAX_LEN 3072
+#endif
+
+#ifndef BOOT_TIMELINE_TASK_PRIORITY
+#define BOOT_TIMELINE_TASK_PRIORITY 5
+#endif
+#ifndef BOOT_TIMELINE_TASK_STACK_SIZE
+#define BOOT_TIMELINE_TASK_STACK_SIZE 4096
+#endif
+
+typedef enum {
+    BOOT_TIMELINE_APP_MAIN = 0,         // app_main entered
+    BOOT_TIMELINE_RELAYS_RESTORED,      // Relay GPIOs configured and the power-on state applied
+    BOOT_TIMELINE_INIT_DONE,            // app_main finished initializing, parallel phases joined
+    BOOT_TIMELINE_WIFI_CONNECTED,       // First STA address
+    BOOT_TIMELINE_MQTT_CONNECTED,       // First broker connection
+    BOOT_TIMELINE_FIRST_COMMAND,        // First relay change from a client (not boot, timer or schedule)
+    BOOT_TIMELINE_MILESTONE_COUNT
+} boot_timeline_milestone_t;
+
+typedef esp_err_t (*boot_timeline_fn_t)(void);
+
+typedef struct {
+    const char *name;
+    int64_t start_us;
+    int64_t end_us;                 // 0 while the phase is running
+    int8_t core;
+    esp_err_t result;
+} boot_timeline_phase_t;
+
+typedef struct {
+    uint8_t phase_count;
+    boot_timeline_phase_t phases[BOOT_TIMELINE_MAX_PHASES];    // In start order
+    int64_t milestones_us[BOOT_TIMELINE_MILESTONE_COUNT];       // 0 until reached
+} boot_timeline_t;
+
+// Function declarations
+esp_err_t boot_timeline_init(void);
+esp_err_t boot_timeline_run(const char *name, boot_timeline_fn_t fn);
+int boot_timeline_start(const char *name, boot_timeline_fn_t fn, BaseType_t core);
+esp_err_t boot_timeline_wait(int phase);
+void boot_timeline_milestone(boot_timeline_milestone_t milestone);
+void boot_timeline_finish(void);
+void boot_timeline_get(boot_timeline_t *timeline);
+const char *boot_timeline_milestone_name(boot_timeline_milestone_t milestone);
+int boot_timeline_format_json(char *buf, size_t buf_size);
+
+#endif // BOOT_TIMELINE_H
@@ -0,0 +1,258 @@
+#include "cbor_lite.h"
+#include <string.h>
+
+// Nesting limit for cbor_lite_skip()
+#define CBOR_LITE_MAX_DEPTH 4
+
+void cbor_lite_reader_init(cbor_lite_reader_t *r, const uint8_t *buf, size_t len)
+{
+    r->buf = buf;
+    r->len = len;
+    r->pos = 0;
+}
+
+esp_err_t cbor_lite_peek_major(const cbor_lite_reader_t *r, uint8_t *major)
+{
+    if (r->pos >= r->len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *major = r->buf[r->pos] >> 5;
+    return ESP_OK;
+}
+
+esp_err_t cbor_lite_read_head(cbor_lite_reader_t *r, uint8_t *major, uint64_t *value)
+{
+    if (r->pos >= r->len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint8_t initial = r->buf[r->pos++];
+    uint8_t info = initial & 0x1f;
+    *major = initial >> 5;
+
+    if (info < 24) {
+        *value = info;
+        return ESP_OK;
+    }
+    if (info > 27) {
+        return ESP_ERR_NOT_SUPPORTED; // Indefinite lengths and reserved values
+    }
+
+    size_t bytes = (size_t)1 << (info - 24);
+    if (r->len - r->pos < bytes) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint64_t v = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        v = (v << 8) | r->buf[r->pos++];
+    }
+    *value = v;
+    return ESP_OK;
+}
+
+static esp_err_t cbor_lite_expect(cbor_lite_reader_t *r, uint8_t expected, uint64_t *value)
+{
+    size_t start = r->pos;
+    uint8_t major;
+    esp_err_t err = cbor_lite_read_head(r, &major, value);
+    if (err == ESP_OK && major != expected) {
+        err = ESP_ERR_INVALID_ARG;
+    }
+    if (err != ESP_OK) {
+        r->pos = start;
+    }
+    return err;
+}
+
+esp_err_t cbor_lite_read_uint(cbor_lite_reader_t *r, uint64_t *value)
+{
+    return cbor_lite_expect(r, CBOR_MAJOR_UINT, value);
+}
+
+esp_err_t cbor_lite_read_bool(cbor_lite_reader_t *r, bool *value)
+{
+    uint64_t simple;
+    esp_err_t err = cbor_lite_expect(r, CBOR_MAJOR_SIMPLE, &simple);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (simple != CBOR_SIMPLE_FALSE && simple != CBOR_SIMPLE_TRUE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *value = simple == CBOR_SIMPLE_TRUE;
+    return ESP_OK;
+}
+
+static esp_err_t cbor_lite_read_string(cbor_lite_reader_t *r, uint8_t major, const uint8_t **data, size_t *len)
+{
+    uint64_t length;
+    esp_err_t err = cbor_lite_expect(r, major, &length);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (length > r->len - r->pos) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *data = &r->buf[r->pos];
+    *len = (size_t)length;
+    r->pos += (size_t)length;
+    return ESP_OK;
+}
+
+esp_err_t cbor_lite_read_text(cbor_lite_reader_t *r, const char **str, size_t *len)
+{
+    return cbor_lite_read_string(r, CBOR_MAJOR_TEXT, (const uint8_t **)str, len);
+}
+
+esp_err_t cbor_lite_read_bytes(cbor_lite_reader_t *r, const uint8_t **data, size_t *len)
+{
+    return cbor_lite_read_string(r, CBOR_MAJOR_BYTES, data, len);
+}
+
+esp_err_t cbor_lite_read_map(cbor_lite_reader_t *r, size_t *pairs)
+{
+    uint64_t count;
+    esp_err_t err = cbor_lite_expect(r, CBOR_MAJOR_MAP, &count);
+    if (err != ESP_OK) {
+        return err;
+    }
+    // Each pair needs at least two bytes; rejects absurd counts early
+    if (count > (r->len - r->pos) / 2) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *pairs = (size_t)count;
+    return ESP_OK;
+}
+
+static esp_err_t cbor_lite_skip_depth(cbor_lite_reader_t *r, int depth)
+{
+    if (depth > CBOR_LITE_MAX_DEPTH) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    uint8_t major;
+    uint64_t value;
+    esp_err_t err = cbor_lite_read_head(r, &major, &value);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    switch (major) {
+    case CBOR_MAJOR_BYTES:
+    case CBOR_MAJOR_TEXT:
+        if (value > r->len - r->pos) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        r->pos += (size_t)value;
+        return ESP_OK;
+    case CBOR_MAJOR_ARRAY:
+    case CBOR_MAJOR_MAP: {
+        uint64_t items = (major == CBOR_MAJOR_MAP) ? value * 2 : value;
+        if (items > r->len - r->pos) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        for (uint64_t i = 0; i < items; i++) {
+            err = cbor_lite_skip_depth(r, depth + 1);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        return ESP_OK;
+    }
+    case CBOR_MAJOR_TAG:
+        return cbor_lite_skip_depth(r, depth + 1);
+    default:
+        return ESP_OK;
+    }
+}
+
+esp_err_t cbor_lite_skip(cbor_lite_reader_t *r)
+{
+    return cbor_lite_skip_depth(r, 0);
+}
+
+void cbor_lite_writer_init(cbor_lite_writer_t *w, uint8_t *buf, size_t size)
+{
+    w->buf = buf;
+    w->size = size;
+    w->pos = 0;
+    w->overflow = false;
+}
+
+static void cbor_lite_put(cbor_lite_writer_t *w, const uint8_t *data, size_t len)
+{
+    if (w->overflow || w->size - w->pos < len) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(&w->buf[w->pos], data, len);
+    w->pos += len;
+}
+
+void cbor_lite_write_head(cbor_lite_writer_t *w, uint8_t major, uint64_t value)
+{
+    uint8_t head[9];
+    size_t len;
+
+    if (value < 24) {
+        head[0] = (uint8_t)((major << 5) | value);
+        len = 1;
+    } else {
+        size_t bytes = value <= 0xff ? 1 : value <= 0xffff ? 2 : value <= 0xffffffffULL ? 4 : 8;
+        uint8_t info = bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27;
+        head[0] = (uint8_t)((major << 5) | info);
+        for (size_t i = 0; i < bytes; i++) {
+            head[1 + i] = (uint8_t)(value >> (8 * (bytes - 1 - i)));
+        }
+        len = 1 + bytes;
+    }
+    cbor_lite_put(w, head, len);
+}
+
+void cbor_lite_write_uint(cbor_lite_writer_t *w, uint64_t value)
+{
+    cbor_lite_write_head(w, CBOR_MAJOR_UINT, value);
+}
+
+void cbor_lite_write_int(cbor_lite_writer_t *w, int64_t value)
+{
+    if (value >= 0) {
+        cbor_lite_write_head(w, CBOR_MAJOR_UINT, (uint64_t)value);
+    } else {
+        cbor_lite_write_head(w, CBOR_MAJOR_NINT, (uint64_t)(-1 - value));
+    }
+}
+
+void cbor_lite_write_bool(cbor_lite_writer_t *w, bool value)
+{
+    cbor_lite_write_head(w, CBOR_MAJOR_SIMPLE, value ? CBOR_SIMPLE_TRUE : CBOR_SIMPLE_FALSE);
+}
+
+void cbor_lite_write_text(cbor_lite_writer_t *w, const char *str)
+{
+    size_t len = strlen(str);
+    cbor_lite_write_head(w, CBOR_MAJOR_TEXT, len);
+    cbor_lite_put(w, (const uint8_t *)str, len);
+}
+
+void cbor_lite_write_bytes(cbor_lite_writer_t *w, const uint8_t *data, size_t len)
+{
+    cbor_lite_write_head(w, CBOR_MAJOR_BYTES, len);
+    cbor_lite_put(w, data, len);
+}
+
+void cbor_lite_write_map(cbor_lite_writer_t *w, size_t pairs)
+{
+    cbor_lite_write_head(w, CBOR_MAJOR_MAP, pairs);
+}
+
+void cbor_lite_write_array(cbor_lite_writer_t *w, size_t items)
+{
+    cbor_lite_write_head(w, CBOR_MAJOR_ARRAY, items);
+}
+
+// Encoded length, or -1 if the buffer overflowed
+int cbor_lite_writer_length(const cbor_lite_writer_t *w)
+{
+    return w->overflow ? -1 : (int)w->pos;
+}
@@ -0,0 +1,61 @@
+#ifndef CBOR_LITE_H
+#define CBOR_LITE_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal allocation-free CBOR (RFC 8949) reader and writer for small control messages.
+// Definite-length items only; strings are returned as pointers into the input buffer.
+
+#define CBOR_MAJOR_UINT   0
+#define CBOR_MAJOR_NINT   1
+#define CBOR_MAJOR_BYTES  2
+#define CBOR_MAJOR_TEXT   3
+#define CBOR_MAJOR_ARRAY  4
+#define CBOR_MAJOR_MAP    5
+#define CBOR_MAJOR_TAG    6
+#define CBOR_MAJOR_SIMPLE 7
+
+#define CBOR_SIMPLE_FALSE 20
+#define CBOR_SIMPLE_TRUE  21
+#define CBOR_SIMPLE_NULL  22
+
+typedef struct {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+} cbor_lite_reader_t;
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t pos;
+    bool overflow;          // Set once a write did not fit; later writes are dropped
+} cbor_lite_writer_t;
+
+// Reader
+void cbor_lite_reader_init(cbor_lite_reader_t *r, const uint8_t *buf, size_t len);
+esp_err_t cbor_lite_peek_major(const cbor_lite_reader_t *r, uint8_t *major);
+esp_err_t cbor_lite_read_head(cbor_lite_reader_t *r, uint8_t *major, uint64_t *value);
+esp_err_t cbor_lite_read_uint(cbor_lite_reader_t *r, uint64_t *value);
+esp_err_t cbor_lite_read_bool(cbor_lite_reader_t *r, bool *value);
+esp_err_t cbor_lite_read_text(cbor_lite_reader_t *r, const char **str, size_t *len);
+esp_err_t cbor_lite_read_bytes(cbor_lite_reader_t *r, const uint8_t **data, size_t *len);
+esp_err_t cbor_lite_read_map(cbor_lite_reader_t *r, size_t *pairs);
+esp_err_t cbor_lite_skip(cbor_lite_reader_t *r);
+
+// Writer
+void cbor_lite_writer_init(cbor_lite_writer_t *w, uint8_t *buf, size_t size);
+void cbor_lite_write_head(cbor_lite_writer_t *w, uint8_t major, uint64_t value);
+void cbor_lite_write_uint(cbor_lite_writer_t *w, uint64_t value);
+void cbor_lite_write_int(cbor_lite_writer_t *w, int64_t value);
+void cbor_lite_write_bool(cbor_lite_writer_t *w, bool value);
+void cbor_lite_write_text(cbor_lite_writer_t *w, const char *str);
+void cbor_lite_write_bytes(cbor_lite_writer_t *w, const uint8_t *data, size_t len);
+void cbor_lite_write_map(cbor_lite_writer_t *w, size_t pairs);
+void cbor_lite_write_array(cbor_lite_writer_t *w, size_t items);
+int cbor_lite_writer_length(const cbor_lite_writer_t *w);
+
+#endif // CBOR_LITE_H
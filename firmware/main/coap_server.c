@@ -0,0 +1,752 @@
+#include "coap_server.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_vfs_eventfd.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "relay_control.h"
+#include "relay_command.h"
+#include "cbor_lite.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+static const char *TAG = "COAP_SERVER";
+
+// RFC 7252 message format
+#define COAP_VERSION 1
+#define COAP_TYPE_CON 0
+#define COAP_TYPE_NON 1
+#define COAP_TYPE_ACK 2
+#define COAP_TYPE_RST 3
+
+#define COAP_CODE(cls, detail) (((cls) << 5) | (detail))
+#define COAP_CODE_EMPTY 0
+#define COAP_CODE_GET COAP_CODE(0, 1)
+#define COAP_CODE_POST COAP_CODE(0, 2)
+#define COAP_CODE_PUT COAP_CODE(0, 3)
+#define COAP_CODE_CHANGED COAP_CODE(2, 4)
+#define COAP_CODE_CONTENT COAP_CODE(2, 5)
+#define COAP_CODE_BAD_REQUEST COAP_CODE(4, 0)
+#define COAP_CODE_BAD_OPTION COAP_CODE(4, 2)
+#define COAP_CODE_FORBIDDEN COAP_CODE(4, 3)
+#define COAP_CODE_NOT_FOUND COAP_CODE(4, 4)
+#define COAP_CODE_METHOD_NOT_ALLOWED COAP_CODE(4, 5)
+#define COAP_CODE_NOT_ACCEPTABLE COAP_CODE(4, 6)
+#define COAP_CODE_UNSUPPORTED_FORMAT COAP_CODE(4, 15)
+#define COAP_CODE_INTERNAL_ERROR COAP_CODE(5, 0)
+
+#define COAP_OPTION_OBSERVE 6
+#define COAP_OPTION_URI_PATH 11
+#define COAP_OPTION_CONTENT_FORMAT 12
+#define COAP_OPTION_ACCEPT 17
+
+#define COAP_MAX_MESSAGE_LEN 256
+#define COAP_MAX_PATH_LEN 32
+#define COAP_OBSERVE_SEQ_MASK 0xffffff
+
+// Resource IDs: relays are 0..NUM_RELAYS-1
+#define COAP_RESOURCE_STATUS NUM_RELAYS
+#define COAP_RESOURCE_RELAY_COMMAND (NUM_RELAYS + 1)
+#define COAP_RESOURCE_CORE (NUM_RELAYS + 2)
+#define COAP_RESOURCE_NONE (-1)
+
+typedef struct {
+    uint8_t type;
+    uint8_t code;
+    uint16_t msg_id;
+    uint8_t token_len;
+    uint8_t token[8];
+    char path[COAP_MAX_PATH_LEN];
+    bool path_too_long;
+    bool has_observe;
+    uint32_t observe;
+    int content_format;     // -1 when absent
+    bool has_accept;
+    uint32_t accept;
+    const uint8_t *payload;
+    size_t payload_len;
+} coap_message_t;
+
+typedef struct {
+    bool used;
+    struct sockaddr_in addr;
+    uint8_t token_len;
+    uint8_t token[8];
+    int resource;
+    uint16_t last_con_msg_id;
+    bool awaiting_ack;
+    uint8_t unacked;
+    int64_t last_con_us;
+} coap_observer_t;
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t pos;
+    uint16_t last_option;
+    bool overflow;
+} coap_builder_t;
+
+static coap_observer_t coap_observers[COAP_MAX_OBSERVERS];
+static uint32_t coap_observe_seq = 0;
+static uint32_t coap_notified_mask = 0;
+static uint16_t coap_next_msg_id = 0;
+static int coap_event_fd = -1;
+
+static coap_server_stats_t coap_stats;
+static portMUX_TYPE coap_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Option delta/length nibble with its 0-2 extension bytes
+static int coap_read_nibble(uint8_t nibble, const uint8_t **p, const uint8_t *end, uint32_t *value)
+{
+    if (nibble < 13) {
+        *value = nibble;
+    } else if (nibble == 13) {
+        if (*p + 1 > end) {
+            return -1;
+        }
+        *value = 13 + (*p)[0];
+        *p += 1;
+    } else if (nibble == 14) {
+        if (*p + 2 > end) {
+            return -1;
+        }
+        *value = 269 + (((uint32_t)(*p)[0] << 8) | (*p)[1]);
+        *p += 2;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t coap_decode_uint(const uint8_t *value, uint32_t len)
+{
+    uint32_t v = 0;
+    for (uint32_t i = 0; i < len && i < 4; i++) {
+        v = (v << 8) | value[i];
+    }
+    return v;
+}
+
+// Returns the response code to send for a malformed request, 0 when the message parsed
+static int coap_parse(const uint8_t *buf, size_t len, coap_message_t *msg)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->content_format = -1;
+    if (len < 4 || (buf[0] >> 6) != COAP_VERSION || (buf[0] & 0x0f) > 8) {
+        return -1;
+    }
+
+    msg->type = (buf[0] >> 4) & 0x03;
+    msg->token_len = buf[0] & 0x0f;
+    msg->code = buf[1];
+    msg->msg_id = ((uint16_t)buf[2] << 8) | buf[3];
+    if (4 + (size_t)msg->token_len > len) {
+        return -1;
+    }
+    memcpy(msg->token, buf + 4, msg->token_len);
+
+    const uint8_t *p = buf + 4 + msg->token_len;
+    const uint8_t *end = buf + len;
+    uint32_t number = 0;
+    size_t path_len = 0;
+    while (p < end) {
+        if (*p == 0xff) {
+            p++;
+            if (p == end) {
+                return COAP_CODE_BAD_REQUEST; // Payload marker without payload
+            }
+            msg->payload = p;
+            msg->payload_len = end - p;
+            break;
+        }
+
+        uint8_t header = *p++;
+        uint32_t delta, opt_len;
+        if (coap_read_nibble(header >> 4, &p, end, &delta) != 0 ||
+            coap_read_nibble(header & 0x0f, &p, end, &opt_len) != 0 || p + opt_len > end) {
+            return COAP_CODE_BAD_REQUEST;
+        }
+        number += delta;
+        const uint8_t *value = p;
+        p += opt_len;
+
+        switch (number) {
+        case COAP_OPTION_OBSERVE:
+            msg->has_observe = true;
+            msg->observe = coap_decode_uint(value, opt_len);
+            break;
+        case COAP_OPTION_URI_PATH:
+            if (path_len + opt_len + 2 > sizeof(msg->path)) {
+                msg->path_too_long = true;
+                break;
+            }
+            if (path_len > 0) {
+                msg->path[path_len++] = '/';
+            }
+            memcpy(msg->path + path_len, value, opt_len);
+            path_len += opt_len;
+            msg->path[path_len] = '\0';
+            break;
+        case COAP_OPTION_CONTENT_FORMAT:
+            msg->content_format = coap_decode_uint(value, opt_len);
+            break;
+        case COAP_OPTION_ACCEPT:
+            msg->has_accept = true;
+            msg->accept = coap_decode_uint(value, opt_len);
+            break;
+        default:
+            // Unknown critical (odd-numbered) options must be rejected
+            if (number & 1) {
+                return COAP_CODE_BAD_OPTION;
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+static void coap_begin(coap_builder_t *b, uint8_t *buf, size_t size, uint8_t type, uint8_t code,
+                       uint16_t msg_id, const uint8_t *token, uint8_t token_len)
+{
+    b->buf = buf;
+    b->size = size;
+    b->pos = 4 + token_len;
+    b->last_option = 0;
+    b->overflow = b->pos > size;
+    if (b->overflow) {
+        return;
+    }
+    buf[0] = (COAP_VERSION << 6) | (type << 4) | token_len;
+    buf[1] = code;
+    buf[2] = msg_id >> 8;
+    buf[3] = msg_id;
+    memcpy(buf + 4, token, token_len);
+}
+
+static uint8_t coap_nibble(uint32_t value, uint8_t *ext, size_t *ext_len)
+{
+    if (value < 13) {
+        return value;
+    }
+    if (value < 269) {
+        ext[(*ext_len)++] = value - 13;
+        return 13;
+    }
+    ext[(*ext_len)++] = (value - 269) >> 8;
+    ext[(*ext_len)++] = (value - 269) & 0xff;
+    return 14;
+}
+
+// Options must be added in increasing option number order
+static void coap_option(coap_builder_t *b, uint16_t number, const uint8_t *value, size_t len)
+{
+    uint8_t ext[4];
+    size_t ext_len = 0;
+    uint8_t delta = coap_nibble(number - b->last_option, ext, &ext_len);
+    uint8_t length = coap_nibble(len, ext, &ext_len);
+
+    if (b->overflow || b->pos + 1 + ext_len + len > b->size) {
+        b->overflow = true;
+        return;
+    }
+    b->buf[b->pos++] = (delta << 4) | length;
+    memcpy(b->buf + b->pos, ext, ext_len);
+    b->pos += ext_len;
+    memcpy(b->buf + b->pos, value, len);
+    b->pos += len;
+    b->last_option = number;
+}
+
+static void coap_option_uint(coap_builder_t *b, uint16_t number, uint32_t value)
+{
+    uint8_t bytes[4];
+    size_t len = 0;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        if (len > 0 || (value >> shift) != 0) {
+            bytes[len++] = value >> shift;
+        }
+    }
+    coap_option(b, number, bytes, len);
+}
+
+static void coap_payload(coap_builder_t *b, const uint8_t *data, size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    if (b->overflow || b->pos + 1 + len > b->size) {
+        b->overflow = true;
+        return;
+    }
+    b->buf[b->pos++] = 0xff;
+    memcpy(b->buf + b->pos, data, len);
+    b->pos += len;
+}
+
+static int coap_resolve(const char *path)
+{
+    if (strcmp(path, "status") == 0) {
+        return COAP_RESOURCE_STATUS;
+    }
+    if (strcmp(path, "relay") == 0) {
+        return COAP_RESOURCE_RELAY_COMMAND;
+    }
+    if (strcmp(path, ".well-known/core") == 0) {
+        return COAP_RESOURCE_CORE;
+    }
+    if (strncmp(path, "relay/", 6) == 0 && path[6] != '\0') {
+        char *end;
+        long relay = strtol(path + 6, &end, 10);
+        if (*end == '\0' && relay >= 0 && relay < NUM_RELAYS) {
+            return (int)relay;
+        }
+    }
+    return COAP_RESOURCE_NONE;
+}
+
+// CBOR representation of an observable resource
+static int coap_encode_resource(int resource, uint32_t mask, uint8_t *buf, size_t size)
+{
+    cbor_lite_writer_t w;
+    cbor_lite_writer_init(&w, buf, size);
+    if (resource == COAP_RESOURCE_STATUS) {
+        cbor_lite_write_map(&w, 2);
+        cbor_lite_write_text(&w, "mask");
+        cbor_lite_write_uint(&w, mask);
+        cbor_lite_write_text(&w, "relays");
+        cbor_lite_write_array(&w, NUM_RELAYS);
+        for (int i = 0; i < NUM_RELAYS; i++) {
+            cbor_lite_write_bool(&w, (mask & (1u << i)) != 0);
+        }
+    } else {
+        cbor_lite_write_bool(&w, (mask & (1u << resource)) != 0);
+    }
+    return cbor_lite_writer_length(&w);
+}
+
+static coap_observer_t *coap_find_observer(const struct sockaddr_in *addr, int resource)
+{
+    for (int i = 0; i < COAP_MAX_OBSERVERS; i++) {
+        coap_observer_t *obs = &coap_observers[i];
+        if (obs->used && obs->resource == resource && obs->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            obs->addr.sin_port == addr->sin_port) {
+            return obs;
+        }
+    }
+    return NULL;
+}
+
+static void coap_remove_observer(coap_observer_t *obs)
+{
+    obs->used = false;
+    portENTER_CRITICAL(&coap_stats_lock);
+    coap_stats.observers--;
+    portEXIT_CRITICAL(&coap_stats_lock);
+}
+
+// Register (or refresh, with a new token) an observation; false if the table is full
+static bool coap_add_observer(const struct sockaddr_in *addr, const coap_message_t *req, int resource)
+{
+    coap_observer_t *obs = coap_find_observer(addr, resource);
+    if (obs == NULL) {
+        for (int i = 0; i < COAP_MAX_OBSERVERS && obs == NULL; i++) {
+            if (!coap_observers[i].used) {
+                obs = &coap_observers[i];
+                portENTER_CRITICAL(&coap_stats_lock);
+                coap_stats.observers++;
+                portEXIT_CRITICAL(&coap_stats_lock);
+            }
+        }
+        if (obs == NULL) {
+            return false;
+        }
+    }
+
+    memset(obs, 0, sizeof(*obs));
+    obs->used = true;
+    obs->addr = *addr;
+    obs->resource = resource;
+    obs->token_len = req->token_len;
+    memcpy(obs->token, req->token, req->token_len);
+    obs->last_con_us = esp_timer_get_time();
+    return true;
+}
+
+static int coap_handle_core(coap_builder_t *b)
+{
+    char links[COAP_MAX_MESSAGE_LEN - 16];
+    int len = snprintf(links, sizeof(links), "</status>;obs;ct=%d,</relay>;ct=%d", COAP_CONTENT_FORMAT_CBOR,
+                       COAP_CONTENT_FORMAT_CBOR);
+    for (int i = 0; i < NUM_RELAYS && len < (int)sizeof(links); i++) {
+        len += snprintf(links + len, sizeof(links) - len, ",</relay/%d>;obs;ct=%d", i, COAP_CONTENT_FORMAT_CBOR);
+    }
+    if (len >= (int)sizeof(links)) {
+        len = sizeof(links) - 1;
+    }
+    coap_option_uint(b, COAP_OPTION_CONTENT_FORMAT, COAP_CONTENT_FORMAT_LINK);
+    coap_payload(b, (const uint8_t *)links, len);
+    return COAP_CODE_CONTENT;
+}
+
+// PUT /relay/<n>: CBOR bool or unsigned, or a short text value
+static int coap_parse_relay_value(const coap_message_t *req, bool *on)
+{
+    if (req->content_format == -1 || req->content_format == COAP_CONTENT_FORMAT_CBOR) {
+        cbor_lite_reader_t r;
+        uint8_t major;
+        cbor_lite_reader_init(&r, req->payload, req->payload_len);
+        if (cbor_lite_peek_major(&r, &major) == ESP_OK) {
+            uint64_t value;
+            if (major == CBOR_MAJOR_SIMPLE && cbor_lite_read_bool(&r, on) == ESP_OK) {
+                return 0;
+            }
+            if (major == CBOR_MAJOR_UINT && cbor_lite_read_uint(&r, &value) == ESP_OK && value <= 1) {
+                *on = value == 1;
+                return 0;
+            }
+        }
+        if (req->content_format == COAP_CONTENT_FORMAT_CBOR) {
+            return COAP_CODE_BAD_REQUEST;
+        }
+    }
+    if (req->content_format == -1 || req->content_format == COAP_CONTENT_FORMAT_TEXT) {
+        static const char *const on_values[] = { "1", "on", "true" };
+        static const char *const off_values[] = { "0", "off", "false" };
+        for (int i = 0; i < 3; i++) {
+            if (req->payload_len == strlen(on_values[i]) &&
+                strncasecmp((const char *)req->payload, on_values[i], req->payload_len) == 0) {
+                *on = true;
+                return 0;
+            }
+            if (req->payload_len == strlen(off_values[i]) &&
+                strncasecmp((const char *)req->payload, off_values[i], req->payload_len) == 0) {
+                *on = false;
+                return 0;
+            }
+        }
+        return COAP_CODE_BAD_REQUEST;
+    }
+    return COAP_CODE_UNSUPPORTED_FORMAT;
+}
+
+static int coap_commit(uint32_t set_mask, uint32_t clear_mask, relay_commit_info_t *info)
+{
+    uint32_t previous_mask = relay_get_mask();
+    esp_err_t ret = relay_commit(set_mask, clear_mask, RELAY_SOURCE_COAP, info);
+    if (ret == ESP_ERR_INVALID_STATE) {
+        return COAP_CODE_FORBIDDEN; // Refused by an interlock or sequence rule
+    } else if (ret != ESP_OK) {
+        return COAP_CODE_INTERNAL_ERROR;
+    }
+    if (info->mask != previous_mask) {
+        relay_publish_status_async();
+    }
+    return 0;
+}
+
+// POST /relay: binary relay command, acknowledged in CBOR like the MQTT/HTTP binary path
+static int coap_handle_command(const coap_message_t *req, coap_builder_t *b)
+{
+    if (req->content_format != -1 && req->content_format != COAP_CONTENT_FORMAT_CBOR &&
+        req->content_format != COAP_CONTENT_FORMAT_OCTETS) {
+        return COAP_CODE_UNSUPPORTED_FORMAT;
+    }
+
+    relay_command_t cmd;
+    relay_ack_t ack = { .result = ESP_OK };
+    relay_commit_info_t info = { 0 };
+    esp_err_t ret = relay_command_parse_binary(req->payload, req->payload_len, &cmd);
+    int code = COAP_CODE_BAD_REQUEST;
+    if (ret == ESP_OK) {
+        code = coap_commit(cmd.set_mask, cmd.clear_mask, &info);
+        if (code == COAP_CODE_FORBIDDEN) {
+            ret = ESP_ERR_INVALID_STATE;
+        } else if (code != 0) {
+            ret = ESP_FAIL;
+        }
+    }
+    if (ret == ESP_OK) {
+        ack.mask = info.mask;
+        ack.applied_at_us = info.applied_at_us;
+        ack.deferred = info.deferred;
+    } else {
+        relay_command_reject(ret, &ack);
+    }
+
+    uint8_t payload[96];
+    int len = relay_command_format_ack_cbor(&cmd, &ack, payload, sizeof(payload));
+    coap_option_uint(b, COAP_OPTION_CONTENT_FORMAT, COAP_CONTENT_FORMAT_CBOR);
+    if (len > 0) {
+        coap_payload(b, payload, len);
+    }
+    return ret == ESP_OK ? COAP_CODE_CHANGED : code;
+}
+
+// Build the response options and payload; returns the response code
+static int coap_handle_resource(const coap_message_t *req, const struct sockaddr_in *from, coap_builder_t *b)
+{
+    int resource = req->path_too_long ? COAP_RESOURCE_NONE : coap_resolve(req->path);
+    if (resource == COAP_RESOURCE_NONE) {
+        return COAP_CODE_NOT_FOUND;
+    }
+    if (resource == COAP_RESOURCE_CORE) {
+        return req->code == COAP_CODE_GET ? coap_handle_core(b) : COAP_CODE_METHOD_NOT_ALLOWED;
+    }
+    if (resource == COAP_RESOURCE_RELAY_COMMAND) {
+        return req->code == COAP_CODE_POST ? coap_handle_command(req, b) : COAP_CODE_METHOD_NOT_ALLOWED;
+    }
+    if (req->has_accept && req->accept != COAP_CONTENT_FORMAT_CBOR) {
+        return COAP_CODE_NOT_ACCEPTABLE;
+    }
+
+    int code;
+    if (req->code == COAP_CODE_GET) {
+        code = COAP_CODE_CONTENT;
+        if (req->has_observe && req->observe == 0) {
+            // A full table is not an error: the client just gets a plain response (RFC 7641 4.1)
+            if (coap_add_observer(from, req, resource)) {
+                coap_option_uint(b, COAP_OPTION_OBSERVE, coap_observe_seq);
+            }
+        } else if (req->has_observe && req->observe == 1) {
+            coap_observer_t *obs = coap_find_observer(from, resource);
+            if (obs != NULL) {
+                coap_remove_observer(obs);
+            }
+        }
+    } else if (req->code == COAP_CODE_PUT && resource < NUM_RELAYS) {
+        bool on;
+        relay_commit_info_t info;
+        code = coap_parse_relay_value(req, &on);
+        if (code == 0) {
+            uint32_t bit = 1u << resource;
+            code = coap_commit(on ? bit : 0, on ? 0 : bit, &info);
+        }
+        if (code != 0) {
+            return code;
+        }
+        code = COAP_CODE_CHANGED;
+    } else {
+        return COAP_CODE_METHOD_NOT_ALLOWED;
+    }
+
+    uint8_t payload[32];
+    int len = coap_encode_resource(resource, relay_get_mask(), payload, sizeof(payload));
+    coap_option_uint(b, COAP_OPTION_CONTENT_FORMAT, COAP_CONTENT_FORMAT_CBOR);
+    if (len > 0) {
+        coap_payload(b, payload, len);
+    }
+    return code;
+}
+
+static void coap_handle_datagram(int sock, const uint8_t *buf, size_t len, const struct sockaddr_in *from)
+{
+    coap_message_t req;
+    int error = coap_parse(buf, len, &req);
+    if (error < 0) {
+        return; // Not CoAP, or too broken to answer
+    }
+
+    if (req.type == COAP_TYPE_ACK || req.type == COAP_TYPE_RST) {
+        // Answers to our notifications: an ACK keeps the observer alive, an RST cancels it
+        for (int i = 0; i < COAP_MAX_OBSERVERS; i++) {
+            coap_observer_t *obs = &coap_observers[i];
+            if (obs->used && obs->addr.sin_addr.s_addr == from->sin_addr.s_addr &&
+                obs->addr.sin_port == from->sin_port && obs->last_con_msg_id == req.msg_id) {
+                if (req.type == COAP_TYPE_RST) {
+                    coap_remove_observer(obs);
+                } else {
+                    obs->awaiting_ack = false;
+                    obs->unacked = 0;
+                }
+            }
+        }
+        return;
+    }
+
+    uint8_t resp[COAP_MAX_MESSAGE_LEN];
+    coap_builder_t b;
+    if (req.code == COAP_CODE_EMPTY) {
+        // CoAP ping: answered with RST
+        if (req.type == COAP_TYPE_CON) {
+            coap_begin(&b, resp, sizeof(resp), COAP_TYPE_RST, COAP_CODE_EMPTY, req.msg_id, NULL, 0);
+            sendto(sock, resp, b.pos, 0, (const struct sockaddr *)from, sizeof(*from));
+        }
+        return;
+    }
+    if ((req.code >> 5) != 0) {
+        return; // A response we did not ask for
+    }
+
+    portENTER_CRITICAL(&coap_stats_lock);
+    coap_stats.requests++;
+    portEXIT_CRITICAL(&coap_stats_lock);
+
+    // CON requests get a piggybacked ACK; NON requests a NON response. Every operation is
+    // idempotent, so a retransmitted CON is simply executed again.
+    uint8_t type = (req.type == COAP_TYPE_CON) ? COAP_TYPE_ACK : COAP_TYPE_NON;
+    uint16_t msg_id = (req.type == COAP_TYPE_CON) ? req.msg_id : coap_next_msg_id++;
+    coap_begin(&b, resp, sizeof(resp), type, 0, msg_id, req.token, req.token_len);
+    int code = error ? error : coap_handle_resource(&req, from, &b);
+    if (b.overflow) {
+        coap_begin(&b, resp, sizeof(resp), type, 0, msg_id, req.token, req.token_len);
+        code = COAP_CODE_INTERNAL_ERROR;
+    }
+    resp[1] = code;
+    sendto(sock, resp, b.pos, 0, (const struct sockaddr *)from, sizeof(*from));
+}
+
+// Push the new representation to every observer of a changed resource
+static void coap_notify_observers(int sock)
+{
+    uint32_t mask = relay_get_mask();
+    uint32_t changed = mask ^ coap_notified_mask;
+    coap_notified_mask = mask;
+    if (changed == 0) {
+        return;
+    }
+
+    coap_observe_seq = (coap_observe_seq + 1) & COAP_OBSERVE_SEQ_MASK;
+    int64_t now_us = esp_timer_get_time();
+    for (int i = 0; i < COAP_MAX_OBSERVERS; i++) {
+        coap_observer_t *obs = &coap_observers[i];
+        if (!obs->used || (obs->resource != COAP_RESOURCE_STATUS && !(changed & (1u << obs->resource)))) {
+            continue;
+        }
+
+        bool confirmable = now_us - obs->last_con_us > (int64_t)COAP_OBSERVE_CON_INTERVAL_MS * 1000 ||
+                           obs->awaiting_ack;
+        if (confirmable && obs->awaiting_ack && ++obs->unacked >= COAP_OBSERVE_MAX_UNACKED) {
+            ESP_LOGW(TAG, "Dropping unresponsive observer of resource %d", obs->resource);
+            coap_remove_observer(obs);
+            continue;
+        }
+
+        uint8_t msg[COAP_MAX_MESSAGE_LEN];
+        uint8_t payload[32];
+        coap_builder_t b;
+        uint16_t msg_id = coap_next_msg_id++;
+        coap_begin(&b, msg, sizeof(msg), confirmable ? COAP_TYPE_CON : COAP_TYPE_NON, COAP_CODE_CONTENT,
+                   msg_id, obs->token, obs->token_len);
+        coap_option_uint(&b, COAP_OPTION_OBSERVE, coap_observe_seq);
+        coap_option_uint(&b, COAP_OPTION_CONTENT_FORMAT, COAP_CONTENT_FORMAT_CBOR);
+        int len = coap_encode_resource(obs->resource, mask, payload, sizeof(payload));
+        if (len > 0) {
+            coap_payload(&b, payload, len);
+        }
+
+        // An RST to a NON notification also cancels the observation
+        obs->last_con_msg_id = msg_id;
+        if (confirmable) {
+            obs->awaiting_ack = true;
+            obs->last_con_us = now_us;
+        }
+        sendto(sock, msg, b.pos, 0, (const struct sockaddr *)&obs->addr, sizeof(obs->addr));
+
+        portENTER_CRITICAL(&coap_stats_lock);
+        coap_stats.notifications++;
+        portEXIT_CRITICAL(&coap_stats_lock);
+    }
+}
+
+// Relay change listener: runs in the committing task, so only wake the CoAP task
+static void coap_relay_changed(uint32_t mask, uint32_t changed, relay_source_t source)
+{
+    uint64_t one = 1;
+    if (coap_event_fd >= 0) {
+        write(coap_event_fd, &one, sizeof(one));
+    }
+}
+
+static void coap_server_task(void *arg)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Failed to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(COAP_SERVER_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ESP_LOGE(TAG, "Failed to bind port %d: errno %d", COAP_SERVER_PORT, errno);
+        close(sock);
+        vTaskDelete(NULL);
+        return;
+    }
+    ESP_LOGI(TAG, "CoAP server listening on port %d", COAP_SERVER_PORT);
+
+    coap_notified_mask = relay_get_mask();
+    while (1) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        FD_SET(coap_event_fd, &fds);
+        int max_fd = sock > coap_event_fd ? sock : coap_event_fd;
+
+        if (select(max_fd + 1, &fds, NULL, NULL, NULL) < 0) {
+            ESP_LOGE(TAG, "select failed: errno %d", errno);
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        if (FD_ISSET(sock, &fds)) {
+            uint8_t buf[COAP_MAX_MESSAGE_LEN];
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            int len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+            if (len > 0) {
+                coap_handle_datagram(sock, buf, len, &from);
+            }
+        }
+        if (FD_ISSET(coap_event_fd, &fds)) {
+            uint64_t count;
+            read(coap_event_fd, &count, sizeof(count));
+            coap_notify_observers(sock);
+        }
+    }
+}
+
+esp_err_t coap_server_init(void)
+{
+    // Another module may already have registered the eventfd VFS
+    esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    esp_err_t ret = esp_vfs_eventfd_register(&eventfd_config);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "Failed to register eventfd: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    coap_event_fd = eventfd(0, 0);
+    if (coap_event_fd < 0) {
+        ESP_LOGE(TAG, "Failed to create eventfd");
+        return ESP_FAIL;
+    }
+
+    coap_next_msg_id = esp_random();
+    if (relay_add_change_listener(coap_relay_changed) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register relay change listener");
+        return ESP_FAIL;
+    }
+
+    if (xTaskCreate(coap_server_task, "coap_server", COAP_SERVER_TASK_STACK_SIZE, NULL,
+                    COAP_SERVER_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create CoAP server task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void coap_server_get_stats(coap_server_stats_t *stats)
+{
+    portENTER_CRITICAL(&coap_stats_lock);
+    *stats = coap_stats;
+    portEXIT_CRITICAL(&coap_stats_lock);
+}
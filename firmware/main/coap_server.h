@@ -0,0 +1,51 @@
+#ifndef COAP_SERVER_H
+#define COAP_SERVER_H
+
+#include "esp_err.h"
+#include <stdint.h>
+
+// CoAP server configuration
+#ifndef COAP_SERVER_PORT
+#define COAP_SERVER_PORT 5683
+#endif
+#ifndef COAP_SERVER_TASK_PRIORITY
+#define COAP_SERVER_TASK_PRIORITY 6
+#endif
+#ifndef COAP_SERVER_TASK_STACK_SIZE
+#define COAP_SERVER_TASK_STACK_SIZE 4096
+#endif
+// RFC 7641 observer registrations across all resources
+#ifndef COAP_MAX_OBSERVERS
+#define COAP_MAX_OBSERVERS 8
+#endif
+// Notifications are NON, with a CON every this often so dead observers are found
+#ifndef COAP_OBSERVE_CON_INTERVAL_MS
+#define COAP_OBSERVE_CON_INTERVAL_MS 60000
+#endif
+// Unacknowledged CON notifications before an observer is dropped
+#ifndef COAP_OBSERVE_MAX_UNACKED
+#define COAP_OBSERVE_MAX_UNACKED 3
+#endif
+
+// Resources:
+//   GET  /relay/<n>   CBOR bool; observable
+//   PUT  /relay/<n>   CBOR bool or 0/1 (text/plain "1"/"0"/"on"/"off" also accepted)
+//   POST /relay       binary relay command (CBOR map or frame, see relay_command.h); CBOR ack
+//   GET  /status      CBOR {"mask": uint, "relays": [bool, ...]}; observable
+//   GET  /.well-known/core
+#define COAP_CONTENT_FORMAT_TEXT 0
+#define COAP_CONTENT_FORMAT_LINK 40
+#define COAP_CONTENT_FORMAT_OCTETS 42
+#define COAP_CONTENT_FORMAT_CBOR 60
+
+typedef struct {
+    uint32_t requests;
+    uint32_t notifications;
+    uint8_t observers;
+} coap_server_stats_t;
+
+// Function declarations
+esp_err_t coap_server_init(void);
+void coap_server_get_stats(coap_server_stats_t *stats);
+
+#endif // COAP_SERVER_H
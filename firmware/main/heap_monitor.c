@@ -0,0 +1,337 @@
+#include "heap_monitor.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "app_mqtt.h"
+#include "json_out.h"
+#include "util.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "HEAP_MONITOR";
+
+ESP_EVENT_DEFINE_BASE(HEAP_MONITOR_EVENT);
+
+static const struct {
+    const char *name;
+    uint32_t caps;
+} heap_monitor_regions[HEAP_MONITOR_REGION_COUNT] = {
+    [HEAP_MONITOR_INTERNAL] = { "internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT },
+    [HEAP_MONITOR_DMA] = { "dma", MALLOC_CAP_DMA },
+    [HEAP_MONITOR_SPIRAM] = { "spiram", MALLOC_CAP_SPIRAM },
+};
+
+// Updated from the allocator on every malloc/free, in any context
+static atomic_uint heap_monitor_allocs;
+static atomic_uint heap_monitor_alloc_bytes;
+static atomic_uint heap_monitor_frees;
+static atomic_uint heap_monitor_alloc_failures;
+
+#if CONFIG_HEAP_USE_HOOKS
+// Called by the heap component; must not allocate and may run with the cache disabled
+void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps)
+{
+    atomic_fetch_add_explicit(&heap_monitor_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&heap_monitor_alloc_bytes, size, memory_order_relaxed);
+}
+
+void IRAM_ATTR esp_heap_trace_free_hook(void *ptr)
+{
+    atomic_fetch_add_explicit(&heap_monitor_frees, 1, memory_order_relaxed);
+}
+#endif
+
+static void heap_monitor_alloc_failed(size_t size, uint32_t caps, const char *function_name)
+{
+    atomic_fetch_add_explicit(&heap_monitor_alloc_failures, 1, memory_order_relaxed);
+}
+
+// Latest sample, under heap_monitor_mutex
+static SemaphoreHandle_t heap_monitor_mutex = NULL;
+static heap_monitor_stats_t heap_monitor_stats;
+
+// Sampler state, only touched by the monitor task
+static uint8_t heap_monitor_clear_count[HEAP_MONITOR_REGION_COUNT];
+static uint32_t heap_monitor_trend[HEAP_MONITOR_TREND_BUCKETS];     // Lowest free per bucket, oldest first
+static int heap_monitor_trend_count = 0;
+static uint32_t heap_monitor_bucket_min = UINT32_MAX;
+static uint32_t heap_monitor_bucket_elapsed_s = 0;
+static uint32_t heap_monitor_prev_alloc_bytes = 0;
+static bool heap_monitor_sampled = false;
+// Set when a post found no default event loop yet (wifi_manager_init creates it after this
+// module starts); the current non-OK levels are posted again on a later sample
+static bool heap_monitor_events_held = false;
+
+const char *heap_monitor_region_name(heap_monitor_region_t region)
+{
+    return (unsigned)region < HEAP_MONITOR_REGION_COUNT ? heap_monitor_regions[region].name : "unknown";
+}
+
+const char *heap_monitor_level_name(heap_monitor_level_t level)
+{
+    switch (level) {
+    case HEAP_MONITOR_LEVEL_OK:
+        return "ok";
+    case HEAP_MONITOR_LEVEL_WARN:
+        return "warn";
+    case HEAP_MONITOR_LEVEL_CRITICAL:
+        return "critical";
+    default:
+        return "unknown";
+    }
+}
+
+static heap_monitor_level_t heap_monitor_classify(const heap_monitor_region_stats_t *r)
+{
+    if (r->total == 0) {
+        return HEAP_MONITOR_LEVEL_OK;
+    }
+    if (r->free < HEAP_MONITOR_FREE_CRITICAL_BYTES || r->largest_free < HEAP_MONITOR_BLOCK_CRITICAL_BYTES ||
+        r->fragmentation_permille >= HEAP_MONITOR_FRAG_CRITICAL_PERMILLE) {
+        return HEAP_MONITOR_LEVEL_CRITICAL;
+    }
+    if (r->free < HEAP_MONITOR_FREE_WARN_BYTES || r->largest_free < HEAP_MONITOR_BLOCK_WARN_BYTES ||
+        r->fragmentation_permille >= HEAP_MONITOR_FRAG_WARN_PERMILLE) {
+        return HEAP_MONITOR_LEVEL_WARN;
+    }
+    return HEAP_MONITOR_LEVEL_OK;
+}
+
+// Push the lowest internal free heap of a finished bucket and look for a steady decline
+static void heap_monitor_update_trend(heap_monitor_stats_t *next, uint32_t internal_free)
+{
+    if (internal_free < heap_monitor_bucket_min) {
+        heap_monitor_bucket_min = internal_free;
+    }
+    heap_monitor_bucket_elapsed_s += HEAP_MONITOR_INTERVAL_S;
+    if (heap_monitor_bucket_elapsed_s >= HEAP_MONITOR_TREND_BUCKET_S) {
+        if (heap_monitor_trend_count == HEAP_MONITOR_TREND_BUCKETS) {
+            memmove(heap_monitor_trend, heap_monitor_trend + 1, sizeof(heap_monitor_trend) - sizeof(heap_monitor_trend[0]));
+            heap_monitor_trend_count--;
+        }
+        heap_monitor_trend[heap_monitor_trend_count++] = heap_monitor_bucket_min;
+        heap_monitor_bucket_min = UINT32_MAX;
+        heap_monitor_bucket_elapsed_s = 0;
+    }
+
+    next->free_trend_per_hour = 0;
+    next->leak_suspected = false;
+    if (heap_monitor_trend_count < 2) {
+        return;
+    }
+    int64_t change = (int64_t)heap_monitor_trend[heap_monitor_trend_count - 1] - heap_monitor_trend[0];
+    int64_t span_s = (int64_t)(heap_monitor_trend_count - 1) * HEAP_MONITOR_TREND_BUCKET_S;
+    next->free_trend_per_hour = (int32_t)(change * 3600 / span_s);
+
+    bool falling = true;
+    for (int i = 1; i < heap_monitor_trend_count; i++) {
+        if (heap_monitor_trend[i] >= heap_monitor_trend[i - 1]) {
+            falling = false;
+            break;
+        }
+    }
+    next->leak_suspected = falling && heap_monitor_trend_count == HEAP_MONITOR_TREND_BUCKETS &&
+                           -next->free_trend_per_hour > HEAP_MONITOR_LEAK_BYTES_PER_HOUR;
+}
+
+static void heap_monitor_post(int32_t event_id, heap_monitor_region_t region, const heap_monitor_stats_t *stats)
+{
+    heap_monitor_event_t event = {
+        .region = region,
+        .level = stats->regions[region].level,
+        .stats = stats->regions[region],
+        .free_trend_per_hour = stats->free_trend_per_hour,
+    };
+    esp_err_t err = esp_event_post(HEAP_MONITOR_EVENT, event_id, &event, sizeof(event), 0);
+    if (err == ESP_ERR_INVALID_STATE) {
+        heap_monitor_events_held = true;
+    } else if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to post heap event: %s", esp_err_to_name(err));
+    }
+}
+
+// Returns true when something worth publishing right away happened
+static bool heap_monitor_sample(void)
+{
+    heap_monitor_stats_t next;
+    xSemaphoreTake(heap_monitor_mutex, portMAX_DELAY);
+    next = heap_monitor_stats;
+    xSemaphoreGive(heap_monitor_mutex);
+    heap_monitor_stats_t prev = next;
+
+    for (int i = 0; i < HEAP_MONITOR_REGION_COUNT; i++) {
+        heap_monitor_region_stats_t *r = &next.regions[i];
+        multi_heap_info_t info;
+        heap_caps_get_info(&info, heap_monitor_regions[i].caps);
+        r->total = heap_caps_get_total_size(heap_monitor_regions[i].caps);
+        r->free = info.total_free_bytes;
+        r->min_free = info.minimum_free_bytes;
+        r->largest_free = info.largest_free_block;
+        r->fragmentation_permille = r->free > 0 ? 1000 - (uint16_t)((uint64_t)r->largest_free * 1000 / r->free) : 0;
+
+        // Worse levels apply at once, better ones only once they have held for a while
+        heap_monitor_level_t level = heap_monitor_classify(r);
+        if (level >= prev.regions[i].level) {
+            heap_monitor_clear_count[i] = 0;
+            r->level = level;
+        } else if (++heap_monitor_clear_count[i] >= HEAP_MONITOR_CLEAR_SAMPLES) {
+            heap_monitor_clear_count[i] = 0;
+            r->level = level;
+        } else {
+            r->level = prev.regions[i].level;
+        }
+    }
+
+#if CONFIG_HEAP_USE_HOOKS
+    next.hooks = true;
+#endif
+    uint32_t allocs = atomic_load_explicit(&heap_monitor_allocs, memory_order_relaxed);
+    uint32_t frees = atomic_load_explicit(&heap_monitor_frees, memory_order_relaxed);
+    uint32_t alloc_bytes = atomic_load_explicit(&heap_monitor_alloc_bytes, memory_order_relaxed);
+    if (heap_monitor_sampled) {
+        next.allocs_per_min = (allocs - prev.allocs) * 60 / HEAP_MONITOR_INTERVAL_S;
+        next.frees_per_min = (frees - prev.frees) * 60 / HEAP_MONITOR_INTERVAL_S;
+        next.alloc_bytes_per_min =
+            (uint32_t)((uint64_t)(alloc_bytes - heap_monitor_prev_alloc_bytes) * 60 / HEAP_MONITOR_INTERVAL_S);
+    }
+    heap_monitor_prev_alloc_bytes = alloc_bytes;
+    heap_monitor_sampled = true;
+    next.allocs = allocs;
+    next.frees = frees;
+    next.alloc_failures = atomic_load_explicit(&heap_monitor_alloc_failures, memory_order_relaxed);
+
+    heap_monitor_update_trend(&next, next.regions[HEAP_MONITOR_INTERNAL].free);
+
+    xSemaphoreTake(heap_monitor_mutex, portMAX_DELAY);
+    heap_monitor_stats = next;
+    xSemaphoreGive(heap_monitor_mutex);
+
+    // Levels that changed are posted below; repost the unchanged ones a held event was about
+    if (heap_monitor_events_held) {
+        heap_monitor_events_held = false;
+        for (int i = 0; i < HEAP_MONITOR_REGION_COUNT; i++) {
+            if (next.regions[i].level != HEAP_MONITOR_LEVEL_OK && next.regions[i].level == prev.regions[i].level) {
+                heap_monitor_post(HEAP_MONITOR_EVENT_LEVEL_CHANGED, i, &next);
+            }
+        }
+        if (next.leak_suspected && prev.leak_suspected) {
+            heap_monitor_post(HEAP_MONITOR_EVENT_LEAK_SUSPECTED, HEAP_MONITOR_INTERNAL, &next);
+        }
+    }
+
+    bool publish = false;
+    for (int i = 0; i < HEAP_MONITOR_REGION_COUNT; i++) {
+        const heap_monitor_region_stats_t *r = &next.regions[i];
+        if (r->level == prev.regions[i].level) {
+            continue;
+        }
+        if (r->level == HEAP_MONITOR_LEVEL_OK) {
+            ESP_LOGI(TAG, "%s heap back to normal: %" PRIu32 " free, largest block %" PRIu32,
+                     heap_monitor_regions[i].name, r->free, r->largest_free);
+        } else {
+            ESP_LOGW(TAG, "%s heap %s: %" PRIu32 " free (min %" PRIu32 "), largest block %" PRIu32
+                     ", fragmentation %u.%u%%", heap_monitor_regions[i].name, heap_monitor_level_name(r->level),
+                     r->free, r->min_free, r->largest_free, r->fragmentation_permille / 10,
+                     r->fragmentation_permille % 10);
+        }
+        heap_monitor_post(HEAP_MONITOR_EVENT_LEVEL_CHANGED, i, &next);
+        publish = true;
+    }
+    if (next.leak_suspected && !prev.leak_suspected) {
+        ESP_LOGW(TAG, "Internal heap shrinking by %" PRId32 " bytes/hour, possible leak", -next.free_trend_per_hour);
+        heap_monitor_post(HEAP_MONITOR_EVENT_LEAK_SUSPECTED, HEAP_MONITOR_INTERNAL, &next);
+        publish = true;
+    }
+    if (next.alloc_failures != prev.alloc_failures) {
+        ESP_LOGW(TAG, "%" PRIu32 " allocations failed", next.alloc_failures - prev.alloc_failures);
+        publish = true;
+    }
+    return publish;
+}
+
+static void heap_monitor_task(void *arg)
+{
+    TickType_t wake = xTaskGetTickCount();
+    uint32_t since_publish_ms = 0;
+    while (1) {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(HEAP_MONITOR_INTERVAL_S * 1000));
+        bool urgent = heap_monitor_sample();
+        if (periodic_due(&since_publish_ms, HEAP_MONITOR_INTERVAL_S * 1000, HEAP_MONITOR_PUBLISH_INTERVAL_S * 1000) ||
+            urgent) {
+            since_publish_ms = 0;
+            json_out_publish(heap_monitor_format_json, HEAP_MONITOR_JSON_MAX_LEN, mqtt_publish_heap);
+        }
+    }
+}
+
+esp_err_t heap_monitor_init(void)
+{
+    heap_monitor_mutex = xSemaphoreCreateMutex();
+    if (heap_monitor_mutex == NULL) {
+        ESP_LOGE(TAG, "Failed to create heap monitor mutex");
+        return ESP_ERR_NO_MEM;
+    }
+    heap_caps_register_failed_alloc_callback(heap_monitor_alloc_failed);
+
+    heap_monitor_sample();
+    if (xTaskCreate(heap_monitor_task, "heap_monitor", HEAP_MONITOR_TASK_STACK_SIZE, NULL,
+                    HEAP_MONITOR_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create heap monitor task");
+        return ESP_ERR_NO_MEM;
+    }
+#if !CONFIG_HEAP_USE_HOOKS
+    ESP_LOGI(TAG, "CONFIG_HEAP_USE_HOOKS is off, allocation rates are not available");
+#endif
+    return ESP_OK;
+}
+
+void heap_monitor_get_stats(heap_monitor_stats_t *stats)
+{
+    if (heap_monitor_mutex == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    xSemaphoreTake(heap_monitor_mutex, portMAX_DELAY);
+    *stats = heap_monitor_stats;
+    xSemaphoreGive(heap_monitor_mutex);
+}
+
+// {"internal":{"total":..,"free":..,"min_free":..,"largest":..,"frag":..,"level":".."},"dma":{..},
+//  "allocs_per_min":..,"frees_per_min":..,"alloc_bytes_per_min":..,"alloc_failures":..,
+//  "trend_per_hour":..,"leak_suspected":..}
+// Regions that do not exist are left out; the allocation rates need CONFIG_HEAP_USE_HOOKS.
+int heap_monitor_format_json(char *buf, size_t buf_size)
+{
+    heap_monitor_stats_t stats;
+    heap_monitor_get_stats(&stats);
+
+    size_t len = 0;
+    len = buf_appendf(buf, buf_size, len, "{");
+    for (int i = 0; i < HEAP_MONITOR_REGION_COUNT; i++) {
+        const heap_monitor_region_stats_t *r = &stats.regions[i];
+        if (r->total == 0) {
+            continue;
+        }
+        len = buf_appendf(buf, buf_size, len,
+                          "\"%s\":{\"total\":%" PRIu32 ",\"free\":%" PRIu32 ",\"min_free\":%" PRIu32
+                          ",\"largest\":%" PRIu32 ",\"frag\":%u.%u,\"level\":\"%s\"},",
+                          heap_monitor_regions[i].name, r->total, r->free, r->min_free, r->largest_free,
+                          r->fragmentation_permille / 10, r->fragmentation_permille % 10,
+                          heap_monitor_level_name(r->level));
+    }
+    if (stats.hooks) {
+        len = buf_appendf(buf, buf_size, len,
+                          "\"allocs_per_min\":%" PRIu32 ",\"frees_per_min\":%" PRIu32
+                          ",\"alloc_bytes_per_min\":%" PRIu32 ",", stats.allocs_per_min, stats.frees_per_min,
+                          stats.alloc_bytes_per_min);
+    }
+    len = buf_appendf(buf, buf_size, len,
+                      "\"alloc_failures\":%" PRIu32 ",\"trend_per_hour\":%" PRId32 ",\"leak_suspected\":%s}",
+                      stats.alloc_failures, stats.free_trend_per_hour, stats.leak_suspected ? "true" : "false");
+    return (int)len;
+}
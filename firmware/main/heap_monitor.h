@@ -0,0 +1,128 @@
+#ifndef HEAP_MONITOR_H
+#define HEAP_MONITOR_H
+
+#include "esp_err.h"
+#include "esp_event.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Heap health per capability region: free, lowest free since boot, largest free block and
+// fragmentation (1 - largest block / free). With CONFIG_HEAP_USE_HOOKS the allocator hooks
+// also count allocations and frees, from which per-minute rates are derived.
+#ifndef HEAP_MONITOR_INTERVAL_S
+#define HEAP_MONITOR_INTERVAL_S 10
+#endif
+// Telemetry on the MQTT heap topic at this interval (and on every level change), 0 to disable
+#ifndef HEAP_MONITOR_PUBLISH_INTERVAL_S
+#define HEAP_MONITOR_PUBLISH_INTERVAL_S 300
+#endif
+
+// A region is at WARN or CRITICAL when any of its figures crosses the threshold, and goes
+// back down a level only after HEAP_MONITOR_CLEAR_SAMPLES samples in a row below it
+#ifndef HEAP_MONITOR_FREE_WARN_BYTES
+#define HEAP_MONITOR_FREE_WARN_BYTES 20000
+#endif
+#ifndef HEAP_MONITOR_FREE_CRITICAL_BYTES
+#define HEAP_MONITOR_FREE_CRITICAL_BYTES 10000
+#endif
+#ifndef HEAP_MONITOR_BLOCK_WARN_BYTES
+#define HEAP_MONITOR_BLOCK_WARN_BYTES 8192
+#endif
+#ifndef HEAP_MONITOR_BLOCK_CRITICAL_BYTES
+#define HEAP_MONITOR_BLOCK_CRITICAL_BYTES 4096
+#endif
+#ifndef HEAP_MONITOR_FRAG_WARN_PERMILLE
+#define HEAP_MONITOR_FRAG_WARN_PERMILLE 700
+#endif
+#ifndef HEAP_MONITOR_FRAG_CRITICAL_PERMILLE
+#define HEAP_MONITOR_FRAG_CRITICAL_PERMILLE 850
+#endif
+#ifndef HEAP_MONITOR_CLEAR_SAMPLES
+#define HEAP_MONITOR_CLEAR_SAMPLES 3
+#endif
+
+// Leak detection: the lowest internal free heap of each HEAP_MONITOR_TREND_BUCKET_S is kept
+// for HEAP_MONITOR_TREND_BUCKETS buckets. If it fell in every bucket and by more than
+// HEAP_MONITOR_LEAK_BYTES_PER_HOUR on average, HEAP_MONITOR_EVENT_LEAK_SUSPECTED is raised.
+#ifndef HEAP_MONITOR_TREND_BUCKET_S
+#define HEAP_MONITOR_TREND_BUCKET_S 300
+#endif
+#ifndef HEAP_MONITOR_TREND_BUCKETS
+#define HEAP_MONITOR_TREND_BUCKETS 12
+#endif
+#ifndef HEAP_MONITOR_LEAK_BYTES_PER_HOUR
+#define HEAP_MONITOR_LEAK_BYTES_PER_HOUR 2048
+#endif
+
+// heap_monitor_format_json() output for every region plus the allocation rates
+#ifndef HEAP_MONITOR_JSON_MAX_LEN
+#define HEAP_MONITOR_JSON_MAX_LEN 768
+#endif
+
+#ifndef HEAP_MONITOR_TASK_PRIORITY
+#define HEAP_MONITOR_TASK_PRIORITY 1
+#endif
+#ifndef HEAP_MONITOR_TASK_STACK_SIZE
+#define HEAP_MONITOR_TASK_STACK_SIZE 3072
+#endif
+
+typedef enum {
+    HEAP_MONITOR_INTERNAL = 0,      // MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT
+    HEAP_MONITOR_DMA,               // MALLOC_CAP_DMA
+    HEAP_MONITOR_SPIRAM,            // MALLOC_CAP_SPIRAM, all zero without PSRAM
+    HEAP_MONITOR_REGION_COUNT
+} heap_monitor_region_t;
+
+typedef enum {
+    HEAP_MONITOR_LEVEL_OK = 0,
+    HEAP_MONITOR_LEVEL_WARN,
+    HEAP_MONITOR_LEVEL_CRITICAL,
+} heap_monitor_level_t;
+
+typedef struct {
+    uint32_t total;
+    uint32_t free;
+    uint32_t min_free;              // Lowest free since boot
+    uint32_t largest_free;
+    uint16_t fragmentation_permille;
+    heap_monitor_level_t level;
+} heap_monitor_region_stats_t;
+
+typedef struct {
+    heap_monitor_region_stats_t regions[HEAP_MONITOR_REGION_COUNT];
+    bool hooks;                     // Allocation counts below are available
+    uint32_t allocs;                // Since boot
+    uint32_t frees;
+    uint32_t alloc_failures;
+    uint32_t allocs_per_min;        // Over the last sample interval
+    uint32_t frees_per_min;
+    uint32_t alloc_bytes_per_min;
+    int32_t free_trend_per_hour;    // Internal free heap change, negative when shrinking
+    bool leak_suspected;
+} heap_monitor_stats_t;
+
+// Posted to the default event loop, data: heap_monitor_event_t. Changes seen before the loop
+// exists are posted with the then-current level once it does.
+ESP_EVENT_DECLARE_BASE(HEAP_MONITOR_EVENT);
+
+enum {
+    HEAP_MONITOR_EVENT_LEVEL_CHANGED,
+    HEAP_MONITOR_EVENT_LEAK_SUSPECTED,
+};
+
+typedef struct {
+    heap_monitor_region_t region;
+    heap_monitor_level_t level;
+    heap_monitor_region_stats_t stats;
+    int32_t free_trend_per_hour;
+} heap_monitor_event_t;
+
+// Function declarations
+esp_err_t heap_monitor_init(void);
+void heap_monitor_get_stats(heap_monitor_stats_t *stats);
+const char *heap_monitor_region_name(heap_monitor_region_t region);
+const char *heap_monitor_level_name(heap_monitor_level_t level);
+int heap_monitor_format_json(char *buf, size_t buf_size);
+
+#endif // HEAP_MONITOR_H
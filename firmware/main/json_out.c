@@ -0,0 +1,32 @@
+#include "json_out.h"
+#include <stdlib.h>
+
+// Format into a heap buffer of max_len bytes. Returns it (free() it) with the length in *len,
+// or NULL when out of memory or when the document does not fit.
+char *json_out_format(json_out_format_fn_t format, size_t max_len, int *len)
+{
+    char *buf = malloc(max_len);
+    if (buf == NULL) {
+        return NULL;
+    }
+    *len = format(buf, max_len);
+    if (*len < 0 || (size_t)*len >= max_len) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+// Format and hand the document to publish (an mqtt_publish_* function). Periodic callers can
+// ignore the result: the next period tries again.
+esp_err_t json_out_publish(json_out_format_fn_t format, size_t max_len, json_out_publish_fn_t publish)
+{
+    int len;
+    char *json = json_out_format(format, max_len, &len);
+    if (json == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t ret = publish(json);
+    free(json);
+    return ret;
+}
@@ -0,0 +1,19 @@
+#ifndef JSON_OUT_H
+#define JSON_OUT_H
+
+#include "esp_err.h"
+#include <stddef.h>
+
+// Helpers for the JSON read-outs (trace, task stats, heap, boot timeline). Formatters follow
+// snprintf: they write what fits and return the length the whole document needs, so a caller
+// can tell that its buffer was too small.
+
+// Formats into buf, returns the length or a negative value on error
+typedef int (*json_out_format_fn_t)(char *buf, size_t buf_size);
+typedef esp_err_t (*json_out_publish_fn_t)(const char *json);
+
+// Function declarations
+char *json_out_format(json_out_format_fn_t format, size_t max_len, int *len);
+esp_err_t json_out_publish(json_out_format_fn_t format, size_t max_len, json_out_publish_fn_t publish);
+
+#endif // JSON_OUT_H
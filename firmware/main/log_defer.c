@@ -0,0 +1,653 @@
+#include "log_defer.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "util.h"
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "LOG_DEFER";
+
+#if (LOG_DEFER_RING_SIZE & (LOG_DEFER_RING_SIZE - 1)) != 0
+#error "LOG_DEFER_RING_SIZE must be a power of two"
+#endif
+#if (LOG_DEFER_MAX_SITES & (LOG_DEFER_MAX_SITES - 1)) != 0
+#error "LOG_DEFER_MAX_SITES must be a power of two"
+#endif
+
+#define LOG_DEFER_PREFORMATTED 0x01     // args holds the formatted text instead of arguments
+#define LOG_DEFER_SITE_PROBES 8
+
+// Same scheme as the trace rings: a slot holds record n once seq == n + 1, and the reader
+// checks seq again after copying. Two writers only share a slot if the ring wraps while
+// one of them is still capturing; the reader may then print a garbled line, but all
+// accesses stay within the record.
+typedef struct {
+    atomic_uint seq;
+    log_defer_record_t record;
+} log_defer_slot_t;
+
+static struct {
+    atomic_uint head;               // Next record index, claimed with fetch_add by writers
+    uint32_t tail;                  // Next record to print, only touched under log_defer_mutex
+    log_defer_slot_t slots[LOG_DEFER_RING_SIZE];
+} log_defer_ring;
+
+// Rate limit state per format string, claimed on first use
+typedef struct {
+    atomic_uintptr_t format;
+    atomic_uint window_ms;
+    atomic_uint count;
+    atomic_uint suppressed;
+} log_defer_site_t;
+
+static log_defer_site_t log_defer_sites[LOG_DEFER_MAX_SITES];
+
+static atomic_uint log_defer_captured;
+static atomic_uint log_defer_suppressed;
+static atomic_uint log_defer_lost;
+static atomic_uint log_defer_preformatted;
+
+static struct {
+    log_defer_sink_t sink;
+    void *ctx;
+} log_defer_sinks[LOG_DEFER_MAX_SINKS];
+static atomic_int log_defer_sink_count;
+static _Atomic log_defer_capture_t log_defer_capture_hook;
+
+static SemaphoreHandle_t log_defer_mutex = NULL;
+static vprintf_like_t log_defer_console = NULL;    // The output function we replaced
+static uint32_t log_defer_lost_reported = 0;       // Under log_defer_mutex
+
+typedef enum {
+    LOG_DEFER_ARG_NONE,             // %%
+    LOG_DEFER_ARG_INT,
+    LOG_DEFER_ARG_LONG,
+    LOG_DEFER_ARG_LLONG,
+    LOG_DEFER_ARG_INTMAX,
+    LOG_DEFER_ARG_SIZE,
+    LOG_DEFER_ARG_PTRDIFF,
+    LOG_DEFER_ARG_DOUBLE,
+    LOG_DEFER_ARG_STRING,
+    LOG_DEFER_ARG_POINTER,
+    LOG_DEFER_ARG_UNSUPPORTED,      // %n, %ls, long double: formatted at the call site
+} log_defer_arg_t;
+
+typedef struct {
+    const char *start;              // The '%'
+    const char *precision;          // The '.', NULL without a precision
+    const char *end;                // Just past the conversion character
+    bool width_star;
+    bool precision_star;
+    int precision_value;            // -1 without a precision or with '*'
+    log_defer_arg_t arg;
+} log_defer_spec_t;
+
+// Parse the conversion specification starting at the '%' at p
+static void log_defer_parse(const char *p, log_defer_spec_t *spec)
+{
+    spec->start = p++;
+    spec->precision = NULL;
+    spec->width_star = false;
+    spec->precision_star = false;
+    spec->precision_value = -1;
+
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+        p++;
+    }
+    if (*p == '*') {
+        spec->width_star = true;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if (*p == '.') {
+        spec->precision = p++;
+        if (*p == '*') {
+            spec->precision_star = true;
+            p++;
+        } else {
+            spec->precision_value = 0;
+            while (*p >= '0' && *p <= '9') {
+                spec->precision_value = spec->precision_value * 10 + (*p++ - '0');
+            }
+        }
+    }
+
+    int longs = 0;
+    char length = 0;
+    while (*p != '\0' && strchr("hljztLq", *p) != NULL) {
+        if (*p == 'l' || *p == 'q') {
+            longs += *p == 'q' ? 2 : 1;
+        } else {
+            length = *p;
+        }
+        p++;
+    }
+
+    char conversion = *p;
+    spec->end = conversion != '\0' ? p + 1 : p;
+    switch (conversion) {
+    case '%':
+        spec->arg = LOG_DEFER_ARG_NONE;
+        break;
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+        if (longs >= 2) {
+            spec->arg = LOG_DEFER_ARG_LLONG;
+        } else if (longs == 1) {
+            spec->arg = LOG_DEFER_ARG_LONG;
+        } else if (length == 'j') {
+            spec->arg = LOG_DEFER_ARG_INTMAX;
+        } else if (length == 'z') {
+            spec->arg = LOG_DEFER_ARG_SIZE;
+        } else if (length == 't') {
+            spec->arg = LOG_DEFER_ARG_PTRDIFF;
+        } else if (length == 'L') {
+            spec->arg = LOG_DEFER_ARG_UNSUPPORTED;
+        } else {
+            spec->arg = LOG_DEFER_ARG_INT;
+        }
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        spec->arg = length == 'L' ? LOG_DEFER_ARG_UNSUPPORTED : LOG_DEFER_ARG_DOUBLE;
+        break;
+    case 's':
+        spec->arg = longs ? LOG_DEFER_ARG_UNSUPPORTED : LOG_DEFER_ARG_STRING;
+        break;
+    case 'p':
+        spec->arg = LOG_DEFER_ARG_POINTER;
+        break;
+    default:
+        spec->arg = LOG_DEFER_ARG_UNSUPPORTED;
+        break;
+    }
+}
+
+static bool log_defer_put(log_defer_record_t *record, const void *value, size_t size)
+{
+    if (record->args_len + size > LOG_DEFER_ARGS_SIZE) {
+        return false;
+    }
+    memcpy(record->args + record->args_len, value, size);
+    record->args_len += size;
+    return true;
+}
+
+#define LOG_DEFER_PUT_ARG(type)                                 \
+    do {                                                        \
+        type value = va_arg(ap, type);                          \
+        if (!log_defer_put(record, &value, sizeof(value))) {    \
+            return false;                                       \
+        }                                                       \
+    } while (0)
+
+// Copy the arguments of the record's format out of ap. Returns false when the record has
+// to be formatted right away (unsupported conversion or the numbers alone do not fit).
+static bool log_defer_capture(log_defer_record_t *record, va_list ap)
+{
+    const char *p = record->format;
+    while ((p = strchr(p, '%')) != NULL) {
+        log_defer_spec_t spec;
+        log_defer_parse(p, &spec);
+        p = spec.end;
+
+        if (spec.width_star) {
+            LOG_DEFER_PUT_ARG(int);
+        }
+        if (spec.precision_star) {
+            int precision = va_arg(ap, int);
+            if (!log_defer_put(record, &precision, sizeof(precision))) {
+                return false;
+            }
+            spec.precision_value = precision;
+        }
+
+        switch (spec.arg) {
+        case LOG_DEFER_ARG_NONE:
+            break;
+        case LOG_DEFER_ARG_INT:
+            LOG_DEFER_PUT_ARG(int);
+            break;
+        case LOG_DEFER_ARG_LONG:
+            LOG_DEFER_PUT_ARG(long);
+            break;
+        case LOG_DEFER_ARG_LLONG:
+            LOG_DEFER_PUT_ARG(long long);
+            break;
+        case LOG_DEFER_ARG_INTMAX:
+            LOG_DEFER_PUT_ARG(intmax_t);
+            break;
+        case LOG_DEFER_ARG_SIZE:
+            LOG_DEFER_PUT_ARG(size_t);
+            break;
+        case LOG_DEFER_ARG_PTRDIFF:
+            LOG_DEFER_PUT_ARG(ptrdiff_t);
+            break;
+        case LOG_DEFER_ARG_DOUBLE:
+            LOG_DEFER_PUT_ARG(double);
+            break;
+        case LOG_DEFER_ARG_POINTER:
+            LOG_DEFER_PUT_ARG(void *);
+            break;
+        case LOG_DEFER_ARG_STRING: {
+            const char *s = va_arg(ap, const char *);
+            if (s == NULL) {
+                s = "(null)";
+            }
+            if (record->args_len + sizeof(uint16_t) > LOG_DEFER_ARGS_SIZE) {
+                return false;
+            }
+            size_t room = LOG_DEFER_ARGS_SIZE - record->args_len - sizeof(uint16_t);
+            size_t n = spec.precision_value >= 0 ? strnlen(s, spec.precision_value) : strnlen(s, room);
+            uint16_t len = n < room ? n : room;
+            log_defer_put(record, &len, sizeof(len));
+            log_defer_put(record, s, len);
+            break;
+        }
+        case LOG_DEFER_ARG_UNSUPPORTED:
+            return false;
+        }
+    }
+    return true;
+}
+
+#undef LOG_DEFER_PUT_ARG
+
+// Per-site rate limit. Returns false when the site is over its budget for the current
+// window; otherwise *suppressed is how many of its messages were dropped since the last
+// one that got through. Windows and counts are updated without a lock, so a burst from
+// both cores may let a message or two more through.
+static bool log_defer_admit(const char *format, uint16_t *suppressed)
+{
+    *suppressed = 0;
+    uint32_t hash = (uint32_t)((uintptr_t)format >> 2) * 2654435761u;
+    uint32_t first = hash >> (32 - __builtin_ctz(LOG_DEFER_MAX_SITES));
+    log_defer_site_t *site = NULL;
+    for (int i = 0; i < LOG_DEFER_SITE_PROBES; i++) {
+        log_defer_site_t *s = &log_defer_sites[(first + i) & (LOG_DEFER_MAX_SITES - 1)];
+        uintptr_t owner = atomic_load_explicit(&s->format, memory_order_acquire);
+        if (owner == 0) {
+            atomic_compare_exchange_strong_explicit(&s->format, &owner, (uintptr_t)format,
+                                                    memory_order_acq_rel, memory_order_acquire);
+            owner = atomic_load_explicit(&s->format, memory_order_acquire);
+        }
+        if (owner == (uintptr_t)format) {
+            site = s;
+            break;
+        }
+    }
+    if (site == NULL) {
+        return true;
+    }
+
+    uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    uint32_t start = atomic_load_explicit(&site->window_ms, memory_order_relaxed);
+    if (now_ms - start >= LOG_DEFER_RATE_WINDOW_MS &&
+        atomic_compare_exchange_strong_explicit(&site->window_ms, &start, now_ms, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+    }
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >= LOG_DEFER_RATE_BURST) {
+        atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&log_defer_suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+    uint32_t dropped = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+    *suppressed = dropped > UINT16_MAX ? UINT16_MAX : dropped;
+    return true;
+}
+
+// Installed with esp_log_set_vprintf(): called by every ESP_LOGx that passes the level
+// check, on the caller's stack. No locks, no I/O.
+static int log_defer_vprintf(const char *format, va_list ap)
+{
+    uint16_t suppressed;
+    if (!log_defer_admit(format, &suppressed)) {
+        return 0;
+    }
+
+    uint32_t index = atomic_fetch_add_explicit(&log_defer_ring.head, 1, memory_order_relaxed);
+    log_defer_slot_t *slot = &log_defer_ring.slots[index & (LOG_DEFER_RING_SIZE - 1)];
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    log_defer_record_t *record = &slot->record;
+    record->format = format;
+    record->suppressed = suppressed;
+    record->flags = 0;
+    record->args_len = 0;
+
+    va_list copy;
+    va_copy(copy, ap);
+    if (!log_defer_capture(record, ap)) {
+        int n = vsnprintf((char *)record->args, LOG_DEFER_ARGS_SIZE, format, copy);
+        if (n < 0) {
+            n = 0;
+        } else if (n >= LOG_DEFER_ARGS_SIZE) {
+            // Keep the line break the format ends with
+            n = LOG_DEFER_ARGS_SIZE - 1;
+            record->args[n - 1] = '\n';
+        }
+        record->args_len = n;
+        record->flags = LOG_DEFER_PREFORMATTED;
+        atomic_fetch_add_explicit(&log_defer_preformatted, 1, memory_order_relaxed);
+    }
+    va_end(copy);
+
+    log_defer_capture_t capture = atomic_load_explicit(&log_defer_capture_hook, memory_order_acquire);
+    if (capture != NULL) {
+        capture(record);
+    }
+    atomic_store_explicit(&slot->seq, index + 1, memory_order_release);
+    atomic_fetch_add_explicit(&log_defer_captured, 1, memory_order_relaxed);
+    return 0;
+}
+
+static bool log_defer_get(const uint8_t **arg, const uint8_t *end, void *value, size_t size)
+{
+    if (*arg + size > end) {
+        return false;
+    }
+    memcpy(value, *arg, size);
+    *arg += size;
+    return true;
+}
+
+// Print a record the way the replaced output function would have. Returns the length,
+// which may exceed size like snprintf. Also used on copies of records kept elsewhere, so
+// their format pointer must come from the running image.
+size_t log_defer_format(const log_defer_record_t *record, char *line, size_t size)
+{
+    size_t len = 0;
+    if (record->flags & LOG_DEFER_PREFORMATTED) {
+        len = buf_appendf(line, size, len, "%.*s", (int)record->args_len, (const char *)record->args);
+        return len;
+    }
+
+    const uint8_t *arg = record->args;
+    const uint8_t *end = record->args + record->args_len;
+    const char *p = record->format;
+    while (*p != '\0') {
+        const char *percent = strchr(p, '%');
+        if (percent == NULL) {
+            len = buf_appendf(line, size, len, "%s", p);
+            break;
+        }
+        len = buf_appendf(line, size, len, "%.*s", (int)(percent - p), p);
+
+        log_defer_spec_t spec;
+        log_defer_parse(percent, &spec);
+        p = spec.end;
+
+        int width = 0;
+        int precision = 0;
+        if ((spec.width_star && !log_defer_get(&arg, end, &width, sizeof(width))) ||
+            (spec.precision_star && !log_defer_get(&arg, end, &precision, sizeof(precision)))) {
+            break;
+        }
+
+        // The specification as written, or for strings without its precision, which was
+        // applied when the string was copied
+        char conversion[24];
+        size_t spec_len = (spec.arg == LOG_DEFER_ARG_STRING && spec.precision ? spec.precision : spec.end) - spec.start;
+        if (spec_len + 4 > sizeof(conversion)) {
+            break;
+        }
+        memcpy(conversion, spec.start, spec_len);
+        conversion[spec_len] = '\0';
+        if (spec.arg == LOG_DEFER_ARG_STRING) {
+            if (spec.precision == NULL) {
+                spec_len--;             // Drop the 's'
+            }
+            strcpy(conversion + spec_len, ".*s");
+        }
+
+#define LOG_DEFER_APPEND_ARG(type)                                                        \
+    do {                                                                                  \
+        type value;                                                                       \
+        if (!log_defer_get(&arg, end, &value, sizeof(value))) {                           \
+            goto done;                                                                    \
+        }                                                                                 \
+        if (spec.width_star && spec.precision_star) {                                     \
+            len = buf_appendf(line, size, len, conversion, width, precision, value);      \
+        } else if (spec.width_star) {                                                     \
+            len = buf_appendf(line, size, len, conversion, width, value);                 \
+        } else if (spec.precision_star) {                                                 \
+            len = buf_appendf(line, size, len, conversion, precision, value);             \
+        } else {                                                                          \
+            len = buf_appendf(line, size, len, conversion, value);                        \
+        }                                                                                 \
+    } while (0)
+
+        switch (spec.arg) {
+        case LOG_DEFER_ARG_NONE:
+            len = buf_appendf(line, size, len, "%%");
+            break;
+        case LOG_DEFER_ARG_INT:
+            LOG_DEFER_APPEND_ARG(int);
+            break;
+        case LOG_DEFER_ARG_LONG:
+            LOG_DEFER_APPEND_ARG(long);
+            break;
+        case LOG_DEFER_ARG_LLONG:
+            LOG_DEFER_APPEND_ARG(long long);
+            break;
+        case LOG_DEFER_ARG_INTMAX:
+            LOG_DEFER_APPEND_ARG(intmax_t);
+            break;
+        case LOG_DEFER_ARG_SIZE:
+            LOG_DEFER_APPEND_ARG(size_t);
+            break;
+        case LOG_DEFER_ARG_PTRDIFF:
+            LOG_DEFER_APPEND_ARG(ptrdiff_t);
+            break;
+        case LOG_DEFER_ARG_DOUBLE:
+            LOG_DEFER_APPEND_ARG(double);
+            break;
+        case LOG_DEFER_ARG_POINTER:
+            LOG_DEFER_APPEND_ARG(void *);
+            break;
+        case LOG_DEFER_ARG_STRING: {
+            uint16_t n;
+            if (!log_defer_get(&arg, end, &n, sizeof(n)) || arg + n > end) {
+                goto done;
+            }
+            if (spec.width_star) {
+                len = buf_appendf(line, size, len, conversion, width, (int)n, (const char *)arg);
+            } else {
+                len = buf_appendf(line, size, len, conversion, (int)n, (const char *)arg);
+            }
+            arg += n;
+            break;
+        }
+        case LOG_DEFER_ARG_UNSUPPORTED:
+            goto done;
+        }
+#undef LOG_DEFER_APPEND_ARG
+    }
+done:
+    return len;
+}
+
+static int log_defer_print(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    int ret = log_defer_console ? log_defer_console(format, ap) : vprintf(format, ap);
+    va_end(ap);
+    return ret;
+}
+
+static void log_defer_emit(char *line, size_t len, size_t size)
+{
+    if (len >= size) {
+        len = size - 1;
+        line[len - 1] = '\n';
+    }
+    log_defer_print("%.*s", (int)len, line);
+    int sinks = atomic_load_explicit(&log_defer_sink_count, memory_order_acquire);
+    for (int i = 0; i < sinks; i++) {
+        log_defer_sinks[i].sink(line, len, log_defer_sinks[i].ctx);
+    }
+}
+
+// Print every completed record; a record still being written stops the ring until the
+// next pass
+static void log_defer_drain_locked(void)
+{
+    static log_defer_record_t record;
+    static char line[LOG_DEFER_LINE_MAX];
+
+    while (1) {
+        uint32_t head = atomic_load_explicit(&log_defer_ring.head, memory_order_acquire);
+        if (head - log_defer_ring.tail > LOG_DEFER_RING_SIZE) {
+            atomic_fetch_add_explicit(&log_defer_lost, head - log_defer_ring.tail - LOG_DEFER_RING_SIZE,
+                                      memory_order_relaxed);
+            log_defer_ring.tail = head - LOG_DEFER_RING_SIZE;
+        }
+        if (log_defer_ring.tail == head) {
+            break;
+        }
+
+        log_defer_slot_t *slot = &log_defer_ring.slots[log_defer_ring.tail & (LOG_DEFER_RING_SIZE - 1)];
+        uint32_t expected = log_defer_ring.tail + 1;
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != expected) {
+            if ((int32_t)(seq - expected) > 0) {
+                atomic_fetch_add_explicit(&log_defer_lost, 1, memory_order_relaxed);
+                log_defer_ring.tail++;
+                continue;
+            }
+            break;
+        }
+        record = slot->record;
+        atomic_thread_fence(memory_order_acquire);
+        log_defer_ring.tail++;
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != expected) {
+            atomic_fetch_add_explicit(&log_defer_lost, 1, memory_order_relaxed);
+            continue;
+        }
+
+        uint32_t lost = atomic_load_explicit(&log_defer_lost, memory_order_relaxed);
+        if (lost != log_defer_lost_reported) {
+            size_t len = snprintf(line, sizeof(line), "W (%" PRIu32 ") %s: %" PRIu32 " log messages lost, output fell behind\n",
+                                  esp_log_timestamp(), TAG, lost - log_defer_lost_reported);
+            log_defer_emit(line, len, sizeof(line));
+            log_defer_lost_reported = lost;
+        }
+        if (record.suppressed != 0) {
+            size_t len = snprintf(line, sizeof(line), "W (%" PRIu32 ") %s: %u messages like the next one were rate-limited\n",
+                                  esp_log_timestamp(), TAG, record.suppressed);
+            log_defer_emit(line, len, sizeof(line));
+        }
+        size_t len = log_defer_format(&record, line, sizeof(line));
+        if (len > 0) {
+            log_defer_emit(line, len, sizeof(line));
+        }
+    }
+}
+
+// Print everything captured so far; also registered as a shutdown handler so the last
+// messages before esp_restart() reach the console
+void log_defer_flush(void)
+{
+    if (log_defer_mutex == NULL) {
+        return;
+    }
+    if (xSemaphoreTake(log_defer_mutex, pdMS_TO_TICKS(500)) != pdTRUE) {
+        return;
+    }
+    log_defer_drain_locked();
+    xSemaphoreGive(log_defer_mutex);
+}
+
+static void log_defer_task(void *arg)
+{
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(LOG_DEFER_DRAIN_INTERVAL_MS));
+        log_defer_flush();
+    }
+}
+
+esp_err_t log_defer_add_sink(log_defer_sink_t sink, void *ctx)
+{
+    // Sinks are only added during start-up; readers see a slot once the count covers it
+    int count = atomic_load_explicit(&log_defer_sink_count, memory_order_relaxed);
+    if (count >= LOG_DEFER_MAX_SINKS) {
+        ESP_LOGE(TAG, "No room for another log sink");
+        return ESP_ERR_NO_MEM;
+    }
+    log_defer_sinks[count].sink = sink;
+    log_defer_sinks[count].ctx = ctx;
+    atomic_store_explicit(&log_defer_sink_count, count + 1, memory_order_release);
+    return ESP_OK;
+}
+
+esp_err_t log_defer_set_capture(log_defer_capture_t capture)
+{
+    log_defer_capture_t none = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&log_defer_capture_hook, &none, capture, memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        ESP_LOGE(TAG, "A log capture hook is already set");
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+// Copy a line without its ANSI colour escapes (CONFIG_LOG_COLORS), for sinks that store or
+// ship it; returns the copied length, at most out_size. out may be line itself.
+size_t log_defer_strip_colors(const char *line, size_t len, char *out, size_t out_size)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < len && n < out_size; i++) {
+        if (line[i] == '\033' && i + 1 < len && line[i + 1] == '[') {
+            i += 2;
+            while (i < len && line[i] != 'm') {
+                i++;
+            }
+            continue;
+        }
+        out[n++] = line[i];
+    }
+    return n;
+}
+
+void log_defer_get_stats(log_defer_stats_t *stats)
+{
+    stats->captured = atomic_load_explicit(&log_defer_captured, memory_order_relaxed);
+    stats->suppressed = atomic_load_explicit(&log_defer_suppressed, memory_order_relaxed);
+    stats->lost = atomic_load_explicit(&log_defer_lost, memory_order_relaxed);
+    stats->preformatted = atomic_load_explicit(&log_defer_preformatted, memory_order_relaxed);
+}
+
+esp_err_t log_defer_init(void)
+{
+#if LOG_DEFER_ENABLED
+    log_defer_mutex = xSemaphoreCreateMutex();
+    if (log_defer_mutex == NULL) {
+        ESP_LOGE(TAG, "Failed to create log mutex");
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(log_defer_task, "log_defer", LOG_DEFER_TASK_STACK_SIZE, NULL,
+                    LOG_DEFER_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create log output task");
+        return ESP_ERR_NO_MEM;
+    }
+    log_defer_console = esp_log_set_vprintf(log_defer_vprintf);
+    esp_register_shutdown_handler(log_defer_flush);
+    ESP_LOGI(TAG, "Deferred logging on, %d records, %d messages/s per call site", LOG_DEFER_RING_SIZE,
+             LOG_DEFER_RATE_BURST * 1000 / LOG_DEFER_RATE_WINDOW_MS);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
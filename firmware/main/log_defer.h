@@ -0,0 +1,99 @@
+#ifndef LOG_DEFER_H
+#define LOG_DEFER_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Deferred logging. log_defer_init() installs itself as the ESP_LOG output function, so
+// every ESP_LOGx call only captures its format pointer and arguments into a lock-free ring
+// (strings are copied, they may not outlive the call). A low-priority task formats the
+// records and writes them to the console and any registered sinks. The caller never waits
+// for the UART, so the control path costs the same at any log level.
+// Build with LOG_DEFER_ENABLED=0 to keep the synchronous ESP_LOG output.
+#ifndef LOG_DEFER_ENABLED
+#define LOG_DEFER_ENABLED 1
+#endif
+
+// Records kept until the output task catches up (power of two); when it falls behind the
+// oldest records are overwritten and reported as lost
+#ifndef LOG_DEFER_RING_SIZE
+#define LOG_DEFER_RING_SIZE 64
+#endif
+// Argument bytes per record; longer strings are cut to fit
+#ifndef LOG_DEFER_ARGS_SIZE
+#define LOG_DEFER_ARGS_SIZE 112
+#endif
+// Longest formatted line handed to the console and sinks
+#ifndef LOG_DEFER_LINE_MAX
+#define LOG_DEFER_LINE_MAX 256
+#endif
+#ifndef LOG_DEFER_DRAIN_INTERVAL_MS
+#define LOG_DEFER_DRAIN_INTERVAL_MS 20
+#endif
+
+// Rate limit per call site (per format string): at most LOG_DEFER_RATE_BURST messages per
+// LOG_DEFER_RATE_WINDOW_MS, the rest are counted and reported with the next window
+#ifndef LOG_DEFER_RATE_BURST
+#define LOG_DEFER_RATE_BURST 10
+#endif
+#ifndef LOG_DEFER_RATE_WINDOW_MS
+#define LOG_DEFER_RATE_WINDOW_MS 1000
+#endif
+// Call sites tracked for rate limiting (power of two); sites beyond this are not limited
+#ifndef LOG_DEFER_MAX_SITES
+#define LOG_DEFER_MAX_SITES 128
+#endif
+
+#ifndef LOG_DEFER_MAX_SINKS
+#define LOG_DEFER_MAX_SINKS 4
+#endif
+
+#ifndef LOG_DEFER_TASK_PRIORITY
+#define LOG_DEFER_TASK_PRIORITY 1
+#endif
+#ifndef LOG_DEFER_TASK_STACK_SIZE
+#define LOG_DEFER_TASK_STACK_SIZE 3072
+#endif
+
+// Called from the output task with each formatted line, newline included. line is only
+// valid during the call; a sink that does I/O should queue the line and return.
+typedef void (*log_defer_sink_t)(const char *line, size_t len, void *ctx);
+
+// One ESP_LOG call: the format (a string literal, so it outlives the call) and its
+// arguments packed back to back in the order the format consumes them. Strings are stored
+// as a uint16_t length followed by the characters. Only the first LOG_DEFER_RECORD_SIZE()
+// bytes are meaningful; log_defer_format() prints a record.
+typedef struct {
+    const char *format;
+    uint16_t suppressed;            // Messages from the same site dropped just before this one
+    uint8_t flags;
+    uint16_t args_len;
+    uint8_t args[LOG_DEFER_ARGS_SIZE];
+} log_defer_record_t;
+
+#define LOG_DEFER_RECORD_SIZE(record) (offsetof(log_defer_record_t, args) + (record)->args_len)
+
+// Called on the logging task itself with each record that passes the rate limit, once it is
+// captured. For consumers that must not lose the last lines before a crash: copy the record
+// and format it later. Runs on the caller's stack and must not log, block or do I/O.
+typedef void (*log_defer_capture_t)(const log_defer_record_t *record);
+
+typedef struct {
+    uint32_t captured;              // Records written to the ring
+    uint32_t suppressed;            // Dropped by the per-site rate limit
+    uint32_t lost;                  // Overwritten before the output task got to them
+    uint32_t preformatted;          // Formatted at the call site (unusual format or too many arguments)
+} log_defer_stats_t;
+
+// Function declarations
+esp_err_t log_defer_init(void);
+esp_err_t log_defer_add_sink(log_defer_sink_t sink, void *ctx);
+esp_err_t log_defer_set_capture(log_defer_capture_t capture);
+void log_defer_flush(void);
+void log_defer_get_stats(log_defer_stats_t *stats);
+size_t log_defer_format(const log_defer_record_t *record, char *line, size_t size);
+size_t log_defer_strip_colors(const char *line, size_t len, char *out, size_t out_size);
+
+#endif // LOG_DEFER_H
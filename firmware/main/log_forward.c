@@ -0,0 +1,517 @@
+#include "log_forward.h"
+#include "log_defer.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "app_mqtt.h"
+#include "time_sync.h"
+#include "wifi_manager.h"
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *TAG = "LOG_FORWARD";
+
+#define NVS_NAMESPACE "log_fwd"
+#define NVS_KEY_CONFIG "config"
+#define LOG_FORWARD_CONFIG_VERSION 1
+#define LOG_FORWARD_RECORD_HEADER 3     // Level, length (u16 little endian)
+#define LOG_FORWARD_APP_NAME_MAX 48     // RFC 5424 APP-NAME
+#define LOG_FORWARD_DATAGRAM_MAX (LOG_DEFER_LINE_MAX + 160)
+
+typedef struct {
+    uint8_t version;
+    log_forward_config_t config;
+} log_forward_config_blob_t;
+
+static log_forward_config_t log_forward_config;
+static SemaphoreHandle_t log_forward_config_mutex = NULL;
+static volatile uint32_t log_forward_config_generation = 1;
+static TaskHandle_t log_forward_task_handle = NULL;
+
+// Most verbose level any destination wants; the sink drops everything above it without
+// taking a lock
+static atomic_int log_forward_max_level = ESP_LOG_NONE;
+
+// Byte queue of records (level, length, text without the newline). head/tail are running
+// byte counts, byte n lives at log_forward_queue[n % LOG_FORWARD_QUEUE_SIZE].
+static portMUX_TYPE log_forward_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t log_forward_queue[LOG_FORWARD_QUEUE_SIZE];
+static uint32_t log_forward_head = 0;
+static uint32_t log_forward_tail = 0;
+static log_forward_stats_t log_forward_stats;
+
+static const char *log_forward_level_names[] = {
+    [ESP_LOG_NONE] = "none",
+    [ESP_LOG_ERROR] = "error",
+    [ESP_LOG_WARN] = "warn",
+    [ESP_LOG_INFO] = "info",
+    [ESP_LOG_DEBUG] = "debug",
+    [ESP_LOG_VERBOSE] = "verbose",
+};
+
+const char *log_forward_level_name(esp_log_level_t level)
+{
+    return (unsigned)level <= ESP_LOG_VERBOSE ? log_forward_level_names[level] : "unknown";
+}
+
+bool log_forward_parse_level(const char *name, esp_log_level_t *level)
+{
+    for (int i = ESP_LOG_NONE; i <= ESP_LOG_VERBOSE; i++) {
+        if (strcmp(name, log_forward_level_names[i]) == 0) {
+            *level = (esp_log_level_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void log_forward_default_config(log_forward_config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->syslog_level = ESP_LOG_NONE;
+    config->mqtt_level = ESP_LOG_NONE;
+    config->syslog_port = LOG_FORWARD_SYSLOG_DEFAULT_PORT;
+    config->facility = LOG_FORWARD_FACILITY_LOCAL0;
+}
+
+static esp_err_t log_forward_load_config(log_forward_config_t *config)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    log_forward_config_blob_t blob = { .version = 0 };
+    size_t len = sizeof(blob);
+    err = nvs_get_blob(nvs_handle, NVS_KEY_CONFIG, &blob, &len);
+    nvs_close(nvs_handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (len != sizeof(blob) || blob.version != LOG_FORWARD_CONFIG_VERSION) {
+        ESP_LOGW(TAG, "Ignoring stored log forward config (version %d, %u bytes)", blob.version, (unsigned)len);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    *config = blob.config;
+    config->syslog_host[sizeof(config->syslog_host) - 1] = '\0';
+    config->hostname[sizeof(config->hostname) - 1] = '\0';
+    return ESP_OK;
+}
+
+static esp_err_t log_forward_save_config(const log_forward_config_t *config)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    log_forward_config_blob_t blob = {
+        .version = LOG_FORWARD_CONFIG_VERSION,
+        .config = *config,
+    };
+    err = nvs_set_blob(nvs_handle, NVS_KEY_CONFIG, &blob, sizeof(blob));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs_handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save log forward config: %s", esp_err_to_name(err));
+    }
+
+    nvs_close(nvs_handle);
+    return err;
+}
+
+static void log_forward_apply_levels(const log_forward_config_t *config)
+{
+    int max_level = config->syslog_host[0] != '\0' ? config->syslog_level : ESP_LOG_NONE;
+    if ((int)config->mqtt_level > max_level) {
+        max_level = config->mqtt_level;
+    }
+    atomic_store_explicit(&log_forward_max_level, max_level, memory_order_relaxed);
+}
+
+void log_forward_get_config(log_forward_config_t *config)
+{
+    if (log_forward_config_mutex == NULL) {
+        log_forward_default_config(config);
+        return;
+    }
+    xSemaphoreTake(log_forward_config_mutex, portMAX_DELAY);
+    *config = log_forward_config;
+    xSemaphoreGive(log_forward_config_mutex);
+}
+
+esp_err_t log_forward_set_config(const log_forward_config_t *config)
+{
+    if (config->syslog_level > ESP_LOG_VERBOSE || config->mqtt_level > ESP_LOG_VERBOSE ||
+        config->syslog_port == 0 || config->facility > 23 ||
+        memchr(config->syslog_host, '\0', sizeof(config->syslog_host)) == NULL ||
+        memchr(config->hostname, '\0', sizeof(config->hostname)) == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (const char *c = config->hostname; *c != '\0'; c++) {
+        if (*c <= ' ' || *c > '~') {
+            return ESP_ERR_INVALID_ARG;     // HOSTNAME is printable US-ASCII without spaces
+        }
+    }
+    if (log_forward_config_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = log_forward_save_config(config);
+    if (err != ESP_OK) {
+        return err;
+    }
+    xSemaphoreTake(log_forward_config_mutex, portMAX_DELAY);
+    log_forward_config = *config;
+    log_forward_config_generation++;
+    log_forward_apply_levels(config);
+    xSemaphoreGive(log_forward_config_mutex);
+
+    ESP_LOGI(TAG, "Forwarding %s and up to syslog %s:%u, %s and up to MQTT",
+             log_forward_level_name(config->syslog_level), config->syslog_host[0] ? config->syslog_host : "(none)",
+             config->syslog_port, log_forward_level_name(config->mqtt_level));
+    xTaskNotifyGive(log_forward_task_handle);
+    return ESP_OK;
+}
+
+void log_forward_get_stats(log_forward_stats_t *stats)
+{
+    portENTER_CRITICAL(&log_forward_lock);
+    *stats = log_forward_stats;
+    portEXIT_CRITICAL(&log_forward_lock);
+}
+
+static void log_forward_queue_copy_in(uint32_t pos, const void *src, size_t len)
+{
+    const uint8_t *bytes = src;
+    for (size_t i = 0; i < len; i++) {
+        log_forward_queue[(pos + i) % LOG_FORWARD_QUEUE_SIZE] = bytes[i];
+    }
+}
+
+static void log_forward_queue_copy_out(uint32_t pos, void *dst, size_t len)
+{
+    uint8_t *bytes = dst;
+    for (size_t i = 0; i < len; i++) {
+        bytes[i] = log_forward_queue[(pos + i) % LOG_FORWARD_QUEUE_SIZE];
+    }
+}
+
+static size_t log_forward_record_len(uint32_t pos)
+{
+    uint8_t header[LOG_FORWARD_RECORD_HEADER];
+    log_forward_queue_copy_out(pos, header, sizeof(header));
+    return LOG_FORWARD_RECORD_HEADER + (header[1] | (header[2] << 8));
+}
+
+// Append a record, dropping the oldest ones until it fits
+static void log_forward_push(esp_log_level_t level, const char *text, size_t len)
+{
+    uint8_t header[LOG_FORWARD_RECORD_HEADER] = { level, len & 0xff, len >> 8 };
+    size_t need = LOG_FORWARD_RECORD_HEADER + len;
+
+    portENTER_CRITICAL(&log_forward_lock);
+    while (LOG_FORWARD_QUEUE_SIZE - (log_forward_head - log_forward_tail) < need) {
+        log_forward_tail += log_forward_record_len(log_forward_tail);
+        log_forward_stats.dropped++;
+    }
+    log_forward_queue_copy_in(log_forward_head, header, sizeof(header));
+    log_forward_queue_copy_in(log_forward_head + LOG_FORWARD_RECORD_HEADER, text, len);
+    log_forward_head += need;
+    log_forward_stats.queued++;
+    uint32_t waiting = log_forward_head - log_forward_tail;
+    portEXIT_CRITICAL(&log_forward_lock);
+
+    if (waiting >= LOG_FORWARD_QUEUE_SIZE / 2 && waiting - need < LOG_FORWARD_QUEUE_SIZE / 2 &&
+        log_forward_task_handle != NULL) {
+        xTaskNotifyGive(log_forward_task_handle);
+    }
+}
+
+// Take the oldest record; text gets at most LOG_DEFER_LINE_MAX bytes
+static bool log_forward_pop(esp_log_level_t *level, char *text, size_t *len)
+{
+    bool found = false;
+    portENTER_CRITICAL(&log_forward_lock);
+    if (log_forward_head != log_forward_tail) {
+        uint8_t header[LOG_FORWARD_RECORD_HEADER];
+        log_forward_queue_copy_out(log_forward_tail, header, sizeof(header));
+        *level = (esp_log_level_t)header[0];
+        *len = header[1] | (header[2] << 8);
+        log_forward_queue_copy_out(log_forward_tail + LOG_FORWARD_RECORD_HEADER, text, *len);
+        log_forward_tail += LOG_FORWARD_RECORD_HEADER + *len;
+        found = true;
+    }
+    portEXIT_CRITICAL(&log_forward_lock);
+    return found;
+}
+
+static esp_log_level_t log_forward_line_level(char letter)
+{
+    switch (letter) {
+    case 'E':
+        return ESP_LOG_ERROR;
+    case 'W':
+        return ESP_LOG_WARN;
+    case 'D':
+        return ESP_LOG_DEBUG;
+    case 'V':
+        return ESP_LOG_VERBOSE;
+    default:
+        return ESP_LOG_INFO;
+    }
+}
+
+// log_defer sink, on the log output task: filter by level and queue, nothing else
+static void log_forward_sink(const char *line, size_t len, void *ctx)
+{
+    int max_level = atomic_load_explicit(&log_forward_max_level, memory_order_relaxed);
+    if (max_level == ESP_LOG_NONE) {
+        return;
+    }
+    char text[LOG_DEFER_LINE_MAX];
+    size_t n = log_defer_strip_colors(line, len, text, sizeof(text));
+    while (n > 0 && (text[n - 1] == '\n' || text[n - 1] == '\r')) {
+        n--;
+    }
+    if (n == 0) {
+        return;
+    }
+    esp_log_level_t level = log_forward_line_level(text[0]);
+    if ((int)level <= max_level) {
+        log_forward_push(level, text, n);
+    }
+}
+
+// Format one line as an RFC 5424 message:
+//   <PRI>1 TIMESTAMP HOSTNAME APP-NAME - - [meta sysUpTime="..."] MSG
+// "I (12345) TAG: text" becomes APP-NAME TAG, sysUpTime 1234 (hundredths of a second) and
+// MSG text; other lines are sent whole with APP-NAME "-". TIMESTAMP is "-" until SNTP has
+// set the clock.
+static int log_forward_format_syslog(char *buf, size_t size, uint8_t facility, const char *hostname,
+                                     esp_log_level_t level, const char *text, size_t len)
+{
+    static const uint8_t severity[] = {
+        [ESP_LOG_NONE] = 6, [ESP_LOG_ERROR] = 3, [ESP_LOG_WARN] = 4,
+        [ESP_LOG_INFO] = 6, [ESP_LOG_DEBUG] = 7, [ESP_LOG_VERBOSE] = 7,
+    };
+
+    char timestamp[32] = "-";
+    if (time_sync_is_synced()) {
+        int64_t now_us = time_sync_now_us();
+        time_t now = now_us / 1000000;
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        size_t n = strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        snprintf(timestamp + n, sizeof(timestamp) - n, ".%03dZ", (int)(now_us / 1000 % 1000));
+    }
+
+    char app[LOG_FORWARD_APP_NAME_MAX + 1] = "-";
+    char structured[40] = "-";
+    const char *msg = text;
+    const char *end = text + len;
+    const char *open = len > 3 && text[1] == ' ' && text[2] == '(' ? text + 3 : NULL;
+    const char *close = open ? memchr(open, ')', end - open) : NULL;
+    const char *colon = close && close + 2 < end ? memchr(close + 2, ':', end - close - 2) : NULL;
+    if (colon != NULL && close[1] == ' ') {
+        size_t app_len = 0;
+        for (const char *c = close + 2; c < colon && app_len < LOG_FORWARD_APP_NAME_MAX; c++) {
+            app[app_len++] = (*c > ' ' && *c <= '~') ? *c : '_';
+        }
+        app[app_len] = '\0';
+        if (app_len == 0) {
+            strcpy(app, "-");
+        }
+        unsigned long uptime_ms = strtoul(open, NULL, 10);
+        snprintf(structured, sizeof(structured), "[meta sysUpTime=\"%lu\"]", uptime_ms / 10);
+        msg = colon + 1;
+        if (msg < end && *msg == ' ') {
+            msg++;
+        }
+    }
+
+    return snprintf(buf, size, "<%u>1 %s %s %s - - %s %.*s", facility * 8 + severity[level], timestamp, hostname,
+                    app, structured, (int)(end - msg), msg);
+}
+
+static int log_forward_open_socket(const char *host, uint16_t port, struct sockaddr_in *dest)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_DGRAM,
+    };
+    struct addrinfo *result = NULL;
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%u", port);
+    if (getaddrinfo(host, port_str, &hints, &result) != 0 || result == NULL) {
+        return -1;
+    }
+    memcpy(dest, result->ai_addr, sizeof(*dest));
+    freeaddrinfo(result);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) {
+        return -1;
+    }
+    // A full send buffer drops the datagram instead of stalling the queue
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    return sock;
+}
+
+static void log_forward_publish(char *batch, size_t *len, uint32_t lines)
+{
+    if (*len == 0) {
+        return;
+    }
+    batch[*len] = '\0';
+    esp_err_t ret = mqtt_publish_log(batch);
+    portENTER_CRITICAL(&log_forward_lock);
+    if (ret == ESP_OK) {
+        log_forward_stats.mqtt_sent += lines;
+    } else {
+        log_forward_stats.send_failures++;
+    }
+    portEXIT_CRITICAL(&log_forward_lock);
+    *len = 0;
+}
+
+static void log_forward_task(void *arg)
+{
+    static char text[LOG_DEFER_LINE_MAX];
+    static char datagram[LOG_FORWARD_DATAGRAM_MAX];
+    static char batch[LOG_FORWARD_MQTT_BATCH_MAX + 1];
+    log_forward_config_t config;
+    uint32_t generation = 0;
+    int sock = -1;
+    struct sockaddr_in dest;
+    bool resolve_failed = false;
+    bool reopen = false;
+    uint32_t retry_ms = 0;
+    TickType_t retry_at = 0;
+
+    char hostname[LOG_FORWARD_HOSTNAME_MAX_LEN];
+    uint8_t mac[6] = { 0 };
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOG_FORWARD_BATCH_INTERVAL_MS));
+        // Lines wait in the queue (oldest dropped first) until there is a network
+        if (!wifi_manager_is_connected()) {
+            continue;
+        }
+
+        if (generation != log_forward_config_generation) {
+            generation = log_forward_config_generation;
+            log_forward_get_config(&config);
+            if (config.hostname[0] != '\0') {
+                strncpy(hostname, config.hostname, sizeof(hostname) - 1);
+                hostname[sizeof(hostname) - 1] = '\0';
+            } else {
+                snprintf(hostname, sizeof(hostname), "relay-%02x%02x%02x", mac[3], mac[4], mac[5]);
+            }
+            if (sock >= 0) {
+                close(sock);
+                sock = -1;
+            }
+            reopen = config.syslog_level != ESP_LOG_NONE && config.syslog_host[0] != '\0';
+            retry_ms = 0;
+            retry_at = xTaskGetTickCount();
+        }
+        // getaddrinfo blocks for the DNS timeout, so a host that does not resolve is retried
+        // with a growing delay rather than on every pass
+        if (reopen && (int32_t)(xTaskGetTickCount() - retry_at) >= 0) {
+            sock = log_forward_open_socket(config.syslog_host, config.syslog_port, &dest);
+            if (sock < 0) {
+                retry_ms = retry_ms == 0 ? LOG_FORWARD_RESOLVE_RETRY_MIN_MS : retry_ms * 2;
+                if (retry_ms > LOG_FORWARD_RESOLVE_RETRY_MAX_MS) {
+                    retry_ms = LOG_FORWARD_RESOLVE_RETRY_MAX_MS;
+                }
+                if (!resolve_failed) {
+                    ESP_LOGW(TAG, "Cannot resolve syslog host %s, retrying", config.syslog_host);
+                }
+                retry_at = xTaskGetTickCount() + pdMS_TO_TICKS(retry_ms);
+            }
+            reopen = sock < 0;
+            resolve_failed = sock < 0;
+        }
+
+        // With the broker down, MQTT lines stay queued unless syslog is draining the queue anyway
+        bool mqtt_up = mqtt_client_is_connected();
+        if (config.mqtt_level != ESP_LOG_NONE && !mqtt_up && sock < 0) {
+            continue;
+        }
+
+        size_t batch_len = 0;
+        uint32_t batch_lines = 0;
+        esp_log_level_t level;
+        size_t len;
+        while (log_forward_pop(&level, text, &len)) {
+            if (sock >= 0 && level <= config.syslog_level) {
+                int n = log_forward_format_syslog(datagram, sizeof(datagram), config.facility, hostname, level, text, len);
+                n = n < (int)sizeof(datagram) ? n : (int)sizeof(datagram) - 1;
+                bool sent = sendto(sock, datagram, n, MSG_DONTWAIT, (struct sockaddr *)&dest, sizeof(dest)) == n;
+                portENTER_CRITICAL(&log_forward_lock);
+                if (sent) {
+                    log_forward_stats.syslog_sent++;
+                } else {
+                    log_forward_stats.send_failures++;
+                }
+                portEXIT_CRITICAL(&log_forward_lock);
+            }
+            if (level <= config.mqtt_level && !mqtt_up) {
+                portENTER_CRITICAL(&log_forward_lock);
+                log_forward_stats.mqtt_skipped++;
+                portEXIT_CRITICAL(&log_forward_lock);
+            } else if (level <= config.mqtt_level) {
+                if (batch_len + len + 1 > LOG_FORWARD_MQTT_BATCH_MAX) {
+                    log_forward_publish(batch, &batch_len, batch_lines);
+                    batch_lines = 0;
+                }
+                memcpy(batch + batch_len, text, len);
+                batch_len += len;
+                batch[batch_len++] = '\n';
+                batch_lines++;
+            }
+        }
+        log_forward_publish(batch, &batch_len, batch_lines);
+    }
+}
+
+esp_err_t log_forward_init(void)
+{
+    log_forward_default_config(&log_forward_config);
+    esp_err_t err = log_forward_load_config(&log_forward_config);
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGW(TAG, "Using default log forward config: %s", esp_err_to_name(err));
+    }
+    log_forward_apply_levels(&log_forward_config);
+
+    log_forward_config_mutex = xSemaphoreCreateMutex();
+    if (log_forward_config_mutex == NULL ||
+        xTaskCreate(log_forward_task, "log_forward", LOG_FORWARD_TASK_STACK_SIZE, NULL,
+                    LOG_FORWARD_TASK_PRIORITY, &log_forward_task_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create log forward task");
+        return ESP_ERR_NO_MEM;
+    }
+    err = log_defer_add_sink(log_forward_sink, NULL);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register log sink");
+        return err;
+    }
+    return ESP_OK;
+}
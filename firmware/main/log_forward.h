@@ -0,0 +1,74 @@
+#ifndef LOG_FORWARD_H
+#define LOG_FORWARD_H
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Log shipping. A log_defer sink puts every line that passes the level filters into a
+// bounded queue (the oldest lines are dropped when it is full); a background task sends
+// them as RFC 5424 syslog datagrams over UDP (one message per datagram, RFC 5426) and/or
+// as newline-separated batches on the MQTT log topic. Configured at runtime through
+// POST /logs/forward and kept in NVS.
+#ifndef LOG_FORWARD_QUEUE_SIZE
+#define LOG_FORWARD_QUEUE_SIZE 4096
+#endif
+// The task sends what is queued at this interval, or as soon as the queue is half full
+#ifndef LOG_FORWARD_BATCH_INTERVAL_MS
+#define LOG_FORWARD_BATCH_INTERVAL_MS 1000
+#endif
+// Largest MQTT payload; a batch that would grow past it is published and a new one started
+#ifndef LOG_FORWARD_MQTT_BATCH_MAX
+#define LOG_FORWARD_MQTT_BATCH_MAX 1024
+#endif
+// A syslog host that does not resolve is retried after this delay, doubled on every failure
+#ifndef LOG_FORWARD_RESOLVE_RETRY_MIN_MS
+#define LOG_FORWARD_RESOLVE_RETRY_MIN_MS 1000
+#endif
+#ifndef LOG_FORWARD_RESOLVE_RETRY_MAX_MS
+#define LOG_FORWARD_RESOLVE_RETRY_MAX_MS 60000
+#endif
+#ifndef LOG_FORWARD_SYSLOG_DEFAULT_PORT
+#define LOG_FORWARD_SYSLOG_DEFAULT_PORT 514
+#endif
+#define LOG_FORWARD_FACILITY_LOCAL0 16
+
+#ifndef LOG_FORWARD_TASK_PRIORITY
+#define LOG_FORWARD_TASK_PRIORITY 1
+#endif
+#ifndef LOG_FORWARD_TASK_STACK_SIZE
+#define LOG_FORWARD_TASK_STACK_SIZE 4096
+#endif
+
+#define LOG_FORWARD_HOST_MAX_LEN 64
+#define LOG_FORWARD_HOSTNAME_MAX_LEN 32
+
+typedef struct {
+    // Most verbose level sent to each destination, ESP_LOG_NONE to send nothing
+    esp_log_level_t syslog_level;
+    esp_log_level_t mqtt_level;
+    char syslog_host[LOG_FORWARD_HOST_MAX_LEN];    // Name or IPv4 address
+    uint16_t syslog_port;
+    uint8_t facility;                               // Syslog facility code, 16-23 = local0-7
+    char hostname[LOG_FORWARD_HOSTNAME_MAX_LEN];    // HOSTNAME field; empty = "relay-" and the MAC's last 3 bytes
+} log_forward_config_t;
+
+typedef struct {
+    uint32_t queued;
+    uint32_t dropped;               // Pushed out of the full queue before they were sent
+    uint32_t syslog_sent;
+    uint32_t mqtt_sent;             // Lines, not publishes
+    uint32_t mqtt_skipped;          // Not published because the broker was down while syslog kept draining
+    uint32_t send_failures;         // Datagrams or publishes the network stack refused
+} log_forward_stats_t;
+
+// Function declarations
+esp_err_t log_forward_init(void);
+void log_forward_get_config(log_forward_config_t *config);
+esp_err_t log_forward_set_config(const log_forward_config_t *config);
+void log_forward_get_stats(log_forward_stats_t *stats);
+const char *log_forward_level_name(esp_log_level_t level);
+bool log_forward_parse_level(const char *name, esp_log_level_t *level);
+
+#endif // LOG_FORWARD_H
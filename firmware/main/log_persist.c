@@ -0,0 +1,434 @@
+#include "log_persist.h"
+#include "log_defer.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_app_desc.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const char *TAG = "LOG_PERSIST";
+
+#define LOG_PERSIST_MAGIC (0x4c4f4733u ^ LOG_PERSIST_RTC_SIZE)     // "LOG3", and a size change invalidates
+#define LOG_PERSIST_BATCH 512
+
+#if LOG_DEFER_LINE_MAX > LOG_PERSIST_BATCH
+#error "A log line must fit in one LOG_PERSIST_BATCH"
+#endif
+
+// Records hold either a log_defer record as captured (format pointer and packed arguments,
+// printed when it is written to the file) or plain text such as the boot marker
+#define LOG_PERSIST_KIND_TEXT 1
+#define LOG_PERSIST_KIND_RECORD 2
+
+// The CRC covers the length, the kind and the payload, so bytes a brownout or a reset
+// mid-write left behind are caught at boot
+typedef struct {
+    uint16_t len;
+    uint8_t kind;
+    uint8_t reserved;
+    uint16_t crc;
+} log_persist_header_t;
+
+// Ring in RTC slow memory, left alone by the startup code on every reset but power-on.
+// head/flushed are running byte counts on record boundaries, byte n lives at
+// data[n % LOG_PERSIST_RTC_SIZE]; records between flushed and head are not on flash yet.
+// Format pointers are only meaningful to the image that stored them, named by image.
+typedef struct {
+    uint32_t magic;
+    uint32_t head;
+    uint32_t flushed;
+    uint8_t image[8];               // Start of the app's ELF SHA-256
+    char data[LOG_PERSIST_RTC_SIZE];
+} log_persist_rtc_t;
+
+static RTC_NOINIT_ATTR log_persist_rtc_t log_persist_rtc;
+
+static portMUX_TYPE log_persist_lock = portMUX_INITIALIZER_UNLOCKED;
+static log_persist_stats_t log_persist_stats;
+
+// File access (flush task, readers) serializes on this mutex
+static SemaphoreHandle_t log_persist_mutex = NULL;
+static TaskHandle_t log_persist_task_handle = NULL;
+
+static void log_persist_copy_in(uint32_t at, const void *in, size_t len)
+{
+    uint32_t pos = at % LOG_PERSIST_RTC_SIZE;
+    size_t first = len < LOG_PERSIST_RTC_SIZE - pos ? len : LOG_PERSIST_RTC_SIZE - pos;
+    memcpy(log_persist_rtc.data + pos, in, first);
+    memcpy(log_persist_rtc.data, (const char *)in + first, len - first);
+}
+
+static void log_persist_copy_out(uint32_t at, void *out, size_t len)
+{
+    uint32_t pos = at % LOG_PERSIST_RTC_SIZE;
+    size_t first = len < LOG_PERSIST_RTC_SIZE - pos ? len : LOG_PERSIST_RTC_SIZE - pos;
+    memcpy(out, log_persist_rtc.data + pos, first);
+    memcpy((char *)out + first, log_persist_rtc.data, len - first);
+}
+
+static uint16_t log_persist_crc(const log_persist_header_t *header, const void *payload)
+{
+    uint16_t crc = esp_rom_crc16_le(0, (const uint8_t *)header, offsetof(log_persist_header_t, reserved));
+    return esp_rom_crc16_le(crc, (const uint8_t *)payload, header->len);
+}
+
+// Append one record; when the ring is full the oldest unwritten records are given up. The
+// head only moves once the record is complete, so a reset halfway leaves the ring as it was.
+static void log_persist_append(uint8_t kind, const void *payload, size_t len)
+{
+    size_t size = sizeof(log_persist_header_t) + len;
+    if (len == 0 || size > LOG_PERSIST_RTC_SIZE) {
+        return;
+    }
+    log_persist_header_t header = {.len = len, .kind = kind};
+    header.crc = log_persist_crc(&header, payload);
+
+    portENTER_CRITICAL(&log_persist_lock);
+    while (log_persist_rtc.head - log_persist_rtc.flushed + size > LOG_PERSIST_RTC_SIZE) {
+        log_persist_header_t oldest;
+        log_persist_copy_out(log_persist_rtc.flushed, &oldest, sizeof(oldest));
+        log_persist_stats.lost += sizeof(oldest) + oldest.len;
+        log_persist_rtc.flushed += sizeof(oldest) + oldest.len;
+    }
+    log_persist_copy_in(log_persist_rtc.head, &header, sizeof(header));
+    log_persist_copy_in(log_persist_rtc.head + sizeof(header), payload, len);
+    log_persist_rtc.head += size;
+    uint32_t waiting = log_persist_rtc.head - log_persist_rtc.flushed;
+    portEXIT_CRITICAL(&log_persist_lock);
+
+    if (waiting >= LOG_PERSIST_RTC_SIZE / 2 && waiting - size < LOG_PERSIST_RTC_SIZE / 2 &&
+        log_persist_task_handle != NULL) {
+        xTaskNotifyGive(log_persist_task_handle);
+    }
+}
+
+// log_defer capture hook, on the task that logs: the record is in RTC memory before the
+// ESP_LOGx call returns, so a crash right after it cannot lose it. Only a copy of the packed
+// record; it is printed by the flush task.
+static void log_persist_capture(const log_defer_record_t *record)
+{
+    log_persist_append(LOG_PERSIST_KIND_RECORD, record, LOG_DEFER_RECORD_SIZE(record));
+}
+
+// Check a record read back from the ring; at boot anything may be there
+static bool log_persist_valid(const log_persist_header_t *header, const void *payload)
+{
+    if (header->kind == LOG_PERSIST_KIND_TEXT) {
+        if (header->len == 0 || header->len > LOG_DEFER_LINE_MAX) {
+            return false;
+        }
+    } else if (header->kind == LOG_PERSIST_KIND_RECORD) {
+        const log_defer_record_t *record = payload;
+        if (header->len < offsetof(log_defer_record_t, args) || header->len > sizeof(log_defer_record_t) ||
+            LOG_DEFER_RECORD_SIZE(record) != header->len) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    return log_persist_crc(header, payload) == header->crc;
+}
+
+static long log_persist_file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+// Print the waiting records and append them to the file in batches. Records only count as
+// flushed once their text is in the file, so whatever a reset interrupts is still in RTC
+// memory on the next boot. Printing happens outside the ring lock. Caller holds
+// log_persist_mutex.
+static esp_err_t log_persist_flush_locked(void)
+{
+    static char batch[LOG_PERSIST_BATCH];
+    static log_defer_record_t record;
+    static char line[LOG_DEFER_LINE_MAX];
+
+    while (1) {
+        size_t len = 0;
+        portENTER_CRITICAL(&log_persist_lock);
+        uint32_t to = log_persist_rtc.flushed;
+        portEXIT_CRITICAL(&log_persist_lock);
+        while (1) {
+            log_persist_header_t header;
+            portENTER_CRITICAL(&log_persist_lock);
+            // Unless the ring overflowed meanwhile and already moved past these records
+            if ((int32_t)(to - log_persist_rtc.flushed) < 0) {
+                to = log_persist_rtc.flushed;
+            }
+            bool more = to != log_persist_rtc.head;
+            if (more) {
+                log_persist_copy_out(to, &header, sizeof(header));
+                log_persist_copy_out(to + sizeof(header),
+                                     header.kind == LOG_PERSIST_KIND_TEXT ? (void *)line : (void *)&record, header.len);
+            }
+            portEXIT_CRITICAL(&log_persist_lock);
+            if (!more) {
+                break;
+            }
+
+            size_t n = header.len;
+            if (header.kind == LOG_PERSIST_KIND_RECORD) {
+                n = log_defer_format(&record, line, sizeof(line));
+                if (n >= sizeof(line)) {
+                    n = sizeof(line) - 1;
+                    line[n - 1] = '\n';
+                }
+                n = log_defer_strip_colors(line, n, line, sizeof(line));
+            }
+            // Printed again for the next batch
+            if (len + n > sizeof(batch)) {
+                break;
+            }
+            memcpy(batch + len, line, n);
+            len += n;
+            to += sizeof(header) + header.len;
+        }
+        if (len == 0) {
+            return ESP_OK;
+        }
+
+        long size = log_persist_file_size(LOG_PERSIST_FILE);
+        if (size + (long)len > LOG_PERSIST_FILE_MAX) {
+            remove(LOG_PERSIST_FILE ".old");
+            rename(LOG_PERSIST_FILE, LOG_PERSIST_FILE ".old");
+        }
+
+        FILE *f = fopen(LOG_PERSIST_FILE, "a");
+        if (f == NULL) {
+            log_persist_stats.write_failures++;
+            return ESP_FAIL;
+        }
+        size_t written = fwrite(batch, 1, len, f);
+        fclose(f);
+        if (written != len) {
+            log_persist_stats.write_failures++;
+            return ESP_FAIL;
+        }
+
+        portENTER_CRITICAL(&log_persist_lock);
+        if ((int32_t)(to - log_persist_rtc.flushed) > 0) {
+            log_persist_rtc.flushed = to;
+        }
+        log_persist_stats.written += len;
+        portEXIT_CRITICAL(&log_persist_lock);
+    }
+}
+
+esp_err_t log_persist_flush(void)
+{
+    if (log_persist_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(log_persist_mutex, portMAX_DELAY);
+    esp_err_t ret = log_persist_flush_locked();
+    xSemaphoreGive(log_persist_mutex);
+    return ret;
+}
+
+static void log_persist_task(void *arg)
+{
+    bool failing = false;
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOG_PERSIST_FLUSH_INTERVAL_MS));
+        esp_err_t ret = log_persist_flush();
+        // Logged once per outage; the message itself lands in the ring we cannot write
+        if (ret != ESP_OK && !failing) {
+            ESP_LOGE(TAG, "Failed to append to %s", LOG_PERSIST_FILE);
+        }
+        failing = ret != ESP_OK;
+    }
+}
+
+static const char *log_persist_reset_reason(esp_reset_reason_t reason)
+{
+    switch (reason) {
+    case ESP_RST_POWERON:
+        return "power-on";
+    case ESP_RST_SW:
+        return "restart";
+    case ESP_RST_PANIC:
+        return "panic";
+    case ESP_RST_INT_WDT:
+        return "interrupt watchdog";
+    case ESP_RST_TASK_WDT:
+        return "task watchdog";
+    case ESP_RST_WDT:
+        return "watchdog";
+    case ESP_RST_BROWNOUT:
+        return "brownout";
+    case ESP_RST_DEEPSLEEP:
+        return "deep sleep";
+    default:
+        return "unknown";
+    }
+}
+
+// Walk the records the previous boot left unwritten and keep them up to the first one that
+// fails its check; everything from there on is dropped. Returns the records kept.
+static uint32_t log_persist_recover(void)
+{
+    static union {
+        log_defer_record_t record;
+        char text[LOG_DEFER_LINE_MAX];
+    } payload;
+    uint32_t at = log_persist_rtc.flushed;
+    uint32_t kept = 0;
+    while (log_persist_rtc.head - at >= sizeof(log_persist_header_t)) {
+        log_persist_header_t header;
+        log_persist_copy_out(at, &header, sizeof(header));
+        if (header.len > sizeof(payload) || header.len > log_persist_rtc.head - at - sizeof(header)) {
+            break;
+        }
+        log_persist_copy_out(at + sizeof(header), &payload, header.len);
+        if (!log_persist_valid(&header, &payload)) {
+            break;
+        }
+        kept++;
+        at += sizeof(header) + header.len;
+    }
+    log_persist_stats.discarded = log_persist_rtc.head - at;
+    log_persist_rtc.head = at;
+    return kept;
+}
+
+// Call after log_defer_init(). The file is first written once LittleFS is mounted; until
+// then lines wait in RTC memory.
+esp_err_t log_persist_init(void)
+{
+    uint8_t image[sizeof(log_persist_rtc.image)];
+    memcpy(image, esp_app_get_description()->app_elf_sha256, sizeof(image));
+
+    // Keep what the previous boot left unwritten; start over if the ring is not ours. Records
+    // from another image (an OTA update) cannot be printed, their format pointers are stale.
+    uint32_t waiting = log_persist_rtc.head - log_persist_rtc.flushed;
+    bool other_image = false;
+    if (log_persist_rtc.magic != LOG_PERSIST_MAGIC || waiting > LOG_PERSIST_RTC_SIZE) {
+        memset(&log_persist_rtc, 0, sizeof(log_persist_rtc));
+        log_persist_rtc.magic = LOG_PERSIST_MAGIC;
+    } else if (memcmp(log_persist_rtc.image, image, sizeof(image)) != 0) {
+        other_image = waiting > 0;
+        log_persist_rtc.head = log_persist_rtc.flushed;
+    }
+    memcpy(log_persist_rtc.image, image, sizeof(image));
+    uint32_t recovered = log_persist_recover();
+    if (other_image) {
+        log_persist_stats.discarded = waiting;
+    }
+    log_persist_stats.recovered = recovered;
+
+    char marker[128];
+    int len = snprintf(marker, sizeof(marker), "%s--- boot, reset reason: %s, %" PRIu32 " lines recovered",
+                       recovered > 0 ? "\n" : "", log_persist_reset_reason(esp_reset_reason()), recovered);
+    if (log_persist_stats.discarded > 0) {
+        len += snprintf(marker + len, sizeof(marker) - len, ", %" PRIu32 " %s bytes dropped",
+                        log_persist_stats.discarded, other_image ? "previous firmware" : "corrupt");
+    }
+    len += snprintf(marker + len, sizeof(marker) - len, " ---\n");
+    log_persist_append(LOG_PERSIST_KIND_TEXT, marker, len);
+
+    log_persist_mutex = xSemaphoreCreateMutex();
+    if (log_persist_mutex == NULL ||
+        xTaskCreate(log_persist_task, "log_persist", LOG_PERSIST_TASK_STACK_SIZE, NULL,
+                    LOG_PERSIST_TASK_PRIORITY, &log_persist_task_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create log persist task");
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t ret = log_defer_set_capture(log_persist_capture);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register log capture");
+        return ret;
+    }
+    if (recovered > 0) {
+        ESP_LOGW(TAG, "Recovered %" PRIu32 " log lines from before the reset", recovered);
+    }
+    if (log_persist_stats.discarded > 0) {
+        ESP_LOGW(TAG, "Dropped %" PRIu32 " bytes of RTC log %s", log_persist_stats.discarded,
+                 other_image ? "written by the previous firmware" : "that failed their check");
+    }
+    return ESP_OK;
+}
+
+static esp_err_t log_persist_read_file(const char *path, uint32_t skip, uint32_t len, log_persist_read_cb_t cb,
+                                       void *ctx)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return ESP_FAIL;
+    }
+    esp_err_t ret = ESP_OK;
+    if (skip > 0 && fseek(f, skip, SEEK_SET) != 0) {
+        ret = ESP_FAIL;
+    }
+    char buf[512];
+    while (ret == ESP_OK && len > 0) {
+        size_t n = fread(buf, 1, len < sizeof(buf) ? len : sizeof(buf), f);
+        if (n == 0) {
+            ret = ESP_FAIL;
+            break;
+        }
+        ret = cb(buf, n, ctx);
+        len -= n;
+    }
+    fclose(f);
+    return ret;
+}
+
+// Write out the ring, resolve the range against the current size and hand its bytes to
+// cb. ESP_ERR_INVALID_SIZE if the range does not overlap the log (range->total is set).
+esp_err_t log_persist_read(log_persist_range_t *range, log_persist_read_cb_t cb, void *ctx)
+{
+    if (log_persist_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(log_persist_mutex, portMAX_DELAY);
+    log_persist_flush_locked();
+
+    long old_size = log_persist_file_size(LOG_PERSIST_FILE ".old");
+    long cur_size = log_persist_file_size(LOG_PERSIST_FILE);
+    uint32_t old_len = old_size > 0 ? old_size : 0;
+    uint32_t total = old_len + (cur_size > 0 ? cur_size : 0);
+    range->total = total;
+
+    if (range->suffix > 0) {
+        range->start = range->suffix < total ? total - range->suffix : 0;
+        range->end = total - 1;
+    } else if (range->end >= total) {
+        range->end = total - 1;
+    }
+    if (total == 0 || range->start >= total || range->start > range->end) {
+        xSemaphoreGive(log_persist_mutex);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t ret = ESP_OK;
+    uint32_t start = range->start;
+    uint32_t end = range->end + 1;
+    if (start < old_len) {
+        uint32_t stop = end < old_len ? end : old_len;
+        ret = log_persist_read_file(LOG_PERSIST_FILE ".old", start, stop - start, cb, ctx);
+        start = stop;
+    }
+    if (ret == ESP_OK && start < end) {
+        ret = log_persist_read_file(LOG_PERSIST_FILE, start - old_len, end - start, cb, ctx);
+    }
+    xSemaphoreGive(log_persist_mutex);
+    return ret;
+}
+
+void log_persist_get_stats(log_persist_stats_t *stats)
+{
+    portENTER_CRITICAL(&log_persist_lock);
+    *stats = log_persist_stats;
+    portEXIT_CRITICAL(&log_persist_lock);
+}
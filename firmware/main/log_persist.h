@@ -0,0 +1,64 @@
+#ifndef LOG_PERSIST_H
+#define LOG_PERSIST_H
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Crash-safe log. A log_defer capture hook copies every record (format pointer and packed
+// arguments, no formatting) into a ring in RTC slow memory while the ESP_LOGx call is still
+// running, so the lines right before a panic or watchdog reset are kept at the cost of a
+// memcpy. RTC memory survives panics, watchdog and software resets; each record carries a
+// CRC so whatever a brownout corrupted is dropped. A background task prints the records
+// (colour codes stripped) and appends them to a LittleFS file in batches; records that had
+// not reached flash when the device reset are written out after the next boot, behind a
+// marker naming the reset reason. Records left by a different firmware image are dropped.
+#ifndef LOG_PERSIST_RTC_SIZE
+#define LOG_PERSIST_RTC_SIZE 4096
+#endif
+#ifndef LOG_PERSIST_FILE
+#define LOG_PERSIST_FILE "/www/system.log"
+#endif
+// The file is renamed to LOG_PERSIST_FILE ".old" when it would grow past this
+#ifndef LOG_PERSIST_FILE_MAX
+#define LOG_PERSIST_FILE_MAX (32 * 1024)
+#endif
+// Batches are written at this interval, or as soon as the ring is half full
+#ifndef LOG_PERSIST_FLUSH_INTERVAL_MS
+#define LOG_PERSIST_FLUSH_INTERVAL_MS 30000
+#endif
+
+#ifndef LOG_PERSIST_TASK_PRIORITY
+#define LOG_PERSIST_TASK_PRIORITY 1
+#endif
+#ifndef LOG_PERSIST_TASK_STACK_SIZE
+#define LOG_PERSIST_TASK_STACK_SIZE 3072
+#endif
+
+typedef struct {
+    uint32_t recovered;             // Lines from before the last reset found in RTC memory at boot
+    uint32_t discarded;             // RTC bytes at boot that failed their check or came from another image
+    uint32_t written;               // Bytes appended to the file since boot
+    uint32_t lost;                  // Ring bytes overwritten before they were written
+    uint32_t write_failures;
+} log_persist_stats_t;
+
+// A byte range of the log (LOG_PERSIST_FILE ".old" followed by LOG_PERSIST_FILE), as
+// asked for by an HTTP Range header
+typedef struct {
+    uint32_t start;                 // In: first byte; out: first byte read
+    uint32_t end;                   // In: last byte, UINT32_MAX for the end of the log; out: last byte read
+    uint32_t suffix;                // In: when non-zero, the last suffix bytes instead of start/end
+    uint32_t total;                 // Out: size of the whole log
+} log_persist_range_t;
+
+// Called with consecutive pieces of the range; a non-ESP_OK return stops the read
+typedef esp_err_t (*log_persist_read_cb_t)(const char *data, size_t len, void *ctx);
+
+// Function declarations
+esp_err_t log_persist_init(void);
+esp_err_t log_persist_flush(void);
+esp_err_t log_persist_read(log_persist_range_t *range, log_persist_read_cb_t cb, void *ctx);
+void log_persist_get_stats(log_persist_stats_t *stats);
+
+#endif // LOG_PERSIST_H
@@ -2,9 +2,7 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/event_groups.h"
 #include "esp_system.h"
-#include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
 #include "nvs_flash.h"
@@ -16,113 +14,48 @@
 #include "esp_littlefs.h"
 
 #include "wifi_manager.h"
+#include "wifi_scan.h"
 #include "relay_control.h"
 #include "web_server.h"
 #include "ota_update.h"
+#include "udp_control.h"
+#include "time_sync.h"
+#include "relay_scheduler.h"
+#include "relay_timer.h"
+#include "relay_persist.h"
+#include "relay_history.h"
+#include "modbus_server.h"
+#include "coap_server.h"
+#include "log_defer.h"
+#include "log_persist.h"
+#include "log_forward.h"
+#include "trace.h"
+#include "task_stats.h"
+#include "heap_monitor.h"
+#include "boot_timeline.h"
 
 static const char *TAG = "MAIN";
 
-// Event group to signal when we are connected
-static EventGroupHandle_t s_wifi_event_group;
-
-// The event group allows the following bits to be set:
-#define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT      BIT1
-
-static int s_retry_num = 0;
-#define EXAMPLE_ESP_MAXIMUM_RETRY  5
-
-static void event_handler(void* arg, esp_event_base_t event_base,
-                                int32_t event_id, void* event_data)
-{
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
-    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY) {
-            esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI(TAG, "retry to connect to the AP");
-        } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
-        }
-        ESP_LOGI(TAG,"connect to the AP fail");
-    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-        s_retry_num = 0;
-        xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
-    }
-}
-
-void wifi_init_sta(void)
-{
-    s_wifi_event_group = xEventGroupCreate();
-
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
-
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &event_handler,
-                                                        NULL,
-                                                        &instance_any_id));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        IP_EVENT_STA_GOT_IP,
-                                                        &event_handler,
-                                                        NULL,
-                                                        &instance_got_ip));
-
-    // Use wifi_manager to handle configuration; keep default STA init minimal
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_start());
-
-    ESP_LOGI(TAG, "wifi_init_sta finished.");
-
-    /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-     * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-            pdFALSE,
-            pdFALSE,
-            portMAX_DELAY);
-
-    /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-     * happened. */
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "connected to AP");
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGI(TAG, "Failed to connect to AP");
-    } else {
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
-    }
-}
-
-void app_main(void)
+static esp_err_t main_init_nvs(void)
 {
-    ESP_LOGI(TAG, "Starting Waveshare ESP32-S3 Relay Firmware");
-
-    // Initialize NVS
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
         ESP_ERROR_CHECK(nvs_flash_erase());
         ret = nvs_flash_init();
     }
-    ESP_ERROR_CHECK(ret);
+    return ret;
+}
 
-    // Mount LittleFS at /www for serving web assets
+// Mount LittleFS at /www for serving web assets
+static esp_err_t main_mount_littlefs(void)
+{
     esp_vfs_littlefs_conf_t lfs_conf = {
         .base_path = "/www",
         .partition_label = "littlefs",
         .format_if_mount_failed = true,
         .dont_mount = false,
     };
-    ret = esp_vfs_littlefs_register(&lfs_conf);
+    esp_err_t ret = esp_vfs_littlefs_register(&lfs_conf);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to mount LittleFS (err=%s)", esp_err_to_name(ret));
     } else {
@@ -131,23 +64,100 @@ void app_main(void)
             ESP_LOGI(TAG, "LittleFS mounted at /www, size=%u, used=%u", (unsigned)total, (unsigned)used);
         }
     }
+    return ret;
+}
+
+static esp_err_t main_start_mqtt(void)
+{
+    esp_err_t ret = mqtt_client_init();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    return mqtt_client_start(); // Connects once WiFi has an address
+}
+
+void app_main(void)
+{
+    // Timestamps every init phase below; GET /boot shows the result
+    boot_timeline_init();
+
+    // From here on ESP_LOG calls only queue their arguments; a background task prints them
+    boot_timeline_run("log_defer", log_defer_init);
+
+    // Keep the latest log lines in RTC memory across resets and append them to LittleFS
+    boot_timeline_run("log_persist", log_persist_init);
+
+    ESP_LOGI(TAG, "Starting Waveshare ESP32-S3 Relay Firmware");
+
+    // Initialize NVS
+    ESP_ERROR_CHECK(boot_timeline_run("nvs", main_init_nvs));
+
+    // Ship log lines to a syslog server and/or MQTT as configured in NVS
+    boot_timeline_run("log_forward", log_forward_init);
+
+    // The mount (a format on first boot) runs on the other core while the relays come up here
+    int littlefs_phase = boot_timeline_start("littlefs", main_mount_littlefs, BOOT_TIMELINE_PARALLEL_CORE);
+
+    // Hot-path latency histograms; first so the earliest spans are aggregated
+    boot_timeline_run("trace", trace_init);
+
+    // Per-task CPU share and stack high-water marks
+    boot_timeline_run("task_stats", task_stats_init);
+
+    // Heap levels, fragmentation and leak trend per region
+    boot_timeline_run("heap_monitor", heap_monitor_init);
 
     // Initialize relay control
-    relay_control_init();
+    boot_timeline_run("relay_control", relay_control_init);
+
+    // Pulse, blink and auto-off modes
+    boot_timeline_run("relay_timer", relay_timer_init);
+
+    // Relay change log (RAM ring, batched to LittleFS); before the power-on restore so it is logged
+    boot_timeline_run("relay_history", relay_history_init);
 
-    // Initialize WiFi and bootstrap connection flow
-    wifi_manager_init();
-    wifi_manager_bootstrap();
+    // Power-on relay state (off/on/last) and coalesced saving of the last state. NVS only,
+    // so the relays are in their power-on state before any networking starts.
+    boot_timeline_run("relay_persist", relay_persist_init);
+    boot_timeline_milestone(BOOT_TIMELINE_RELAYS_RESTORED);
 
-    // Initialize MQTT client
-    mqtt_client_init();
-    mqtt_client_start(); // Start the MQTT client
+    // Initialize WiFi (TCP/IP stack, default event loop, radio)
+    boot_timeline_run("wifi", wifi_manager_init);
 
-    // Initialize web server
-    web_server_init();
+    // The HTTP server only needs the TCP/IP stack; start it on the other core. In AP mode or
+    // on a fast connect a request can arrive before the modules below are initialized; their
+    // getters then return defaults or nothing and their setters fail.
+    int web_server_phase = boot_timeline_start("web_server", web_server_init, BOOT_TIMELINE_PARALLEL_CORE);
+
+    boot_timeline_run("wifi_scan", wifi_scan_init);
+
+    // Start connecting; returns right away, the state machine connects or falls back to AP
+    boot_timeline_run("wifi_bootstrap", wifi_manager_bootstrap);
+
+    // Wall clock for scheduled multicast group commands and relay schedules
+    boot_timeline_run("time_sync", time_sync_init);
+
+    // On-device relay schedules (restored from LittleFS, armed once the clock is set)
+    boot_timeline_wait(littlefs_phase);
+    boot_timeline_run("relay_scheduler", relay_scheduler_init);
+
+    // Initialize and start the MQTT client
+    boot_timeline_run("mqtt", main_start_mqtt);
 
     // Initialize OTA update
-    ota_update_init();
+    boot_timeline_run("ota", ota_update_init);
+
+    // Low-latency UDP control listener (idle until enabled via POST /udp)
+    boot_timeline_run("udp_control", udp_control_init);
+
+    // Modbus TCP server for SCADA polling
+    boot_timeline_run("modbus", modbus_server_init);
+
+    // CoAP server with Observe for constrained clients
+    boot_timeline_run("coap", coap_server_init);
+
+    boot_timeline_wait(web_server_phase);
+    boot_timeline_finish();
 
     ESP_LOGI(TAG, "All components initialized successfully");
 
@@ -155,11 +165,6 @@ void app_main(void)
     while (1) {
         vTaskDelay(pdMS_TO_TICKS(1000));
         
-        // Check system health
-        if (esp_get_free_heap_size() < 10000) {
-            ESP_LOGW(TAG, "Low memory warning: %d bytes free", esp_get_free_heap_size());
-        }
-        
         // Publish relay status periodically if MQTT is connected
         static int status_counter = 0;
         status_counter++;
@@ -167,5 +172,13 @@ void app_main(void)
             relay_publish_status();
             status_counter = 0;
         }
+
+        // Relay cycle counts and on-time, every 5 minutes
+        static int usage_counter = 0;
+        usage_counter++;
+        if (usage_counter >= 300) {
+            relay_publish_usage();
+            usage_counter = 0;
+        }
     }
 }
@@ -0,0 +1,424 @@
+#include "metrics.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "app_mqtt.h"
+#include "wifi_manager.h"
+#include "task_stats.h"
+#include "boot_timeline.h"
+#include "heap_monitor.h"
+#include "log_defer.h"
+#include "log_forward.h"
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+static const char *TAG = "METRICS";
+
+typedef struct {
+    atomic_uint buckets[METRICS_LATENCY_BUCKETS + 1];   // Per bucket, not cumulative; last is +Inf
+    atomic_ullong sum_us;
+} metrics_histogram_t;
+
+typedef struct {
+    const char *uri;
+    const char *method;
+    atomic_uint requests;
+    atomic_uint errors;                 // Handler returned something other than ESP_OK
+    atomic_ullong duration_us;
+} metrics_http_route_t;
+
+static const uint32_t metrics_latency_bounds_us[METRICS_LATENCY_BUCKETS] = METRICS_LATENCY_BOUNDS_US;
+
+static atomic_uint metrics_commits[RELAY_SOURCE_COUNT];
+static atomic_uint metrics_commit_refused[RELAY_SOURCE_COUNT];     // Refused by a relay rule
+static atomic_uint metrics_commit_failed[RELAY_SOURCE_COUNT];      // Any other error
+static metrics_histogram_t metrics_command_latency[RELAY_SOURCE_COUNT];
+static atomic_uint metrics_mqtt_publishes;
+static atomic_uint metrics_mqtt_publish_failures;
+
+// Filled in while the web server registers its handlers, before any request is dispatched
+static metrics_http_route_t metrics_http_routes[METRICS_MAX_HTTP_ROUTES];
+static atomic_int metrics_http_route_count;
+
+void metrics_record_commit(relay_source_t source, esp_err_t result)
+{
+    if ((unsigned)source >= RELAY_SOURCE_COUNT) {
+        return;
+    }
+    if (result == ESP_OK) {
+        atomic_fetch_add_explicit(&metrics_commits[source], 1, memory_order_relaxed);
+    } else if (result == ESP_ERR_INVALID_STATE) {
+        atomic_fetch_add_explicit(&metrics_commit_refused[source], 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&metrics_commit_failed[source], 1, memory_order_relaxed);
+    }
+}
+
+// Time from receiving a command to its GPIO commit
+void metrics_record_command(relay_source_t source, int64_t latency_us)
+{
+    if ((unsigned)source >= RELAY_SOURCE_COUNT || latency_us < 0) {
+        return;
+    }
+    int bucket = 0;
+    while (bucket < METRICS_LATENCY_BUCKETS && latency_us > metrics_latency_bounds_us[bucket]) {
+        bucket++;
+    }
+    metrics_histogram_t *h = &metrics_command_latency[source];
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_us, (unsigned long long)latency_us, memory_order_relaxed);
+}
+
+void metrics_record_mqtt_publish(bool ok)
+{
+    atomic_fetch_add_explicit(ok ? &metrics_mqtt_publishes : &metrics_mqtt_publish_failures, 1,
+                              memory_order_relaxed);
+}
+
+// Returns the route index for metrics_record_http(), or -1 when the table is full
+int metrics_register_http_route(const char *uri, const char *method)
+{
+    int index = atomic_load_explicit(&metrics_http_route_count, memory_order_relaxed);
+    for (int i = 0; i < index; i++) {
+        // Registered again after web_server_stop(); keep counting on the old entry
+        if (metrics_http_routes[i].uri == uri && metrics_http_routes[i].method == method) {
+            return i;
+        }
+    }
+    if (index >= METRICS_MAX_HTTP_ROUTES) {
+        ESP_LOGW(TAG, "No metrics slot for %s %s", method, uri);
+        return -1;
+    }
+    metrics_http_routes[index].uri = uri;
+    metrics_http_routes[index].method = method;
+    atomic_store_explicit(&metrics_http_route_count, index + 1, memory_order_release);
+    return index;
+}
+
+void metrics_record_http(int route, int64_t duration_us, esp_err_t result)
+{
+    if (route < 0 || route >= atomic_load_explicit(&metrics_http_route_count, memory_order_acquire)) {
+        return;
+    }
+    metrics_http_route_t *r = &metrics_http_routes[route];
+    atomic_fetch_add_explicit(&r->requests, 1, memory_order_relaxed);
+    if (result != ESP_OK) {
+        atomic_fetch_add_explicit(&r->errors, 1, memory_order_relaxed);
+    }
+    if (duration_us > 0) {
+        atomic_fetch_add_explicit(&r->duration_us, (unsigned long long)duration_us, memory_order_relaxed);
+    }
+}
+
+// Exposition text is assembled in buf and handed to the sink whenever the next line does not fit
+typedef struct {
+    char buf[METRICS_CHUNK_SIZE];
+    size_t len;
+    metrics_sink_t sink;
+    void *ctx;
+    esp_err_t err;
+} metrics_writer_t;
+
+static void metrics_flush(metrics_writer_t *w)
+{
+    if (w->err == ESP_OK && w->len > 0) {
+        w->err = w->sink(w->buf, w->len, w->ctx);
+    }
+    w->len = 0;
+}
+
+static void metrics_printf(metrics_writer_t *w, const char *fmt, ...)
+{
+    for (int attempt = 0; attempt < 2 && w->err == ESP_OK; attempt++) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(w->buf + w->len, sizeof(w->buf) - w->len, fmt, args);
+        va_end(args);
+        if (n >= 0 && w->len + n < sizeof(w->buf)) {
+            w->len += n;
+            return;
+        }
+        if (n < 0 || w->len == 0) {
+            w->err = ESP_ERR_INVALID_SIZE;   // A single line longer than the chunk buffer
+            return;
+        }
+        metrics_flush(w);
+    }
+}
+
+static void metrics_header(metrics_writer_t *w, const char *name, const char *type, const char *help)
+{
+    metrics_printf(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Microseconds as seconds with six decimals, without going through floating point
+#define METRICS_US_FMT "%" PRIu64 ".%06" PRIu64
+#define METRICS_US_ARGS(us) (uint64_t)(us) / 1000000, (uint64_t)(us) % 1000000
+
+static void metrics_write_relays(metrics_writer_t *w)
+{
+    uint32_t mask = relay_get_mask();
+    metrics_header(w, "relay_state", "gauge", "Relay output, 1 = on");
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        metrics_printf(w, "relay_state{relay=\"%d\"} %d\n", i, (mask >> i) & 1 ? 1 : 0);
+    }
+
+    relay_usage_t usage[NUM_RELAYS];
+    relay_get_usage(usage);
+    metrics_header(w, "relay_cycles_total", "counter", "Relay off-to-on transitions");
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        metrics_printf(w, "relay_cycles_total{relay=\"%d\"} %" PRIu32 "\n", i, usage[i].cycles);
+    }
+    metrics_header(w, "relay_on_seconds_total", "counter", "Cumulative relay on-time");
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        metrics_printf(w, "relay_on_seconds_total{relay=\"%d\"} " METRICS_US_FMT "\n", i,
+                       METRICS_US_ARGS(usage[i].on_time_ms * 1000));
+    }
+}
+
+// Sources that never committed anything are left out to keep the scrape small
+static void metrics_write_commands(metrics_writer_t *w)
+{
+    static const struct {
+        const char *result;
+        atomic_uint *counts;
+    } results[] = {
+        { "ok", metrics_commits },
+        { "refused", metrics_commit_refused },
+        { "error", metrics_commit_failed },
+    };
+
+    metrics_header(w, "relay_commits_total", "counter", "Relay commits by source and result");
+    for (int s = 0; s < RELAY_SOURCE_COUNT; s++) {
+        for (size_t r = 0; r < sizeof(results) / sizeof(results[0]); r++) {
+            unsigned count = atomic_load_explicit(&results[r].counts[s], memory_order_relaxed);
+            if (count != 0) {
+                metrics_printf(w, "relay_commits_total{source=\"%s\",result=\"%s\"} %u\n",
+                               relay_source_name(s), results[r].result, count);
+            }
+        }
+    }
+
+    metrics_header(w, "relay_command_latency_seconds", "histogram", "Time from receiving a command to its GPIO commit");
+    for (int s = 0; s < RELAY_SOURCE_COUNT; s++) {
+        metrics_histogram_t *h = &metrics_command_latency[s];
+        unsigned counts[METRICS_LATENCY_BUCKETS + 1];
+        unsigned total = 0;
+        for (int b = 0; b <= METRICS_LATENCY_BUCKETS; b++) {
+            counts[b] = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+            total += counts[b];
+        }
+        if (total == 0) {
+            continue;
+        }
+        const char *source = relay_source_name(s);
+        unsigned cumulative = 0;
+        for (int b = 0; b < METRICS_LATENCY_BUCKETS; b++) {
+            cumulative += counts[b];
+            metrics_printf(w, "relay_command_latency_seconds_bucket{source=\"%s\",le=\"" METRICS_US_FMT "\"} %u\n",
+                           source, METRICS_US_ARGS(metrics_latency_bounds_us[b]), cumulative);
+        }
+        metrics_printf(w, "relay_command_latency_seconds_bucket{source=\"%s\",le=\"+Inf\"} %u\n", source, total);
+        metrics_printf(w, "relay_command_latency_seconds_sum{source=\"%s\"} " METRICS_US_FMT "\n", source,
+                       METRICS_US_ARGS(atomic_load_explicit(&h->sum_us, memory_order_relaxed)));
+        metrics_printf(w, "relay_command_latency_seconds_count{source=\"%s\"} %u\n", source, total);
+    }
+}
+
+static void metrics_write_system(metrics_writer_t *w)
+{
+    metrics_header(w, "mqtt_connected", "gauge", "1 while connected to a broker");
+    metrics_printf(w, "mqtt_connected %d\n", mqtt_client_is_connected() ? 1 : 0);
+    metrics_header(w, "mqtt_publishes_total", "counter", "Messages handed to the MQTT client");
+    metrics_printf(w, "mqtt_publishes_total %u\n",
+                   atomic_load_explicit(&metrics_mqtt_publishes, memory_order_relaxed));
+    metrics_header(w, "mqtt_publish_failures_total", "counter", "Publishes the MQTT client refused");
+    metrics_printf(w, "mqtt_publish_failures_total %u\n",
+                   atomic_load_explicit(&metrics_mqtt_publish_failures, memory_order_relaxed));
+
+    bool wifi_connected = wifi_manager_is_connected();
+    metrics_header(w, "wifi_connected", "gauge", "1 while associated with an access point");
+    metrics_printf(w, "wifi_connected %d\n", wifi_connected ? 1 : 0);
+    wifi_ap_record_t ap;
+    if (wifi_connected && esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        metrics_header(w, "wifi_rssi_dbm", "gauge", "Signal strength of the access point");
+        metrics_printf(w, "wifi_rssi_dbm %d\n", ap.rssi);
+    }
+
+    log_defer_stats_t log_stats;
+    log_defer_get_stats(&log_stats);
+    metrics_header(w, "log_messages_total", "counter", "Log messages queued for output");
+    metrics_printf(w, "log_messages_total %" PRIu32 "\n", log_stats.captured);
+    metrics_header(w, "log_suppressed_total", "counter", "Log messages dropped by the per-site rate limit");
+    metrics_printf(w, "log_suppressed_total %" PRIu32 "\n", log_stats.suppressed);
+    metrics_header(w, "log_lost_total", "counter", "Log messages overwritten before they were printed");
+    metrics_printf(w, "log_lost_total %" PRIu32 "\n", log_stats.lost);
+    log_forward_stats_t forward_stats;
+    log_forward_get_stats(&forward_stats);
+    metrics_header(w, "log_forwarded_total", "counter", "Log lines shipped, by destination");
+    metrics_printf(w, "log_forwarded_total{dest=\"syslog\"} %" PRIu32 "\n", forward_stats.syslog_sent);
+    metrics_printf(w, "log_forwarded_total{dest=\"mqtt\"} %" PRIu32 "\n", forward_stats.mqtt_sent);
+    metrics_header(w, "log_forward_mqtt_skipped_total", "counter",
+                   "Log lines not published because the broker was down while syslog was sending");
+    metrics_printf(w, "log_forward_mqtt_skipped_total %" PRIu32 "\n", forward_stats.mqtt_skipped);
+    metrics_header(w, "log_forward_dropped_total", "counter", "Log lines dropped from the full forwarding queue");
+    metrics_printf(w, "log_forward_dropped_total %" PRIu32 "\n", forward_stats.dropped);
+    metrics_header(w, "log_forward_send_failures_total", "counter", "Syslog datagrams or MQTT publishes that failed");
+    metrics_printf(w, "log_forward_send_failures_total %" PRIu32 "\n", forward_stats.send_failures);
+
+    metrics_header(w, "uptime_seconds", "counter", "Time since boot");
+    metrics_printf(w, "uptime_seconds " METRICS_US_FMT "\n", METRICS_US_ARGS(esp_timer_get_time()));
+}
+
+// From the last heap_monitor sample, one series per capability region that exists
+static void metrics_write_heap(metrics_writer_t *w)
+{
+    heap_monitor_stats_t stats;
+    heap_monitor_get_stats(&stats);
+
+    metrics_header(w, "heap_free_bytes", "gauge", "Free heap");
+    for (int r = 0; r < HEAP_MONITOR_REGION_COUNT; r++) {
+        if (stats.regions[r].total == 0) {
+            continue;
+        }
+        metrics_printf(w, "heap_free_bytes{caps=\"%s\"} %" PRIu32 "\n", heap_monitor_region_name(r),
+                       stats.regions[r].free);
+    }
+    metrics_header(w, "heap_minimum_free_bytes", "gauge", "Lowest free heap since boot");
+    for (int r = 0; r < HEAP_MONITOR_REGION_COUNT; r++) {
+        if (stats.regions[r].total == 0) {
+            continue;
+        }
+        metrics_printf(w, "heap_minimum_free_bytes{caps=\"%s\"} %" PRIu32 "\n", heap_monitor_region_name(r),
+                       stats.regions[r].min_free);
+    }
+    metrics_header(w, "heap_largest_free_block_bytes", "gauge", "Largest allocatable block");
+    for (int r = 0; r < HEAP_MONITOR_REGION_COUNT; r++) {
+        if (stats.regions[r].total == 0) {
+            continue;
+        }
+        metrics_printf(w, "heap_largest_free_block_bytes{caps=\"%s\"} %" PRIu32 "\n",
+                       heap_monitor_region_name(r), stats.regions[r].largest_free);
+    }
+    metrics_header(w, "heap_fragmentation_ratio", "gauge", "1 - largest free block / free heap");
+    for (int r = 0; r < HEAP_MONITOR_REGION_COUNT; r++) {
+        if (stats.regions[r].total == 0) {
+            continue;
+        }
+        metrics_printf(w, "heap_fragmentation_ratio{caps=\"%s\"} %u.%03u\n", heap_monitor_region_name(r),
+                       stats.regions[r].fragmentation_permille / 1000, stats.regions[r].fragmentation_permille % 1000);
+    }
+    metrics_header(w, "heap_level", "gauge", "0 ok, 1 warn, 2 critical");
+    for (int r = 0; r < HEAP_MONITOR_REGION_COUNT; r++) {
+        if (stats.regions[r].total == 0) {
+            continue;
+        }
+        metrics_printf(w, "heap_level{caps=\"%s\"} %d\n", heap_monitor_region_name(r), (int)stats.regions[r].level);
+    }
+    metrics_header(w, "heap_alloc_failures_total", "counter", "Allocations that could not be satisfied");
+    metrics_printf(w, "heap_alloc_failures_total %" PRIu32 "\n", stats.alloc_failures);
+    if (stats.hooks) {
+        metrics_header(w, "heap_allocations_total", "counter", "Allocations since boot");
+        metrics_printf(w, "heap_allocations_total %" PRIu32 "\n", stats.allocs);
+        metrics_header(w, "heap_frees_total", "counter", "Frees since boot");
+        metrics_printf(w, "heap_frees_total %" PRIu32 "\n", stats.frees);
+    }
+}
+
+// From the last task_stats sample; shares are of one core
+static void metrics_write_tasks(metrics_writer_t *w)
+{
+    task_stats_t stats;
+    task_stats_get(&stats);
+    if (stats.interval_ms == 0) {
+        return;
+    }
+    metrics_header(w, "cpu_load_ratio", "gauge", "Busy share of each core over the last sample interval");
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        metrics_printf(w, "cpu_load_ratio{core=\"%d\"} %u.%03u\n", core, stats.core_load_permille[core] / 1000,
+                       stats.core_load_permille[core] % 1000);
+    }
+    metrics_header(w, "task_cpu_ratio", "gauge", "Share of one core used by each task over the last sample interval");
+    for (int i = 0; i < stats.task_count; i++) {
+        metrics_printf(w, "task_cpu_ratio{task=\"%s\"} %u.%03u\n", stats.tasks[i].name,
+                       stats.tasks[i].cpu_permille / 1000, stats.tasks[i].cpu_permille % 1000);
+    }
+    metrics_header(w, "task_stack_free_bytes", "gauge", "Lowest free stack of each task since it started");
+    for (int i = 0; i < stats.task_count; i++) {
+        metrics_printf(w, "task_stack_free_bytes{task=\"%s\"} %" PRIu32 "\n", stats.tasks[i].name,
+                       stats.tasks[i].stack_free);
+    }
+}
+
+static void metrics_write_boot(metrics_writer_t *w)
+{
+    boot_timeline_t timeline;
+    boot_timeline_get(&timeline);
+    metrics_header(w, "boot_phase_duration_seconds", "gauge", "Duration of each init phase at the last boot");
+    for (int i = 0; i < timeline.phase_count; i++) {
+        const boot_timeline_phase_t *p = &timeline.phases[i];
+        if (p->end_us != 0) {
+            int64_t us = p->end_us - p->start_us;
+            metrics_printf(w, "boot_phase_duration_seconds{phase=\"%s\"} %u.%06u\n", p->name,
+                           (unsigned)(us / 1000000), (unsigned)(us % 1000000));
+        }
+    }
+    metrics_header(w, "boot_milestone_seconds", "gauge", "Time since startup at which each boot milestone was reached");
+    for (int i = 0; i < BOOT_TIMELINE_MILESTONE_COUNT; i++) {
+        int64_t us = timeline.milestones_us[i];
+        if (us != 0) {
+            metrics_printf(w, "boot_milestone_seconds{milestone=\"%s\"} %u.%06u\n",
+                           boot_timeline_milestone_name((boot_timeline_milestone_t)i), (unsigned)(us / 1000000),
+                           (unsigned)(us % 1000000));
+        }
+    }
+}
+
+static void metrics_write_http(metrics_writer_t *w)
+{
+    int count = atomic_load_explicit(&metrics_http_route_count, memory_order_acquire);
+
+    metrics_header(w, "http_requests_total", "counter", "Requests by handler");
+    for (int i = 0; i < count; i++) {
+        const metrics_http_route_t *r = &metrics_http_routes[i];
+        metrics_printf(w, "http_requests_total{method=\"%s\",path=\"%s\"} %u\n", r->method, r->uri,
+                       atomic_load_explicit(&r->requests, memory_order_relaxed));
+    }
+    metrics_header(w, "http_request_errors_total", "counter", "Requests whose handler failed");
+    for (int i = 0; i < count; i++) {
+        const metrics_http_route_t *r = &metrics_http_routes[i];
+        unsigned errors = atomic_load_explicit(&r->errors, memory_order_relaxed);
+        if (errors != 0) {
+            metrics_printf(w, "http_request_errors_total{method=\"%s\",path=\"%s\"} %u\n", r->method, r->uri, errors);
+        }
+    }
+    metrics_header(w, "http_request_duration_seconds_total", "counter", "Time spent in request handlers");
+    for (int i = 0; i < count; i++) {
+        const metrics_http_route_t *r = &metrics_http_routes[i];
+        metrics_printf(w, "http_request_duration_seconds_total{method=\"%s\",path=\"%s\"} " METRICS_US_FMT "\n",
+                       r->method, r->uri,
+                       METRICS_US_ARGS(atomic_load_explicit(&r->duration_us, memory_order_relaxed)));
+    }
+}
+
+// Write all metrics in Prometheus text format (version 0.0.4) through sink
+esp_err_t metrics_write(metrics_sink_t sink, void *ctx)
+{
+    metrics_writer_t w = {
+        .sink = sink,
+        .ctx = ctx,
+        .err = ESP_OK,
+    };
+    metrics_write_relays(&w);
+    metrics_write_commands(&w);
+    metrics_write_system(&w);
+    metrics_write_heap(&w);
+    metrics_write_tasks(&w);
+    metrics_write_boot(&w);
+    metrics_write_http(&w);
+    metrics_flush(&w);
+    return w.err;
+}
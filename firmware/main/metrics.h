@@ -0,0 +1,39 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "esp_err.h"
+#include "relay_control.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Counters are plain relaxed atomics updated on the hot paths (relay commits, command
+// handlers, httpd dispatch, MQTT publish); metrics_write() reads them into Prometheus text
+// exposition format through a small stack buffer, so a scrape never allocates.
+
+// Upper bounds of the command latency histogram buckets in microseconds (+Inf is implicit)
+#define METRICS_LATENCY_BOUNDS_US { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000 }
+#define METRICS_LATENCY_BUCKETS 11
+
+// One entry per registered httpd URI handler
+#ifndef METRICS_MAX_HTTP_ROUTES
+#define METRICS_MAX_HTTP_ROUTES 32
+#endif
+
+// Size of the stack buffer the exposition text is assembled in before each chunk is sent
+#ifndef METRICS_CHUNK_SIZE
+#define METRICS_CHUNK_SIZE 512
+#endif
+
+// Receives each chunk of exposition text; returning an error aborts the write
+typedef esp_err_t (*metrics_sink_t)(const char *text, size_t len, void *ctx);
+
+// Function declarations
+void metrics_record_commit(relay_source_t source, esp_err_t result);
+void metrics_record_command(relay_source_t source, int64_t latency_us);
+void metrics_record_mqtt_publish(bool ok);
+int metrics_register_http_route(const char *uri, const char *method);
+void metrics_record_http(int route, int64_t duration_us, esp_err_t result);
+esp_err_t metrics_write(metrics_sink_t sink, void *ctx);
+
+#endif // METRICS_H
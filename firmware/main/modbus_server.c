@@ -0,0 +1,403 @@
+#include "modbus_server.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "relay_control.h"
+#include <string.h>
+
+static const char *TAG = "MODBUS_SERVER";
+
+#define MODBUS_MBAP_LEN 7
+#define MODBUS_ADU_MAX_LEN 260
+#define MODBUS_PDU_MAX_LEN (MODBUS_ADU_MAX_LEN - MODBUS_MBAP_LEN)
+
+#define MODBUS_FC_READ_COILS 0x01
+#define MODBUS_FC_READ_HOLDING_REGISTERS 0x03
+#define MODBUS_FC_READ_INPUT_REGISTERS 0x04
+#define MODBUS_FC_WRITE_SINGLE_COIL 0x05
+#define MODBUS_FC_WRITE_SINGLE_REGISTER 0x06
+#define MODBUS_FC_WRITE_MULTIPLE_COILS 0x0F
+
+#define MODBUS_EX_ILLEGAL_FUNCTION 0x01
+#define MODBUS_EX_ILLEGAL_ADDRESS 0x02
+#define MODBUS_EX_ILLEGAL_VALUE 0x03
+#define MODBUS_EX_DEVICE_FAILURE 0x04
+
+typedef struct {
+    int sock;
+    int64_t last_active_us;
+    uint16_t rx_len;
+    uint8_t rx[MODBUS_ADU_MAX_LEN];
+} modbus_client_t;
+
+static modbus_client_t modbus_clients[MODBUS_SERVER_MAX_CLIENTS];
+
+static modbus_server_stats_t modbus_stats;
+static portMUX_TYPE modbus_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint16_t modbus_get_u16(const uint8_t *p)
+{
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static void modbus_put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static int modbus_exception(uint8_t function, uint8_t code, uint8_t *resp)
+{
+    resp[0] = function | 0x80;
+    resp[1] = code;
+    return 2;
+}
+
+static int modbus_commit(uint8_t function, uint32_t set_mask, uint32_t clear_mask, uint8_t *resp)
+{
+    uint32_t previous_mask = relay_get_mask();
+    relay_commit_info_t info;
+    esp_err_t ret = relay_commit(set_mask, clear_mask, RELAY_SOURCE_MODBUS, &info);
+    if (ret == ESP_ERR_INVALID_STATE) {
+        // Refused by an interlock or sequence rule
+        return modbus_exception(function, MODBUS_EX_ILLEGAL_VALUE, resp);
+    } else if (ret != ESP_OK) {
+        return modbus_exception(function, MODBUS_EX_DEVICE_FAILURE, resp);
+    }
+    if (info.mask != previous_mask) {
+        relay_publish_status_async();
+    }
+    return 0;
+}
+
+static void modbus_put_u32_registers(uint16_t *regs, uint32_t v)
+{
+    regs[0] = v >> 16;
+    regs[1] = v & 0xffff;
+}
+
+// Snapshot of all input registers, so the two halves of a 32-bit value always match
+static void modbus_read_input_registers(uint16_t regs[MODBUS_IR_COUNT])
+{
+    wifi_ap_record_t ap;
+    modbus_put_u32_registers(&regs[MODBUS_IR_UPTIME_S], (uint32_t)(esp_timer_get_time() / 1000000));
+    modbus_put_u32_registers(&regs[MODBUS_IR_FREE_HEAP], esp_get_free_heap_size());
+    modbus_put_u32_registers(&regs[MODBUS_IR_MIN_FREE_HEAP], esp_get_minimum_free_heap_size());
+    regs[MODBUS_IR_RSSI] = (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) ? (uint16_t)(int16_t)ap.rssi : 0;
+    regs[MODBUS_IR_RELAY_MASK] = relay_get_mask();
+}
+
+// Handle one request PDU and build the response PDU; returns the response length
+static int modbus_handle_pdu(const uint8_t *req, int req_len, uint8_t *resp)
+{
+    uint8_t function = req[0];
+    if (req_len < 5) {
+        bool supported = function == MODBUS_FC_READ_COILS || function == MODBUS_FC_READ_HOLDING_REGISTERS ||
+                         function == MODBUS_FC_READ_INPUT_REGISTERS || function == MODBUS_FC_WRITE_SINGLE_COIL ||
+                         function == MODBUS_FC_WRITE_SINGLE_REGISTER || function == MODBUS_FC_WRITE_MULTIPLE_COILS;
+        return modbus_exception(function, supported ? MODBUS_EX_ILLEGAL_VALUE : MODBUS_EX_ILLEGAL_FUNCTION, resp);
+    }
+    uint16_t address = modbus_get_u16(req + 1);
+    uint16_t value = modbus_get_u16(req + 3);   // Quantity for reads and FC 15
+
+    switch (function) {
+    case MODBUS_FC_READ_COILS: {
+        if (value < 1 || value > 2000) {
+            return modbus_exception(function, MODBUS_EX_ILLEGAL_VALUE, resp);
+        }
+        if ((uint32_t)address + value > NUM_RELAYS) {
+            return modbus_exception(function, MODBUS_EX_ILLEGAL_ADDRESS, resp);
+        }
+        uint32_t bits = relay_get_mask() >> address;
+        resp[0] = function;
+        resp[1] = (value + 7) / 8;
+        for (int i = 0; i < resp[1]; i++) {
+            resp[2 + i] = (bits >> (8 * i)) & 0xff;
+        }
+        // Bits beyond the requested quantity must be zero
+        if (value % 8 != 0) {
+            resp[1 + resp[1]] &= (1u << (value % 8)) - 1;
+        }
+        return 2 + resp[1];
+    }
+
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+    case MODBUS_FC_READ_HOLDING_REGISTERS: {
+        uint16_t regs[MODBUS_IR_COUNT];
+        uint16_t count = MODBUS_IR_COUNT;
+        if (value < 1 || value > 125) {
+            return modbus_exception(function, MODBUS_EX_ILLEGAL_VALUE, resp);
+        }
+        if (function == MODBUS_FC_READ_INPUT_REGISTERS) {
+            modbus_read_input_registers(regs);
+        } else {
+            regs[0] = relay_get_mask();
+            count = 1;
+        }
+        if ((uint32_t)address + value > count) {
+            return modbus_exception(function, MODBUS_EX_ILLEGAL_ADDRESS, resp);
+        }
+        resp[0] = function;
+        resp[1] = value * 2;
+        for (int i = 0; i < value; i++) {
+            modbus_put_u16(resp + 2 + i * 2, regs[address + i]);
+        }
+        return 2 + resp[1];
+    }
+
+    case MODBUS_FC_WRITE_SINGLE_COIL: {
+        if (value != 0xff00 && value != 0x0000) {
+            return modbus_exception(function, MODBUS_EX_ILLEGAL_VALUE, resp);
+        }
+        if (address >= NUM_RELAYS) {
+            return modbus_exception(function, MODBUS_EX_ILLEGAL_ADDRESS, resp);
+        }
+        uint32_t bit = 1u << address;
+        int ret = modbus_commit(function, value ? bit : 0, value ? 0 : bit, resp);
+        if (ret != 0) {
+            return ret;
+        }
+        memcpy(resp, req, 5);
+        return 5;
+    }
+
+    case MODBUS_FC_WRITE_SINGLE_REGISTER: {
+        if (address != 0) {
+            return modbus_exception(function, MODBUS_EX_ILLEGAL_ADDRESS, resp);
+        }
+        if (value > RELAY_ALL_MASK) {
+            return modbus_exception(function, MODBUS_EX_ILLEGAL_VALUE, resp);
+        }
+        int ret = modbus_commit(function, value, RELAY_ALL_MASK & ~value, resp);
+        if (ret != 0) {
+            return ret;
+        }
+        memcpy(resp, req, 5);
+        return 5;
+    }
+
+    case MODBUS_FC_WRITE_MULTIPLE_COILS: {
+        if (req_len < 6 || value < 1 || value > 0x7b0 ||
+            req[5] != (value + 7) / 8 || req_len != 6 + req[5]) {
+            return modbus_exception(function, MODBUS_EX_ILLEGAL_VALUE, resp);
+        }
+        if ((uint32_t)address + value > NUM_RELAYS) {
+            return modbus_exception(function, MODBUS_EX_ILLEGAL_ADDRESS, resp);
+        }
+        // All coils of the request land in one relay commit
+        uint32_t set_mask = 0;
+        uint32_t clear_mask = 0;
+        for (int i = 0; i < value; i++) {
+            uint32_t bit = 1u << (address + i);
+            if (req[6 + i / 8] & (1u << (i % 8))) {
+                set_mask |= bit;
+            } else {
+                clear_mask |= bit;
+            }
+        }
+        int ret = modbus_commit(function, set_mask, clear_mask, resp);
+        if (ret != 0) {
+            return ret;
+        }
+        memcpy(resp, req, 5);
+        return 5;
+    }
+
+    default:
+        return modbus_exception(function, MODBUS_EX_ILLEGAL_FUNCTION, resp);
+    }
+}
+
+static void modbus_close_client(modbus_client_t *client)
+{
+    if (client->sock >= 0) {
+        close(client->sock);
+        client->sock = -1;
+        portENTER_CRITICAL(&modbus_stats_lock);
+        modbus_stats.active_clients--;
+        portEXIT_CRITICAL(&modbus_stats_lock);
+    }
+    client->rx_len = 0;
+}
+
+// Answer every complete ADU in the receive buffer; returns false if the connection must be closed
+static bool modbus_process_client(modbus_client_t *client)
+{
+    while (client->rx_len >= MODBUS_MBAP_LEN) {
+        uint16_t protocol = modbus_get_u16(client->rx + 2);
+        uint16_t length = modbus_get_u16(client->rx + 4);
+        if (protocol != 0 || length < 2 || length > MODBUS_PDU_MAX_LEN + 1) {
+            ESP_LOGW(TAG, "Malformed MBAP header, closing connection");
+            return false;
+        }
+        int adu_len = MODBUS_MBAP_LEN - 1 + length;
+        if (client->rx_len < adu_len) {
+            return true; // Wait for the rest of the frame
+        }
+
+        uint8_t resp[MODBUS_ADU_MAX_LEN];
+        int pdu_len = modbus_handle_pdu(client->rx + MODBUS_MBAP_LEN, length - 1, resp + MODBUS_MBAP_LEN);
+        memcpy(resp, client->rx, 4);            // Transaction and protocol ID
+        modbus_put_u16(resp + 4, pdu_len + 1);
+        resp[6] = client->rx[6];                // Unit ID
+
+        portENTER_CRITICAL(&modbus_stats_lock);
+        modbus_stats.requests++;
+        if (resp[MODBUS_MBAP_LEN] & 0x80) {
+            modbus_stats.exceptions++;
+        }
+        portEXIT_CRITICAL(&modbus_stats_lock);
+
+        if (send(client->sock, resp, MODBUS_MBAP_LEN + pdu_len, 0) != MODBUS_MBAP_LEN + pdu_len) {
+            return false;
+        }
+
+        client->rx_len -= adu_len;
+        memmove(client->rx, client->rx + adu_len, client->rx_len);
+    }
+    return true;
+}
+
+static void modbus_accept(int listen_sock)
+{
+    int sock = accept(listen_sock, NULL, NULL);
+    if (sock < 0) {
+        return;
+    }
+
+    // Free slot, or evict the connection that has been quiet longest (typically a half-open
+    // socket left behind by a master that rebooted)
+    modbus_client_t *slot = NULL;
+    for (int i = 0; i < MODBUS_SERVER_MAX_CLIENTS; i++) {
+        modbus_client_t *client = &modbus_clients[i];
+        if (client->sock < 0) {
+            slot = client;
+            break;
+        }
+        if (slot == NULL || client->last_active_us < slot->last_active_us) {
+            slot = client;
+        }
+    }
+    if (slot->sock >= 0) {
+        ESP_LOGW(TAG, "Client limit reached, dropping least recently active connection");
+        modbus_close_client(slot);
+    }
+
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    struct timeval send_timeout = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+    slot->sock = sock;
+    slot->rx_len = 0;
+    slot->last_active_us = esp_timer_get_time();
+    portENTER_CRITICAL(&modbus_stats_lock);
+    modbus_stats.connections++;
+    modbus_stats.active_clients++;
+    portEXIT_CRITICAL(&modbus_stats_lock);
+}
+
+// One task serves all masters; every request is answered from RAM state or a single relay
+// commit, so per-request latency does not depend on other connections
+static void modbus_server_task(void *arg)
+{
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_sock < 0) {
+        ESP_LOGE(TAG, "Failed to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    int reuse = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(MODBUS_SERVER_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_sock, 2) < 0) {
+        ESP_LOGE(TAG, "Failed to listen on port %d: errno %d", MODBUS_SERVER_PORT, errno);
+        close(listen_sock);
+        vTaskDelete(NULL);
+        return;
+    }
+    ESP_LOGI(TAG, "Modbus TCP server listening on port %d", MODBUS_SERVER_PORT);
+
+    while (1) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(listen_sock, &fds);
+        int max_fd = listen_sock;
+        for (int i = 0; i < MODBUS_SERVER_MAX_CLIENTS; i++) {
+            if (modbus_clients[i].sock >= 0) {
+                FD_SET(modbus_clients[i].sock, &fds);
+                if (modbus_clients[i].sock > max_fd) {
+                    max_fd = modbus_clients[i].sock;
+                }
+            }
+        }
+
+        struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+        int ready = select(max_fd + 1, &fds, NULL, NULL, &timeout);
+        if (ready < 0) {
+            ESP_LOGE(TAG, "select failed: errno %d", errno);
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        int64_t now_us = esp_timer_get_time();
+        for (int i = 0; i < MODBUS_SERVER_MAX_CLIENTS; i++) {
+            modbus_client_t *client = &modbus_clients[i];
+            if (client->sock < 0) {
+                continue;
+            }
+            if (!FD_ISSET(client->sock, &fds)) {
+                if (now_us - client->last_active_us > (int64_t)MODBUS_SERVER_IDLE_TIMEOUT_MS * 1000) {
+                    modbus_close_client(client);
+                }
+                continue;
+            }
+
+            int len = recv(client->sock, client->rx + client->rx_len, sizeof(client->rx) - client->rx_len, 0);
+            if (len <= 0) {
+                modbus_close_client(client);
+                continue;
+            }
+            client->rx_len += len;
+            client->last_active_us = now_us;
+            if (!modbus_process_client(client)) {
+                modbus_close_client(client);
+            }
+        }
+
+        if (FD_ISSET(listen_sock, &fds)) {
+            modbus_accept(listen_sock);
+        }
+    }
+}
+
+esp_err_t modbus_server_init(void)
+{
+    for (int i = 0; i < MODBUS_SERVER_MAX_CLIENTS; i++) {
+        modbus_clients[i].sock = -1;
+    }
+
+    if (xTaskCreate(modbus_server_task, "modbus_server", MODBUS_SERVER_TASK_STACK_SIZE, NULL,
+                    MODBUS_SERVER_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create Modbus server task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void modbus_server_get_stats(modbus_server_stats_t *stats)
+{
+    portENTER_CRITICAL(&modbus_stats_lock);
+    *stats = modbus_stats;
+    portEXIT_CRITICAL(&modbus_stats_lock);
+}
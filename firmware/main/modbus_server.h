@@ -0,0 +1,47 @@
+#ifndef MODBUS_SERVER_H
+#define MODBUS_SERVER_H
+
+#include "esp_err.h"
+#include <stdint.h>
+
+// Modbus TCP server configuration
+#ifndef MODBUS_SERVER_PORT
+#define MODBUS_SERVER_PORT 502
+#endif
+#ifndef MODBUS_SERVER_MAX_CLIENTS
+#define MODBUS_SERVER_MAX_CLIENTS 4
+#endif
+// Connections without a request for this long are closed
+#ifndef MODBUS_SERVER_IDLE_TIMEOUT_MS
+#define MODBUS_SERVER_IDLE_TIMEOUT_MS 60000
+#endif
+#ifndef MODBUS_SERVER_TASK_PRIORITY
+#define MODBUS_SERVER_TASK_PRIORITY 6
+#endif
+#ifndef MODBUS_SERVER_TASK_STACK_SIZE
+#define MODBUS_SERVER_TASK_STACK_SIZE 4096
+#endif
+
+// Data model (zero-based addresses, any unit ID is accepted):
+//   coils 0..NUM_RELAYS-1        relay states (FC 1, 5, 15; FC 15 is one atomic commit)
+//   holding register 0           relay bitmask (FC 3, 6)
+//   input registers, 32-bit values high word first (FC 4):
+#define MODBUS_IR_UPTIME_S      0   // 2 registers
+#define MODBUS_IR_FREE_HEAP     2   // 2 registers
+#define MODBUS_IR_MIN_FREE_HEAP 4   // 2 registers
+#define MODBUS_IR_RSSI          6   // int16 dBm, 0 when not associated
+#define MODBUS_IR_RELAY_MASK    7
+#define MODBUS_IR_COUNT         8
+
+typedef struct {
+    uint32_t connections;
+    uint32_t requests;
+    uint32_t exceptions;
+    uint8_t active_clients;
+} modbus_server_stats_t;
+
+// Function declarations
+esp_err_t modbus_server_init(void);
+void modbus_server_get_stats(modbus_server_stats_t *stats);
+
+#endif // MODBUS_SERVER_H
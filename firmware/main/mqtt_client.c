@@ -1,26 +1,448 @@
 #include "app_mqtt.h"
 #include "esp_log.h"
 #include "cJSON.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "relay_control.h"
+#include "relay_command.h"
+#include "relay_timer.h"
+#include "metrics.h"
+#include "trace.h"
+#include "esp_timer.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "wifi_manager.h"
+#include "boot_timeline.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
 
 static const char *TAG = "MQTT_CLIENT";
 
 esp_mqtt_client_handle_t mqtt_client = NULL;
 
+// NVS keys for MQTT configuration
+#define NVS_NAMESPACE "mqtt_config"
+#define NVS_KEY_CONFIG "config"
+#define MQTT_CONFIG_VERSION 2
+
+// Consecutive failed connects before moving on to the next broker in the list
+#define MQTT_BROKER_FAILOVER_ATTEMPTS 2
+
+typedef struct {
+    uint8_t version;
+    app_mqtt_config_t config;
+} mqtt_config_blob_t;
+
+// Full topic strings, rebuilt once per config change. Two buffers so a reconfigure
+// never rewrites the strings a concurrent publisher is reading.
+typedef struct {
+    char set[MQTT_TOPIC_MAX_LEN];
+    char status[MQTT_TOPIC_MAX_LEN];
+    char config[MQTT_TOPIC_MAX_LEN];
+    char ack[MQTT_TOPIC_MAX_LEN];
+    char set_bin[MQTT_TOPIC_MAX_LEN];
+    char ack_bin[MQTT_TOPIC_MAX_LEN];
+    char mode[MQTT_TOPIC_MAX_LEN];
+    char usage[MQTT_TOPIC_MAX_LEN];
+    char trace[MQTT_TOPIC_MAX_LEN];
+    char tasks[MQTT_TOPIC_MAX_LEN];
+    char heap[MQTT_TOPIC_MAX_LEN];
+    char log[MQTT_TOPIC_MAX_LEN];
+} mqtt_topics_t;
+
+static app_mqtt_config_t mqtt_config;
+static SemaphoreHandle_t mqtt_config_mutex = NULL;
+// Rebuilt by POST /mqtt under mqtt_config_mutex; read it through mqtt_client_copy_topic()
+static mqtt_topics_t mqtt_topics;
+static int mqtt_broker_index = 0;
+static int mqtt_failed_attempts = 0;
+static bool mqtt_connected_once = false;
+static volatile bool mqtt_connected = false;
+static bool mqtt_started = false;
+
+// Set while a start waits for WiFi; whoever clears it first (the IP event or
+// mqtt_client_start() itself) starts the client
+static atomic_bool mqtt_start_deferred = false;
+static esp_event_handler_instance_t mqtt_got_ip_handler = NULL;
+
+// Serializes publishes: MQTT 5 publish properties are per client, and a topic alias
+// must reach the broker with its full topic before any alias-only publish
+static SemaphoreHandle_t mqtt_publish_mutex = NULL;
+#if CONFIG_MQTT_PROTOCOL_5
+static bool mqtt5_alias_sent[MQTT5_TOPIC_ALIAS_COUNT + 1];     // The broker has the topic for this alias
+static int mqtt5_alias_pending[MQTT5_TOPIC_ALIAS_COUNT + 1];   // msg_id of the QoS>0 publish carrying it, 0 if none
+static int mqtt5_alias_only_msg_id = 0;     // Last alias-only QoS>0 publish not acknowledged yet
+static bool mqtt5_alias_enabled = true;     // For this connection
+static bool mqtt5_alias_refused = false;    // For the rest of the boot
+static uint8_t mqtt5_alias_drops = 0;
+#endif
+
+static void mqtt_client_default_config(app_mqtt_config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->enabled = true;
+    config->broker_count = 1;
+    strncpy(config->brokers[0], MQTT_BROKER_URL, MQTT_URI_MAX_LEN - 1);
+    strncpy(config->username, MQTT_USERNAME, MQTT_CRED_MAX_LEN - 1);
+    strncpy(config->password, MQTT_PASSWORD, MQTT_CRED_MAX_LEN - 1);
+    strncpy(config->topic_root, MQTT_TOPIC_ROOT, MQTT_TOPIC_ROOT_MAX_LEN - 1);
+    config->qos = MQTT_DEFAULT_QOS;
+    config->keepalive = MQTT_DEFAULT_KEEPALIVE;
+    config->protocol_version = MQTT_DEFAULT_PROTOCOL_VERSION;
+}
+
+static esp_err_t mqtt_client_load_config(app_mqtt_config_t *config)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // Fields appended in later versions keep their defaults when loading an older blob
+    mqtt_config_blob_t blob = { .version = 0 };
+    mqtt_client_default_config(&blob.config);
+    size_t len = sizeof(blob);
+    err = nvs_get_blob(nvs_handle, NVS_KEY_CONFIG, &blob, &len);
+    nvs_close(nvs_handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (len < offsetof(mqtt_config_blob_t, config.protocol_version) ||
+        blob.version == 0 || blob.version > MQTT_CONFIG_VERSION) {
+        ESP_LOGW(TAG, "Ignoring stored MQTT config (version %d, %u bytes)", blob.version, (unsigned)len);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    *config = blob.config;
+    return ESP_OK;
+}
+
+static esp_err_t mqtt_client_save_config(const app_mqtt_config_t *config)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    mqtt_config_blob_t blob = {
+        .version = MQTT_CONFIG_VERSION,
+        .config = *config,
+    };
+    err = nvs_set_blob(nvs_handle, NVS_KEY_CONFIG, &blob, sizeof(blob));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs_handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save MQTT config: %s", esp_err_to_name(err));
+    }
+
+    nvs_close(nvs_handle);
+    return err;
+}
+
+// Call with mqtt_config_mutex held
+static void mqtt_client_build_topics(const app_mqtt_config_t *config)
+{
+    mqtt_topics_t *topics = &mqtt_topics;
+
+    snprintf(topics->set, sizeof(topics->set), "%s%s", config->topic_root, MQTT_TOPIC_SET);
+    snprintf(topics->status, sizeof(topics->status), "%s%s", config->topic_root, MQTT_TOPIC_STATUS);
+    snprintf(topics->config, sizeof(topics->config), "%s%s", config->topic_root, MQTT_TOPIC_CONFIG);
+    snprintf(topics->ack, sizeof(topics->ack), "%s%s", config->topic_root, MQTT_TOPIC_ACK);
+    snprintf(topics->set_bin, sizeof(topics->set_bin), "%s%s", config->topic_root, MQTT_TOPIC_SET_BIN);
+    snprintf(topics->ack_bin, sizeof(topics->ack_bin), "%s%s", config->topic_root, MQTT_TOPIC_ACK_BIN);
+    snprintf(topics->mode, sizeof(topics->mode), "%s%s", config->topic_root, MQTT_TOPIC_MODE);
+    snprintf(topics->usage, sizeof(topics->usage), "%s%s", config->topic_root, MQTT_TOPIC_USAGE);
+    snprintf(topics->trace, sizeof(topics->trace), "%s%s", config->topic_root, MQTT_TOPIC_TRACE);
+    snprintf(topics->tasks, sizeof(topics->tasks), "%s%s", config->topic_root, MQTT_TOPIC_TASKS);
+    snprintf(topics->heap, sizeof(topics->heap), "%s%s", config->topic_root, MQTT_TOPIC_HEAP);
+    snprintf(topics->log, sizeof(topics->log), "%s%s", config->topic_root, MQTT_TOPIC_LOG);
+}
+
+// Copy one topic of the current set, e.g. offsetof(mqtt_topics_t, status), so a publish
+// never reads a topic while POST /mqtt rewrites it. Returns the QoS from the same snapshot.
+static int mqtt_client_copy_topic(size_t offset, char topic[MQTT_TOPIC_MAX_LEN])
+{
+    xSemaphoreTake(mqtt_config_mutex, portMAX_DELAY);
+    memcpy(topic, (const char *)&mqtt_topics + offset, MQTT_TOPIC_MAX_LEN);
+    int qos = mqtt_config.qos;
+    xSemaphoreGive(mqtt_config_mutex);
+    return qos;
+}
+
+#if CONFIG_MQTT_PROTOCOL_5
+static int mqtt_client_get_qos(void)
+{
+    xSemaphoreTake(mqtt_config_mutex, portMAX_DELAY);
+    int qos = mqtt_config.qos;
+    xSemaphoreGive(mqtt_config_mutex);
+    return qos;
+}
+#endif
+
+// Call with mqtt_config_mutex held; strings are copied by the MQTT client
+static void mqtt_client_fill_client_config(esp_mqtt_client_config_t *mqtt_cfg)
+{
+    memset(mqtt_cfg, 0, sizeof(*mqtt_cfg));
+    mqtt_cfg->broker.address.uri = mqtt_config.brokers[mqtt_broker_index];
+    mqtt_cfg->credentials.username = mqtt_config.username;
+    mqtt_cfg->credentials.authentication.password = mqtt_config.password;
+    mqtt_cfg->session.keepalive = mqtt_config.keepalive;
+    mqtt_cfg->session.disable_clean_session = false;
+    mqtt_cfg->session.protocol_ver = (mqtt_config.protocol_version == MQTT_PROTOCOL_VERSION_5) ?
+                                     MQTT_PROTOCOL_V_5 : MQTT_PROTOCOL_V_3_1_1;
+    mqtt_cfg->buffer.size = 1024;
+    mqtt_cfg->buffer.out_size = 1024;
+    mqtt_cfg->task.stack_size = 6144;
+    mqtt_cfg->task.priority = 5;
+}
+
+// Runs in the MQTT task: move to the next broker after repeated failed connects
+static void mqtt_client_failover(void)
+{
+    if (mqtt_connected_once) {
+        return; // Lost an established connection; let the client reconnect to the same broker
+    }
+
+    xSemaphoreTake(mqtt_config_mutex, portMAX_DELAY);
+    if (mqtt_config.broker_count > 1 && ++mqtt_failed_attempts >= MQTT_BROKER_FAILOVER_ATTEMPTS) {
+        mqtt_failed_attempts = 0;
+        mqtt_broker_index = (mqtt_broker_index + 1) % mqtt_config.broker_count;
+        ESP_LOGW(TAG, "Failing over to broker %s", mqtt_config.brokers[mqtt_broker_index]);
+
+        esp_mqtt_client_config_t mqtt_cfg;
+        mqtt_client_fill_client_config(&mqtt_cfg);
+        esp_mqtt_set_config(mqtt_client, &mqtt_cfg);
+    }
+    xSemaphoreGive(mqtt_config_mutex);
+}
+
+// Publish under mqtt_publish_mutex. With MQTT 5 and a non-zero alias the full topic goes out
+// once per session and later publishes carry only the alias. Correlation data (MQTT 5 only)
+// is attached when responding to a request.
+static int mqtt_client_publish_internal(const char *topic, uint16_t alias, const char *data, int len,
+                                        int qos, const char *correlation, uint16_t correlation_len)
+{
+    int msg_id;
+
+#if CONFIG_MQTT_PROTOCOL_5
+    // Taken before mqtt_publish_mutex, never nested with it
+    xSemaphoreTake(mqtt_config_mutex, portMAX_DELAY);
+    bool mqtt5 = mqtt_config.protocol_version == MQTT_PROTOCOL_VERSION_5;
+    xSemaphoreGive(mqtt_config_mutex);
+#endif
+
+    xSemaphoreTake(mqtt_publish_mutex, portMAX_DELAY);
+#if CONFIG_MQTT_PROTOCOL_5
+    if (mqtt5) {
+        bool use_alias = alias != 0 && alias <= MQTT5_TOPIC_ALIAS_COUNT && mqtt5_alias_enabled;
+        // Only while connected: a queued message is resent on the next connection, which
+        // does not know the alias
+        bool alias_only = use_alias && mqtt5_alias_sent[alias] && mqtt_connected;
+        esp_mqtt5_publish_property_config_t property = {
+            .topic_alias = use_alias ? alias : 0,
+            .correlation_data = correlation,
+            .correlation_data_len = correlation_len,
+        };
+        esp_mqtt5_client_set_publish_property(mqtt_client, &property);
+        msg_id = esp_mqtt_client_publish(mqtt_client, alias_only ? "" : topic, data, len, qos, 0);
+        if (msg_id == -1 && use_alias) {
+            property.topic_alias = 0;
+            esp_mqtt5_client_set_publish_property(mqtt_client, &property);
+            msg_id = esp_mqtt_client_publish(mqtt_client, topic, data, len, qos, 0);
+            if (msg_id >= 0) {
+                // The client checks the alias against the Topic Alias Maximum in CONNACK, and
+                // the same message went through by name: the broker grants no aliases
+                ESP_LOGW(TAG, "Broker does not accept topic aliases; publishing by name");
+                mqtt5_alias_enabled = false;
+            }
+        } else if (msg_id >= 0 && use_alias) {
+            if (alias_only) {
+                if (qos > 0) {
+                    mqtt5_alias_only_msg_id = msg_id;
+                }
+            } else if (qos > 0) {
+                mqtt5_alias_pending[alias] = msg_id;    // Known to the broker once acknowledged
+            } else if (mqtt_connected) {
+                mqtt5_alias_sent[alias] = true;         // QoS 0 is written to the socket right away
+            }
+        }
+        xSemaphoreGive(mqtt_publish_mutex);
+        metrics_record_mqtt_publish(msg_id >= 0);
+        return msg_id;
+    }
+#endif
+    msg_id = esp_mqtt_client_publish(mqtt_client, topic, data, len, qos, 0);
+    xSemaphoreGive(mqtt_publish_mutex);
+    metrics_record_mqtt_publish(msg_id >= 0);
+    return msg_id;
+}
+
+#if CONFIG_MQTT_PROTOCOL_5
+// Topic aliases only live for one network connection
+static void mqtt5_reset_aliases(void)
+{
+    xSemaphoreTake(mqtt_publish_mutex, portMAX_DELAY);
+    memset(mqtt5_alias_sent, 0, sizeof(mqtt5_alias_sent));
+    memset(mqtt5_alias_pending, 0, sizeof(mqtt5_alias_pending));
+    mqtt5_alias_only_msg_id = 0;
+    mqtt5_alias_enabled = !mqtt5_alias_refused;
+    xSemaphoreGive(mqtt_publish_mutex);
+}
+
+// PUBACK/PUBCOMP: the topic behind a pending alias has reached the broker
+static void mqtt5_alias_published(int msg_id)
+{
+    xSemaphoreTake(mqtt_publish_mutex, portMAX_DELAY);
+    for (int alias = 1; alias <= MQTT5_TOPIC_ALIAS_COUNT; alias++) {
+        if (mqtt5_alias_pending[alias] == msg_id) {
+            mqtt5_alias_pending[alias] = 0;
+            mqtt5_alias_sent[alias] = true;
+        }
+    }
+    if (mqtt5_alias_only_msg_id == msg_id) {
+        mqtt5_alias_only_msg_id = 0;
+        mqtt5_alias_drops = 0;
+    }
+    xSemaphoreGive(mqtt_publish_mutex);
+}
+
+// A broker that rejects an alias closes the connection with a protocol error, which leaves
+// the alias-only publish unacknowledged
+static void mqtt5_alias_disconnected(void)
+{
+    xSemaphoreTake(mqtt_publish_mutex, portMAX_DELAY);
+    if (mqtt5_alias_only_msg_id != 0 && ++mqtt5_alias_drops >= MQTT5_ALIAS_MAX_DROPS && !mqtt5_alias_refused) {
+        ESP_LOGW(TAG, "Connection lost after alias-only publishes %d times; topic aliases off", mqtt5_alias_drops);
+        mqtt5_alias_refused = true;
+    }
+    mqtt5_alias_only_msg_id = 0;
+    xSemaphoreGive(mqtt_publish_mutex);
+}
+
+// Answer an MQTT 5 request on its response topic, echoing the correlation data
+static void mqtt5_send_response(const esp_mqtt_event_handle_t event, const char *payload, int len)
+{
+    const esp_mqtt5_event_property_t *property = event->property;
+    if (property == NULL || property->response_topic == NULL || property->response_topic_len <= 0 ||
+        property->response_topic_len >= MQTT_TOPIC_MAX_LEN * 2) {
+        return;
+    }
+
+    char response_topic[MQTT_TOPIC_MAX_LEN * 2];
+    memcpy(response_topic, property->response_topic, property->response_topic_len);
+    response_topic[property->response_topic_len] = '\0';
+
+    int msg_id = mqtt_client_publish_internal(response_topic, 0, payload, len, mqtt_client_get_qos(),
+                                              property->correlation_data, property->correlation_data_len);
+    if (msg_id == -1) {
+        ESP_LOGE(TAG, "Failed to publish response to %s", response_topic);
+    }
+}
+#endif
+
+#if CONFIG_MQTT_PROTOCOL_5
+// MQTT 5 content type marks a binary payload on the regular set topic
+static bool mqtt5_is_binary_content(const esp_mqtt_event_handle_t event)
+{
+    const esp_mqtt5_event_property_t *property = event->property;
+    if (property == NULL || property->content_type == NULL) {
+        return false;
+    }
+    return (property->content_type_len == (int)strlen(RELAY_CONTENT_TYPE_CBOR) &&
+            strncmp(property->content_type, RELAY_CONTENT_TYPE_CBOR, property->content_type_len) == 0) ||
+           (property->content_type_len == (int)strlen(RELAY_CONTENT_TYPE_FRAME) &&
+            strncmp(property->content_type, RELAY_CONTENT_TYPE_FRAME, property->content_type_len) == 0);
+}
+#endif
+
+// Execute a relay command and acknowledge it: on the ack topic when the payload carries
+// a correlation ID, and on the MQTT 5 response topic when one was given. Binary commands
+// are acknowledged in CBOR on the binary ack topic.
+static void mqtt_client_handle_command(const esp_mqtt_event_handle_t event, bool binary)
+{
+    TRACE_SCOPE(TRACE_MQTT_COMMAND);
+    relay_command_t cmd;
+    relay_ack_t ack;
+    int64_t received_us = esp_timer_get_time();
+
+    esp_err_t ret = binary ?
+                    relay_command_parse_binary((const uint8_t *)event->data, event->data_len, &cmd) :
+                    relay_command_parse_json(event->data, event->data_len, &cmd);
+    if (ret == ESP_OK) {
+        cmd.received_us = received_us;
+        relay_command_execute(&cmd, RELAY_SOURCE_MQTT, &ack);
+    } else {
+        relay_command_reject(ret, &ack);
+    }
+    if (ack.result != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to process relay control message");
+    }
+
+    bool has_response_topic = false;
+#if CONFIG_MQTT_PROTOCOL_5
+    has_response_topic = event->property != NULL && event->property->response_topic_len > 0;
+#endif
+    if (cmd.id[0] == '\0' && !has_response_topic) {
+        return;
+    }
+
+    char payload[160];
+    int len = binary ?
+              relay_command_format_ack_cbor(&cmd, &ack, (uint8_t *)payload, sizeof(payload)) :
+              relay_command_format_ack_json(&cmd, &ack, payload, sizeof(payload));
+    if (len < 0 || len >= (int)sizeof(payload)) {
+        return;
+    }
+    if (cmd.id[0] != '\0') {
+        if (binary) {
+            mqtt_publish_ack_binary((const uint8_t *)payload, len);
+        } else {
+            mqtt_publish_ack(payload);
+        }
+    }
+#if CONFIG_MQTT_PROTOCOL_5
+    if (has_response_topic) {
+        mqtt5_send_response(event, payload, len);
+    }
+#endif
+}
+
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
+    TRACE_SCOPE(TRACE_MQTT_EVENT);
     esp_mqtt_event_handle_t event = event_data;
     esp_mqtt_client_handle_t client = event->client;
+    char set_topic[MQTT_TOPIC_MAX_LEN];
+    char set_bin_topic[MQTT_TOPIC_MAX_LEN];
+    char mode_topic[MQTT_TOPIC_MAX_LEN];
     
     switch ((esp_mqtt_event_id_t)event_id) {
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+        boot_timeline_milestone(BOOT_TIMELINE_MQTT_CONNECTED);
+        mqtt_connected_once = true;
+        mqtt_connected = true;
+        mqtt_failed_attempts = 0;
+#if CONFIG_MQTT_PROTOCOL_5
+        mqtt5_reset_aliases();
+#endif
         
         // Subscribe to relay control topic
-        char topic_set_conn[128];
-        snprintf(topic_set_conn, sizeof(topic_set_conn), "%s%s", MQTT_TOPIC_ROOT, MQTT_TOPIC_SET);
-        esp_mqtt_client_subscribe(client, topic_set_conn, 0);
-        ESP_LOGI(TAG, "Subscribed to %s", topic_set_conn);
+        int qos = mqtt_client_copy_topic(offsetof(mqtt_topics_t, set), set_topic);
+        mqtt_client_copy_topic(offsetof(mqtt_topics_t, set_bin), set_bin_topic);
+        mqtt_client_copy_topic(offsetof(mqtt_topics_t, mode), mode_topic);
+        esp_mqtt_client_subscribe(client, set_topic, qos);
+        ESP_LOGI(TAG, "Subscribed to %s", set_topic);
+        esp_mqtt_client_subscribe(client, set_bin_topic, qos);
+        ESP_LOGI(TAG, "Subscribed to %s", set_bin_topic);
+        esp_mqtt_client_subscribe(client, mode_topic, qos);
+        ESP_LOGI(TAG, "Subscribed to %s", mode_topic);
         
         // Publish initial status
         relay_publish_status();
@@ -28,6 +450,11 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+        mqtt_connected = false;
+#if CONFIG_MQTT_PROTOCOL_5
+        mqtt5_alias_disconnected();
+#endif
+        mqtt_client_failover();
         break;
         
     case MQTT_EVENT_SUBSCRIBED:
@@ -40,33 +467,37 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         
     case MQTT_EVENT_PUBLISHED:
         ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+#if CONFIG_MQTT_PROTOCOL_5
+        mqtt5_alias_published(event->msg_id);
+#endif
         break;
         
     case MQTT_EVENT_DATA:
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
         ESP_LOGI(TAG, "TOPIC=%.*s\r\n", event->topic_len, event->topic);
-        ESP_LOGI(TAG, "DATA=%.*s\r\n", event->data_len, event->data);
         
         // Check if this is a relay control message
-        char topic_set[128];
-        snprintf(topic_set, sizeof(topic_set), "%s%s", MQTT_TOPIC_ROOT, MQTT_TOPIC_SET);
-        
-        if (strncmp(event->topic, topic_set, event->topic_len) == 0) {
-            // Create a null-terminated string from the data
-            char *data = malloc(event->data_len + 1);
-            if (data != NULL) {
-                memcpy(data, event->data, event->data_len);
-                data[event->data_len] = '\0';
-                
-                ESP_LOGI(TAG, "Processing relay control message: %s", data);
-                
-                // Parse and execute relay commands
-                esp_err_t ret = relay_set_multiple(data);
-                if (ret != ESP_OK) {
-                    ESP_LOGE(TAG, "Failed to process relay control message");
-                }
-                
-                free(data);
+        mqtt_client_copy_topic(offsetof(mqtt_topics_t, set), set_topic);
+        mqtt_client_copy_topic(offsetof(mqtt_topics_t, set_bin), set_bin_topic);
+        mqtt_client_copy_topic(offsetof(mqtt_topics_t, mode), mode_topic);
+        if (event->topic_len == (int)strlen(set_topic) &&
+            strncmp(event->topic, set_topic, event->topic_len) == 0) {
+            bool binary = false;
+#if CONFIG_MQTT_PROTOCOL_5
+            binary = mqtt5_is_binary_content(event);
+#endif
+            if (!binary) {
+                ESP_LOGI(TAG, "DATA=%.*s\r\n", event->data_len, event->data);
+            }
+            mqtt_client_handle_command(event, binary);
+        } else if (event->topic_len == (int)strlen(set_bin_topic) &&
+                   strncmp(event->topic, set_bin_topic, event->topic_len) == 0) {
+            mqtt_client_handle_command(event, true);
+        } else if (event->topic_len == (int)strlen(mode_topic) &&
+                   strncmp(event->topic, mode_topic, event->topic_len) == 0) {
+            ESP_LOGI(TAG, "DATA=%.*s\r\n", event->data_len, event->data);
+            if (relay_timer_apply_json(event->data, event->data_len) != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to apply relay mode");
             }
         }
         break;
@@ -74,6 +505,10 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
         break;
+
+    case MQTT_EVENT_BEFORE_CONNECT:
+        mqtt_connected_once = false;
+        break;
         
     default:
         ESP_LOGI(TAG, "Other event id:%d", event->event_id);
@@ -84,20 +519,33 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 esp_err_t mqtt_client_init(void)
 {
     ESP_LOGI(TAG, "Initializing MQTT client");
+
+    mqtt_publish_mutex = xSemaphoreCreateMutex();
+    if (mqtt_publish_mutex == NULL) {
+        ESP_LOGE(TAG, "Failed to create MQTT publish mutex");
+        return ESP_ERR_NO_MEM;
+    }
+    // Held until the client exists; GET/POST /mqtt may run before this, or wait on it
+    SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+    if (mutex == NULL) {
+        ESP_LOGE(TAG, "Failed to create MQTT config mutex");
+        return ESP_ERR_NO_MEM;
+    }
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    mqtt_config_mutex = mutex;
+
+    if (mqtt_client_load_config(&mqtt_config) != ESP_OK) {
+        ESP_LOGI(TAG, "No stored MQTT config; using defaults");
+        mqtt_client_default_config(&mqtt_config);
+    }
+    mqtt_broker_index = 0;
+    mqtt_client_build_topics(&mqtt_config);
     
-    esp_mqtt_client_config_t mqtt_cfg = {
-        .broker.address.uri = MQTT_BROKER_URL,
-        .credentials.username = MQTT_USERNAME,
-        .credentials.authentication.password = MQTT_PASSWORD,
-        .session.keepalive = 60,
-        .session.disable_clean_session = false,
-        .buffer.size = 1024,
-        .buffer.out_size = 1024,
-        .task.stack_size = 6144,
-        .task.priority = 5,
-    };
+    esp_mqtt_client_config_t mqtt_cfg;
+    mqtt_client_fill_client_config(&mqtt_cfg);
     
     mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
+    xSemaphoreGive(mqtt_config_mutex);
     if (mqtt_client == NULL) {
         ESP_LOGE(TAG, "Failed to initialize MQTT client");
         return ESP_FAIL;
@@ -109,43 +557,164 @@ esp_err_t mqtt_client_init(void)
         return err;
     }
     
-    ESP_LOGI(TAG, "MQTT client initialized successfully");
+    ESP_LOGI(TAG, "MQTT client initialized successfully (broker %s, root %s)",
+             mqtt_config.brokers[0], mqtt_config.topic_root);
     return ESP_OK;
 }
 
-esp_err_t mqtt_client_start(void)
+static esp_err_t mqtt_client_start_now(void)
 {
-    if (mqtt_client == NULL) {
-        ESP_LOGE(TAG, "MQTT client not initialized");
-        return ESP_FAIL;
-    }
-    
     esp_err_t err = esp_mqtt_client_start(mqtt_client);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to start MQTT client");
         return err;
     }
     
+    mqtt_started = true;
     ESP_LOGI(TAG, "MQTT client started");
     return ESP_OK;
 }
 
+static void mqtt_client_on_got_ip(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    if (atomic_exchange(&mqtt_start_deferred, false)) {
+        mqtt_client_start_now();
+    }
+}
+
+esp_err_t mqtt_client_start(void)
+{
+    if (mqtt_client == NULL) {
+        ESP_LOGE(TAG, "MQTT client not initialized");
+        return ESP_FAIL;
+    }
+
+    if (!mqtt_config.enabled) {
+        ESP_LOGI(TAG, "MQTT disabled by configuration");
+        return ESP_OK;
+    }
+
+    // Without an address a connect attempt only fails and then waits out the reconnect
+    // timeout; start on the next IP_EVENT_STA_GOT_IP instead
+    if (!wifi_manager_is_connected()) {
+        esp_err_t err = ESP_OK;
+        if (mqtt_got_ip_handler == NULL) {
+            err = esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, mqtt_client_on_got_ip, NULL,
+                                                      &mqtt_got_ip_handler);
+        }
+        if (err == ESP_OK) {
+            atomic_store(&mqtt_start_deferred, true);
+            if (!wifi_manager_is_connected()) {
+                ESP_LOGI(TAG, "MQTT client starts once WiFi is connected");
+                return ESP_OK;
+            }
+            // Connected meanwhile; the IP event may have got here first
+            if (!atomic_exchange(&mqtt_start_deferred, false)) {
+                return ESP_OK;
+            }
+        }
+    }
+    return mqtt_client_start_now();
+}
+
 esp_err_t mqtt_client_stop(void)
 {
     if (mqtt_client == NULL) {
         return ESP_FAIL;
     }
     
+    atomic_store(&mqtt_start_deferred, false);
     esp_err_t err = esp_mqtt_client_stop(mqtt_client);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to stop MQTT client");
         return err;
     }
     
+    mqtt_started = false;
+    mqtt_connected = false;
     ESP_LOGI(TAG, "MQTT client stopped");
     return ESP_OK;
 }
 
+bool mqtt_client_is_connected(void)
+{
+    return mqtt_connected;
+}
+
+void mqtt_client_get_config(app_mqtt_config_t *config)
+{
+    if (mqtt_config_mutex == NULL) {
+        mqtt_client_default_config(config);
+        return;
+    }
+    xSemaphoreTake(mqtt_config_mutex, portMAX_DELAY);
+    *config = mqtt_config;
+    xSemaphoreGive(mqtt_config_mutex);
+}
+
+// Validate, persist and apply a new configuration to the running client.
+// Relay state and the other control paths are untouched; only the broker session restarts.
+esp_err_t mqtt_client_set_config(const app_mqtt_config_t *config)
+{
+    if (config == NULL || config->qos > 2 || config->keepalive == 0 ||
+        (config->protocol_version != MQTT_PROTOCOL_VERSION_311 &&
+         config->protocol_version != MQTT_PROTOCOL_VERSION_5) ||
+        config->broker_count > MQTT_MAX_BROKERS ||
+        (config->enabled && config->broker_count == 0) ||
+        config->topic_root[0] == '\0' || strpbrk(config->topic_root, "+#") != NULL) {
+        ESP_LOGE(TAG, "Invalid MQTT config");
+        return ESP_ERR_INVALID_ARG;
+    }
+#if !CONFIG_MQTT_PROTOCOL_5
+    if (config->protocol_version == MQTT_PROTOCOL_VERSION_5) {
+        ESP_LOGE(TAG, "MQTT 5 support not compiled in (CONFIG_MQTT_PROTOCOL_5)");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+#endif
+    for (int i = 0; i < config->broker_count; i++) {
+        if (config->brokers[i][0] == '\0') {
+            ESP_LOGE(TAG, "Empty broker URI at index %d", i);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    if (mqtt_config_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (mqtt_client_save_config(config) != ESP_OK) {
+        ESP_LOGW(TAG, "MQTT config applied but not persisted");
+    }
+
+    if (mqtt_started) {
+        mqtt_client_stop();
+    }
+
+    xSemaphoreTake(mqtt_config_mutex, portMAX_DELAY);
+    if (mqtt_client == NULL) {
+        xSemaphoreGive(mqtt_config_mutex);
+        return ESP_ERR_INVALID_STATE;
+    }
+    mqtt_config = *config;
+    mqtt_broker_index = 0;
+    mqtt_failed_attempts = 0;
+    mqtt_client_build_topics(&mqtt_config);
+
+    esp_mqtt_client_config_t mqtt_cfg;
+    mqtt_client_fill_client_config(&mqtt_cfg);
+    esp_err_t err = esp_mqtt_set_config(mqtt_client, &mqtt_cfg);
+    xSemaphoreGive(mqtt_config_mutex);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to apply MQTT config: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    ESP_LOGI(TAG, "MQTT config applied (%d broker(s), root %s, qos %d, keepalive %d)",
+             config->broker_count, config->topic_root, config->qos, config->keepalive);
+    return mqtt_client_start();
+}
+
 esp_err_t mqtt_publish_status(const char* status_json)
 {
     if (mqtt_client == NULL) {
@@ -153,16 +722,17 @@ esp_err_t mqtt_publish_status(const char* status_json)
         return ESP_FAIL;
     }
     
-    char topic_status[128];
-    snprintf(topic_status, sizeof(topic_status), "%s%s", MQTT_TOPIC_ROOT, MQTT_TOPIC_STATUS);
+    char topic[MQTT_TOPIC_MAX_LEN];
+    int qos = mqtt_client_copy_topic(offsetof(mqtt_topics_t, status), topic);
     
-    int msg_id = esp_mqtt_client_publish(mqtt_client, topic_status, status_json, 0, 1, 0);
+    int msg_id = mqtt_client_publish_internal(topic, MQTT5_TOPIC_ALIAS_STATUS, status_json, 0,
+                                              qos, NULL, 0);
     if (msg_id == -1) {
         ESP_LOGE(TAG, "Failed to publish status");
         return ESP_FAIL;
     }
     
-    ESP_LOGI(TAG, "Published status to %s: %s", topic_status, status_json);
+    ESP_LOGI(TAG, "Published status to %s: %s", topic, status_json);
     return ESP_OK;
 }
 
@@ -173,15 +743,152 @@ esp_err_t mqtt_publish_config(const char* config_json)
         return ESP_FAIL;
     }
     
-    char topic_config[128];
-    snprintf(topic_config, sizeof(topic_config), "%s%s", MQTT_TOPIC_ROOT, MQTT_TOPIC_CONFIG);
+    char topic[MQTT_TOPIC_MAX_LEN];
+    int qos = mqtt_client_copy_topic(offsetof(mqtt_topics_t, config), topic);
     
-    int msg_id = esp_mqtt_client_publish(mqtt_client, topic_config, config_json, 0, 1, 0);
+    int msg_id = mqtt_client_publish_internal(topic, 0, config_json, 0, qos, NULL, 0);
     if (msg_id == -1) {
         ESP_LOGE(TAG, "Failed to publish config");
         return ESP_FAIL;
     }
     
-    ESP_LOGI(TAG, "Published config to %s: %s", topic_config, config_json);
+    ESP_LOGI(TAG, "Published config to %s: %s", topic, config_json);
+    return ESP_OK;
+}
+
+esp_err_t mqtt_publish_ack(const char* ack_json)
+{
+    if (mqtt_client == NULL) {
+        ESP_LOGE(TAG, "MQTT client not initialized");
+        return ESP_FAIL;
+    }
+
+    char topic[MQTT_TOPIC_MAX_LEN];
+    int qos = mqtt_client_copy_topic(offsetof(mqtt_topics_t, ack), topic);
+
+    int msg_id = mqtt_client_publish_internal(topic, MQTT5_TOPIC_ALIAS_ACK, ack_json, 0,
+                                              qos, NULL, 0);
+    if (msg_id == -1) {
+        ESP_LOGE(TAG, "Failed to publish ack");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Published ack to %s: %s", topic, ack_json);
+    return ESP_OK;
+}
+
+esp_err_t mqtt_publish_ack_binary(const uint8_t *ack, int len)
+{
+    if (mqtt_client == NULL) {
+        ESP_LOGE(TAG, "MQTT client not initialized");
+        return ESP_FAIL;
+    }
+
+    char topic[MQTT_TOPIC_MAX_LEN];
+    int qos = mqtt_client_copy_topic(offsetof(mqtt_topics_t, ack_bin), topic);
+
+    int msg_id = mqtt_client_publish_internal(topic, 0, (const char *)ack, len,
+                                              qos, NULL, 0);
+    if (msg_id == -1) {
+        ESP_LOGE(TAG, "Failed to publish binary ack");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Published %d byte ack to %s", len, topic);
     return ESP_OK;
 }
+
+esp_err_t mqtt_publish_usage(const char *usage_json)
+{
+    if (mqtt_client == NULL) {
+        ESP_LOGE(TAG, "MQTT client not initialized");
+        return ESP_FAIL;
+    }
+
+    char topic[MQTT_TOPIC_MAX_LEN];
+    int qos = mqtt_client_copy_topic(offsetof(mqtt_topics_t, usage), topic);
+
+    int msg_id = mqtt_client_publish_internal(topic, 0, usage_json, 0, qos, NULL, 0);
+    if (msg_id == -1) {
+        ESP_LOGE(TAG, "Failed to publish usage");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGD(TAG, "Published usage to %s: %s", topic, usage_json);
+    return ESP_OK;
+}
+
+esp_err_t mqtt_publish_trace(const char *trace_json)
+{
+    if (mqtt_client == NULL) {
+        ESP_LOGE(TAG, "MQTT client not initialized");
+        return ESP_FAIL;
+    }
+
+    char topic[MQTT_TOPIC_MAX_LEN];
+    int qos = mqtt_client_copy_topic(offsetof(mqtt_topics_t, trace), topic);
+
+    int msg_id = mqtt_client_publish_internal(topic, 0, trace_json, 0, qos, NULL, 0);
+    if (msg_id == -1) {
+        ESP_LOGE(TAG, "Failed to publish trace");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGD(TAG, "Published trace to %s", topic);
+    return ESP_OK;
+}
+
+esp_err_t mqtt_publish_tasks(const char *tasks_json)
+{
+    if (mqtt_client == NULL) {
+        ESP_LOGE(TAG, "MQTT client not initialized");
+        return ESP_FAIL;
+    }
+
+    char topic[MQTT_TOPIC_MAX_LEN];
+    int qos = mqtt_client_copy_topic(offsetof(mqtt_topics_t, tasks), topic);
+
+    int msg_id = mqtt_client_publish_internal(topic, 0, tasks_json, 0, qos, NULL, 0);
+    if (msg_id == -1) {
+        ESP_LOGE(TAG, "Failed to publish task stats");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGD(TAG, "Published task stats to %s", topic);
+    return ESP_OK;
+}
+
+esp_err_t mqtt_publish_heap(const char *heap_json)
+{
+    if (mqtt_client == NULL) {
+        ESP_LOGE(TAG, "MQTT client not initialized");
+        return ESP_FAIL;
+    }
+
+    char topic[MQTT_TOPIC_MAX_LEN];
+    int qos = mqtt_client_copy_topic(offsetof(mqtt_topics_t, heap), topic);
+
+    int msg_id = mqtt_client_publish_internal(topic, 0, heap_json, 0, qos, NULL, 0);
+    if (msg_id == -1) {
+        ESP_LOGE(TAG, "Failed to publish heap stats");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGD(TAG, "Published heap stats to %s: %s", topic, heap_json);
+    return ESP_OK;
+}
+
+// No log line on success here: with MQTT forwarding at debug level it would be forwarded
+// in turn
+esp_err_t mqtt_publish_log(const char *lines)
+{
+    if (mqtt_client == NULL) {
+        return ESP_FAIL;
+    }
+
+    char topic[MQTT_TOPIC_MAX_LEN];
+    mqtt_client_copy_topic(offsetof(mqtt_topics_t, log), topic);
+
+    int msg_id = mqtt_client_publish_internal(topic, 0, lines, 0, 0, NULL, 0);
+    return msg_id == -1 ? ESP_FAIL : ESP_OK;
+}
@@ -0,0 +1,369 @@
+#include "relay_command.h"
+#include "esp_log.h"
+#include "cJSON.h"
+#include "cbor_lite.h"
+#include "metrics.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "RELAY_COMMAND";
+
+// Parse {"0": true, "3": false, "id": "abc", "stagger_ms": 200}. The command is rejected as a
+// whole if any key or value is invalid, so a bad command never applies partially.
+esp_err_t relay_command_parse_json(const char *json, size_t len, relay_command_t *cmd)
+{
+    memset(cmd, 0, sizeof(*cmd));
+
+    cJSON *root = cJSON_ParseWithLength(json, len);
+    if (root == NULL) {
+        ESP_LOGE(TAG, "Failed to parse JSON data");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t ret = relay_command_parse_json_object(root, cmd);
+    cJSON_Delete(root);
+    return ret;
+}
+
+// Same as relay_command_parse_json() for an already parsed object, e.g. one nested in a
+// larger request
+esp_err_t relay_command_parse_json_object(const cJSON *object, relay_command_t *cmd)
+{
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->stagger_ms = RELAY_STAGGER_USE_DEFAULT;
+    if (!cJSON_IsObject(object)) {
+        ESP_LOGE(TAG, "Expected JSON object of relay states");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t ret = ESP_OK;
+    for (cJSON *item = object->child; item != NULL; item = item->next) {
+        if (item->string == NULL) {
+            continue;
+        }
+        if (strcmp(item->string, "id") == 0) {
+            if (cJSON_IsString(item)) {
+                strncpy(cmd->id, item->valuestring, sizeof(cmd->id) - 1);
+            } else if (cJSON_IsNumber(item) && item->valuedouble >= 0 && item->valuedouble <= RELAY_CMD_ID_MAX_NUMBER &&
+                       item->valuedouble == (double)(uint64_t)item->valuedouble) {
+                snprintf(cmd->id, sizeof(cmd->id), "%llu", (unsigned long long)item->valuedouble);
+                cmd->id_is_number = true;
+            } else {
+                // Still acknowledged, as an error under the placeholder ID the acks use
+                ESP_LOGE(TAG, "Invalid command id; expected string or non-negative integer");
+                strcpy(cmd->id, "?");
+                cmd->id_is_number = false;
+                ret = ESP_ERR_INVALID_ARG;
+            }
+            continue;
+        }
+        if (strcmp(item->string, "stagger_ms") == 0) {
+            if (cJSON_IsNumber(item) && item->valuedouble >= 0 && item->valuedouble <= RELAY_STAGGER_MAX_MS) {
+                cmd->stagger_ms = (int32_t)item->valuedouble;
+            } else {
+                ESP_LOGE(TAG, "Invalid stagger_ms; expected 0..%d", RELAY_STAGGER_MAX_MS);
+                ret = ESP_ERR_INVALID_ARG;
+            }
+            continue;
+        }
+        // Keys are "0".."5"
+        char *endptr = NULL;
+        long relay_id_long = strtol(item->string, &endptr, 10);
+        if (endptr == item->string || *endptr != '\0' || relay_id_long < 0 || relay_id_long >= NUM_RELAYS) {
+            ESP_LOGE(TAG, "Invalid relay key: '%s'", item->string);
+            ret = ESP_ERR_INVALID_ARG;
+            continue;
+        }
+        int relay_id = (int)relay_id_long;
+        if (!cJSON_IsBool(item)) {
+            ESP_LOGE(TAG, "Invalid state for relay %d; expected boolean", relay_id);
+            ret = ESP_ERR_INVALID_ARG;
+            continue;
+        }
+        if (cJSON_IsTrue(item)) {
+            cmd->set_mask |= 1u << relay_id;
+            cmd->clear_mask &= ~(1u << relay_id);
+        } else {
+            cmd->clear_mask |= 1u << relay_id;
+            cmd->set_mask &= ~(1u << relay_id);
+        }
+    }
+    return ret;
+}
+
+static esp_err_t relay_command_parse_frame(const uint8_t *data, size_t len, relay_command_t *cmd)
+{
+    if (len < 2 || (data[0] >> 4) != RELAY_FRAME_VERSION) {
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    switch (data[0] & 0x0f) {
+    case RELAY_FRAME_OP_WRITE:
+        if (len != 2) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        cmd->set_mask = data[1];
+        cmd->clear_mask = RELAY_ALL_MASK & ~data[1];
+        break;
+    case RELAY_FRAME_OP_SET_CLEAR:
+    case RELAY_FRAME_OP_SET_CLEAR_ID:
+        if (len != ((data[0] & 0x0f) == RELAY_FRAME_OP_SET_CLEAR ? 3 : 4)) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        cmd->set_mask = data[1];
+        cmd->clear_mask = data[2];
+        if (len == 4 && cmd->id[0] == '\0') {
+            snprintf(cmd->id, sizeof(cmd->id), "%u", data[3]);
+            cmd->id_is_number = true;
+        }
+        break;
+    default:
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    return ESP_OK;
+}
+
+// Map key, either a small integer or the equivalent text key
+static int relay_command_cbor_key(cbor_lite_reader_t *r)
+{
+    static const char *const names[] = { "v", "s", "c", "id", "f", "st" };
+    uint8_t major;
+    if (cbor_lite_peek_major(r, &major) != ESP_OK) {
+        return -1;
+    }
+    if (major == CBOR_MAJOR_UINT) {
+        uint64_t key;
+        if (cbor_lite_read_uint(r, &key) != ESP_OK) {
+            return -1;
+        }
+        return key < sizeof(names) / sizeof(names[0]) ? (int)key : -2;
+    }
+    const char *key;
+    size_t key_len;
+    if (cbor_lite_read_text(r, &key, &key_len) != ESP_OK) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == key_len && memcmp(names[i], key, key_len) == 0) {
+            return (int)i;
+        }
+    }
+    return -2; // Unknown key; value is skipped
+}
+
+// CBOR envelope: {"v": 1, "s": set, "c": clear, "id": uint|text} or {"f": h'frame', "id": ...},
+// optionally with "st": stagger_ms; keys may also be given as integers 0..5 in that order
+static esp_err_t relay_command_parse_cbor(const uint8_t *data, size_t len, relay_command_t *cmd)
+{
+    cbor_lite_reader_t r;
+    size_t pairs;
+    cbor_lite_reader_init(&r, data, len);
+    if (cbor_lite_read_map(&r, &pairs) != ESP_OK) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const uint8_t *frame = NULL;
+    size_t frame_len = 0;
+    for (size_t i = 0; i < pairs; i++) {
+        int key = relay_command_cbor_key(&r);
+        uint64_t value;
+        esp_err_t err = ESP_OK;
+
+        switch (key) {
+        case 0: // Version
+            err = cbor_lite_read_uint(&r, &value);
+            if (err == ESP_OK && value != RELAY_FRAME_VERSION) {
+                return ESP_ERR_INVALID_VERSION;
+            }
+            break;
+        case 1: // Set mask
+        case 2: // Clear mask
+            err = cbor_lite_read_uint(&r, &value);
+            if (err == ESP_OK && value > RELAY_ALL_MASK) {
+                err = ESP_ERR_INVALID_ARG;
+            }
+            if (err == ESP_OK) {
+                *(key == 1 ? &cmd->set_mask : &cmd->clear_mask) = (uint32_t)value;
+            }
+            break;
+        case 3: { // Correlation ID
+            uint8_t major = 0;
+            cbor_lite_peek_major(&r, &major);
+            if (major == CBOR_MAJOR_UINT) {
+                err = cbor_lite_read_uint(&r, &value);
+                if (err == ESP_OK) {
+                    snprintf(cmd->id, sizeof(cmd->id), "%llu", (unsigned long long)value);
+                    cmd->id_is_number = true;
+                }
+            } else {
+                const char *id;
+                size_t id_len;
+                err = cbor_lite_read_text(&r, &id, &id_len);
+                if (err == ESP_OK && id_len >= sizeof(cmd->id)) {
+                    err = ESP_ERR_INVALID_SIZE;
+                }
+                if (err == ESP_OK) {
+                    memcpy(cmd->id, id, id_len);
+                    cmd->id[id_len] = '\0';
+                    cmd->id_is_number = false;
+                }
+            }
+            break;
+        }
+        case 4: // Embedded frame
+            err = cbor_lite_read_bytes(&r, &frame, &frame_len);
+            break;
+        case 5: // ON stagger
+            err = cbor_lite_read_uint(&r, &value);
+            if (err == ESP_OK && value > RELAY_STAGGER_MAX_MS) {
+                err = ESP_ERR_INVALID_ARG;
+            }
+            if (err == ESP_OK) {
+                cmd->stagger_ms = (int32_t)value;
+            }
+            break;
+        case -2:
+            err = cbor_lite_skip(&r);
+            break;
+        default:
+            err = ESP_ERR_INVALID_ARG;
+            break;
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    if (frame != NULL) {
+        return relay_command_parse_frame(frame, frame_len, cmd);
+    }
+    return ESP_OK;
+}
+
+// Decode a binary command without allocating: a CBOR map (first byte 0xa0..0xbb) or a raw frame.
+// Bits present in both set and clear are rejected.
+esp_err_t relay_command_parse_binary(const uint8_t *data, size_t len, relay_command_t *cmd)
+{
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->stagger_ms = RELAY_STAGGER_USE_DEFAULT;
+    if (data == NULL || len == 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t ret = ((data[0] >> 5) == CBOR_MAJOR_MAP) ?
+                    relay_command_parse_cbor(data, len, cmd) :
+                    relay_command_parse_frame(data, len, cmd);
+    if (ret == ESP_OK && (((cmd->set_mask | cmd->clear_mask) & ~RELAY_ALL_MASK) != 0 ||
+                          (cmd->set_mask & cmd->clear_mask) != 0)) {
+        ret = ESP_ERR_INVALID_ARG;
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Invalid binary command (%u bytes): %s", (unsigned)len, esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+// Apply a decoded command through the relay commit path and fill in the ack
+esp_err_t relay_command_execute(const relay_command_t *cmd, relay_source_t source, relay_ack_t *ack)
+{
+    relay_commit_info_t info = {0};
+    esp_err_t ret = relay_commit_staggered(cmd->set_mask, cmd->clear_mask, source, cmd->stagger_ms, &info);
+
+    if (ack != NULL) {
+        ack->result = ret;
+        ack->mask = (ret == ESP_OK) ? info.mask : relay_get_mask();
+        ack->applied_at_us = (ret == ESP_OK) ? info.applied_at_us : 0;
+        ack->deferred = (ret == ESP_OK) ? info.deferred : 0;
+    }
+
+    if (ret == ESP_OK && cmd->received_us != 0) {
+        metrics_record_command(source, info.applied_at_us - cmd->received_us);
+    }
+    if (ret == ESP_OK) {
+        relay_publish_status();
+    }
+    return ret;
+}
+
+// Fill in the ack for a command that was not applied (e.g. failed to decode)
+void relay_command_reject(esp_err_t result, relay_ack_t *ack)
+{
+    ack->result = result;
+    ack->mask = relay_get_mask();
+    ack->applied_at_us = 0;
+    ack->deferred = 0;
+}
+
+int relay_command_format_ack_json(const relay_command_t *cmd, const relay_ack_t *ack, char *buf, size_t buf_size)
+{
+    char id_field[RELAY_CMD_ID_MAX_LEN + 12] = "";
+    if (cmd != NULL && cmd->id[0] != '\0') {
+        if (cmd->id_is_number) {
+            snprintf(id_field, sizeof(id_field), "\"id\":%s,", cmd->id);
+        } else {
+            // IDs with characters that need escaping are not echoed verbatim
+            bool plain = true;
+            for (const char *c = cmd->id; *c != '\0'; c++) {
+                if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) {
+                    plain = false;
+                    break;
+                }
+            }
+            snprintf(id_field, sizeof(id_field), "\"id\":\"%s\",", plain ? cmd->id : "?");
+        }
+    }
+
+    if (ack->result == ESP_OK && ack->deferred != 0) {
+        return snprintf(buf, buf_size, "{%s\"ok\":true,\"mask\":%u,\"applied_at_us\":%lld,\"deferred\":%u}",
+                        id_field, (unsigned)ack->mask, (long long)ack->applied_at_us, (unsigned)ack->deferred);
+    }
+    if (ack->result == ESP_OK) {
+        return snprintf(buf, buf_size, "{%s\"ok\":true,\"mask\":%u,\"applied_at_us\":%lld}",
+                        id_field, (unsigned)ack->mask, (long long)ack->applied_at_us);
+    }
+    return snprintf(buf, buf_size, "{%s\"ok\":false,\"error\":\"%s\",\"mask\":%u}",
+                    id_field, esp_err_to_name(ack->result), (unsigned)ack->mask);
+}
+
+// CBOR ack: {"id": ..., "ok": bool, "m": mask, "t": applied_at_us[, "d": deferred]} or
+// {..., "e": error name}
+int relay_command_format_ack_cbor(const relay_command_t *cmd, const relay_ack_t *ack, uint8_t *buf, size_t buf_size)
+{
+    cbor_lite_writer_t w;
+    bool has_id = cmd != NULL && cmd->id[0] != '\0';
+
+    cbor_lite_writer_init(&w, buf, buf_size);
+    bool has_deferred = ack->result == ESP_OK && ack->deferred != 0;
+    cbor_lite_write_map(&w, 3 + (has_id ? 1 : 0) + (has_deferred ? 1 : 0));
+    if (has_id) {
+        cbor_lite_write_text(&w, "id");
+        // Only an ID that is all digits goes out as a uint; anything else is echoed as text
+        char *end = NULL;
+        errno = 0;
+        unsigned long long value = cmd->id_is_number && isdigit((unsigned char)cmd->id[0]) ?
+                                   strtoull(cmd->id, &end, 10) : 0;
+        if (end != NULL && *end == '\0' && errno == 0) {
+            cbor_lite_write_uint(&w, value);
+        } else {
+            cbor_lite_write_text(&w, cmd->id);
+        }
+    }
+    cbor_lite_write_text(&w, "ok");
+    cbor_lite_write_bool(&w, ack->result == ESP_OK);
+    cbor_lite_write_text(&w, "m");
+    cbor_lite_write_uint(&w, ack->mask);
+    if (ack->result == ESP_OK) {
+        cbor_lite_write_text(&w, "t");
+        cbor_lite_write_int(&w, ack->applied_at_us);
+        if (has_deferred) {
+            cbor_lite_write_text(&w, "d");
+            cbor_lite_write_uint(&w, ack->deferred);
+        }
+    } else {
+        cbor_lite_write_text(&w, "e");
+        cbor_lite_write_text(&w, esp_err_to_name(ack->result));
+    }
+    return cbor_lite_writer_length(&w);
+}
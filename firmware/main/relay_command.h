@@ -0,0 +1,56 @@
+#ifndef RELAY_COMMAND_H
+#define RELAY_COMMAND_H
+
+#include "esp_err.h"
+#include "cJSON.h"
+#include "relay_control.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Maximum length of a command correlation ID (including terminator)
+#define RELAY_CMD_ID_MAX_LEN 40
+// Largest numeric JSON ID: 2^53 - 1, the last integer a JSON number holds exactly
+#define RELAY_CMD_ID_MAX_NUMBER 9007199254740991.0
+
+// Compact binary frame, byte 0 = (version << 4) | op, bit i of a mask = relay i:
+//   op 0: [hdr][mask]                absolute state (relays not in mask are turned off)
+//   op 1: [hdr][set][clear]
+//   op 2: [hdr][set][clear][id]      8-bit correlation ID
+// A frame may also be wrapped in a CBOR map envelope; see relay_command_parse_binary().
+#define RELAY_FRAME_VERSION 1
+#define RELAY_FRAME_OP_WRITE 0
+#define RELAY_FRAME_OP_SET_CLEAR 1
+#define RELAY_FRAME_OP_SET_CLEAR_ID 2
+
+#define RELAY_CONTENT_TYPE_CBOR "application/cbor"
+#define RELAY_CONTENT_TYPE_FRAME "application/octet-stream"
+
+// A decoded relay command, independent of the wire format it arrived in
+typedef struct {
+    uint32_t set_mask;                  // Relays to turn on
+    uint32_t clear_mask;                // Relays to turn off
+    char id[RELAY_CMD_ID_MAX_LEN];      // Optional correlation ID, empty when absent
+    bool id_is_number;                  // Echo the ID as a JSON number
+    int32_t stagger_ms;                 // ON spacing, RELAY_STAGGER_USE_DEFAULT when not given
+    int64_t received_us;                // esp_timer_get_time() on arrival, 0 if unknown (for metrics)
+} relay_command_t;
+
+// Outcome of a command, reported back to the sender
+typedef struct {
+    esp_err_t result;
+    uint32_t mask;                      // Relay bitmask after the command
+    int64_t applied_at_us;              // esp_timer_get_time() of the GPIO commit, 0 if not applied
+    uint32_t deferred;                  // ONs held back by a relay rule or staggering
+} relay_ack_t;
+
+// Function declarations
+esp_err_t relay_command_parse_json(const char *json, size_t len, relay_command_t *cmd);
+esp_err_t relay_command_parse_json_object(const cJSON *object, relay_command_t *cmd);
+esp_err_t relay_command_parse_binary(const uint8_t *data, size_t len, relay_command_t *cmd);
+esp_err_t relay_command_execute(const relay_command_t *cmd, relay_source_t source, relay_ack_t *ack);
+void relay_command_reject(esp_err_t result, relay_ack_t *ack);
+int relay_command_format_ack_json(const relay_command_t *cmd, const relay_ack_t *ack, char *buf, size_t buf_size);
+int relay_command_format_ack_cbor(const relay_command_t *cmd, const relay_ack_t *ack, uint8_t *buf, size_t buf_size);
+
+#endif // RELAY_COMMAND_H
@@ -3,10 +3,24 @@
 #include "driver/gpio.h"
 #include "cJSON.h"
 #include "app_mqtt.h"
+#include "relay_command.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "relay_rules.h"
+#include "metrics.h"
+#include "trace.h"
+#include "boot_timeline.h"
 #include <stdlib.h>
+#include <string.h>
 
 static const char *TAG = "RELAY_CONTROL";
 
+#define NVS_NAMESPACE "relay"
+#define NVS_KEY_STAGGER "stagger_ms"
+
 // Relay GPIO pins array
 const int relay_gpios[NUM_RELAYS] = {
     RELAY_1_GPIO,
@@ -20,6 +34,94 @@ const int relay_gpios[NUM_RELAYS] = {
 // Current relay states
 int relay_states[NUM_RELAYS] = {0};
 
+// Guards relay_states/relay_mask so a multi-relay commit is applied as one unit
+static portMUX_TYPE relay_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t relay_mask = 0;
+
+static TaskHandle_t relay_status_task_handle = NULL;
+
+// Usage counters, guarded by relay_lock. On-time is accumulated when a relay turns off;
+// relay_on_since_us holds the start of the current ON period.
+static uint32_t relay_cycles[NUM_RELAYS];
+static uint64_t relay_on_time_us[NUM_RELAYS];
+static int64_t relay_on_since_us[NUM_RELAYS];
+
+static uint32_t relay_stagger_default_ms = RELAY_STAGGER_DEFAULT_MS;
+static int64_t relay_last_on_us = INT64_MIN / 2;            // Latest ON transition, guarded by relay_lock
+
+static relay_change_listener_t relay_listeners[RELAY_MAX_CHANGE_LISTENERS];
+static volatile int relay_listener_count = 0;
+
+// Publishes status whenever notified; several requests while busy collapse into one publish
+static void relay_status_task(void *arg)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        relay_publish_status();
+    }
+}
+
+// Deferred ON transitions (interlock dead-time, sequence delays): applied by
+// relay_pending_timer through relay_commit() again, so every rule is re-checked then
+static uint32_t relay_pending_on = 0;                   // Guarded by relay_lock
+static int64_t relay_pending_due_us[NUM_RELAYS];
+static uint8_t relay_pending_source[NUM_RELAYS];
+static esp_timer_handle_t relay_pending_timer = NULL;
+static SemaphoreHandle_t relay_pending_mutex = NULL;    // Serializes re-arming the timer
+
+static void relay_pending_rearm(void)
+{
+    xSemaphoreTake(relay_pending_mutex, portMAX_DELAY);
+    portENTER_CRITICAL(&relay_lock);
+    int64_t earliest = INT64_MAX;
+    for (uint32_t bits = relay_pending_on; bits != 0; bits &= bits - 1) {
+        int i = __builtin_ctz(bits);
+        if (relay_pending_due_us[i] < earliest) {
+            earliest = relay_pending_due_us[i];
+        }
+    }
+    portEXIT_CRITICAL(&relay_lock);
+
+    esp_timer_stop(relay_pending_timer);
+    if (earliest != INT64_MAX) {
+        int64_t delay = earliest - esp_timer_get_time();
+        esp_timer_start_once(relay_pending_timer, delay > 0 ? (uint64_t)delay : 0);
+    }
+    xSemaphoreGive(relay_pending_mutex);
+}
+
+static void relay_pending_callback(void *arg)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t due_by_source[RELAY_SOURCE_COUNT] = {0};
+
+    portENTER_CRITICAL(&relay_lock);
+    for (uint32_t bits = relay_pending_on; bits != 0; bits &= bits - 1) {
+        int i = __builtin_ctz(bits);
+        if (relay_pending_due_us[i] <= now) {
+            due_by_source[relay_pending_source[i]] |= 1u << i;
+            relay_pending_on &= ~(1u << i);
+        }
+    }
+    portEXIT_CRITICAL(&relay_lock);
+
+    for (int source = 0; source < RELAY_SOURCE_COUNT; source++) {
+        if (due_by_source[source] != 0) {
+            relay_commit_info_t info;
+            uint32_t previous_mask = relay_get_mask();
+            // Already spaced when deferred; staggering again would push them back twice
+            esp_err_t ret = relay_commit_staggered(due_by_source[source], 0, (relay_source_t)source, 0, &info);
+            if (ret != ESP_OK) {
+                ESP_LOGW(TAG, "Deferred relay ON 0x%02x dropped: %s", (unsigned)due_by_source[source],
+                         esp_err_to_name(ret));
+            } else if (info.mask != previous_mask) {
+                relay_publish_status_async();
+            }
+        }
+    }
+    relay_pending_rearm();
+}
+
 esp_err_t relay_control_init(void)
 {
     ESP_LOGI(TAG, "Initializing relay control");
@@ -43,16 +145,51 @@ esp_err_t relay_control_init(void)
         // Initialize relay to OFF state
         gpio_set_level(relay_gpios[i], RELAY_OFF);
         relay_states[i] = RELAY_OFF;
+        relay_mask &= ~(1u << i);
         
         ESP_LOGI(TAG, "Relay %d initialized on GPIO %d", i, relay_gpios[i]);
     }
     
+    esp_err_t ret = relay_rules_init();
+    if (ret != ESP_OK) {
+        // Refuse to run with a broken safety table rather than without rules
+        ESP_LOGE(TAG, "Relay rules invalid; relays stay off");
+        return ret;
+    }
+    nvs_handle_t nvs_handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle) == ESP_OK) {
+        uint32_t stagger_ms;
+        if (nvs_get_u32(nvs_handle, NVS_KEY_STAGGER, &stagger_ms) == ESP_OK && stagger_ms <= RELAY_STAGGER_MAX_MS) {
+            relay_stagger_default_ms = stagger_ms;
+        }
+        nvs_close(nvs_handle);
+    }
+    if (relay_stagger_default_ms > 0) {
+        ESP_LOGI(TAG, "Relay ONs staggered by %u ms", (unsigned)relay_stagger_default_ms);
+    }
+
+    relay_pending_mutex = xSemaphoreCreateMutex();
+    const esp_timer_create_args_t pending_args = {
+        .callback = relay_pending_callback,
+        .name = "relay_pending",
+    };
+    if (relay_pending_mutex == NULL || esp_timer_create(&pending_args, &relay_pending_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create deferred commit timer");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreate(relay_status_task, "relay_status", RELAY_STATUS_TASK_STACK_SIZE, NULL,
+                    RELAY_STATUS_TASK_PRIORITY, &relay_status_task_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create relay status task");
+    }
+
     ESP_LOGI(TAG, "Relay control initialized successfully");
     return ESP_OK;
 }
 
 esp_err_t relay_set_state(int relay_id, bool state)
 {
+    TRACE_SCOPE(TRACE_RELAY_SET_STATE);
     if (relay_id < 0 || relay_id >= NUM_RELAYS) {
         ESP_LOGE(TAG, "Invalid relay ID: %d", relay_id);
         return ESP_ERR_INVALID_ARG;
@@ -60,72 +197,283 @@ esp_err_t relay_set_state(int relay_id, bool state)
     
     ESP_LOGI(TAG, "Setting relay %d to %s", relay_id, state ? "ON" : "OFF");
     
-    gpio_set_level(relay_gpios[relay_id], state ? RELAY_ON : RELAY_OFF);
-    relay_states[relay_id] = state ? RELAY_ON : RELAY_OFF;
-    
-    return ESP_OK;
+    uint32_t bit = 1u << relay_id;
+    return relay_commit(state ? bit : 0, state ? 0 : bit, RELAY_SOURCE_API, NULL);
 }
 
-bool relay_get_state(int relay_id)
+// Single commit path for all relay changes: bits in set_mask are turned on, bits in
+// clear_mask off (set wins if both), and every changed GPIO is written under one lock.
+// The rules in relay_rules.h are checked in the same critical section: a command that
+// violates one is refused as a whole (ESP_ERR_INVALID_STATE, offending bits in
+// info->rejected), and ONs that must wait are deferred and reported in info->deferred.
+esp_err_t relay_commit(uint32_t set_mask, uint32_t clear_mask, relay_source_t source,
+                       relay_commit_info_t *info)
 {
-    if (relay_id < 0 || relay_id >= NUM_RELAYS) {
-        ESP_LOGE(TAG, "Invalid relay ID: %d", relay_id);
-        return false;
-    }
-    
-    return relay_states[relay_id] == RELAY_ON;
+    return relay_commit_staggered(set_mask, clear_mask, source, RELAY_STAGGER_USE_DEFAULT, info);
 }
 
-esp_err_t relay_set_multiple(const char* json_data)
+// relay_commit() with an explicit ON spacing; 0 switches everything at once and
+// RELAY_STAGGER_USE_DEFAULT takes the device default
+esp_err_t relay_commit_staggered(uint32_t set_mask, uint32_t clear_mask, relay_source_t source,
+                                 int32_t stagger_ms, relay_commit_info_t *info)
 {
-    cJSON *json = cJSON_Parse(json_data);
-    if (json == NULL) {
-        ESP_LOGE(TAG, "Failed to parse JSON data");
+    TRACE_SCOPE(TRACE_RELAY_COMMIT);
+    if (stagger_ms == RELAY_STAGGER_USE_DEFAULT) {
+        stagger_ms = (int32_t)relay_stagger_default_ms;
+    } else if (stagger_ms < 0 || stagger_ms > RELAY_STAGGER_MAX_MS) {
+        ESP_LOGE(TAG, "Invalid stagger %d ms", (int)stagger_ms);
+        metrics_record_commit(source, ESP_ERR_INVALID_ARG);
         return ESP_ERR_INVALID_ARG;
     }
-    if (!cJSON_IsObject(json)) {
-        ESP_LOGE(TAG, "Expected JSON object of relay states");
-        cJSON_Delete(json);
+    int64_t stagger_us = (int64_t)stagger_ms * 1000;
+
+    if (((set_mask | clear_mask) & ~RELAY_ALL_MASK) != 0) {
+        ESP_LOGE(TAG, "Invalid relay mask set=0x%02x clear=0x%02x", (unsigned)set_mask, (unsigned)clear_mask);
+        metrics_record_commit(source, ESP_ERR_INVALID_ARG);
         return ESP_ERR_INVALID_ARG;
     }
 
-    esp_err_t ret = ESP_OK;
-    for (cJSON *item = json->child; item != NULL; item = item->next) {
-        if (item->string == NULL) {
-            continue;
+    relay_rules_eval_t eval = {
+        .set_mask = set_mask,
+        .clear_mask = clear_mask,
+    };
+
+    portENTER_CRITICAL(&relay_lock);
+    int64_t now = esp_timer_get_time();
+    relay_rules_evaluate(relay_mask, now, &eval);
+    if (eval.rejected != 0) {
+        uint32_t mask = relay_mask;
+        portEXIT_CRITICAL(&relay_lock);
+        ESP_LOGW(TAG, "Commit from %s refused by relay rules: set=0x%02x clear=0x%02x conflicts=0x%02x",
+                 relay_source_name(source), (unsigned)set_mask, (unsigned)clear_mask, (unsigned)eval.rejected);
+        if (info != NULL) {
+            info->mask = mask;
+            info->applied_at_us = 0;
+            info->rejected = eval.rejected;
+            info->deferred = 0;
         }
-        // Keys are "0".."5"
-        char *endptr = NULL;
-        long relay_id_long = strtol(item->string, &endptr, 10);
-        if (endptr == item->string || relay_id_long < 0 || relay_id_long >= NUM_RELAYS) {
-            ESP_LOGE(TAG, "Invalid relay key: '%s'", item->string);
-            ret = ESP_ERR_INVALID_ARG;
-            continue;
+        metrics_record_commit(source, ESP_ERR_INVALID_STATE);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // A newer command for a relay supersedes its deferred ON
+    relay_pending_on &= ~(set_mask | clear_mask);
+
+    // One ON per stagger slot, prerequisites before their dependents, after the last ON and
+    // any ON still pending, so back-to-back commands are spaced as well
+    if (stagger_us > 0) {
+        int64_t last_on_us = relay_last_on_us;
+        for (uint32_t bits = relay_pending_on; bits != 0; bits &= bits - 1) {
+            int i = __builtin_ctz(bits);
+            if (relay_pending_due_us[i] > last_on_us) {
+                last_on_us = relay_pending_due_us[i];
+            }
         }
-        int relay_id = (int)relay_id_long;
-        if (!cJSON_IsBool(item)) {
-            ESP_LOGE(TAG, "Invalid state for relay %d; expected boolean", relay_id);
-            ret = ESP_ERR_INVALID_ARG;
-            continue;
+        relay_rules_stagger(&eval, relay_mask, now, last_on_us, stagger_us);
+    }
+
+    uint32_t new_mask = (relay_mask & ~eval.clear_mask) | eval.set_mask;
+    uint32_t changed = relay_mask ^ new_mask;
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        if (changed & (1u << i)) {
+            int level = (new_mask & (1u << i)) ? RELAY_ON : RELAY_OFF;
+            gpio_set_level(relay_gpios[i], level);
+            relay_states[i] = level;
         }
-        bool state = cJSON_IsTrue(item);
-        esp_err_t set_ret = relay_set_state(relay_id, state);
-        if (set_ret != ESP_OK) {
-            ret = set_ret;
+    }
+    relay_mask = new_mask;
+    int64_t applied_at = esp_timer_get_time();
+    for (uint32_t bits = changed; bits != 0; bits &= bits - 1) {
+        int i = __builtin_ctz(bits);
+        if (new_mask & (1u << i)) {
+            relay_cycles[i]++;
+            relay_on_since_us[i] = applied_at;
+        } else {
+            relay_on_time_us[i] += applied_at - relay_on_since_us[i];
         }
     }
+    relay_rules_record(new_mask ^ changed, new_mask, applied_at);
+    if ((changed & new_mask) != 0) {
+        relay_last_on_us = applied_at;
+    }
+    for (uint32_t bits = eval.deferred; bits != 0; bits &= bits - 1) {
+        int i = __builtin_ctz(bits);
+        relay_pending_due_us[i] = eval.defer_until_us[i];
+        relay_pending_source[i] = source;
+    }
+    relay_pending_on |= eval.deferred;
+    portEXIT_CRITICAL(&relay_lock);
 
-    cJSON_Delete(json);
+    ESP_LOGD(TAG, "Commit from %s: mask 0x%02x -> 0x%02x", relay_source_name(source),
+             (unsigned)(new_mask ^ changed), (unsigned)new_mask);
+    metrics_record_commit(source, ESP_OK);
+    if (source != RELAY_SOURCE_BOOT && source != RELAY_SOURCE_TIMER && source != RELAY_SOURCE_SCHEDULE) {
+        boot_timeline_milestone(BOOT_TIMELINE_FIRST_COMMAND);
+    }
 
-    if (ret == ESP_OK) {
-        relay_publish_status();
+    if (info != NULL) {
+        info->mask = new_mask;
+        info->applied_at_us = applied_at;
+        info->rejected = 0;
+        info->deferred = eval.deferred;
+    }
+
+    if (eval.deferred != 0) {
+        relay_pending_rearm();
+    }
+    if (changed != 0) {
+        for (int i = 0; i < relay_listener_count; i++) {
+            relay_listeners[i](new_mask, changed, source);
+        }
     }
+    return ESP_OK;
+}
 
+void relay_get_usage(relay_usage_t usage[NUM_RELAYS])
+{
+    portENTER_CRITICAL(&relay_lock);
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        uint64_t on_us = relay_on_time_us[i];
+        if (relay_mask & (1u << i)) {
+            on_us += now - relay_on_since_us[i];
+        }
+        usage[i].cycles = relay_cycles[i];
+        usage[i].on_time_ms = on_us / 1000;
+    }
+    portEXIT_CRITICAL(&relay_lock);
+}
+
+// Counters from the last checkpoint; call once at boot, before the first commit
+void relay_restore_usage(const relay_usage_t usage[NUM_RELAYS])
+{
+    portENTER_CRITICAL(&relay_lock);
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        relay_cycles[i] = usage[i].cycles;
+        relay_on_time_us[i] = usage[i].on_time_ms * 1000;
+    }
+    portEXIT_CRITICAL(&relay_lock);
+}
+
+esp_err_t relay_set_stagger_default(uint32_t stagger_ms)
+{
+    if (stagger_ms > RELAY_STAGGER_MAX_MS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return err;
+    }
+    err = nvs_set_u32(nvs_handle, NVS_KEY_STAGGER, stagger_ms);
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save stagger setting: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    relay_stagger_default_ms = stagger_ms;
+    ESP_LOGI(TAG, "Default ON stagger set to %u ms", (unsigned)stagger_ms);
+    return ESP_OK;
+}
+
+uint32_t relay_get_stagger_default(void)
+{
+    return relay_stagger_default_ms;
+}
+
+// Listeners are registered during init and never removed
+esp_err_t relay_add_change_listener(relay_change_listener_t listener)
+{
+    esp_err_t ret = ESP_OK;
+
+    portENTER_CRITICAL(&relay_lock);
+    if (relay_listener_count >= RELAY_MAX_CHANGE_LISTENERS) {
+        ret = ESP_ERR_NO_MEM;
+    } else {
+        relay_listeners[relay_listener_count] = listener;
+        relay_listener_count++;
+    }
+    portEXIT_CRITICAL(&relay_lock);
     return ret;
 }
 
+const char *relay_source_name(relay_source_t source)
+{
+    switch (source) {
+    case RELAY_SOURCE_BOOT:
+        return "boot";
+    case RELAY_SOURCE_API:
+        return "api";
+    case RELAY_SOURCE_HTTP:
+        return "http";
+    case RELAY_SOURCE_MQTT:
+        return "mqtt";
+    case RELAY_SOURCE_UDP:
+        return "udp";
+    case RELAY_SOURCE_MULTICAST:
+        return "multicast";
+    case RELAY_SOURCE_MODBUS:
+        return "modbus";
+    case RELAY_SOURCE_COAP:
+        return "coap";
+    case RELAY_SOURCE_SCHEDULE:
+        return "schedule";
+    case RELAY_SOURCE_TIMER:
+        return "timer";
+    default:
+        return "unknown";
+    }
+}
+
+bool relay_get_state(int relay_id)
+{
+    if (relay_id < 0 || relay_id >= NUM_RELAYS) {
+        ESP_LOGE(TAG, "Invalid relay ID: %d", relay_id);
+        return false;
+    }
+    
+    return relay_states[relay_id] == RELAY_ON;
+}
+
+// Current relay states as a bitmask, bit i = relay i
+uint32_t relay_get_mask(void)
+{
+    return relay_mask;
+}
+
+// Deferred ONs waiting for a rule's dead-time or delay; due_us may be NULL
+uint32_t relay_get_pending(int64_t due_us[NUM_RELAYS])
+{
+    portENTER_CRITICAL(&relay_lock);
+    uint32_t pending = relay_pending_on;
+    if (due_us != NULL) {
+        memcpy(due_us, relay_pending_due_us, sizeof(relay_pending_due_us));
+    }
+    portEXIT_CRITICAL(&relay_lock);
+    return pending;
+}
+
+esp_err_t relay_set_multiple(const char* json_data)
+{
+    TRACE_SCOPE(TRACE_RELAY_SET_MULTIPLE);
+    relay_command_t cmd;
+    esp_err_t ret = relay_command_parse_json(json_data, strlen(json_data), &cmd);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    return relay_command_execute(&cmd, RELAY_SOURCE_API, NULL);
+}
+
 void relay_publish_status(void)
 {
+    TRACE_SCOPE(TRACE_RELAY_PUBLISH_STATUS);
     cJSON *json = cJSON_CreateObject();
     if (json == NULL) {
         ESP_LOGE(TAG, "Failed to create JSON object for status");
@@ -148,3 +496,33 @@ void relay_publish_status(void)
     
     cJSON_Delete(json);
 }
+
+// {"cycles":[...],"on_time_s":[...]}, one entry per relay
+void relay_publish_usage(void)
+{
+    relay_usage_t usage[NUM_RELAYS];
+    relay_get_usage(usage);
+
+    char buf[32 + NUM_RELAYS * 24];
+    int len = snprintf(buf, sizeof(buf), "{\"cycles\":[");
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%lu", i ? "," : "", (unsigned long)usage[i].cycles);
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "],\"on_time_s\":[");
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%llu", i ? "," : "",
+                        (unsigned long long)(usage[i].on_time_ms / 1000));
+    }
+    snprintf(buf + len, sizeof(buf) - len, "]}");
+    mqtt_publish_usage(buf);
+}
+
+// Queue a status publish without blocking the caller on cJSON or the MQTT client
+void relay_publish_status_async(void)
+{
+    if (relay_status_task_handle == NULL) {
+        relay_publish_status();
+        return;
+    }
+    xTaskNotifyGive(relay_status_task_handle);
+}
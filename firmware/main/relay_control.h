@@ -3,6 +3,8 @@
 
 #include "esp_err.h"
 #include "driver/gpio.h"
+#include <stdbool.h>
+#include <stdint.h>
 
 // Number of relays on the Waveshare ESP32-S3-Relay-6CH
 #define NUM_RELAYS 6
@@ -19,12 +21,82 @@
 #define RELAY_ON  1
 #define RELAY_OFF 0
 
+#define RELAY_ALL_MASK ((1u << NUM_RELAYS) - 1)
+
+// Task that publishes status on behalf of time-critical callers (timers, UDP)
+#ifndef RELAY_STATUS_TASK_PRIORITY
+#define RELAY_STATUS_TASK_PRIORITY 3
+#endif
+#ifndef RELAY_STATUS_TASK_STACK_SIZE
+#define RELAY_STATUS_TASK_STACK_SIZE 4096
+#endif
+
+// Inrush limiting: ONs landing within stagger_ms of each other are spread out, one relay per
+// slot, through the deferred commit timer; OFFs are never delayed. The default applies to
+// every commit that does not pass its own value and can be changed at runtime (kept in NVS).
+#ifndef RELAY_STAGGER_DEFAULT_MS
+#define RELAY_STAGGER_DEFAULT_MS 0
+#endif
+#define RELAY_STAGGER_MAX_MS 10000
+#define RELAY_STAGGER_USE_DEFAULT (-1)
+
+// Origin of a relay commit
+typedef enum {
+    RELAY_SOURCE_BOOT = 0,
+    RELAY_SOURCE_API,           // Direct calls to relay_set_state()/relay_set_multiple()
+    RELAY_SOURCE_HTTP,
+    RELAY_SOURCE_MQTT,
+    RELAY_SOURCE_UDP,
+    RELAY_SOURCE_MULTICAST,
+    RELAY_SOURCE_MODBUS,
+    RELAY_SOURCE_COAP,
+    RELAY_SOURCE_SCHEDULE,
+    RELAY_SOURCE_TIMER,         // Pulse, blink and auto-off transitions
+    RELAY_SOURCE_COUNT
+} relay_source_t;
+
+// Result of a relay commit
+typedef struct {
+    uint32_t mask;              // Relay bitmask after the commit
+    int64_t applied_at_us;      // esp_timer_get_time() when the GPIOs were written
+    uint32_t rejected;          // Bits that violated a relay rule (commit refused)
+    uint32_t deferred;          // ONs held back by a relay rule or staggering, applied later
+} relay_commit_info_t;
+
+// Contact wear accounting, kept in the commit path and checkpointed by relay_persist
+typedef struct {
+    uint32_t cycles;            // OFF -> ON transitions
+    uint64_t on_time_ms;        // Cumulative time energized
+} relay_usage_t;
+
+// Called after every commit that changed at least one relay, in the committing task's context
+// (HTTP, MQTT, UDP, esp_timer, ...). Listeners must not block; hand work off to a task.
+typedef void (*relay_change_listener_t)(uint32_t mask, uint32_t changed, relay_source_t source);
+
+#ifndef RELAY_MAX_CHANGE_LISTENERS
+#define RELAY_MAX_CHANGE_LISTENERS 4
+#endif
+
 // Function declarations
 esp_err_t relay_control_init(void);
+esp_err_t relay_add_change_listener(relay_change_listener_t listener);
 esp_err_t relay_set_state(int relay_id, bool state);
 bool relay_get_state(int relay_id);
+uint32_t relay_get_mask(void);
+uint32_t relay_get_pending(int64_t due_us[NUM_RELAYS]);
+void relay_get_usage(relay_usage_t usage[NUM_RELAYS]);
+void relay_restore_usage(const relay_usage_t usage[NUM_RELAYS]);
+esp_err_t relay_commit(uint32_t set_mask, uint32_t clear_mask, relay_source_t source,
+                       relay_commit_info_t *info);
+esp_err_t relay_commit_staggered(uint32_t set_mask, uint32_t clear_mask, relay_source_t source,
+                                 int32_t stagger_ms, relay_commit_info_t *info);
+esp_err_t relay_set_stagger_default(uint32_t stagger_ms);
+uint32_t relay_get_stagger_default(void);
+const char *relay_source_name(relay_source_t source);
 esp_err_t relay_set_multiple(const char* json_data);
 void relay_publish_status(void);
+void relay_publish_status_async(void);
+void relay_publish_usage(void);
 
 // External variables
 extern int relay_states[NUM_RELAYS];
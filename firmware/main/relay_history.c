@@ -0,0 +1,380 @@
+#include "relay_history.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "time_sync.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const char *TAG = "RELAY_HISTORY";
+
+#define RELAY_HISTORY_MAGIC "RHL1"
+#define RELAY_HISTORY_MAGIC_LEN 4
+#define RELAY_HISTORY_RECORD_MAX 8      // Flags, 6-byte absolute time, mask
+#define RELAY_HISTORY_BATCH 32
+
+// Ring of the latest events. recorded/flushed are running counts, the slot of event n is
+// n % RELAY_HISTORY_RING_SIZE; events between flushed and recorded are not on flash yet.
+static portMUX_TYPE relay_history_lock = portMUX_INITIALIZER_UNLOCKED;
+static relay_history_event_t relay_history_ring[RELAY_HISTORY_RING_SIZE];
+static relay_history_stats_t relay_history_stats;
+
+// File access (flush task, readers) serializes on this mutex
+static SemaphoreHandle_t relay_history_mutex = NULL;
+// Bumped on every rotation: the current log is file relay_history_generation, .old the one before
+static uint32_t relay_history_generation = 1;
+static TaskHandle_t relay_history_task_handle = NULL;
+static relay_history_event_t relay_history_last_written;
+static bool relay_history_have_last = false;    // Next record can be a delta
+
+// Encode one record; a delta is used when it follows prev on the same clock
+int relay_history_encode(const relay_history_event_t *event, const relay_history_event_t *prev, uint8_t *buf)
+{
+    int len = 0;
+    uint8_t head = (event->flags & RELAY_HISTORY_FLAG_UPTIME) | (event->source & RELAY_HISTORY_SOURCE_MASK);
+    if (prev != NULL && prev->flags == event->flags && event->time_ms >= prev->time_ms) {
+        buf[len++] = head;
+        uint64_t delta = (uint64_t)(event->time_ms - prev->time_ms);
+        do {
+            buf[len++] = (delta & 0x7f) | (delta >= 0x80 ? 0x80 : 0);
+            delta >>= 7;
+        } while (delta != 0 && len < RELAY_HISTORY_RECORD_MAX - 1);
+        if (delta == 0) {
+            buf[len++] = event->mask;
+            return len;
+        }
+        len = 0; // Gap too large for a short delta
+    }
+    buf[len++] = head | RELAY_HISTORY_FLAG_ABSOLUTE;
+    for (int i = 0; i < 6; i++) {
+        buf[len++] = (uint8_t)((uint64_t)event->time_ms >> (8 * i));
+    }
+    buf[len++] = event->mask;
+    return len;
+}
+
+// Decode one record; returns its length, 0 if buf ends mid-record, -1 if it is invalid
+int relay_history_decode(const uint8_t *buf, size_t len, const relay_history_event_t *prev,
+                         relay_history_event_t *event)
+{
+    if (len < 1) {
+        return 0;
+    }
+    size_t pos = 1;
+    event->source = buf[0] & RELAY_HISTORY_SOURCE_MASK;
+    event->flags = buf[0] & RELAY_HISTORY_FLAG_UPTIME;
+    if (event->source >= RELAY_SOURCE_COUNT || (buf[0] & 0x30) != 0) {
+        return -1;
+    }
+
+    if (buf[0] & RELAY_HISTORY_FLAG_ABSOLUTE) {
+        if (len < 8) {
+            return 0;
+        }
+        uint64_t t = 0;
+        for (int i = 0; i < 6; i++) {
+            t |= (uint64_t)buf[pos++] << (8 * i);
+        }
+        event->time_ms = (int64_t)t;
+    } else {
+        if (prev == NULL || prev->flags != event->flags) {
+            return -1;
+        }
+        uint64_t delta = 0;
+        int shift = 0;
+        do {
+            if (pos >= len) {
+                return 0;
+            }
+            if (shift > 35) {
+                return -1;
+            }
+            delta |= (uint64_t)(buf[pos] & 0x7f) << shift;
+            shift += 7;
+        } while (buf[pos++] & 0x80);
+        event->time_ms = prev->time_ms + (int64_t)delta;
+    }
+
+    if (pos >= len) {
+        return 0;
+    }
+    event->mask = buf[pos++];
+    return (int)pos;
+}
+
+// From the commit path: timestamp the change and put it in the ring, nothing else
+static void relay_history_on_change(uint32_t mask, uint32_t changed, relay_source_t source)
+{
+    relay_history_event_t event = {
+        .mask = (uint8_t)mask,
+        .source = (uint8_t)source,
+    };
+    if (time_sync_is_synced()) {
+        event.time_ms = time_sync_now_us() / 1000;
+    } else {
+        event.time_ms = esp_timer_get_time() / 1000;
+        event.flags = RELAY_HISTORY_FLAG_UPTIME;
+    }
+
+    portENTER_CRITICAL(&relay_history_lock);
+    uint32_t n = relay_history_stats.recorded++;
+    relay_history_ring[n % RELAY_HISTORY_RING_SIZE] = event;
+    uint32_t waiting = relay_history_stats.recorded - relay_history_stats.flushed;
+    if (waiting > RELAY_HISTORY_RING_SIZE) {
+        relay_history_stats.flushed++;
+        relay_history_stats.dropped++;
+        waiting--;
+    }
+    portEXIT_CRITICAL(&relay_history_lock);
+
+    if (waiting == RELAY_HISTORY_RING_SIZE / 2 && relay_history_task_handle != NULL) {
+        xTaskNotifyGive(relay_history_task_handle);
+    }
+}
+
+static long relay_history_file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+// Append everything waiting in the ring. Caller holds relay_history_mutex.
+static esp_err_t relay_history_flush_locked(void)
+{
+    esp_err_t ret = ESP_OK;
+    while (1) {
+        relay_history_event_t batch[RELAY_HISTORY_BATCH];
+        int count = 0;
+        // Events stay in the ring (and count as not flushed) until they are on flash
+        portENTER_CRITICAL(&relay_history_lock);
+        uint32_t first = relay_history_stats.flushed;
+        while (count < RELAY_HISTORY_BATCH && first + count != relay_history_stats.recorded) {
+            batch[count] = relay_history_ring[(first + count) % RELAY_HISTORY_RING_SIZE];
+            count++;
+        }
+        portEXIT_CRITICAL(&relay_history_lock);
+        if (count == 0) {
+            return ret;
+        }
+
+        long size = relay_history_file_size(RELAY_HISTORY_FILE);
+        if (size + count * RELAY_HISTORY_RECORD_MAX > RELAY_HISTORY_FILE_MAX) {
+            remove(RELAY_HISTORY_FILE ".old");
+            rename(RELAY_HISTORY_FILE, RELAY_HISTORY_FILE ".old");
+            relay_history_generation++;
+            size = -1;
+        }
+
+        FILE *f = fopen(RELAY_HISTORY_FILE, "ab");
+        if (f == NULL) {
+            ESP_LOGE(TAG, "Failed to open %s", RELAY_HISTORY_FILE);
+            portENTER_CRITICAL(&relay_history_lock);
+            relay_history_stats.write_failures++;
+            portEXIT_CRITICAL(&relay_history_lock);
+            return ESP_FAIL;
+        }
+        uint8_t buf[RELAY_HISTORY_MAGIC_LEN + RELAY_HISTORY_BATCH * RELAY_HISTORY_RECORD_MAX];
+        size_t len = 0;
+        if (size <= 0) {
+            memcpy(buf, RELAY_HISTORY_MAGIC, RELAY_HISTORY_MAGIC_LEN);
+            len = RELAY_HISTORY_MAGIC_LEN;
+            relay_history_have_last = false;
+        }
+        for (int i = 0; i < count; i++) {
+            len += relay_history_encode(&batch[i], relay_history_have_last ? &relay_history_last_written : NULL,
+                                        buf + len);
+            relay_history_last_written = batch[i];
+            relay_history_have_last = true;
+        }
+        bool written = fwrite(buf, 1, len, f) == len;
+        if (fclose(f) != 0) {
+            written = false;
+        }
+        if (!written) {
+            ESP_LOGE(TAG, "Failed to append %d events", count);
+            relay_history_have_last = false; // The next record must not depend on a torn one
+            portENTER_CRITICAL(&relay_history_lock);
+            relay_history_stats.write_failures++;
+            portEXIT_CRITICAL(&relay_history_lock);
+            return ESP_FAIL;    // Still in the ring; the next flush tries again
+        }
+
+        // The commit path may have pushed flushed past the batch by dropping events meanwhile
+        portENTER_CRITICAL(&relay_history_lock);
+        if ((int32_t)(first + count - relay_history_stats.flushed) > 0) {
+            relay_history_stats.flushed = first + count;
+        }
+        portEXIT_CRITICAL(&relay_history_lock);
+    }
+}
+
+static void relay_history_task(void *arg)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RELAY_HISTORY_FLUSH_INTERVAL_MS));
+        xSemaphoreTake(relay_history_mutex, portMAX_DELAY);
+        relay_history_flush_locked();
+        xSemaphoreGive(relay_history_mutex);
+    }
+}
+
+esp_err_t relay_history_init(void)
+{
+    relay_history_mutex = xSemaphoreCreateMutex();
+    if (relay_history_mutex == NULL ||
+        xTaskCreate(relay_history_task, "relay_history", RELAY_HISTORY_TASK_STACK_SIZE, NULL,
+                    RELAY_HISTORY_TASK_PRIORITY, &relay_history_task_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create relay history task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t ret = relay_add_change_listener(relay_history_on_change);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register change listener");
+        return ret;
+    }
+
+    // The boot state is the first event of every session, and always written in full
+    relay_history_on_change(relay_get_mask(), 0, RELAY_SOURCE_BOOT);
+    return ESP_OK;
+}
+
+// Replay events at or after since_ms (Unix ms): the .old log, the current log, then events
+// not flushed yet. Events stamped before the clock was set are only included for since_ms 0.
+// The callback may block on the network, so relay_history_mutex is only held while a chunk is
+// read, at a remembered file and offset. Files are tracked by generation: a rotation in between
+// turns the file being read into .old, and one rotated out entirely is skipped.
+esp_err_t relay_history_read(int64_t since_ms, relay_history_cb_t cb, void *ctx)
+{
+    uint8_t buf[256];
+    size_t len = 0;                 // Bytes in buf, including a partial record carried over
+    long offset = 0;
+    relay_history_event_t prev;
+    bool have_prev = false;
+    bool stop = false;
+    uint32_t next = 0;
+
+    xSemaphoreTake(relay_history_mutex, portMAX_DELAY);
+    uint32_t file = relay_history_generation - 1;
+    xSemaphoreGive(relay_history_mutex);
+
+    while (!stop) {
+        xSemaphoreTake(relay_history_mutex, portMAX_DELAY);
+        if (file + 1 < relay_history_generation) {
+            file = relay_history_generation - 1;
+            offset = 0;
+            len = 0;
+            have_prev = false;
+        }
+        bool current = file == relay_history_generation;
+        const char *path = current ? RELAY_HISTORY_FILE : RELAY_HISTORY_FILE ".old";
+        size_t n = 0;
+        bool bad_header = false;
+        FILE *f = fopen(path, "rb");
+        if (f != NULL) {
+            if (offset == 0) {
+                uint8_t magic[RELAY_HISTORY_MAGIC_LEN];
+                if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                    memcmp(magic, RELAY_HISTORY_MAGIC, RELAY_HISTORY_MAGIC_LEN) == 0) {
+                    offset = RELAY_HISTORY_MAGIC_LEN;
+                } else {
+                    bad_header = true;
+                }
+            }
+            if (!bad_header && fseek(f, offset, SEEK_SET) == 0) {
+                n = fread(buf + len, 1, sizeof(buf) - len, f);
+            }
+            fclose(f);
+        }
+        if (n == 0 && current) {
+            // Same moment as the end of the log: the ring continues exactly there
+            portENTER_CRITICAL(&relay_history_lock);
+            next = relay_history_stats.flushed;
+            portEXIT_CRITICAL(&relay_history_lock);
+        }
+        xSemaphoreGive(relay_history_mutex);
+
+        if (bad_header) {
+            ESP_LOGW(TAG, "Ignoring %s: bad header", path);
+        }
+        if (n == 0) {
+            if (current) {
+                break;
+            }
+            file++;
+            offset = 0;
+            len = 0;
+            have_prev = false;
+            continue;
+        }
+        offset += n;
+        len += n;
+
+        size_t pos = 0;
+        while (!stop) {
+            relay_history_event_t event;
+            int used = relay_history_decode(buf + pos, len - pos, have_prev ? &prev : NULL, &event);
+            if (used == 0) {
+                break;
+            }
+            if (used < 0) {
+                // Skip a damaged byte; the next absolute record resynchronizes the deltas
+                pos++;
+                have_prev = false;
+                continue;
+            }
+            pos += used;
+            prev = event;
+            have_prev = true;
+            if (((event.flags & RELAY_HISTORY_FLAG_UPTIME) ? since_ms == 0 : event.time_ms >= since_ms) &&
+                !cb(&event, ctx)) {
+                stop = true;
+            }
+        }
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+    }
+
+    while (!stop) {
+        relay_history_event_t event;
+        portENTER_CRITICAL(&relay_history_lock);
+        bool valid = next != relay_history_stats.recorded;
+        if (valid && relay_history_stats.recorded - next > RELAY_HISTORY_RING_SIZE) {
+            next = relay_history_stats.recorded - RELAY_HISTORY_RING_SIZE; // Overtaken while reading
+        }
+        if (valid) {
+            event = relay_history_ring[next % RELAY_HISTORY_RING_SIZE];
+        }
+        portEXIT_CRITICAL(&relay_history_lock);
+        if (!valid) {
+            break;
+        }
+        next++;
+        if (((event.flags & RELAY_HISTORY_FLAG_UPTIME) ? since_ms == 0 : event.time_ms >= since_ms) &&
+            !cb(&event, ctx)) {
+            stop = true;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t relay_history_flush(void)
+{
+    xSemaphoreTake(relay_history_mutex, portMAX_DELAY);
+    esp_err_t ret = relay_history_flush_locked();
+    xSemaphoreGive(relay_history_mutex);
+    return ret;
+}
+
+void relay_history_get_stats(relay_history_stats_t *stats)
+{
+    portENTER_CRITICAL(&relay_history_lock);
+    *stats = relay_history_stats;
+    portEXIT_CRITICAL(&relay_history_lock);
+    long size = relay_history_file_size(RELAY_HISTORY_FILE);
+    long old_size = relay_history_file_size(RELAY_HISTORY_FILE ".old");
+    stats->file_bytes = (size > 0 ? size : 0) + (old_size > 0 ? old_size : 0);
+}
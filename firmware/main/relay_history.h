@@ -0,0 +1,65 @@
+#ifndef RELAY_HISTORY_H
+#define RELAY_HISTORY_H
+
+#include "esp_err.h"
+#include "relay_control.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Every relay change is recorded in a RAM ring from the commit path (no blocking, no flash)
+// and appended in batches to a delta-encoded log on LittleFS. When the log reaches
+// RELAY_HISTORY_FILE_MAX it becomes the .old file, so flash use stays below twice that.
+#ifndef RELAY_HISTORY_FILE
+#define RELAY_HISTORY_FILE "/www/history.log"
+#endif
+#ifndef RELAY_HISTORY_FILE_MAX
+#define RELAY_HISTORY_FILE_MAX (32 * 1024)
+#endif
+#ifndef RELAY_HISTORY_RING_SIZE
+#define RELAY_HISTORY_RING_SIZE 256
+#endif
+// Events are flushed at this interval, or earlier once half the ring is waiting
+#ifndef RELAY_HISTORY_FLUSH_INTERVAL_MS
+#define RELAY_HISTORY_FLUSH_INTERVAL_MS 10000
+#endif
+
+#ifndef RELAY_HISTORY_TASK_PRIORITY
+#define RELAY_HISTORY_TASK_PRIORITY 1
+#endif
+#ifndef RELAY_HISTORY_TASK_STACK_SIZE
+#define RELAY_HISTORY_TASK_STACK_SIZE 4096
+#endif
+
+// On-flash record: [flags|source] [varint ms since previous record | 6-byte absolute ms] [mask]
+#define RELAY_HISTORY_FLAG_ABSOLUTE 0x80    // Absolute timestamp follows instead of a delta
+#define RELAY_HISTORY_FLAG_UPTIME 0x40      // Time is ms since boot; the wall clock was not set
+#define RELAY_HISTORY_SOURCE_MASK 0x0f
+
+typedef struct {
+    int64_t time_ms;                // Unix time in ms, or ms since boot with the UPTIME flag
+    uint8_t mask;                   // Relay bitmask after the change
+    uint8_t source;                 // relay_source_t
+    uint8_t flags;                  // RELAY_HISTORY_FLAG_UPTIME
+} relay_history_event_t;
+
+typedef struct {
+    uint32_t recorded;
+    uint32_t flushed;
+    uint32_t dropped;               // Overwritten in the ring before they could be flushed
+    uint32_t write_failures;
+    uint32_t file_bytes;            // Current log file plus the .old file
+} relay_history_stats_t;
+
+// Called for each event in order; return false to stop
+typedef bool (*relay_history_cb_t)(const relay_history_event_t *event, void *ctx);
+
+// Function declarations
+esp_err_t relay_history_init(void);
+esp_err_t relay_history_read(int64_t since_ms, relay_history_cb_t cb, void *ctx);
+esp_err_t relay_history_flush(void);
+void relay_history_get_stats(relay_history_stats_t *stats);
+int relay_history_encode(const relay_history_event_t *event, const relay_history_event_t *prev, uint8_t *buf);
+int relay_history_decode(const uint8_t *buf, size_t len, const relay_history_event_t *prev,
+                         relay_history_event_t *event);
+
+#endif // RELAY_HISTORY_H
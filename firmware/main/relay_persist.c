@@ -0,0 +1,361 @@
+#include "relay_persist.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "RELAY_PERSIST";
+
+#define NVS_NAMESPACE "relay_persist"
+#define NVS_KEY_POWER_ON "power_on"
+#define NVS_KEY_STATE_FMT "state%d"
+#define NVS_KEY_USAGE "usage"
+
+static uint8_t relay_power_on[NUM_RELAYS];
+static uint32_t relay_last_modes = 0;       // Relays in RELAY_POWER_ON_LAST
+
+// Last state is stored as (sequence << 8) | mask in one of RELAY_PERSIST_SLOTS keys, each
+// write going to the next key; the highest sequence wins at boot. A write that is cut off
+// by a reset leaves the previous slot intact.
+static int relay_persist_next_slot = 0;
+static uint64_t relay_persist_next_seq = 1;
+
+static portMUX_TYPE relay_persist_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t relay_persist_mask = 0;     // Latest state, guarded by relay_persist_lock
+static relay_persist_stats_t relay_persist_stats;
+
+static relay_usage_t relay_usage_saved[NUM_RELAYS];    // As of the last checkpoint
+
+static SemaphoreHandle_t relay_persist_mutex = NULL;    // Serializes NVS writes
+static TaskHandle_t relay_persist_task_handle = NULL;
+
+const char *relay_power_on_name(relay_power_on_t mode)
+{
+    switch (mode) {
+    case RELAY_POWER_ON_ON:
+        return "on";
+    case RELAY_POWER_ON_LAST:
+        return "last";
+    default:
+        return "off";
+    }
+}
+
+esp_err_t relay_power_on_from_name(const char *name, relay_power_on_t *mode)
+{
+    if (strcmp(name, "off") == 0) {
+        *mode = RELAY_POWER_ON_OFF;
+    } else if (strcmp(name, "on") == 0) {
+        *mode = RELAY_POWER_ON_ON;
+    } else if (strcmp(name, "last") == 0) {
+        *mode = RELAY_POWER_ON_LAST;
+    } else {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
+// Write the latest state if it differs from the stored one in a relay that restores it
+static esp_err_t relay_persist_write(void)
+{
+    xSemaphoreTake(relay_persist_mutex, portMAX_DELAY);
+    portENTER_CRITICAL(&relay_persist_lock);
+    uint32_t mask = relay_persist_mask;
+    bool dirty = relay_persist_stats.dirty;
+    relay_persist_stats.dirty = false;
+    portEXIT_CRITICAL(&relay_persist_lock);
+
+    if (!dirty || ((mask ^ relay_persist_stats.saved_mask) & relay_last_modes) == 0) {
+        xSemaphoreGive(relay_persist_mutex);
+        return ESP_OK;
+    }
+
+    char key[16];
+    snprintf(key, sizeof(key), NVS_KEY_STATE_FMT, relay_persist_next_slot);
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK) {
+        err = nvs_set_u64(nvs_handle, key, (relay_persist_next_seq << 8) | mask);
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs_handle);
+        }
+        nvs_close(nvs_handle);
+    }
+
+    portENTER_CRITICAL(&relay_persist_lock);
+    if (err == ESP_OK) {
+        relay_persist_stats.saved_mask = mask;
+        relay_persist_stats.writes++;
+        relay_persist_stats.last_write_us = esp_timer_get_time();
+    } else {
+        relay_persist_stats.dirty = true;
+        relay_persist_stats.failures++;
+    }
+    portEXIT_CRITICAL(&relay_persist_lock);
+
+    if (err == ESP_OK) {
+        relay_persist_next_slot = (relay_persist_next_slot + 1) % RELAY_PERSIST_SLOTS;
+        relay_persist_next_seq++;
+        ESP_LOGD(TAG, "Saved relay state 0x%02x to %s", (unsigned)mask, key);
+    } else {
+        ESP_LOGE(TAG, "Failed to save relay state: %s", esp_err_to_name(err));
+    }
+    xSemaphoreGive(relay_persist_mutex);
+    return err;
+}
+
+// Store the usage counters if they moved since the last checkpoint
+esp_err_t relay_persist_checkpoint_usage(void)
+{
+    relay_usage_t usage[NUM_RELAYS];
+    relay_get_usage(usage);
+
+    xSemaphoreTake(relay_persist_mutex, portMAX_DELAY);
+    bool changed = false;
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        // On-time only counts as a change in whole seconds, so an idle-on relay does not
+        // cause a write for every millisecond
+        if (usage[i].cycles != relay_usage_saved[i].cycles ||
+            usage[i].on_time_ms / 1000 != relay_usage_saved[i].on_time_ms / 1000) {
+            changed = true;
+        }
+    }
+    if (!changed) {
+        xSemaphoreGive(relay_persist_mutex);
+        return ESP_OK;
+    }
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs_handle, NVS_KEY_USAGE, usage, sizeof(usage));
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs_handle);
+        }
+        nvs_close(nvs_handle);
+    }
+    if (err == ESP_OK) {
+        memcpy(relay_usage_saved, usage, sizeof(usage));
+        portENTER_CRITICAL(&relay_persist_lock);
+        relay_persist_stats.usage_checkpoints++;
+        portEXIT_CRITICAL(&relay_persist_lock);
+    } else {
+        ESP_LOGE(TAG, "Failed to save relay usage: %s", esp_err_to_name(err));
+    }
+    xSemaphoreGive(relay_persist_mutex);
+    return err;
+}
+
+// Low-priority writer: the commit path only records the mask and notifies, so switching
+// never waits for flash
+static void relay_persist_task(void *arg)
+{
+    int64_t last_attempt_us = 0;
+    int64_t last_checkpoint_us = esp_timer_get_time();
+    while (1) {
+        if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RELAY_USAGE_CHECKPOINT_S * 1000)) > 0) {
+            // Let a burst of changes settle: every change restarts the quiet period, but a
+            // burst that never pauses is written after RELAY_PERSIST_MIN_INTERVAL_S anyway.
+            // Then keep to the minimum write interval; changes meanwhile only update the mask.
+            int64_t burst_start_us = esp_timer_get_time();
+            while (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RELAY_PERSIST_DELAY_MS)) > 0 &&
+                   esp_timer_get_time() - burst_start_us < (int64_t)RELAY_PERSIST_MIN_INTERVAL_S * 1000000) {
+            }
+            int64_t wait_us = last_attempt_us + (int64_t)RELAY_PERSIST_MIN_INTERVAL_S * 1000000 - esp_timer_get_time();
+            if (last_attempt_us != 0 && wait_us > 0) {
+                vTaskDelay(pdMS_TO_TICKS(wait_us / 1000) + 1);
+            }
+            last_attempt_us = esp_timer_get_time();
+            if (relay_persist_write() != ESP_OK) {
+                xTaskNotifyGive(xTaskGetCurrentTaskHandle()); // Retry after the next interval
+            }
+        }
+
+        // Checked on every pass, so steady switching cannot postpone it
+        if (esp_timer_get_time() - last_checkpoint_us >= (int64_t)RELAY_USAGE_CHECKPOINT_S * 1000000) {
+            last_checkpoint_us = esp_timer_get_time();
+            relay_persist_checkpoint_usage();
+        }
+    }
+}
+
+static void relay_persist_on_change(uint32_t mask, uint32_t changed, relay_source_t source)
+{
+    if ((changed & relay_last_modes) == 0) {
+        return;
+    }
+    portENTER_CRITICAL(&relay_persist_lock);
+    relay_persist_mask = mask;
+    if (relay_persist_stats.dirty) {
+        relay_persist_stats.coalesced++;
+    }
+    relay_persist_stats.dirty = true;
+    portEXIT_CRITICAL(&relay_persist_lock);
+    xTaskNotifyGive(relay_persist_task_handle);
+}
+
+// Runs from esp_restart(), so an OTA or requested reboot does not lose a pending change
+static void relay_persist_shutdown(void)
+{
+    relay_persist_write();
+    relay_persist_checkpoint_usage();
+}
+
+static void relay_persist_load(void)
+{
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        relay_power_on[i] = RELAY_POWER_ON_DEFAULT;
+    }
+
+    nvs_handle_t nvs_handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
+        return;
+    }
+    uint8_t modes[NUM_RELAYS];
+    size_t len = sizeof(modes);
+    if (nvs_get_blob(nvs_handle, NVS_KEY_POWER_ON, modes, &len) == ESP_OK && len == sizeof(modes)) {
+        for (int i = 0; i < NUM_RELAYS; i++) {
+            relay_power_on[i] = modes[i] <= RELAY_POWER_ON_LAST ? modes[i] : RELAY_POWER_ON_DEFAULT;
+        }
+    }
+
+    uint64_t best_seq = 0;
+    for (int slot = 0; slot < RELAY_PERSIST_SLOTS; slot++) {
+        char key[16];
+        uint64_t value;
+        snprintf(key, sizeof(key), NVS_KEY_STATE_FMT, slot);
+        if (nvs_get_u64(nvs_handle, key, &value) == ESP_OK && (value >> 8) > best_seq) {
+            best_seq = value >> 8;
+            relay_persist_stats.saved_mask = (uint32_t)value & RELAY_ALL_MASK;
+            relay_persist_next_slot = (slot + 1) % RELAY_PERSIST_SLOTS;
+        }
+    }
+    relay_persist_next_seq = best_seq + 1;
+
+    len = sizeof(relay_usage_saved);
+    if (nvs_get_blob(nvs_handle, NVS_KEY_USAGE, relay_usage_saved, &len) != ESP_OK ||
+        len != sizeof(relay_usage_saved)) {
+        memset(relay_usage_saved, 0, sizeof(relay_usage_saved));
+    }
+    nvs_close(nvs_handle);
+}
+
+// Restore the usage counters and the power-on state; call after relay_control_init() and
+// before anything that commands relays, so the restore is the first commit
+esp_err_t relay_persist_init(void)
+{
+    relay_persist_load();
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        if (relay_power_on[i] == RELAY_POWER_ON_LAST) {
+            relay_last_modes |= 1u << i;
+        }
+    }
+    relay_persist_mask = relay_persist_stats.saved_mask;
+    relay_restore_usage(relay_usage_saved);
+
+    relay_persist_mutex = xSemaphoreCreateMutex();
+    if (relay_persist_mutex == NULL ||
+        xTaskCreate(relay_persist_task, "relay_persist", RELAY_PERSIST_TASK_STACK_SIZE, NULL,
+                    RELAY_PERSIST_TASK_PRIORITY, &relay_persist_task_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create relay persist task");
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t ret = relay_add_change_listener(relay_persist_on_change);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register change listener");
+        return ret;
+    }
+    esp_register_shutdown_handler(relay_persist_shutdown);
+
+    uint32_t set_mask = 0;
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        if (relay_power_on[i] == RELAY_POWER_ON_ON ||
+            (relay_power_on[i] == RELAY_POWER_ON_LAST && (relay_persist_stats.saved_mask & (1u << i)))) {
+            set_mask |= 1u << i;
+        }
+    }
+    if (set_mask == 0) {
+        return ESP_OK;
+    }
+
+    ESP_LOGI(TAG, "Restoring relays 0x%02x at power-on", (unsigned)set_mask);
+    ret = relay_commit(set_mask, 0, RELAY_SOURCE_BOOT, NULL);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Power-on restore refused: %s", esp_err_to_name(ret));
+    }
+    return ESP_OK;
+}
+
+esp_err_t relay_persist_set_power_on(int relay_id, relay_power_on_t mode)
+{
+    if (relay_id < 0 || relay_id >= NUM_RELAYS || mode > RELAY_POWER_ON_LAST) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (relay_power_on[relay_id] == mode) {
+        return ESP_OK;
+    }
+
+    xSemaphoreTake(relay_persist_mutex, portMAX_DELAY);
+    uint8_t modes[NUM_RELAYS];
+    memcpy(modes, relay_power_on, sizeof(modes));
+    modes[relay_id] = mode;
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs_handle, NVS_KEY_POWER_ON, modes, sizeof(modes));
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs_handle);
+        }
+        nvs_close(nvs_handle);
+    }
+    if (err != ESP_OK) {
+        xSemaphoreGive(relay_persist_mutex);
+        ESP_LOGE(TAG, "Failed to save power-on modes: %s", esp_err_to_name(err));
+        return err;
+    }
+    memcpy(relay_power_on, modes, sizeof(modes));
+    xSemaphoreGive(relay_persist_mutex);
+
+    uint32_t bit = 1u << relay_id;
+    ESP_LOGI(TAG, "Relay %d power-on: %s", relay_id, relay_power_on_name(mode));
+    if (mode != RELAY_POWER_ON_LAST) {
+        relay_last_modes &= ~bit;
+        return ESP_OK;
+    }
+
+    // Newly restored relay: make sure its current state gets stored
+    relay_last_modes |= bit;
+    portENTER_CRITICAL(&relay_persist_lock);
+    relay_persist_mask = relay_get_mask();
+    relay_persist_stats.dirty = true;
+    portEXIT_CRITICAL(&relay_persist_lock);
+    xTaskNotifyGive(relay_persist_task_handle);
+    return ESP_OK;
+}
+
+relay_power_on_t relay_persist_get_power_on(int relay_id)
+{
+    if (relay_id < 0 || relay_id >= NUM_RELAYS) {
+        return RELAY_POWER_ON_OFF;
+    }
+    return (relay_power_on_t)relay_power_on[relay_id];
+}
+
+// Write a pending change now, ignoring the coalescing interval
+esp_err_t relay_persist_flush(void)
+{
+    return relay_persist_write();
+}
+
+void relay_persist_get_stats(relay_persist_stats_t *stats)
+{
+    portENTER_CRITICAL(&relay_persist_lock);
+    *stats = relay_persist_stats;
+    portEXIT_CRITICAL(&relay_persist_lock);
+}
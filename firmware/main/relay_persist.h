@@ -0,0 +1,70 @@
+#ifndef RELAY_PERSIST_H
+#define RELAY_PERSIST_H
+
+#include "esp_err.h"
+#include "relay_control.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// What a relay does at power-on
+typedef enum {
+    RELAY_POWER_ON_OFF = 0,
+    RELAY_POWER_ON_ON,
+    RELAY_POWER_ON_LAST,            // State saved before the reset
+} relay_power_on_t;
+
+#ifndef RELAY_POWER_ON_DEFAULT
+#define RELAY_POWER_ON_DEFAULT RELAY_POWER_ON_OFF
+#endif
+
+// Last-state writes are coalesced: a burst of changes is written once it has been quiet for
+// RELAY_PERSIST_DELAY_MS (each change restarts the wait; a burst that never pauses is written
+// after RELAY_PERSIST_MIN_INTERVAL_S), and never more often than every
+// RELAY_PERSIST_MIN_INTERVAL_S.
+// Pending state is also written on esp_restart() (OTA, reboot requests).
+#ifndef RELAY_PERSIST_DELAY_MS
+#define RELAY_PERSIST_DELAY_MS 2000
+#endif
+#ifndef RELAY_PERSIST_MIN_INTERVAL_S
+#define RELAY_PERSIST_MIN_INTERVAL_S 10
+#endif
+
+// Number of NVS keys the last state rotates through
+#ifndef RELAY_PERSIST_SLOTS
+#define RELAY_PERSIST_SLOTS 8
+#endif
+
+// Relay cycle counters and on-time are checkpointed at this interval when they changed, and
+// on esp_restart(); a power cut loses at most one interval of counting
+#ifndef RELAY_USAGE_CHECKPOINT_S
+#define RELAY_USAGE_CHECKPOINT_S 600
+#endif
+
+#ifndef RELAY_PERSIST_TASK_PRIORITY
+#define RELAY_PERSIST_TASK_PRIORITY 1
+#endif
+#ifndef RELAY_PERSIST_TASK_STACK_SIZE
+#define RELAY_PERSIST_TASK_STACK_SIZE 3072
+#endif
+
+typedef struct {
+    uint32_t saved_mask;            // Last state as stored in NVS
+    bool dirty;                     // A change is waiting to be written
+    uint32_t writes;
+    uint32_t coalesced;             // Changes absorbed into a later write
+    uint32_t failures;
+    int64_t last_write_us;          // esp_timer_get_time() of the last write, 0 if none
+    uint32_t usage_checkpoints;
+} relay_persist_stats_t;
+
+// Function declarations
+esp_err_t relay_persist_init(void);
+esp_err_t relay_persist_set_power_on(int relay_id, relay_power_on_t mode);
+relay_power_on_t relay_persist_get_power_on(int relay_id);
+const char *relay_power_on_name(relay_power_on_t mode);
+esp_err_t relay_power_on_from_name(const char *name, relay_power_on_t *mode);
+esp_err_t relay_persist_flush(void);
+esp_err_t relay_persist_checkpoint_usage(void);
+void relay_persist_get_stats(relay_persist_stats_t *stats);
+
+#endif // RELAY_PERSIST_H
@@ -0,0 +1,259 @@
+#include "relay_rules.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "RELAY_RULES";
+
+// Tables from the build configuration, each closed by a sentinel entry
+static const relay_interlock_t relay_interlocks[] = { RELAY_RULE_INTERLOCKS { 0 } };
+static const relay_sequence_t relay_sequences[] = { RELAY_RULE_SEQUENCES { .relay = 0xff } };
+static int relay_interlock_count = 0;
+static int relay_sequence_count = 0;
+
+// Compiled form: everything relay_rules_evaluate() needs is a mask lookup
+static bool rules_active = false;
+static uint32_t rules_group_mask[RELAY_RULE_MAX_INTERLOCKS];
+static int64_t rules_group_dead_us[RELAY_RULE_MAX_INTERLOCKS];
+static uint32_t rules_requires[NUM_RELAYS];         // Direct prerequisites
+static uint32_t rules_requires_all[NUM_RELAYS];     // Transitive prerequisites
+static uint32_t rules_dependents[NUM_RELAYS];       // Relays that (transitively) require this one
+static int64_t rules_delay_us[NUM_RELAYS];
+static uint8_t rules_order[NUM_RELAYS];             // Prerequisites before their dependents
+
+// Transition times, only touched under the relay commit lock
+static int64_t rules_group_last_off_us[RELAY_RULE_MAX_INTERLOCKS];
+static int64_t rules_last_on_us[NUM_RELAYS];
+
+static relay_rules_stats_t rules_stats;
+
+esp_err_t relay_rules_init(void)
+{
+    for (relay_interlock_count = 0; relay_interlocks[relay_interlock_count].mask != 0; relay_interlock_count++) {
+        const relay_interlock_t *rule = &relay_interlocks[relay_interlock_count];
+        if (relay_interlock_count >= RELAY_RULE_MAX_INTERLOCKS || (rule->mask & ~RELAY_ALL_MASK) ||
+            (rule->mask & (rule->mask - 1)) == 0) {
+            ESP_LOGE(TAG, "Invalid interlock rule %d (mask 0x%02x)", relay_interlock_count, (unsigned)rule->mask);
+            return ESP_ERR_INVALID_ARG;
+        }
+        rules_group_mask[relay_interlock_count] = rule->mask;
+        rules_group_dead_us[relay_interlock_count] = (int64_t)rule->dead_time_ms * 1000;
+        rules_group_last_off_us[relay_interlock_count] = INT64_MIN / 2;
+    }
+
+    for (relay_sequence_count = 0; relay_sequences[relay_sequence_count].relay != 0xff; relay_sequence_count++) {
+        const relay_sequence_t *rule = &relay_sequences[relay_sequence_count];
+        if (rule->relay >= NUM_RELAYS || (rule->requires & ~RELAY_ALL_MASK) || rule->requires == 0) {
+            ESP_LOGE(TAG, "Invalid sequence rule %d (relay %d)", relay_sequence_count, rule->relay);
+            return ESP_ERR_INVALID_ARG;
+        }
+        rules_requires[rule->relay] |= rule->requires;
+        if ((int64_t)rule->delay_ms * 1000 > rules_delay_us[rule->relay]) {
+            rules_delay_us[rule->relay] = (int64_t)rule->delay_ms * 1000;
+        }
+    }
+
+    // Transitive closure; NUM_RELAYS rounds are enough for the longest chain
+    memcpy(rules_requires_all, rules_requires, sizeof(rules_requires_all));
+    for (int round = 0; round < NUM_RELAYS; round++) {
+        for (int i = 0; i < NUM_RELAYS; i++) {
+            for (int j = 0; j < NUM_RELAYS; j++) {
+                if (rules_requires_all[i] & (1u << j)) {
+                    rules_requires_all[i] |= rules_requires_all[j];
+                }
+            }
+        }
+    }
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        if (rules_requires_all[i] & (1u << i)) {
+            ESP_LOGE(TAG, "Sequence rules for relay %d form a cycle", i);
+            return ESP_ERR_INVALID_ARG;
+        }
+        for (int j = 0; j < NUM_RELAYS; j++) {
+            if (rules_requires_all[j] & (1u << i)) {
+                rules_dependents[i] |= 1u << j;
+            }
+        }
+        for (int g = 0; g < relay_interlock_count; g++) {
+            if ((rules_group_mask[g] & (1u << i)) && (rules_requires_all[i] & rules_group_mask[g])) {
+                ESP_LOGE(TAG, "Relay %d requires a relay it is interlocked with", i);
+                return ESP_ERR_INVALID_ARG;
+            }
+        }
+        rules_last_on_us[i] = INT64_MIN / 2;
+    }
+
+    // Order by number of prerequisites: a relay always has more than any of its prerequisites
+    int count = 0;
+    for (int depth = 0; depth <= NUM_RELAYS; depth++) {
+        for (int i = 0; i < NUM_RELAYS; i++) {
+            if (__builtin_popcount(rules_requires_all[i]) == depth) {
+                rules_order[count++] = i;
+            }
+        }
+    }
+
+    rules_active = relay_interlock_count > 0 || relay_sequence_count > 0;
+    if (rules_active) {
+        ESP_LOGI(TAG, "%d interlock and %d sequence rules active", relay_interlock_count, relay_sequence_count);
+    }
+    return ESP_OK;
+}
+
+bool relay_rules_active(void)
+{
+    return rules_active;
+}
+
+// Called under the relay commit lock for every commit, so only bit operations over the
+// compiled tables; the loops are bounded by NUM_RELAYS and the number of groups.
+void relay_rules_evaluate(uint32_t current, int64_t now_us, relay_rules_eval_t *eval)
+{
+    eval->rejected = 0;
+    eval->deferred = 0;
+    if (!rules_active) {
+        return;
+    }
+
+    uint32_t set = eval->set_mask;
+    uint32_t clear = eval->clear_mask & ~set;
+
+    // Dependents follow their prerequisites off; turning one on at the same time is a conflict
+    uint32_t cascade = 0;
+    for (uint32_t bits = clear & current; bits != 0; bits &= bits - 1) {
+        cascade |= rules_dependents[__builtin_ctz(bits)];
+    }
+    uint32_t rejected = set & cascade;
+    cascade &= current & ~clear;
+    clear |= cascade;
+
+    uint32_t new_mask = (current & ~clear) | set;
+    uint32_t turning_on = set & ~current;
+    for (uint32_t bits = turning_on; bits != 0; bits &= bits - 1) {
+        int i = __builtin_ctz(bits);
+        if (rules_requires_all[i] & ~new_mask) {
+            rejected |= 1u << i;
+        }
+    }
+    for (int g = 0; g < relay_interlock_count; g++) {
+        uint32_t on = new_mask & rules_group_mask[g];
+        if (on & (on - 1)) {
+            rejected |= turning_on & rules_group_mask[g];
+        }
+    }
+    if (rejected != 0) {
+        eval->rejected = rejected;
+        rules_stats.rejected++;
+        return;
+    }
+
+    // Earliest time each ON may happen; prerequisites come first in rules_order so a
+    // deferred prerequisite pushes its dependents back too
+    uint32_t going_off = clear & current;
+    int64_t on_at_us[NUM_RELAYS];
+    for (int k = 0; k < NUM_RELAYS; k++) {
+        int i = rules_order[k];
+        uint32_t bit = 1u << i;
+        if (!(turning_on & bit)) {
+            continue;
+        }
+        int64_t due_us = now_us;
+        for (int g = 0; g < relay_interlock_count; g++) {
+            if (rules_group_mask[g] & bit) {
+                int64_t off_us = (going_off & rules_group_mask[g]) ? now_us : rules_group_last_off_us[g];
+                if (off_us + rules_group_dead_us[g] > due_us) {
+                    due_us = off_us + rules_group_dead_us[g];
+                }
+            }
+        }
+        // Also without a delay: a prerequisite held back by its dead-time holds this one too
+        for (uint32_t bits = rules_requires[i]; bits != 0; bits &= bits - 1) {
+            int j = __builtin_ctz(bits);
+            int64_t on_us = (turning_on & (1u << j)) ? on_at_us[j] : rules_last_on_us[j];
+            if (on_us + rules_delay_us[i] > due_us) {
+                due_us = on_us + rules_delay_us[i];
+            }
+        }
+        on_at_us[i] = due_us;
+        if (due_us > now_us) {
+            eval->deferred |= bit;
+            eval->defer_until_us[i] = due_us;
+        }
+    }
+
+    eval->set_mask = set & ~eval->deferred;
+    eval->clear_mask = clear;
+    rules_stats.deferred += __builtin_popcount(eval->deferred);
+    rules_stats.cascaded += __builtin_popcount(cascade);
+}
+
+// Space the ONs of an evaluated commit stagger_us apart, starting after last_on_us.
+// Relays go in dependency order, and a dependent is never given a slot before its
+// prerequisites' slots (plus its delay), so staggering cannot reorder a sequence. ONs the
+// rules already deferred keep their time unless a prerequisite moved later. Called under
+// the relay commit lock.
+void relay_rules_stagger(relay_rules_eval_t *eval, uint32_t current, int64_t now_us, int64_t last_on_us,
+                         int64_t stagger_us)
+{
+    uint32_t turning_on = (eval->set_mask | eval->deferred) & ~current;
+    int64_t on_at_us[NUM_RELAYS];
+    for (int k = 0; k < NUM_RELAYS; k++) {
+        int i = rules_order[k];
+        uint32_t bit = 1u << i;
+        if (!(turning_on & bit)) {
+            continue;
+        }
+        int64_t due_us = (eval->deferred & bit) ? eval->defer_until_us[i] : now_us;
+        for (uint32_t bits = rules_requires[i] & turning_on; bits != 0; bits &= bits - 1) {
+            int j = __builtin_ctz(bits);
+            if (on_at_us[j] + rules_delay_us[i] > due_us) {
+                due_us = on_at_us[j] + rules_delay_us[i];
+            }
+        }
+        if (!(eval->deferred & bit)) {
+            if (last_on_us + stagger_us > due_us) {
+                due_us = last_on_us + stagger_us;
+            }
+            last_on_us = due_us;
+        }
+        on_at_us[i] = due_us;
+        if (due_us > now_us) {
+            eval->set_mask &= ~bit;
+            eval->deferred |= bit;
+            eval->defer_until_us[i] = due_us;
+        }
+    }
+}
+
+// Called under the relay commit lock once the GPIOs are written
+void relay_rules_record(uint32_t old_mask, uint32_t new_mask, int64_t now_us)
+{
+    if (!rules_active) {
+        return;
+    }
+    uint32_t turned_off = old_mask & ~new_mask;
+    for (int g = 0; g < relay_interlock_count; g++) {
+        if (turned_off & rules_group_mask[g]) {
+            rules_group_last_off_us[g] = now_us;
+        }
+    }
+    for (uint32_t bits = new_mask & ~old_mask; bits != 0; bits &= bits - 1) {
+        rules_last_on_us[__builtin_ctz(bits)] = now_us;
+    }
+}
+
+void relay_rules_get_stats(relay_rules_stats_t *stats)
+{
+    *stats = rules_stats;
+}
+
+int relay_rules_get_interlocks(const relay_interlock_t **interlocks)
+{
+    *interlocks = relay_interlocks;
+    return relay_interlock_count;
+}
+
+int relay_rules_get_sequences(const relay_sequence_t **sequences)
+{
+    *sequences = relay_sequences;
+    return relay_sequence_count;
+}
@@ -0,0 +1,70 @@
+#ifndef RELAY_RULES_H
+#define RELAY_RULES_H
+
+#include "esp_err.h"
+#include "relay_control.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Safety rules, fixed at build time and enforced in relay_commit() for every source.
+//
+// Interlock groups: at most one relay of the group may be on. A command that would turn a
+// second one on is rejected as a whole. After any member turns off, no member turns on
+// again before dead_time_ms has passed; such an ON is deferred, not rejected, so
+// {"0": false, "1": true} reverses a motor pair with the dead-time in between.
+//
+// Sequences: a relay may only be on while all relays in its requires mask are on, and
+// turns on no earlier than delay_ms after the last of them did. Turning a required relay
+// off turns its dependents off in the same commit; an ON command without the required
+// relays (on already, or in the same command) is rejected.
+//
+// Example, in the project's compiler flags or before this header is included:
+//   #define RELAY_RULE_INTERLOCKS { .mask = 0x03, .dead_time_ms = 500 },
+//   #define RELAY_RULE_SEQUENCES  { .relay = 3, .requires = 0x04, .delay_ms = 2000 },
+#ifndef RELAY_RULE_INTERLOCKS
+#define RELAY_RULE_INTERLOCKS
+#endif
+#ifndef RELAY_RULE_SEQUENCES
+#define RELAY_RULE_SEQUENCES
+#endif
+
+#define RELAY_RULE_MAX_INTERLOCKS 8
+
+typedef struct {
+    uint32_t mask;
+    uint32_t dead_time_ms;
+} relay_interlock_t;
+
+typedef struct {
+    uint8_t relay;
+    uint32_t requires;
+    uint32_t delay_ms;
+} relay_sequence_t;
+
+// One commit as seen by the rules: set/clear are adjusted in place
+typedef struct {
+    uint32_t set_mask;
+    uint32_t clear_mask;
+    uint32_t rejected;                      // Bits that violate a rule; the commit is refused
+    uint32_t deferred;                      // ONs removed from set_mask until defer_until_us
+    int64_t defer_until_us[NUM_RELAYS];
+} relay_rules_eval_t;
+
+typedef struct {
+    uint32_t rejected;                      // Commands refused
+    uint32_t deferred;                      // ON transitions delayed by dead-time or sequencing
+    uint32_t cascaded;                      // Relays turned off because a required relay went off
+} relay_rules_stats_t;
+
+// Function declarations
+esp_err_t relay_rules_init(void);
+bool relay_rules_active(void);
+void relay_rules_evaluate(uint32_t current, int64_t now_us, relay_rules_eval_t *eval);
+void relay_rules_stagger(relay_rules_eval_t *eval, uint32_t current, int64_t now_us, int64_t last_on_us,
+                         int64_t stagger_us);
+void relay_rules_record(uint32_t old_mask, uint32_t new_mask, int64_t now_us);
+void relay_rules_get_stats(relay_rules_stats_t *stats);
+int relay_rules_get_interlocks(const relay_interlock_t **interlocks);
+int relay_rules_get_sequences(const relay_sequence_t **sequences);
+
+#endif // RELAY_RULES_H
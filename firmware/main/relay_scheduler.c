@@ -0,0 +1,769 @@
+#include "relay_scheduler.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "relay_control.h"
+#include "time_sync.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *TAG = "RELAY_SCHEDULER";
+
+// Hierarchical timer wheel in one-second ticks: 4 levels of 64 slots cover 2^24 s (~194 days).
+// Entries further out are parked in the last top-level slot and re-filed when it cascades.
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_HORIZON (1u << (WHEEL_BITS * WHEEL_LEVELS))
+#define NODE_NONE 0xffff
+
+// Persisted file: header, then one fixed-size little-endian record per entry
+#define SCHEDULE_FILE_MAGIC 0x48435352     // "RSCH"
+#define SCHEDULE_FILE_VERSION 1
+#define SCHEDULE_HEADER_SIZE 8
+#define SCHEDULE_RECORD_SIZE 25
+
+_Static_assert(NUM_RELAYS <= 8, "schedule masks are 8 bits wide");
+_Static_assert(RELAY_SCHEDULE_MAX_ENTRIES < NODE_NONE, "entry index must fit in 16 bits");
+
+// Entry IDs are pool indices, so lookup, insertion and removal are all O(1)
+typedef struct {
+    relay_schedule_t entry;
+    uint32_t expires;       // Next fire time, Unix seconds
+    uint16_t next;          // Wheel slot list, or free list
+    uint16_t prev;
+    uint16_t slot;          // Wheel slot, NODE_NONE when not queued
+    bool used;
+} sched_node_t;
+
+static sched_node_t *sched_nodes = NULL;
+static uint16_t sched_free_head = NODE_NONE;
+static uint16_t sched_wheel[WHEEL_LEVELS * WHEEL_SIZE];
+static uint32_t sched_wheel_time = 0;       // Next second to process
+static bool sched_clock_valid = false;
+static bool sched_dirty = false;
+static int64_t sched_dirty_since_us = 0;
+static SemaphoreHandle_t sched_mutex = NULL;
+static TaskHandle_t sched_task_handle = NULL;
+static esp_timer_handle_t sched_tick_timer = NULL;
+static relay_scheduler_stats_t sched_stats;
+
+static uint32_t sched_now_s(void)
+{
+    return (uint32_t)(time_sync_now_us() / 1000000);
+}
+
+// Cron matching
+
+static bool relay_cron_day_matches(const relay_cron_t *cron, const struct tm *tm)
+{
+    bool days_restricted = (cron->days & 0xfffffffe) != 0xfffffffe;
+    bool weekdays_restricted = (cron->weekdays & 0x7f) != 0x7f;
+    bool day = (cron->days >> tm->tm_mday) & 1;
+    bool weekday = (cron->weekdays >> tm->tm_wday) & 1;
+    return (days_restricted && weekdays_restricted) ? (day || weekday) : (day && weekday);
+}
+
+// First matching minute strictly after 'after', or 0 if none within the search bound
+static uint32_t relay_cron_next(const relay_cron_t *cron, uint32_t after)
+{
+    time_t t = (time_t)after - (after % 60) + 60;
+    struct tm tm;
+    localtime_r(&t, &tm);
+
+    // Each step jumps to the start of the next month, day, hour or minute, so a match
+    // (or proof that none exists, e.g. 30 February) takes a few hundred steps at most
+    for (int steps = 0; steps < 2000; steps++) {
+        if (!((cron->months >> (tm.tm_mon + 1)) & 1)) {
+            tm.tm_mon++;
+            tm.tm_mday = 1;
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+        } else if (!relay_cron_day_matches(cron, &tm)) {
+            tm.tm_mday++;
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+        } else if (!((cron->hours >> tm.tm_hour) & 1)) {
+            tm.tm_hour++;
+            tm.tm_min = 0;
+        } else if (!((cron->minutes >> tm.tm_min) & 1)) {
+            tm.tm_min++;
+        } else {
+            return (uint32_t)t;
+        }
+        tm.tm_sec = 0;
+        tm.tm_isdst = -1;
+        t = mktime(&tm);
+        localtime_r(&t, &tm);
+    }
+    return 0;
+}
+
+// Field: "*" or a comma-separated list of "n", "n-m", each optionally followed by "/step"
+static esp_err_t relay_cron_parse_field(const char *field, size_t len, int min, int max, uint64_t *mask)
+{
+    *mask = 0;
+    const char *p = field;
+    const char *end = field + len;
+    while (p < end) {
+        int lo, hi, step = 1;
+        char *next;
+        if (*p == '*') {
+            lo = min;
+            hi = max;
+            p++;
+        } else {
+            lo = hi = (int)strtol(p, &next, 10);
+            if (next == p) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            p = next;
+            if (p < end && *p == '-') {
+                hi = (int)strtol(p + 1, &next, 10);
+                if (next == p + 1) {
+                    return ESP_ERR_INVALID_ARG;
+                }
+                p = next;
+            }
+        }
+        if (p < end && *p == '/') {
+            step = (int)strtol(p + 1, &next, 10);
+            if (next == p + 1 || step <= 0) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            p = next;
+        }
+        if (lo < min || hi > max || lo > hi || (p < end && *p != ',')) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        for (int v = lo; v <= hi; v += step) {
+            *mask |= 1ull << v;
+        }
+        if (p < end) {
+            p++;
+        }
+    }
+    return *mask != 0 ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+// Standard five-field expression: "minute hour day month weekday", weekday 0-7 (0 and 7 = Sunday)
+esp_err_t relay_cron_parse(const char *expr, relay_cron_t *cron)
+{
+    static const int limits[5][2] = { { 0, 59 }, { 0, 23 }, { 1, 31 }, { 1, 12 }, { 0, 7 } };
+    uint64_t masks[5];
+    const char *p = expr;
+
+    for (int i = 0; i < 5; i++) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        size_t len = strcspn(p, " \t");
+        if (len == 0 || relay_cron_parse_field(p, len, limits[i][0], limits[i][1], &masks[i]) != ESP_OK) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        p += len;
+    }
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p != '\0') {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    cron->minutes = masks[0];
+    cron->hours = (uint32_t)masks[1];
+    cron->days = (uint32_t)masks[2];
+    cron->months = (uint16_t)masks[3];
+    cron->weekdays = (uint8_t)((masks[4] | (masks[4] >> 7)) & 0x7f);
+    return ESP_OK;
+}
+
+// Greedy: "*" or "*/step" for the whole field, otherwise runs of consecutive values as "a-b",
+// progressions of three or more as "a-b/step" and everything left as single values. No token
+// takes more than three characters per value it covers, which RELAY_CRON_MAX_LEN relies on.
+static int relay_cron_format_field(uint64_t mask, int min, int max, char *buf, size_t buf_size)
+{
+    uint64_t full = ((max == 63 ? 0 : (1ull << (max + 1))) - 1) & ~((1ull << min) - 1);
+    uint64_t rest = mask & full;
+    if (rest == full) {
+        return snprintf(buf, buf_size, "*");
+    }
+
+    int len = 0;
+    for (int v = min; v <= max && len < (int)buf_size; v++) {
+        if (!((rest >> v) & 1)) {
+            continue;
+        }
+        const char *sep = len > 0 ? "," : "";
+        int run_end = v;
+        while (run_end < max && ((rest >> (run_end + 1)) & 1)) {
+            run_end++;
+        }
+        if (run_end > v) {
+            len += snprintf(buf + len, buf_size - len, "%s%d-%d", sep, v, run_end);
+            rest &= ~(((run_end == 63 ? 0 : (1ull << (run_end + 1))) - 1) & ~((1ull << v) - 1));
+            v = run_end;
+            continue;
+        }
+
+        int step = 0;
+        for (int w = v + 1; w <= max; w++) {
+            if ((rest >> w) & 1) {
+                step = w - v;
+                break;
+            }
+        }
+        int last = v;
+        uint64_t taken = 1ull << v;
+        while (step > 0 && last + step <= max && ((rest >> (last + step)) & 1)) {
+            last += step;
+            taken |= 1ull << last;
+        }
+        if (last >= v + 2 * step && step > 0) {
+            if (v == min && last + step > max) {
+                len += snprintf(buf + len, buf_size - len, "%s*/%d", sep, step);
+            } else {
+                len += snprintf(buf + len, buf_size - len, "%s%d-%d/%d", sep, v, last, step);
+            }
+            rest &= ~taken;
+        } else {
+            len += snprintf(buf + len, buf_size - len, "%s%d", sep, v);
+            rest &= ~(1ull << v);
+        }
+    }
+    return len;
+}
+
+// Canonical five-field form of the masks; returns the length as snprintf does
+int relay_cron_format(const relay_cron_t *cron, char *buf, size_t buf_size)
+{
+    const uint64_t masks[5] = { cron->minutes, cron->hours, cron->days, cron->months, cron->weekdays };
+    static const int limits[5][2] = { { 0, 59 }, { 0, 23 }, { 1, 31 }, { 1, 12 }, { 0, 6 } };
+    int len = 0;
+    for (int i = 0; i < 5 && len < (int)buf_size; i++) {
+        if (i > 0) {
+            buf[len++] = ' ';
+        }
+        if (len < (int)buf_size) {
+            len += relay_cron_format_field(masks[i], limits[i][0], limits[i][1], buf + len, buf_size - len);
+        }
+    }
+    if (len >= (int)buf_size) {
+        buf[buf_size - 1] = '\0';
+    }
+    return len;
+}
+
+// Timer wheel
+
+static void sched_wheel_link(uint16_t slot, uint16_t idx)
+{
+    sched_node_t *node = &sched_nodes[idx];
+    node->slot = slot;
+    node->prev = NODE_NONE;
+    node->next = sched_wheel[slot];
+    if (node->next != NODE_NONE) {
+        sched_nodes[node->next].prev = idx;
+    }
+    sched_wheel[slot] = idx;
+}
+
+static void sched_wheel_unlink(uint16_t idx)
+{
+    sched_node_t *node = &sched_nodes[idx];
+    if (node->slot == NODE_NONE) {
+        return;
+    }
+    if (node->prev != NODE_NONE) {
+        sched_nodes[node->prev].next = node->next;
+    } else {
+        sched_wheel[node->slot] = node->next;
+    }
+    if (node->next != NODE_NONE) {
+        sched_nodes[node->next].prev = node->prev;
+    }
+    node->slot = NODE_NONE;
+}
+
+static void sched_wheel_insert(uint16_t idx)
+{
+    uint32_t expires = sched_nodes[idx].expires;
+    if ((int32_t)(expires - sched_wheel_time) < 0) {
+        expires = sched_wheel_time;
+    }
+    uint32_t delta = expires - sched_wheel_time;
+    if (delta >= WHEEL_HORIZON) {
+        expires = sched_wheel_time + WHEEL_HORIZON - 1;
+        delta = WHEEL_HORIZON - 1;
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1u << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    sched_wheel_link(level * WHEEL_SIZE + ((expires >> (WHEEL_BITS * level)) & WHEEL_MASK), idx);
+}
+
+// Re-file a higher-level slot; its entries land in lower levels as their time approaches
+static void sched_wheel_cascade(int level)
+{
+    uint16_t slot = level * WHEEL_SIZE + ((sched_wheel_time >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    uint16_t idx = sched_wheel[slot];
+    sched_wheel[slot] = NODE_NONE;
+    while (idx != NODE_NONE) {
+        uint16_t next = sched_nodes[idx].next;
+        sched_wheel_insert(idx);
+        idx = next;
+    }
+}
+
+// Compute the next fire time and queue the entry; false if it will never fire again
+static bool sched_arm(uint16_t idx, uint32_t after)
+{
+    sched_node_t *node = &sched_nodes[idx];
+    sched_wheel_unlink(idx);
+    if (!node->entry.enabled || !sched_clock_valid) {
+        return true;
+    }
+    if (node->entry.type == RELAY_SCHEDULE_ONE_SHOT) {
+        if (node->entry.at <= after) {
+            return false;
+        }
+        node->expires = node->entry.at;
+    } else {
+        node->expires = relay_cron_next(&node->entry.cron, after);
+        if (node->expires == 0) {
+            return false;
+        }
+    }
+    sched_wheel_insert(idx);
+    return true;
+}
+
+static void sched_mark_dirty(void)
+{
+    if (!sched_dirty) {
+        sched_dirty = true;
+        sched_dirty_since_us = esp_timer_get_time();
+    }
+}
+
+static void sched_free_node(uint16_t idx)
+{
+    sched_wheel_unlink(idx);
+    sched_nodes[idx].used = false;
+    sched_nodes[idx].next = sched_free_head;
+    sched_free_head = idx;
+    sched_stats.entries--;
+    sched_mark_dirty();
+}
+
+// Free list in index order so new entries get the lowest free IDs
+static void sched_rebuild_free_list(void)
+{
+    sched_free_head = NODE_NONE;
+    for (int i = RELAY_SCHEDULE_MAX_ENTRIES - 1; i >= 0; i--) {
+        if (!sched_nodes[i].used) {
+            sched_nodes[i].next = sched_free_head;
+            sched_free_head = i;
+        }
+    }
+}
+
+// O(n) re-filing of every entry, used when the clock first becomes valid or steps
+static void sched_rebuild(uint32_t now)
+{
+    for (int i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++) {
+        sched_wheel[i] = NODE_NONE;
+    }
+    sched_wheel_time = now;
+    for (int i = 0; i < RELAY_SCHEDULE_MAX_ENTRIES; i++) {
+        if (!sched_nodes[i].used) {
+            continue;
+        }
+        sched_nodes[i].slot = NODE_NONE;
+        if (!sched_arm(i, now - 1)) {
+            ESP_LOGW(TAG, "Schedule %d expired while the clock was not set; removing", i);
+            sched_free_node(i);
+        }
+    }
+}
+
+// Process one second; fired actions are merged in order into one set/clear pair
+static void sched_process_tick(uint32_t *set_mask, uint32_t *clear_mask)
+{
+    uint32_t now = sched_wheel_time;
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if ((now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) {
+            break;
+        }
+        sched_wheel_cascade(level);
+    }
+
+    uint16_t slot = now & WHEEL_MASK;
+    uint16_t idx = sched_wheel[slot];
+    sched_wheel[slot] = NODE_NONE;
+    while (idx != NODE_NONE) {
+        sched_node_t *node = &sched_nodes[idx];
+        uint16_t next = node->next;
+        node->slot = NODE_NONE;
+
+        *set_mask = (*set_mask & ~node->entry.clear_mask) | node->entry.set_mask;
+        *clear_mask = (*clear_mask & ~node->entry.set_mask) | node->entry.clear_mask;
+        sched_stats.fired++;
+        if (!sched_arm(idx, now)) {
+            sched_free_node(idx);
+        }
+        idx = next;
+    }
+    sched_wheel_time = now + 1;
+}
+
+// Persistence
+
+static void sched_put_le(uint8_t *p, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint64_t sched_get_le(const uint8_t *p, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+static void sched_encode(const relay_schedule_t *e, uint8_t *rec)
+{
+    memset(rec, 0, SCHEDULE_RECORD_SIZE);
+    sched_put_le(rec, e->id, 2);
+    rec[2] = e->type;
+    rec[3] = e->enabled ? 1 : 0;
+    rec[4] = e->set_mask;
+    rec[5] = e->clear_mask;
+    if (e->type == RELAY_SCHEDULE_ONE_SHOT) {
+        sched_put_le(rec + 6, e->at, 4);
+    } else {
+        sched_put_le(rec + 6, e->cron.minutes, 8);
+        sched_put_le(rec + 14, e->cron.hours, 4);
+        sched_put_le(rec + 18, e->cron.days, 4);
+        sched_put_le(rec + 22, e->cron.months, 2);
+        rec[24] = e->cron.weekdays;
+    }
+}
+
+static void sched_decode(const uint8_t *rec, relay_schedule_t *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->id = (uint16_t)sched_get_le(rec, 2);
+    e->type = rec[2];
+    e->enabled = rec[3] & 1;
+    e->set_mask = rec[4];
+    e->clear_mask = rec[5];
+    if (e->type == RELAY_SCHEDULE_ONE_SHOT) {
+        e->at = (uint32_t)sched_get_le(rec + 6, 4);
+    } else {
+        e->cron.minutes = sched_get_le(rec + 6, 8);
+        e->cron.hours = (uint32_t)sched_get_le(rec + 14, 4);
+        e->cron.days = (uint32_t)sched_get_le(rec + 18, 4);
+        e->cron.months = (uint16_t)sched_get_le(rec + 22, 2);
+        e->cron.weekdays = rec[24];
+    }
+}
+
+static void sched_load(void)
+{
+    FILE *f = fopen(RELAY_SCHEDULE_FILE, "rb");
+    if (f == NULL) {
+        ESP_LOGI(TAG, "No saved schedules");
+        return;
+    }
+
+    uint8_t header[SCHEDULE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+        sched_get_le(header, 4) != SCHEDULE_FILE_MAGIC || header[4] != SCHEDULE_FILE_VERSION) {
+        ESP_LOGW(TAG, "Ignoring unrecognized schedule file");
+        fclose(f);
+        return;
+    }
+
+    uint16_t count = (uint16_t)sched_get_le(header + 6, 2);
+    uint8_t rec[SCHEDULE_RECORD_SIZE];
+    for (uint16_t i = 0; i < count && fread(rec, 1, sizeof(rec), f) == sizeof(rec); i++) {
+        relay_schedule_t entry;
+        sched_decode(rec, &entry);
+        if (entry.id >= RELAY_SCHEDULE_MAX_ENTRIES || sched_nodes[entry.id].used ||
+            entry.type > RELAY_SCHEDULE_RECURRING || ((entry.set_mask | entry.clear_mask) & ~RELAY_ALL_MASK)) {
+            ESP_LOGW(TAG, "Skipping invalid schedule record %u", i);
+            continue;
+        }
+        sched_nodes[entry.id].entry = entry;
+        sched_nodes[entry.id].used = true;
+        sched_stats.entries++;
+    }
+    fclose(f);
+    ESP_LOGI(TAG, "Loaded %u schedules", sched_stats.entries);
+}
+
+// Serialize under the lock, write without it: a slow flash write never delays a tick
+static void sched_save(void)
+{
+    xSemaphoreTake(sched_mutex, portMAX_DELAY);
+    size_t size = SCHEDULE_HEADER_SIZE + (size_t)sched_stats.entries * SCHEDULE_RECORD_SIZE;
+    uint8_t *buf = malloc(size);
+    if (buf == NULL) {
+        xSemaphoreGive(sched_mutex);
+        ESP_LOGE(TAG, "No memory to save schedules");
+        return;
+    }
+    sched_put_le(buf, SCHEDULE_FILE_MAGIC, 4);
+    buf[4] = SCHEDULE_FILE_VERSION;
+    buf[5] = 0;
+    sched_put_le(buf + 6, sched_stats.entries, 2);
+    uint8_t *rec = buf + SCHEDULE_HEADER_SIZE;
+    for (int i = 0; i < RELAY_SCHEDULE_MAX_ENTRIES; i++) {
+        if (sched_nodes[i].used) {
+            sched_encode(&sched_nodes[i].entry, rec);
+            rec += SCHEDULE_RECORD_SIZE;
+        }
+    }
+    sched_dirty = false;
+    xSemaphoreGive(sched_mutex);
+
+    // Write a new file and rename it over the old one so a reset never leaves a torn file
+    FILE *f = fopen(RELAY_SCHEDULE_FILE ".tmp", "wb");
+    bool ok = f != NULL && fwrite(buf, 1, size, f) == size;
+    if (f != NULL) {
+        ok = (fclose(f) == 0) && ok;
+    }
+    free(buf);
+    if (!ok || rename(RELAY_SCHEDULE_FILE ".tmp", RELAY_SCHEDULE_FILE) != 0) {
+        ESP_LOGE(TAG, "Failed to save schedules");
+        xSemaphoreTake(sched_mutex, portMAX_DELAY);
+        sched_mark_dirty();
+        xSemaphoreGive(sched_mutex);
+    }
+}
+
+// Scheduler task
+
+// The tick timer is re-armed for just after each wall-clock second boundary
+static void sched_tick_callback(void *arg)
+{
+    xTaskNotifyGive(sched_task_handle);
+}
+
+static void relay_scheduler_task(void *arg)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        uint32_t set_mask = 0;
+        uint32_t clear_mask = 0;
+        xSemaphoreTake(sched_mutex, portMAX_DELAY);
+        if (time_sync_is_synced()) {
+            uint32_t now = sched_now_s();
+            int32_t behind = (int32_t)(now - sched_wheel_time);
+            if (!sched_clock_valid || behind > RELAY_SCHEDULE_MAX_CATCHUP_S || behind < -1) {
+                if (sched_clock_valid) {
+                    ESP_LOGW(TAG, "Clock stepped by %ld s; rebuilding schedule wheel", (long)behind);
+                    sched_stats.rebuilds++;
+                }
+                sched_clock_valid = true;
+                sched_rebuild(now);
+            }
+            while ((int32_t)(now - sched_wheel_time) >= 0) {
+                sched_process_tick(&set_mask, &clear_mask);
+            }
+        }
+        bool save = sched_dirty &&
+                    esp_timer_get_time() - sched_dirty_since_us >= (int64_t)RELAY_SCHEDULE_SAVE_DELAY_MS * 1000;
+        xSemaphoreGive(sched_mutex);
+
+        if (set_mask | clear_mask) {
+            relay_commit_info_t info;
+            uint32_t previous_mask = relay_get_mask();
+            if (relay_commit(set_mask, clear_mask, RELAY_SOURCE_SCHEDULE, &info) == ESP_OK &&
+                info.mask != previous_mask) {
+                relay_publish_status_async();
+            }
+        }
+        if (save) {
+            sched_save();
+        }
+
+        int64_t now_us = time_sync_now_us();
+        esp_timer_start_once(sched_tick_timer, 1000000 - (now_us % 1000000) + 1000);
+    }
+}
+
+esp_err_t relay_scheduler_init(void)
+{
+    // The HTTP handlers may already be running: they see the mutex only once it is held, and
+    // wait on it until the table is loaded
+    sched_nodes = calloc(RELAY_SCHEDULE_MAX_ENTRIES, sizeof(sched_node_t));
+    SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+    if (sched_nodes == NULL || mutex == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate scheduler");
+        return ESP_ERR_NO_MEM;
+    }
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    sched_mutex = mutex;
+    for (int i = 0; i < RELAY_SCHEDULE_MAX_ENTRIES; i++) {
+        sched_nodes[i].slot = NODE_NONE;
+    }
+    for (int i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++) {
+        sched_wheel[i] = NODE_NONE;
+    }
+    sched_load();
+    sched_rebuild_free_list();
+    xSemaphoreGive(sched_mutex);
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = sched_tick_callback,
+        .name = "sched_tick",
+    };
+    esp_err_t ret = esp_timer_create(&timer_args, &sched_tick_timer);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create tick timer: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    if (xTaskCreate(relay_scheduler_task, "relay_sched", RELAY_SCHEDULER_TASK_STACK_SIZE, NULL,
+                    RELAY_SCHEDULER_TASK_PRIORITY, &sched_task_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create scheduler task");
+        return ESP_FAIL;
+    }
+    xTaskNotifyGive(sched_task_handle);
+    return ESP_OK;
+}
+
+esp_err_t relay_scheduler_add(relay_schedule_t *entry)
+{
+    if (entry->type > RELAY_SCHEDULE_RECURRING || ((entry->set_mask | entry->clear_mask) & ~RELAY_ALL_MASK)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Not initialized yet; ESP_ERR_INVALID_STATE already means "never fires" here
+    if (sched_mutex == NULL) {
+        return ESP_FAIL;
+    }
+
+    xSemaphoreTake(sched_mutex, portMAX_DELAY);
+    if (sched_free_head == NODE_NONE) {
+        xSemaphoreGive(sched_mutex);
+        return ESP_ERR_NO_MEM;
+    }
+    uint16_t idx = sched_free_head;
+    sched_node_t *node = &sched_nodes[idx];
+    sched_free_head = node->next;
+
+    entry->id = idx;
+    node->entry = *entry;
+    node->used = true;
+    node->slot = NODE_NONE;
+    sched_stats.entries++;
+
+    // Without a valid clock the entry is only checked once time is known
+    esp_err_t ret = ESP_OK;
+    if (!sched_arm(idx, sched_wheel_time - 1)) {
+        sched_free_node(idx);
+        ret = ESP_ERR_INVALID_STATE;
+    } else {
+        sched_mark_dirty();
+    }
+    xSemaphoreGive(sched_mutex);
+    return ret;
+}
+
+esp_err_t relay_scheduler_remove(uint16_t id)
+{
+    if (sched_mutex == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(sched_mutex, portMAX_DELAY);
+    if (id < RELAY_SCHEDULE_MAX_ENTRIES && sched_nodes[id].used) {
+        sched_free_node(id);
+        ret = ESP_OK;
+    }
+    xSemaphoreGive(sched_mutex);
+    return ret;
+}
+
+esp_err_t relay_scheduler_set_enabled(uint16_t id, bool enabled)
+{
+    if (sched_mutex == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(sched_mutex, portMAX_DELAY);
+    if (id < RELAY_SCHEDULE_MAX_ENTRIES && sched_nodes[id].used) {
+        sched_nodes[id].entry.enabled = enabled;
+        ret = ESP_OK;
+        if (!sched_arm(id, sched_wheel_time - 1)) {
+            sched_free_node(id);
+            ret = ESP_ERR_INVALID_STATE;
+        }
+        sched_mark_dirty();
+    }
+    xSemaphoreGive(sched_mutex);
+    return ret;
+}
+
+void relay_scheduler_clear(void)
+{
+    if (sched_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(sched_mutex, portMAX_DELAY);
+    for (int i = 0; i < RELAY_SCHEDULE_MAX_ENTRIES; i++) {
+        sched_nodes[i].used = false;
+        sched_nodes[i].slot = NODE_NONE;
+    }
+    for (int i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++) {
+        sched_wheel[i] = NODE_NONE;
+    }
+    sched_rebuild_free_list();
+    sched_stats.entries = 0;
+    sched_mark_dirty();
+    xSemaphoreGive(sched_mutex);
+}
+
+// Copy up to max_entries entries with id >= start_id; next[i] is 0 while not queued
+int relay_scheduler_list(uint16_t start_id, relay_schedule_t *entries, uint32_t *next, int max_entries)
+{
+    int count = 0;
+    if (sched_mutex == NULL) {
+        return 0;
+    }
+    xSemaphoreTake(sched_mutex, portMAX_DELAY);
+    for (int i = start_id; i < RELAY_SCHEDULE_MAX_ENTRIES && count < max_entries; i++) {
+        if (sched_nodes[i].used) {
+            entries[count] = sched_nodes[i].entry;
+            next[count] = sched_nodes[i].slot != NODE_NONE ? sched_nodes[i].expires : 0;
+            count++;
+        }
+    }
+    xSemaphoreGive(sched_mutex);
+    return count;
+}
+
+void relay_scheduler_get_stats(relay_scheduler_stats_t *stats)
+{
+    if (sched_mutex == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    xSemaphoreTake(sched_mutex, portMAX_DELAY);
+    *stats = sched_stats;
+    stats->clock_valid = sched_clock_valid;
+    xSemaphoreGive(sched_mutex);
+}
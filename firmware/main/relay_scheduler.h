@@ -0,0 +1,80 @@
+#ifndef RELAY_SCHEDULER_H
+#define RELAY_SCHEDULER_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Scheduler configuration
+#ifndef RELAY_SCHEDULE_MAX_ENTRIES
+#define RELAY_SCHEDULE_MAX_ENTRIES 512
+#endif
+#ifndef RELAY_SCHEDULE_FILE
+#define RELAY_SCHEDULE_FILE "/www/schedules.bin"
+#endif
+// Changes are written back at most this often
+#ifndef RELAY_SCHEDULE_SAVE_DELAY_MS
+#define RELAY_SCHEDULE_SAVE_DELAY_MS 5000
+#endif
+// A wall-clock step larger than this (SNTP correction, first sync) rebuilds the wheel
+#ifndef RELAY_SCHEDULE_MAX_CATCHUP_S
+#define RELAY_SCHEDULE_MAX_CATCHUP_S 120
+#endif
+#ifndef RELAY_SCHEDULER_TASK_PRIORITY
+#define RELAY_SCHEDULER_TASK_PRIORITY 4
+#endif
+#ifndef RELAY_SCHEDULER_TASK_STACK_SIZE
+#define RELAY_SCHEDULER_TASK_STACK_SIZE 4096
+#endif
+
+// Longest relay_cron_format() output including the terminator: at most three characters per
+// value a field can hold
+#define RELAY_CRON_MAX_LEN ((60 + 24 + 31 + 12 + 7) * 3 + 5)
+
+typedef enum {
+    RELAY_SCHEDULE_ONE_SHOT = 0,    // Fires once at a Unix time, then is deleted
+    RELAY_SCHEDULE_RECURRING,       // Fires on every minute matching the cron masks
+} relay_schedule_type_t;
+
+// Cron fields as bitmasks, evaluated in local time (TIME_SYNC_TZ). As in cron, when both
+// days and weekdays are restricted a day matching either one fires.
+typedef struct {
+    uint64_t minutes;               // Bits 0-59
+    uint32_t hours;                 // Bits 0-23
+    uint32_t days;                  // Bits 1-31
+    uint16_t months;                // Bits 1-12
+    uint8_t weekdays;               // Bits 0-6, Sunday = 0
+} relay_cron_t;
+
+typedef struct {
+    uint16_t id;                    // Assigned by relay_scheduler_add()
+    uint8_t type;                   // relay_schedule_type_t
+    bool enabled;
+    uint8_t set_mask;               // Relays turned on when the entry fires
+    uint8_t clear_mask;             // Relays turned off (set wins if both)
+    union {
+        uint32_t at;                // RELAY_SCHEDULE_ONE_SHOT: Unix time in seconds
+        relay_cron_t cron;          // RELAY_SCHEDULE_RECURRING
+    };
+} relay_schedule_t;
+
+typedef struct {
+    uint16_t entries;
+    uint32_t fired;
+    uint32_t rebuilds;              // Wheel rebuilt after a clock step
+    bool clock_valid;               // False until SNTP has set the clock
+} relay_scheduler_stats_t;
+
+// Function declarations
+esp_err_t relay_scheduler_init(void);
+esp_err_t relay_scheduler_add(relay_schedule_t *entry);
+esp_err_t relay_scheduler_remove(uint16_t id);
+esp_err_t relay_scheduler_set_enabled(uint16_t id, bool enabled);
+void relay_scheduler_clear(void);
+int relay_scheduler_list(uint16_t start_id, relay_schedule_t *entries, uint32_t *next, int max_entries);
+void relay_scheduler_get_stats(relay_scheduler_stats_t *stats);
+esp_err_t relay_cron_parse(const char *expr, relay_cron_t *cron);
+int relay_cron_format(const relay_cron_t *cron, char *buf, size_t buf_size);
+
+#endif // RELAY_SCHEDULER_H
@@ -0,0 +1,510 @@
+#include "relay_timer.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "cJSON.h"
+#include "relay_control.h"
+#include <string.h>
+
+static const char *TAG = "RELAY_TIMER";
+
+#define NVS_NAMESPACE "relay_timer"
+#define NVS_KEY_AUTO_OFF "auto_off"
+
+typedef struct {
+    esp_timer_handle_t timer;
+    uint8_t mode;               // relay_timer_mode_t
+    bool next_on;               // Blink: state applied at the next transition
+    uint32_t on_ms;
+    uint32_t off_ms;
+    uint32_t remaining;
+    int64_t due_us;
+    uint32_t generation;        // Bumped on every stop, so a caller can tell it was superseded
+} relay_timer_slot_t;
+
+typedef struct {
+    esp_timer_handle_t timer;
+    relay_timer_bench_t state;
+    bool next_on;
+    int64_t due_us;
+} relay_timer_bench_run_t;
+
+// Slot, benchmark and jitter state. Only held for bookkeeping and esp_timer calls (which take
+// nothing but esp_timer's own spinlock): never across relay_commit() or NVS, since it is taken
+// in the esp_timer task and in the change listener. A command from another source that lands
+// between a timed transition's bookkeeping and its GPIO write is overridden by it, as if it had
+// come a few microseconds earlier.
+static portMUX_TYPE relay_timer_lock = portMUX_INITIALIZER_UNLOCKED;
+// Serializes relay_set_auto_off() so NVS always ends up with the latest settings
+static SemaphoreHandle_t relay_timer_save_mutex = NULL;
+static relay_timer_slot_t relay_slots[NUM_RELAYS];
+static uint32_t relay_auto_off_ms[NUM_RELAYS];
+static relay_timer_bench_run_t relay_bench;
+static relay_jitter_stats_t relay_live_jitter;
+static relay_jitter_stats_t relay_bench_jitter;
+
+static void relay_jitter_record(relay_jitter_stats_t *stats, int64_t late_us, int64_t commit_late_us)
+{
+    int32_t late = late_us > INT32_MAX ? INT32_MAX : (int32_t)late_us;
+    if (stats->samples == 0 || late < stats->min_us) {
+        stats->min_us = late;
+    }
+    if (stats->samples == 0 || late > stats->max_us) {
+        stats->max_us = late;
+    }
+    if (commit_late_us > stats->max_commit_us) {
+        stats->max_commit_us = commit_late_us > INT32_MAX ? INT32_MAX : (int32_t)commit_late_us;
+    }
+    stats->samples++;
+    stats->sum_us += late;
+
+    int bucket = 0;
+    while (bucket < RELAY_JITTER_BUCKETS - 1 && late >= (1 << bucket)) {
+        bucket++;
+    }
+    stats->histogram[bucket]++;
+}
+
+// Arm the slot timer for its due time; a transition that is already due runs at once
+static void relay_timer_arm(esp_timer_handle_t timer, int64_t due_us)
+{
+    int64_t delay = due_us - esp_timer_get_time();
+    esp_timer_stop(timer);
+    esp_timer_start_once(timer, delay > 0 ? (uint64_t)delay : 0);
+}
+
+// Call with relay_timer_lock held
+static void relay_timer_stop_slot(int relay_id)
+{
+    esp_timer_stop(relay_slots[relay_id].timer);
+    relay_slots[relay_id].mode = RELAY_TIMER_MODE_NONE;
+    relay_slots[relay_id].generation++;
+}
+
+// When a timer's ON actually lands: an interlock dead-time or sequence delay defers it, and
+// the ON phase has to be measured from then or its own OFF would cancel it before it applies
+static int64_t relay_timer_on_at(int relay_id, const relay_commit_info_t *info)
+{
+    int64_t due_us[NUM_RELAYS];
+    if ((info->deferred & (1u << relay_id)) && (relay_get_pending(due_us) & (1u << relay_id))) {
+        return due_us[relay_id];
+    }
+    return info->applied_at_us;
+}
+
+static void relay_timer_callback(void *arg)
+{
+    int relay_id = (int)(intptr_t)arg;
+    int64_t fired_us = esp_timer_get_time();
+    relay_timer_slot_t *slot = &relay_slots[relay_id];
+
+    portENTER_CRITICAL(&relay_timer_lock);
+    if (slot->mode == RELAY_TIMER_MODE_NONE) {
+        portEXIT_CRITICAL(&relay_timer_lock);
+        return; // Cancelled after the timer had already fired
+    }
+
+    int64_t due_us = slot->due_us;
+    uint32_t generation = slot->generation;
+    bool on = false;
+    if (slot->mode == RELAY_TIMER_MODE_BLINK) {
+        on = slot->next_on;
+        if (slot->remaining > 0 && --slot->remaining == 0) {
+            slot->mode = RELAY_TIMER_MODE_NONE;
+        } else {
+            // Next transition relative to the intended time, so jitter does not accumulate
+            slot->next_on = !on;
+            slot->due_us += (int64_t)(on ? slot->on_ms : slot->off_ms) * 1000;
+            relay_timer_arm(slot->timer, slot->due_us);
+        }
+    } else {
+        slot->mode = RELAY_TIMER_MODE_NONE;
+    }
+    portEXIT_CRITICAL(&relay_timer_lock);
+
+    uint32_t bit = 1u << relay_id;
+    relay_commit_info_t info;
+    uint32_t previous_mask = relay_get_mask();
+    // Single-relay transitions on a fixed timebase: not subject to the ON stagger
+    esp_err_t ret = relay_commit_staggered(on ? bit : 0, on ? 0 : bit, RELAY_SOURCE_TIMER, 0, &info);
+    if (ret == ESP_OK) {
+        int64_t on_at_us = on ? relay_timer_on_at(relay_id, &info) : 0;
+        portENTER_CRITICAL(&relay_timer_lock);
+        relay_jitter_record(&relay_live_jitter, fired_us - due_us, info.applied_at_us - due_us);
+        if (on && on_at_us != info.applied_at_us && slot->generation == generation &&
+            slot->mode == RELAY_TIMER_MODE_BLINK) {
+            slot->due_us = on_at_us + (int64_t)slot->on_ms * 1000;
+            relay_timer_arm(slot->timer, slot->due_us);
+        }
+        portEXIT_CRITICAL(&relay_timer_lock);
+    }
+
+    if (ret == ESP_OK && info.mask != previous_mask) {
+        relay_publish_status_async();
+    }
+}
+
+static void relay_timer_bench_callback(void *arg)
+{
+    int64_t fired_us = esp_timer_get_time();
+    relay_timer_bench_run_t *bench = &relay_bench;
+
+    portENTER_CRITICAL(&relay_timer_lock);
+    if (!bench->state.running) {
+        portEXIT_CRITICAL(&relay_timer_lock);
+        return;
+    }
+    int64_t due_us = bench->due_us;
+    bool dry = bench->state.dry;
+    bool on = bench->next_on;
+    uint32_t bit = 1u << bench->state.relay;
+    bench->next_on = !on;
+    bool done = --bench->state.remaining == 0;
+    if (done) {
+        bench->state.running = false;
+    } else {
+        bench->due_us += bench->state.period_us;
+        relay_timer_arm(bench->timer, bench->due_us);
+    }
+    portEXIT_CRITICAL(&relay_timer_lock);
+
+    int64_t applied_us = fired_us;
+    relay_commit_info_t info;
+    if (!dry && relay_commit_staggered(on ? bit : 0, on ? 0 : bit, RELAY_SOURCE_TIMER, 0, &info) == ESP_OK) {
+        applied_us = info.applied_at_us;
+    }
+
+    portENTER_CRITICAL(&relay_timer_lock);
+    relay_jitter_record(&relay_bench_jitter, fired_us - due_us, applied_us - due_us);
+    relay_jitter_stats_t stats = relay_bench_jitter;
+    portEXIT_CRITICAL(&relay_timer_lock);
+
+    if (done) {
+        ESP_LOGI(TAG, "Benchmark done: %lu samples, lateness min %ld us, max %ld us, mean %lld us",
+                 (unsigned long)stats.samples, (long)stats.min_us, (long)stats.max_us,
+                 (long long)(stats.sum_us / (stats.samples ? stats.samples : 1)));
+    }
+}
+
+// Commits from other sources cancel pulse/blink on the relays they touch and start or
+// stop auto-off countdowns
+static void relay_timer_on_change(uint32_t mask, uint32_t changed, relay_source_t source)
+{
+    if (source == RELAY_SOURCE_TIMER) {
+        return;
+    }
+
+    portENTER_CRITICAL(&relay_timer_lock);
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        if (!(changed & (1u << i))) {
+            continue;
+        }
+        relay_timer_slot_t *slot = &relay_slots[i];
+        if (slot->mode != RELAY_TIMER_MODE_NONE) {
+            relay_timer_stop_slot(i);
+        }
+        if ((mask & (1u << i)) && relay_auto_off_ms[i] > 0) {
+            slot->mode = RELAY_TIMER_MODE_AUTO_OFF;
+            slot->due_us = esp_timer_get_time() + (int64_t)relay_auto_off_ms[i] * 1000;
+            relay_timer_arm(slot->timer, slot->due_us);
+        }
+    }
+    portEXIT_CRITICAL(&relay_timer_lock);
+}
+
+static esp_err_t relay_timer_save_auto_off(const uint32_t values[NUM_RELAYS])
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return err;
+    }
+    err = nvs_set_blob(nvs_handle, NVS_KEY_AUTO_OFF, values, sizeof(relay_auto_off_ms));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs_handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save auto-off settings: %s", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+    return err;
+}
+
+static void relay_timer_load_auto_off(void)
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
+        return;
+    }
+    uint32_t values[NUM_RELAYS];
+    size_t len = sizeof(values);
+    if (nvs_get_blob(nvs_handle, NVS_KEY_AUTO_OFF, values, &len) == ESP_OK && len == sizeof(values)) {
+        for (int i = 0; i < NUM_RELAYS; i++) {
+            relay_auto_off_ms[i] = values[i] <= RELAY_TIMER_MAX_MS ? values[i] : 0;
+        }
+    }
+    nvs_close(nvs_handle);
+}
+
+esp_err_t relay_timer_init(void)
+{
+    relay_timer_save_mutex = xSemaphoreCreateMutex();
+    if (relay_timer_save_mutex == NULL) {
+        ESP_LOGE(TAG, "Failed to create relay timer mutex");
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        const esp_timer_create_args_t args = {
+            .callback = relay_timer_callback,
+            .arg = (void *)(intptr_t)i,
+            .name = "relay_timer",
+        };
+        esp_err_t ret = esp_timer_create(&args, &relay_slots[i].timer);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create timer for relay %d: %s", i, esp_err_to_name(ret));
+            return ret;
+        }
+    }
+    const esp_timer_create_args_t bench_args = {
+        .callback = relay_timer_bench_callback,
+        .name = "relay_bench",
+    };
+    esp_err_t ret = esp_timer_create(&bench_args, &relay_bench.timer);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create benchmark timer: %s", esp_err_to_name(ret));
+        return ret;
+    }
+
+    relay_timer_load_auto_off();
+    return relay_add_change_listener(relay_timer_on_change);
+}
+
+static bool relay_timer_valid_ms(uint32_t ms)
+{
+    return ms >= RELAY_TIMER_MIN_MS && ms <= RELAY_TIMER_MAX_MS;
+}
+
+// Start a pulse or blink: the relay turns on now, or when a relay rule lets it, and the slot
+// timer takes it from there
+static esp_err_t relay_timer_start(int relay_id, uint8_t mode, uint32_t on_ms, uint32_t off_ms, uint32_t transitions)
+{
+    relay_timer_slot_t *slot = &relay_slots[relay_id];
+    portENTER_CRITICAL(&relay_timer_lock);
+    relay_timer_stop_slot(relay_id);
+    uint32_t generation = slot->generation;
+    portEXIT_CRITICAL(&relay_timer_lock);
+
+    uint32_t bit = 1u << relay_id;
+    relay_commit_info_t info;
+    uint32_t previous_mask = relay_get_mask();
+    esp_err_t ret = relay_commit_staggered(bit, 0, RELAY_SOURCE_TIMER, 0, &info);
+    if (ret == ESP_OK) {
+        int64_t on_at_us = relay_timer_on_at(relay_id, &info);
+        if (on_at_us != info.applied_at_us) {
+            ESP_LOGI(TAG, "Relay %d ON deferred by %lld ms by a relay rule", relay_id,
+                     (long long)((on_at_us - info.applied_at_us) / 1000));
+        }
+        portENTER_CRITICAL(&relay_timer_lock);
+        // Otherwise another command or a cancel came in meanwhile and wins
+        if (slot->generation == generation) {
+            slot->mode = mode;
+            slot->on_ms = on_ms;
+            slot->off_ms = off_ms;
+            slot->remaining = transitions;
+            slot->next_on = false;
+            slot->due_us = on_at_us + (int64_t)on_ms * 1000;
+            relay_timer_arm(slot->timer, slot->due_us);
+        }
+        portEXIT_CRITICAL(&relay_timer_lock);
+    }
+
+    if (ret == ESP_OK && info.mask != previous_mask) {
+        relay_publish_status_async();
+    }
+    return ret;
+}
+
+esp_err_t relay_pulse(int relay_id, uint32_t on_ms)
+{
+    if (relay_id < 0 || relay_id >= NUM_RELAYS || !relay_timer_valid_ms(on_ms)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ESP_LOGI(TAG, "Pulse relay %d for %lu ms", relay_id, (unsigned long)on_ms);
+    return relay_timer_start(relay_id, RELAY_TIMER_MODE_PULSE, on_ms, 0, 0);
+}
+
+// cycles = 0 blinks until cancelled; otherwise the relay ends off after the last cycle
+esp_err_t relay_blink(int relay_id, uint32_t on_ms, uint32_t off_ms, uint32_t cycles)
+{
+    if (relay_id < 0 || relay_id >= NUM_RELAYS || !relay_timer_valid_ms(on_ms) || !relay_timer_valid_ms(off_ms) ||
+        cycles > UINT32_MAX / 2) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ESP_LOGI(TAG, "Blink relay %d: %lu/%lu ms, %lu cycles", relay_id, (unsigned long)on_ms,
+             (unsigned long)off_ms, (unsigned long)cycles);
+    return relay_timer_start(relay_id, RELAY_TIMER_MODE_BLINK, on_ms, off_ms, cycles * 2 - (cycles ? 1 : 0));
+}
+
+esp_err_t relay_set_auto_off(int relay_id, uint32_t off_after_ms)
+{
+    if (relay_id < 0 || relay_id >= NUM_RELAYS || (off_after_ms != 0 && !relay_timer_valid_ms(off_after_ms))) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(relay_timer_save_mutex, portMAX_DELAY);
+    uint32_t values[NUM_RELAYS];
+    bool is_on = relay_get_state(relay_id);
+    portENTER_CRITICAL(&relay_timer_lock);
+    relay_auto_off_ms[relay_id] = off_after_ms;
+    relay_timer_slot_t *slot = &relay_slots[relay_id];
+    if (slot->mode == RELAY_TIMER_MODE_AUTO_OFF) {
+        relay_timer_stop_slot(relay_id);
+    }
+    // A relay that is already on starts counting down now
+    if (off_after_ms > 0 && slot->mode == RELAY_TIMER_MODE_NONE && is_on) {
+        slot->mode = RELAY_TIMER_MODE_AUTO_OFF;
+        slot->due_us = esp_timer_get_time() + (int64_t)off_after_ms * 1000;
+        relay_timer_arm(slot->timer, slot->due_us);
+    }
+    memcpy(values, relay_auto_off_ms, sizeof(values));
+    portEXIT_CRITICAL(&relay_timer_lock);
+
+    esp_err_t ret = relay_timer_save_auto_off(values);
+    xSemaphoreGive(relay_timer_save_mutex);
+    return ret;
+}
+
+// Stop a pulse, blink or auto-off countdown, leaving the relay as it is
+esp_err_t relay_timer_cancel(int relay_id)
+{
+    if (relay_id < 0 || relay_id >= NUM_RELAYS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    portENTER_CRITICAL(&relay_timer_lock);
+    relay_timer_stop_slot(relay_id);
+    portEXIT_CRITICAL(&relay_timer_lock);
+    return ESP_OK;
+}
+
+// Toggle on a fixed period and record how late each timer callback runs. A dry run
+// exercises only the timer path; otherwise the relay really switches, and the period (one
+// half-cycle) must be at least RELAY_TIMER_BENCH_MIN_SWITCH_US.
+esp_err_t relay_timer_benchmark(int relay_id, uint32_t period_us, uint32_t cycles, bool dry)
+{
+    if (relay_id < 0 || relay_id >= NUM_RELAYS || period_us < RELAY_TIMER_BENCH_MIN_US ||
+        period_us > RELAY_TIMER_BENCH_MAX_US || (!dry && period_us < RELAY_TIMER_BENCH_MIN_SWITCH_US) ||
+        cycles == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    bool is_on = relay_get_state(relay_id);
+    portENTER_CRITICAL(&relay_timer_lock);
+    if (relay_bench.state.running) {
+        portEXIT_CRITICAL(&relay_timer_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!dry) {
+        relay_timer_stop_slot(relay_id);
+    }
+    memset(&relay_bench_jitter, 0, sizeof(relay_bench_jitter));
+    relay_bench.state = (relay_timer_bench_t) {
+        .running = true,
+        .dry = dry,
+        .relay = (uint8_t)relay_id,
+        .period_us = period_us,
+        .remaining = cycles,
+    };
+    relay_bench.next_on = !is_on;
+    relay_bench.due_us = esp_timer_get_time() + period_us;
+    relay_timer_arm(relay_bench.timer, relay_bench.due_us);
+    portEXIT_CRITICAL(&relay_timer_lock);
+
+    ESP_LOGI(TAG, "Benchmark started: relay %d, period %lu us, %lu cycles%s", relay_id,
+             (unsigned long)period_us, (unsigned long)cycles, dry ? " (dry)" : "");
+    return ESP_OK;
+}
+
+static uint32_t relay_timer_json_ms(const cJSON *json, const char *key)
+{
+    const cJSON *item = cJSON_GetObjectItem(json, key);
+    if (!cJSON_IsNumber(item) || item->valuedouble < 0 || item->valuedouble > UINT32_MAX) {
+        return 0;
+    }
+    return (uint32_t)item->valuedouble;
+}
+
+// {"relay": n, "mode": "pulse", "on_ms": 500}
+// {"relay": n, "mode": "blink", "on_ms": 250, "off_ms": 250, "cycles": 10}
+// {"relay": n, "mode": "auto_off", "off_after_ms": 600000}     (0 disables)
+// {"relay": n, "mode": "cancel"}
+// {"relay": n, "mode": "bench", "period_us": 10000, "cycles": 1000, "dry": true}
+esp_err_t relay_timer_apply_json(const char *json, size_t len)
+{
+    cJSON *root = cJSON_ParseWithLength(json, len);
+    if (root == NULL) {
+        ESP_LOGE(TAG, "Failed to parse relay mode JSON");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t ret = ESP_ERR_INVALID_ARG;
+    const cJSON *relay = cJSON_GetObjectItem(root, "relay");
+    const cJSON *mode = cJSON_GetObjectItem(root, "mode");
+    if (cJSON_IsNumber(relay) && cJSON_IsString(mode)) {
+        int relay_id = relay->valueint;
+        if (strcmp(mode->valuestring, "pulse") == 0) {
+            ret = relay_pulse(relay_id, relay_timer_json_ms(root, "on_ms"));
+        } else if (strcmp(mode->valuestring, "blink") == 0) {
+            ret = relay_blink(relay_id, relay_timer_json_ms(root, "on_ms"), relay_timer_json_ms(root, "off_ms"),
+                              relay_timer_json_ms(root, "cycles"));
+        } else if (strcmp(mode->valuestring, "auto_off") == 0) {
+            ret = relay_set_auto_off(relay_id, relay_timer_json_ms(root, "off_after_ms"));
+        } else if (strcmp(mode->valuestring, "cancel") == 0) {
+            ret = relay_timer_cancel(relay_id);
+        } else if (strcmp(mode->valuestring, "bench") == 0) {
+            const cJSON *dry = cJSON_GetObjectItem(root, "dry");
+            ret = relay_timer_benchmark(relay_id, relay_timer_json_ms(root, "period_us"),
+                                        relay_timer_json_ms(root, "cycles"), !cJSON_IsFalse(dry));
+        } else {
+            ESP_LOGE(TAG, "Unknown relay mode '%s'", mode->valuestring);
+        }
+    }
+
+    cJSON_Delete(root);
+    return ret;
+}
+
+void relay_timer_get_status(int relay_id, relay_timer_status_t *status)
+{
+    memset(status, 0, sizeof(*status));
+    if (relay_id < 0 || relay_id >= NUM_RELAYS) {
+        return;
+    }
+    portENTER_CRITICAL(&relay_timer_lock);
+    const relay_timer_slot_t *slot = &relay_slots[relay_id];
+    status->mode = slot->mode;
+    status->on_ms = slot->on_ms;
+    status->off_ms = slot->off_ms;
+    status->remaining = slot->remaining;
+    status->due_us = slot->mode != RELAY_TIMER_MODE_NONE ? slot->due_us : 0;
+    status->auto_off_ms = relay_auto_off_ms[relay_id];
+    portEXIT_CRITICAL(&relay_timer_lock);
+}
+
+void relay_timer_get_jitter(relay_jitter_stats_t *live, relay_jitter_stats_t *bench, relay_timer_bench_t *bench_state)
+{
+    portENTER_CRITICAL(&relay_timer_lock);
+    if (live != NULL) {
+        *live = relay_live_jitter;
+    }
+    if (bench != NULL) {
+        *bench = relay_bench_jitter;
+    }
+    if (bench_state != NULL) {
+        *bench_state = relay_bench.state;
+    }
+    portEXIT_CRITICAL(&relay_timer_lock);
+}
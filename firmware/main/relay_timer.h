@@ -0,0 +1,73 @@
+#ifndef RELAY_TIMER_H
+#define RELAY_TIMER_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Timed relay modes on esp_timer: pulse (on, then off after on_ms), blink (on_ms/off_ms
+// for a number of cycles or until cancelled) and auto-off (any source turning the relay on
+// arms an off timer). A command from any other source to a relay cancels its pulse or blink.
+typedef enum {
+    RELAY_TIMER_MODE_NONE = 0,
+    RELAY_TIMER_MODE_PULSE,
+    RELAY_TIMER_MODE_BLINK,
+    RELAY_TIMER_MODE_AUTO_OFF,      // Auto-off countdown running
+} relay_timer_mode_t;
+
+// Limits for durations given over the network
+#define RELAY_TIMER_MIN_MS 1
+#define RELAY_TIMER_MAX_MS (24u * 60 * 60 * 1000)
+
+// Benchmark period limits; a run that really switches the relay needs at least
+// RELAY_TIMER_BENCH_MIN_SWITCH_US per state so the contacts are not driven beyond their
+// mechanical rating
+#define RELAY_TIMER_BENCH_MIN_US 100
+#define RELAY_TIMER_BENCH_MAX_US 10000000
+#ifndef RELAY_TIMER_BENCH_MIN_SWITCH_US
+#define RELAY_TIMER_BENCH_MIN_SWITCH_US 50000
+#endif
+
+// Lateness of timer-driven transitions, histogram bucket n counts samples below 2^n us
+// (the last bucket takes the rest)
+#define RELAY_JITTER_BUCKETS 12
+
+typedef struct {
+    uint32_t samples;
+    int32_t min_us;
+    int32_t max_us;
+    int64_t sum_us;
+    int32_t max_commit_us;          // Lateness of the GPIO write itself
+    uint32_t histogram[RELAY_JITTER_BUCKETS];
+} relay_jitter_stats_t;
+
+typedef struct {
+    uint8_t mode;                   // relay_timer_mode_t
+    uint32_t on_ms;
+    uint32_t off_ms;
+    uint32_t remaining;             // Blink transitions left, 0 = until cancelled
+    uint32_t auto_off_ms;           // 0 = auto-off disabled
+    int64_t due_us;                 // esp_timer time of the next transition
+} relay_timer_status_t;
+
+typedef struct {
+    bool running;
+    bool dry;                       // Timers only, relays untouched
+    uint8_t relay;
+    uint32_t period_us;
+    uint32_t remaining;
+} relay_timer_bench_t;
+
+// Function declarations
+esp_err_t relay_timer_init(void);
+esp_err_t relay_pulse(int relay_id, uint32_t on_ms);
+esp_err_t relay_blink(int relay_id, uint32_t on_ms, uint32_t off_ms, uint32_t cycles);
+esp_err_t relay_set_auto_off(int relay_id, uint32_t off_after_ms);
+esp_err_t relay_timer_cancel(int relay_id);
+esp_err_t relay_timer_benchmark(int relay_id, uint32_t period_us, uint32_t cycles, bool dry);
+esp_err_t relay_timer_apply_json(const char *json, size_t len);
+void relay_timer_get_status(int relay_id, relay_timer_status_t *status);
+void relay_timer_get_jitter(relay_jitter_stats_t *live, relay_jitter_stats_t *bench, relay_timer_bench_t *bench_state);
+
+#endif // RELAY_TIMER_H
@@ -0,0 +1,209 @@
+#include "task_stats.h"
+#include "esp_log.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "app_mqtt.h"
+#include "json_out.h"
+#include "util.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "TASK_STATS";
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+
+// Snapshot buffers, only touched by the sampler (task_stats_sample() callers serialize on
+// task_stats_sample_mutex)
+static TaskStatus_t task_stats_raw[TASK_STATS_MAX_TASKS];
+static struct {
+    UBaseType_t number;             // xTaskNumber, unique for the life of the system
+    uint32_t run_time;
+    uint32_t stack_free;
+} task_stats_prev[TASK_STATS_MAX_TASKS];
+static int task_stats_prev_count = 0;
+static uint32_t task_stats_prev_total = 0;
+static bool task_stats_have_prev = false;
+static SemaphoreHandle_t task_stats_sample_mutex = NULL;
+
+#endif
+
+// Latest result, copied in and out under task_stats_mutex
+static SemaphoreHandle_t task_stats_mutex = NULL;
+static task_stats_t task_stats_current;
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+
+static int task_stats_compare(const void *a, const void *b)
+{
+    const task_stats_task_t *ta = a;
+    const task_stats_task_t *tb = b;
+    return (int)tb->cpu_permille - (int)ta->cpu_permille;
+}
+
+// Take a snapshot and compute shares against the previous one. Run-time counters are 32-bit
+// microseconds and wrap after about 71 minutes; unsigned deltas stay correct as long as
+// samples are closer together than that.
+esp_err_t task_stats_sample(void)
+{
+    if (task_stats_sample_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(task_stats_sample_mutex, portMAX_DELAY);
+
+    uint32_t total = 0;
+    UBaseType_t count = uxTaskGetSystemState(task_stats_raw, TASK_STATS_MAX_TASKS, &total);
+    if (count == 0) {
+        xSemaphoreGive(task_stats_sample_mutex);
+        ESP_LOGW(TAG, "More than %d tasks, increase TASK_STATS_MAX_TASKS", TASK_STATS_MAX_TASKS);
+        return ESP_ERR_NO_MEM;
+    }
+
+    static task_stats_t next;
+    memset(&next, 0, sizeof(next));
+    uint32_t elapsed = total - task_stats_prev_total;
+    bool have_delta = task_stats_have_prev && elapsed > 0;
+    next.interval_ms = have_delta ? elapsed / 1000 : 0;
+
+    for (UBaseType_t i = 0; i < count; i++) {
+        const TaskStatus_t *raw = &task_stats_raw[i];
+        task_stats_task_t *task = &next.tasks[i];
+        strncpy(task->name, raw->pcTaskName, sizeof(task->name) - 1);
+        task->core = raw->xCoreID == tskNO_AFFINITY ? -1 : (int8_t)raw->xCoreID;
+        task->priority = (uint8_t)raw->uxCurrentPriority;
+        task->stack_free = raw->usStackHighWaterMark;
+
+        int prev = -1;
+        for (int j = 0; j < task_stats_prev_count; j++) {
+            if (task_stats_prev[j].number == raw->xTaskNumber) {
+                prev = j;
+                break;
+            }
+        }
+        if (have_delta) {
+            // A task created during the interval has run for at most its whole counter
+            uint32_t ran = raw->ulRunTimeCounter - (prev >= 0 ? task_stats_prev[prev].run_time : 0);
+            uint64_t permille = (uint64_t)ran * 1000 / elapsed;
+            task->cpu_permille = permille > 1000 ? 1000 : (uint16_t)permille;
+        }
+
+        bool was_above = prev < 0 || task_stats_prev[prev].stack_free >= TASK_STATS_STACK_WARN_BYTES;
+        if (task->stack_free < TASK_STATS_STACK_WARN_BYTES && was_above) {
+            ESP_LOGW(TAG, "Task %s has only %" PRIu32 " bytes of stack left", task->name, task->stack_free);
+        }
+
+        // The idle task of a core runs whenever nothing else does
+        if (strncmp(raw->pcTaskName, "IDLE", 4) == 0 && task->core >= 0 && task->core < portNUM_PROCESSORS) {
+            next.core_load_permille[task->core] = have_delta ? 1000 - task->cpu_permille : 0;
+        }
+    }
+    next.task_count = (uint8_t)count;
+    qsort(next.tasks, count, sizeof(next.tasks[0]), task_stats_compare);
+
+    for (UBaseType_t i = 0; i < count; i++) {
+        task_stats_prev[i].number = task_stats_raw[i].xTaskNumber;
+        task_stats_prev[i].run_time = task_stats_raw[i].ulRunTimeCounter;
+        task_stats_prev[i].stack_free = task_stats_raw[i].usStackHighWaterMark;
+    }
+    task_stats_prev_count = count;
+    task_stats_prev_total = total;
+    task_stats_have_prev = true;
+
+    xSemaphoreTake(task_stats_mutex, portMAX_DELAY);
+    task_stats_current = next;
+    xSemaphoreGive(task_stats_mutex);
+    xSemaphoreGive(task_stats_sample_mutex);
+    return ESP_OK;
+}
+
+static void task_stats_task(void *arg)
+{
+    TickType_t wake = xTaskGetTickCount();
+    uint32_t since_publish_ms = 0;
+    while (1) {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(TASK_STATS_INTERVAL_S * 1000));
+        if (task_stats_sample() != ESP_OK) {
+            continue;
+        }
+        if (periodic_due(&since_publish_ms, TASK_STATS_INTERVAL_S * 1000, TASK_STATS_PUBLISH_INTERVAL_S * 1000)) {
+            json_out_publish(task_stats_format_json, TASK_STATS_JSON_MAX_LEN, mqtt_publish_tasks);
+        }
+    }
+}
+
+esp_err_t task_stats_init(void)
+{
+    task_stats_mutex = xSemaphoreCreateMutex();
+    task_stats_sample_mutex = xSemaphoreCreateMutex();
+    if (task_stats_mutex == NULL || task_stats_sample_mutex == NULL) {
+        ESP_LOGE(TAG, "Failed to create task stats mutex");
+        return ESP_ERR_NO_MEM;
+    }
+
+    // First snapshot now, so the first interval is measured from boot
+    task_stats_sample();
+    if (xTaskCreate(task_stats_task, "task_stats", TASK_STATS_TASK_STACK_SIZE, NULL,
+                    TASK_STATS_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create task stats task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+#else
+
+esp_err_t task_stats_sample(void)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t task_stats_init(void)
+{
+    task_stats_mutex = xSemaphoreCreateMutex();
+    ESP_LOGW(TAG, "FreeRTOS run-time statistics are disabled in sdkconfig");
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif
+
+void task_stats_get(task_stats_t *stats)
+{
+    if (task_stats_mutex == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    xSemaphoreTake(task_stats_mutex, portMAX_DELAY);
+    *stats = task_stats_current;
+    xSemaphoreGive(task_stats_mutex);
+}
+
+// {"interval_ms":..,"load":[<core 0 %>,..],"tasks":[["<name>",<cpu %>,<stack free>,<core>,<prio>],...]}
+// Percentages are of one core. Returns the length the full document needs, like snprintf.
+int task_stats_format_json(char *buf, size_t buf_size)
+{
+    if (task_stats_mutex == NULL) {
+        return -1;
+    }
+    // Formatted straight from the latest result; the sampler waits for the lock meanwhile
+    xSemaphoreTake(task_stats_mutex, portMAX_DELAY);
+    const task_stats_t *stats = &task_stats_current;
+
+    size_t len = 0;
+    len = buf_appendf(buf, buf_size, len, "{\"interval_ms\":%" PRIu32 ",\"load\":[", stats->interval_ms);
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        len = buf_appendf(buf, buf_size, len, "%s%u.%u", core ? "," : "", stats->core_load_permille[core] / 10,
+                          stats->core_load_permille[core] % 10);
+    }
+    len = buf_appendf(buf, buf_size, len, "],\"tasks\":[");
+    for (int i = 0; i < stats->task_count; i++) {
+        const task_stats_task_t *task = &stats->tasks[i];
+        len = buf_appendf(buf, buf_size, len, "%s[\"%s\",%u.%u,%" PRIu32 ",%d,%u]", i ? "," : "", task->name,
+                          task->cpu_permille / 10, task->cpu_permille % 10, task->stack_free, task->core,
+                          task->priority);
+    }
+    len = buf_appendf(buf, buf_size, len, "]}");
+
+    xSemaphoreGive(task_stats_mutex);
+    return (int)len;
+}
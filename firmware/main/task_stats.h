@@ -0,0 +1,59 @@
+#ifndef TASK_STATS_H
+#define TASK_STATS_H
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// FreeRTOS run-time statistics, sampled periodically. CPU shares are deltas between two
+// snapshots, so they show the load of the last interval rather than the average since boot.
+// Requires CONFIG_FREERTOS_USE_TRACE_FACILITY and CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS.
+#ifndef TASK_STATS_INTERVAL_S
+#define TASK_STATS_INTERVAL_S 10
+#endif
+// Compact summary on the MQTT tasks topic at this interval, 0 to disable
+#ifndef TASK_STATS_PUBLISH_INTERVAL_S
+#define TASK_STATS_PUBLISH_INTERVAL_S 60
+#endif
+#ifndef TASK_STATS_MAX_TASKS
+#define TASK_STATS_MAX_TASKS 32
+#endif
+// A task whose stack high-water mark drops below this is logged as a warning
+#ifndef TASK_STATS_STACK_WARN_BYTES
+#define TASK_STATS_STACK_WARN_BYTES 512
+#endif
+// Room for TASK_STATS_MAX_TASKS tasks in task_stats_format_json()
+#ifndef TASK_STATS_JSON_MAX_LEN
+#define TASK_STATS_JSON_MAX_LEN 2048
+#endif
+
+#ifndef TASK_STATS_TASK_PRIORITY
+#define TASK_STATS_TASK_PRIORITY 2
+#endif
+#ifndef TASK_STATS_TASK_STACK_SIZE
+#define TASK_STATS_TASK_STACK_SIZE 3072
+#endif
+
+typedef struct {
+    char name[configMAX_TASK_NAME_LEN];
+    int8_t core;                    // Pinned core, -1 when the task may run on either
+    uint8_t priority;
+    uint16_t cpu_permille;          // Share of one core over the last interval
+    uint32_t stack_free;            // Stack high-water mark in bytes (lowest free ever)
+} task_stats_task_t;
+
+typedef struct {
+    uint32_t interval_ms;           // Length of the interval the shares cover, 0 before the second sample
+    uint16_t core_load_permille[portNUM_PROCESSORS];    // 1000 minus the idle task's share
+    uint8_t task_count;
+    task_stats_task_t tasks[TASK_STATS_MAX_TASKS];      // Busiest first
+} task_stats_t;
+
+// Function declarations
+esp_err_t task_stats_init(void);
+esp_err_t task_stats_sample(void);
+void task_stats_get(task_stats_t *stats);
+int task_stats_format_json(char *buf, size_t buf_size);
+
+#endif // TASK_STATS_H
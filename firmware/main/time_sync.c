@@ -0,0 +1,58 @@
+#include "time_sync.h"
+#include "esp_log.h"
+#include "esp_netif_sntp.h"
+#include "esp_timer.h"
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+static const char *TAG = "TIME_SYNC";
+
+static volatile bool time_synced = false;
+static volatile int64_t time_last_sync_us = 0;     // esp_timer time of the last SNTP update
+
+static void time_sync_notification(struct timeval *tv)
+{
+    time_last_sync_us = esp_timer_get_time();
+    if (!time_synced) {
+        ESP_LOGI(TAG, "Clock synchronized: %lld.%06ld", (long long)tv->tv_sec, (long)tv->tv_usec);
+    }
+    time_synced = true;
+}
+
+// SNTP runs in the background and retries on its own once the STA has an IP
+esp_err_t time_sync_init(void)
+{
+    setenv("TZ", TIME_SYNC_TZ, 1);
+    tzset();
+
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(TIME_SYNC_SERVER);
+    config.sync_cb = time_sync_notification;
+
+    esp_err_t ret = esp_netif_sntp_init(&config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start SNTP: %s", esp_err_to_name(ret));
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "SNTP started with server %s", TIME_SYNC_SERVER);
+    return ESP_OK;
+}
+
+bool time_sync_is_synced(void)
+{
+    return time_synced;
+}
+
+// Wall-clock time in microseconds since the Unix epoch
+int64_t time_sync_now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int64_t time_sync_last_sync_us(void)
+{
+    return time_last_sync_us;
+}
@@ -0,0 +1,23 @@
+#ifndef TIME_SYNC_H
+#define TIME_SYNC_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// SNTP configuration
+#ifndef TIME_SYNC_SERVER
+#define TIME_SYNC_SERVER "pool.ntp.org"
+#endif
+// POSIX TZ string for local time (schedules), e.g. "CET-1CEST,M3.5.0,M10.5.0/3"
+#ifndef TIME_SYNC_TZ
+#define TIME_SYNC_TZ "UTC0"
+#endif
+
+// Function declarations
+esp_err_t time_sync_init(void);
+bool time_sync_is_synced(void);
+int64_t time_sync_now_us(void);
+int64_t time_sync_last_sync_us(void);
+
+#endif // TIME_SYNC_H
@@ -0,0 +1,286 @@
+#include "trace.h"
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "app_mqtt.h"
+#include "json_out.h"
+#include "util.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "TRACE";
+
+#if (TRACE_RING_SIZE & (TRACE_RING_SIZE - 1)) != 0
+#error "TRACE_RING_SIZE must be a power of two"
+#endif
+
+// A slot is valid for span n once seq == n + 1; the writer clears seq while it fills the
+// slot, so a reader that sees the same seq before and after copying got a consistent span
+typedef struct {
+    atomic_uint seq;
+    uint32_t start;
+    uint32_t cycles;
+    uint8_t point;
+} trace_slot_t;
+
+typedef struct {
+    atomic_uint head;               // Next span index, claimed with fetch_add by writers
+    uint32_t tail;                  // Next span to aggregate, only touched under trace_mutex
+    trace_slot_t slots[TRACE_RING_SIZE];
+} trace_ring_t;
+
+static trace_ring_t trace_rings[portNUM_PROCESSORS];
+
+// Aggregated spans, under trace_mutex
+static SemaphoreHandle_t trace_mutex = NULL;
+static trace_histogram_t trace_histograms[TRACE_POINT_COUNT];
+static trace_stats_t trace_stats;
+
+static const char *trace_point_names[TRACE_POINT_COUNT] = {
+    [TRACE_MQTT_EVENT] = "mqtt_event",
+    [TRACE_MQTT_COMMAND] = "mqtt_command",
+    [TRACE_HTTP_POST_RELAY] = "http_post_relay",
+    [TRACE_RELAY_SET_STATE] = "relay_set_state",
+    [TRACE_RELAY_SET_MULTIPLE] = "relay_set_multiple",
+    [TRACE_RELAY_COMMIT] = "relay_commit",
+    [TRACE_RELAY_PUBLISH_STATUS] = "relay_publish_status",
+};
+
+const char *trace_point_name(trace_point_t point)
+{
+    return (unsigned)point < TRACE_POINT_COUNT ? trace_point_names[point] : "unknown";
+}
+
+// Lock-free: safe from any task on either core and from interrupts. A task that migrates
+// between cores inside a span is measured against two cycle counters; such spans are rare
+// and end up in the outer buckets.
+void trace_record(trace_point_t point, uint32_t start_cycles, uint32_t end_cycles)
+{
+    trace_ring_t *ring = &trace_rings[esp_cpu_get_core_id()];
+    uint32_t index = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+    trace_slot_t *slot = &ring->slots[index & (TRACE_RING_SIZE - 1)];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->start = start_cycles;
+    slot->cycles = end_cycles - start_cycles;
+    slot->point = point;
+    atomic_store_explicit(&slot->seq, index + 1, memory_order_release);
+}
+
+static void trace_add(trace_histogram_t *h, uint32_t cycles)
+{
+    int bucket = cycles == 0 ? 0 : 31 - __builtin_clz(cycles);
+    h->count++;
+    h->sum_cycles += cycles;
+    if (cycles > h->max_cycles) {
+        h->max_cycles = cycles;
+    }
+    h->buckets[bucket]++;
+}
+
+// Fold every completed span into the histograms; a span still being written stops the
+// ring until the next pass
+static void trace_aggregate_locked(void)
+{
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        trace_ring_t *ring = &trace_rings[core];
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head - ring->tail > TRACE_RING_SIZE) {
+            trace_stats.dropped += head - ring->tail - TRACE_RING_SIZE;
+            ring->tail = head - TRACE_RING_SIZE;
+        }
+
+        while (ring->tail != head) {
+            trace_slot_t *slot = &ring->slots[ring->tail & (TRACE_RING_SIZE - 1)];
+            uint32_t expected = ring->tail + 1;
+            uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            if (seq != expected) {
+                if ((int32_t)(seq - expected) > 0) {
+                    trace_stats.dropped++;          // Already overwritten by a newer span
+                    ring->tail++;
+                    continue;
+                }
+                break;
+            }
+            uint32_t cycles = slot->cycles;
+            uint8_t point = slot->point;
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != expected) {
+                trace_stats.dropped++;
+            } else if (point < TRACE_POINT_COUNT) {
+                trace_add(&trace_histograms[point], cycles);
+                trace_stats.recorded++;
+            }
+            ring->tail++;
+        }
+    }
+}
+
+void trace_get_histogram(trace_point_t point, trace_histogram_t *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    if ((unsigned)point >= TRACE_POINT_COUNT || trace_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(trace_mutex, portMAX_DELAY);
+    trace_aggregate_locked();
+    *histogram = trace_histograms[point];
+    xSemaphoreGive(trace_mutex);
+}
+
+void trace_get_stats(trace_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (trace_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(trace_mutex, portMAX_DELAY);
+    trace_aggregate_locked();
+    *stats = trace_stats;
+    xSemaphoreGive(trace_mutex);
+}
+
+// Clears the histograms; spans still in the rings are discarded as well
+void trace_reset(void)
+{
+    if (trace_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(trace_mutex, portMAX_DELAY);
+    trace_aggregate_locked();
+    memset(trace_histograms, 0, sizeof(trace_histograms));
+    trace_stats.recorded = 0;
+    trace_stats.dropped = 0;
+    xSemaphoreGive(trace_mutex);
+}
+
+// Upper bound in microseconds of the bucket holding the given fraction of spans
+static double trace_percentile_us(const trace_histogram_t *h, uint32_t per_mille, uint32_t ticks_per_us)
+{
+    uint64_t target = ((uint64_t)h->count * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    for (int i = 0; i < TRACE_HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            double upper = (double)(2ull << i) / ticks_per_us;
+            double max = (double)h->max_cycles / ticks_per_us;
+            return upper < max ? upper : max;
+        }
+    }
+    return (double)h->max_cycles / ticks_per_us;
+}
+
+// {"cpu_mhz":..,"recorded":..,"dropped":..,"points":{"<name>":{"count":..,"mean_us":..,
+//  "p50_us":..,"p99_us":..,"max_us":..,"hist":[[<le_us>,<count>],...]},...}}
+// Points without spans are left out and so are empty buckets. Returns the length the
+// full document needs, like snprintf.
+int trace_format_json(char *buf, size_t buf_size)
+{
+    trace_stats_t stats;
+    trace_histogram_t histograms[TRACE_POINT_COUNT];
+    memset(&stats, 0, sizeof(stats));
+    memset(histograms, 0, sizeof(histograms));
+    if (trace_mutex != NULL) {
+        xSemaphoreTake(trace_mutex, portMAX_DELAY);
+        trace_aggregate_locked();
+        stats = trace_stats;
+        memcpy(histograms, trace_histograms, sizeof(histograms));
+        xSemaphoreGive(trace_mutex);
+    }
+    uint32_t mhz = stats.cpu_ticks_per_us ? stats.cpu_ticks_per_us : 1;
+
+    size_t len = 0;
+    len = buf_appendf(buf, buf_size, len,
+                      "{\"enabled\":%s,\"cpu_mhz\":%" PRIu32 ",\"recorded\":%" PRIu32 ",\"dropped\":%" PRIu32
+                      ",\"points\":{", TRACE_ENABLED ? "true" : "false", stats.cpu_ticks_per_us, stats.recorded,
+                      stats.dropped);
+    bool first = true;
+    for (int p = 0; p < TRACE_POINT_COUNT; p++) {
+        const trace_histogram_t *h = &histograms[p];
+        if (h->count == 0) {
+            continue;
+        }
+        len = buf_appendf(buf, buf_size, len,
+                          "%s\"%s\":{\"count\":%" PRIu32 ",\"mean_us\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,"
+                          "\"max_us\":%.2f,\"hist\":[", first ? "" : ",", trace_point_names[p], h->count,
+                          (double)h->sum_cycles / h->count / mhz, trace_percentile_us(h, 500, mhz),
+                          trace_percentile_us(h, 990, mhz), (double)h->max_cycles / mhz);
+        bool first_bucket = true;
+        for (int i = 0; i < TRACE_HISTOGRAM_BUCKETS; i++) {
+            if (h->buckets[i] != 0) {
+                len = buf_appendf(buf, buf_size, len, "%s[%.3f,%" PRIu32 "]", first_bucket ? "" : ",",
+                                  (double)(2ull << i) / mhz, h->buckets[i]);
+                first_bucket = false;
+            }
+        }
+        len = buf_appendf(buf, buf_size, len, "]}");
+        first = false;
+    }
+    len = buf_appendf(buf, buf_size, len, "}}");
+    return (int)len;
+}
+
+void trace_log_summary(void)
+{
+    trace_stats_t stats;
+    trace_get_stats(&stats);
+    uint32_t mhz = stats.cpu_ticks_per_us ? stats.cpu_ticks_per_us : 1;
+    ESP_LOGI(TAG, "%" PRIu32 " spans, %" PRIu32 " dropped", stats.recorded, stats.dropped);
+    for (int p = 0; p < TRACE_POINT_COUNT; p++) {
+        trace_histogram_t h;
+        trace_get_histogram(p, &h);
+        if (h.count == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%-20s n=%-6" PRIu32 " mean=%8.2fus p50<%8.2fus p99<%8.2fus max=%8.2fus",
+                 trace_point_names[p], h.count, (double)h.sum_cycles / h.count / mhz,
+                 trace_percentile_us(&h, 500, mhz), trace_percentile_us(&h, 990, mhz),
+                 (double)h.max_cycles / mhz);
+    }
+}
+
+#if TRACE_ENABLED
+static void trace_task(void *arg)
+{
+    TickType_t wake = xTaskGetTickCount();
+    uint32_t since_log_ms = 0;
+    uint32_t since_publish_ms = 0;
+    while (1) {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(TRACE_AGGREGATE_INTERVAL_MS));
+        xSemaphoreTake(trace_mutex, portMAX_DELAY);
+        trace_aggregate_locked();
+        xSemaphoreGive(trace_mutex);
+
+        if (periodic_due(&since_log_ms, TRACE_AGGREGATE_INTERVAL_MS, TRACE_LOG_INTERVAL_S * 1000)) {
+            trace_log_summary();
+        }
+        if (periodic_due(&since_publish_ms, TRACE_AGGREGATE_INTERVAL_MS, TRACE_PUBLISH_INTERVAL_S * 1000)) {
+            json_out_publish(trace_format_json, TRACE_JSON_MAX_LEN, mqtt_publish_trace);
+        }
+    }
+}
+#endif
+
+esp_err_t trace_init(void)
+{
+    trace_mutex = xSemaphoreCreateMutex();
+    if (trace_mutex == NULL) {
+        ESP_LOGE(TAG, "Failed to create trace mutex");
+        return ESP_ERR_NO_MEM;
+    }
+    trace_stats.cpu_ticks_per_us = esp_rom_get_cpu_ticks_per_us();
+
+#if TRACE_ENABLED
+    if (xTaskCreate(trace_task, "trace", TRACE_TASK_STACK_SIZE, NULL, TRACE_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create trace task");
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "Tracing %d points, %d spans per core", TRACE_POINT_COUNT, TRACE_RING_SIZE);
+#endif
+    return ESP_OK;
+}
@@ -0,0 +1,102 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "esp_err.h"
+#include "esp_cpu.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hot-path tracing. TRACE_SCOPE(point) takes an esp_cpu_get_cycle_count() timestamp and
+// records the span when the enclosing scope is left, on every return path. Spans go into a
+// lock-free ring per core and are folded by a background task into log2 histograms per
+// trace point, readable at GET /trace, on MQTT and on the serial log.
+// Build with TRACE_ENABLED=0 to compile every hook out.
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+// Spans kept per core until the aggregation task picks them up (power of two)
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 256
+#endif
+#ifndef TRACE_AGGREGATE_INTERVAL_MS
+#define TRACE_AGGREGATE_INTERVAL_MS 500
+#endif
+// Histogram summary on the serial log at this interval, 0 to disable
+#ifndef TRACE_LOG_INTERVAL_S
+#define TRACE_LOG_INTERVAL_S 300
+#endif
+
+// Histograms published to the MQTT trace topic at this interval, 0 to disable
+#ifndef TRACE_PUBLISH_INTERVAL_S
+#define TRACE_PUBLISH_INTERVAL_S 300
+#endif
+// Largest trace_format_json() document, with every trace point populated
+#ifndef TRACE_JSON_MAX_LEN
+#define TRACE_JSON_MAX_LEN 2048
+#endif
+
+#ifndef TRACE_TASK_PRIORITY
+#define TRACE_TASK_PRIORITY 1
+#endif
+#ifndef TRACE_TASK_STACK_SIZE
+#define TRACE_TASK_STACK_SIZE 4096
+#endif
+
+// Bucket i holds spans of [2^i, 2^(i+1)) CPU cycles
+#define TRACE_HISTOGRAM_BUCKETS 32
+
+typedef enum {
+    TRACE_MQTT_EVENT = 0,           // mqtt_event_handler(), any event
+    TRACE_MQTT_COMMAND,             // Relay command on the set topics, decode to ack
+    TRACE_HTTP_POST_RELAY,          // POST /relay handler
+    TRACE_RELAY_SET_STATE,
+    TRACE_RELAY_SET_MULTIPLE,
+    TRACE_RELAY_COMMIT,             // Rule check and GPIO writes
+    TRACE_RELAY_PUBLISH_STATUS,
+    TRACE_POINT_COUNT
+} trace_point_t;
+
+typedef struct {
+    uint32_t count;
+    uint64_t sum_cycles;
+    uint32_t max_cycles;
+    uint32_t buckets[TRACE_HISTOGRAM_BUCKETS];
+} trace_histogram_t;
+
+typedef struct {
+    uint32_t recorded;
+    uint32_t dropped;               // Overwritten in a ring before they were aggregated
+    uint32_t cpu_ticks_per_us;
+} trace_stats_t;
+
+#if TRACE_ENABLED
+typedef struct {
+    trace_point_t point;
+    uint32_t start;
+} trace_scope_t;
+
+void trace_record(trace_point_t point, uint32_t start_cycles, uint32_t end_cycles);
+
+static inline void trace_scope_end(trace_scope_t *scope)
+{
+    trace_record(scope->point, scope->start, esp_cpu_get_cycle_count());
+}
+
+#define TRACE_SCOPE(point) \
+    trace_scope_t trace_scope_ __attribute__((cleanup(trace_scope_end))) = { (point), esp_cpu_get_cycle_count() }
+#else
+#define TRACE_SCOPE(point) do { } while (0)
+#endif
+
+// Function declarations
+esp_err_t trace_init(void);
+const char *trace_point_name(trace_point_t point);
+void trace_get_histogram(trace_point_t point, trace_histogram_t *histogram);
+void trace_get_stats(trace_stats_t *stats);
+void trace_reset(void);
+int trace_format_json(char *buf, size_t buf_size);
+void trace_log_summary(void);
+
+#endif // TRACE_H
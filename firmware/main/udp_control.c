@@ -0,0 +1,697 @@
+#include "udp_control.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+#include "mbedtls/md.h"
+#include "relay_control.h"
+#include "relay_command.h"
+#include "metrics.h"
+#include "time_sync.h"
+#include <stddef.h>
+#include <string.h>
+
+static const char *TAG = "UDP_CONTROL";
+
+#define NVS_NAMESPACE "udp_ctrl"
+#define NVS_KEY_CONFIG "config"
+#define NVS_KEY_GROUP_SEQ "group_seq"
+#define UDP_CONTROL_CONFIG_VERSION 2
+
+typedef struct {
+    uint8_t version;
+    udp_control_config_t config;
+} udp_control_config_blob_t;
+
+static udp_control_config_t udp_config;
+static SemaphoreHandle_t udp_config_mutex = NULL;
+static volatile uint32_t udp_config_generation = 1;
+static TaskHandle_t udp_task_handle = NULL;
+
+// Random per boot and per key: requests must carry it, so datagrams captured before a reboot
+// or a key change are rejected even though the sequence window starts over
+static uint32_t udp_epoch = 0;
+// Set by udp_control_set_config() when a key changes; the task then starts a new session
+static bool udp_key_changed = false;
+static bool udp_group_key_changed = false;
+
+// Sliding sequence window, only touched by the listener task
+typedef struct {
+    uint32_t highest;
+    uint64_t seen;      // Bit n set = (highest - n) already seen
+} udp_seq_window_t;
+
+static udp_seq_window_t udp_seq;
+// Group frames have no epoch (nobody answers them), so the highest accepted sequence number is
+// kept in NVS and restored at boot; everything at or below it counts as seen
+static udp_seq_window_t udp_group_seq;
+
+// Group commands armed on esp_timer until their apply time
+typedef struct {
+    esp_timer_handle_t timer;
+    volatile bool busy;
+    uint32_t set_mask;
+    uint32_t clear_mask;
+    int64_t apply_at_us;
+} udp_group_pending_t;
+
+static udp_group_pending_t udp_group_pending[UDP_GROUP_MAX_PENDING];
+
+static udp_control_stats_t udp_stats;
+static portMUX_TYPE udp_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#define UDP_STATS_INC(field) do { \
+        portENTER_CRITICAL(&udp_stats_lock); \
+        udp_stats.field++; \
+        portEXIT_CRITICAL(&udp_stats_lock); \
+    } while (0)
+
+static uint32_t udp_get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void udp_put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void udp_control_default_config(udp_control_config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->enabled = false;
+    config->port = UDP_CONTROL_DEFAULT_PORT;
+    config->group_port = UDP_GROUP_DEFAULT_PORT;
+    strncpy(config->group_addr, UDP_GROUP_DEFAULT_ADDR, sizeof(config->group_addr) - 1);
+}
+
+static esp_err_t udp_control_load_config(udp_control_config_t *config)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // Fields appended in later versions keep their defaults when loading an older blob
+    udp_control_config_blob_t blob = { .version = 0 };
+    udp_control_default_config(&blob.config);
+    size_t len = sizeof(blob);
+    err = nvs_get_blob(nvs_handle, NVS_KEY_CONFIG, &blob, &len);
+    nvs_close(nvs_handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (len < offsetof(udp_control_config_blob_t, config.group_enabled) ||
+        blob.version == 0 || blob.version > UDP_CONTROL_CONFIG_VERSION) {
+        ESP_LOGW(TAG, "Ignoring stored UDP control config (version %d, %u bytes)", blob.version, (unsigned)len);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    *config = blob.config;
+    return ESP_OK;
+}
+
+static esp_err_t udp_control_save_config(const udp_control_config_t *config)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    udp_control_config_blob_t blob = {
+        .version = UDP_CONTROL_CONFIG_VERSION,
+        .config = *config,
+    };
+    err = nvs_set_blob(nvs_handle, NVS_KEY_CONFIG, &blob, sizeof(blob));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs_handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save UDP control config: %s", esp_err_to_name(err));
+    }
+
+    nvs_close(nvs_handle);
+    return err;
+}
+
+// Returns OK and marks the sequence as seen, or DUPLICATE/REPLAY without changing anything.
+// Sequence numbers start at 1 for each epoch and must not wrap within one.
+static udp_control_status_t udp_control_accept_seq(udp_seq_window_t *window, uint32_t seq)
+{
+    if (seq == 0) {
+        return UDP_CONTROL_STATUS_REPLAY;
+    }
+    if (seq > window->highest) {
+        uint32_t shift = seq - window->highest;
+        window->seen = (shift >= UDP_CONTROL_REPLAY_WINDOW) ? 0 : (window->seen << shift);
+        window->seen |= 1;
+        window->highest = seq;
+        return UDP_CONTROL_STATUS_OK;
+    }
+
+    uint32_t offset = window->highest - seq;
+    if (offset >= UDP_CONTROL_REPLAY_WINDOW) {
+        return UDP_CONTROL_STATUS_REPLAY;
+    }
+    if (window->seen & (1ULL << offset)) {
+        return UDP_CONTROL_STATUS_DUPLICATE;
+    }
+    window->seen |= 1ULL << offset;
+    return UDP_CONTROL_STATUS_OK;
+}
+
+// Always together with resetting udp_seq: a window that starts over under an old epoch would
+// accept the datagrams already seen with it
+static void udp_control_new_epoch(void)
+{
+    uint32_t epoch;
+    do {
+        epoch = esp_random();
+    } while (epoch == 0 || epoch == udp_epoch);
+    udp_epoch = epoch;
+}
+
+static void udp_group_load_seq(void)
+{
+    nvs_handle_t nvs_handle;
+    uint32_t highest = 0;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle) == ESP_OK) {
+        nvs_get_u32(nvs_handle, NVS_KEY_GROUP_SEQ, &highest);
+        nvs_close(nvs_handle);
+    }
+    udp_group_seq.highest = highest;
+    udp_group_seq.seen = highest != 0 ? UINT64_MAX : 0;
+}
+
+static esp_err_t udp_group_save_seq(uint32_t highest)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK) {
+        err = nvs_set_u32(nvs_handle, NVS_KEY_GROUP_SEQ, highest);
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs_handle);
+        }
+        nvs_close(nvs_handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save group sequence: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+static void udp_control_compute_mac(mbedtls_md_context_t *hmac, const uint8_t *data, size_t len,
+                                    uint8_t mac[UDP_CONTROL_MAC_LEN])
+{
+    uint8_t digest[32];
+    mbedtls_md_hmac_reset(hmac);
+    mbedtls_md_hmac_update(hmac, data, len);
+    mbedtls_md_hmac_finish(hmac, digest);
+    memcpy(mac, digest, UDP_CONTROL_MAC_LEN);
+}
+
+static bool udp_control_mac_equal(const uint8_t *a, const uint8_t *b)
+{
+    uint8_t diff = 0;
+    for (int i = 0; i < UDP_CONTROL_MAC_LEN; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+// Authenticate, de-duplicate and apply one request, then answer with the relay state.
+// Datagrams that fail authentication are dropped silently.
+static void udp_control_handle_datagram(int sock, mbedtls_md_context_t *hmac, const uint8_t *buf, int len,
+                                        const struct sockaddr_in *from)
+{
+    int64_t received_us = esp_timer_get_time();
+    UDP_STATS_INC(received);
+
+    if (len < UDP_CONTROL_HEADER_LEN + UDP_CONTROL_MAC_LEN ||
+        len > UDP_CONTROL_HEADER_LEN + UDP_CONTROL_MAX_COMMAND_LEN + UDP_CONTROL_MAC_LEN ||
+        buf[0] != UDP_CONTROL_MAGIC0 || buf[1] != UDP_CONTROL_MAGIC1 ||
+        buf[2] != UDP_CONTROL_VERSION || buf[3] != UDP_CONTROL_TYPE_COMMAND) {
+        UDP_STATS_INC(bad_mac);
+        return;
+    }
+
+    uint8_t mac[UDP_CONTROL_MAC_LEN];
+    int signed_len = len - UDP_CONTROL_MAC_LEN;
+    udp_control_compute_mac(hmac, buf, signed_len, mac);
+    if (!udp_control_mac_equal(mac, buf + signed_len)) {
+        UDP_STATS_INC(bad_mac);
+        return;
+    }
+
+    uint32_t epoch = udp_get_le32(buf + 4);
+    uint32_t seq = udp_get_le32(buf + 8);
+    int cmd_len = signed_len - UDP_CONTROL_HEADER_LEN;
+    udp_control_status_t status = UDP_CONTROL_STATUS_OK;
+    relay_commit_info_t info = { .mask = relay_get_mask(), .applied_at_us = 0 };
+    uint32_t previous_mask = info.mask;
+
+    if (epoch != udp_epoch) {
+        status = UDP_CONTROL_STATUS_STALE_EPOCH;
+        UDP_STATS_INC(stale_epoch);
+    } else if (cmd_len > 0) {
+        // An empty command is a state query and does not consume a sequence number
+        status = udp_control_accept_seq(&udp_seq, seq);
+        if (status == UDP_CONTROL_STATUS_OK) {
+            relay_command_t cmd;
+            if (relay_command_parse_binary(buf + UDP_CONTROL_HEADER_LEN, cmd_len, &cmd) != ESP_OK) {
+                status = UDP_CONTROL_STATUS_INVALID;
+                UDP_STATS_INC(invalid);
+            } else if (relay_commit(cmd.set_mask, cmd.clear_mask, RELAY_SOURCE_UDP, &info) != ESP_OK) {
+                status = UDP_CONTROL_STATUS_REJECTED;
+                info.mask = relay_get_mask();
+            } else {
+                UDP_STATS_INC(applied);
+                metrics_record_command(RELAY_SOURCE_UDP, info.applied_at_us - received_us);
+            }
+        } else if (status == UDP_CONTROL_STATUS_DUPLICATE) {
+            UDP_STATS_INC(duplicates);
+        } else {
+            UDP_STATS_INC(replays);
+        }
+    }
+
+    uint8_t reply[UDP_CONTROL_REPLY_LEN] = {
+        UDP_CONTROL_MAGIC0, UDP_CONTROL_MAGIC1, UDP_CONTROL_VERSION, UDP_CONTROL_TYPE_STATE,
+    };
+    udp_put_le32(reply + 4, udp_epoch);
+    udp_put_le32(reply + 8, seq);
+    reply[12] = status;
+    reply[13] = info.mask;
+    udp_put_le32(reply + 16, (uint32_t)info.applied_at_us);
+    udp_put_le32(reply + 20, (uint32_t)((uint64_t)info.applied_at_us >> 32));
+    udp_control_compute_mac(hmac, reply, UDP_CONTROL_REPLY_LEN - UDP_CONTROL_MAC_LEN,
+                            reply + UDP_CONTROL_REPLY_LEN - UDP_CONTROL_MAC_LEN);
+    sendto(sock, reply, sizeof(reply), 0, (const struct sockaddr *)from, sizeof(*from));
+
+    if (info.mask != previous_mask) {
+        relay_publish_status_async();
+    }
+}
+
+static void udp_group_commit(uint32_t set_mask, uint32_t clear_mask, int64_t apply_at_us)
+{
+    relay_commit_info_t info;
+    uint32_t previous_mask = relay_get_mask();
+    if (relay_commit(set_mask, clear_mask, RELAY_SOURCE_MULTICAST, &info) != ESP_OK) {
+        return;
+    }
+
+    int64_t late_us = (apply_at_us > 0) ? time_sync_now_us() - apply_at_us : 0;
+    portENTER_CRITICAL(&udp_stats_lock);
+    udp_stats.group_applied++;
+    if (late_us > udp_stats.group_max_late_us) {
+        udp_stats.group_max_late_us = late_us > INT32_MAX ? INT32_MAX : (int32_t)late_us;
+    }
+    portEXIT_CRITICAL(&udp_stats_lock);
+
+    if (info.mask != previous_mask) {
+        relay_publish_status_async();
+    }
+}
+
+static void udp_group_timer_callback(void *arg)
+{
+    udp_group_pending_t *pending = arg;
+    udp_group_commit(pending->set_mask, pending->clear_mask, pending->apply_at_us);
+    pending->busy = false;
+}
+
+// Drop group commands armed under the previous settings. A callback already running finishes
+// and clears its own slot.
+static void udp_group_cancel_pending(void)
+{
+    for (int i = 0; i < UDP_GROUP_MAX_PENDING; i++) {
+        udp_group_pending_t *pending = &udp_group_pending[i];
+        if (pending->timer != NULL && esp_timer_stop(pending->timer) == ESP_OK) {
+            pending->busy = false;
+        }
+    }
+}
+
+// Apply now, or arm a pending slot for a future apply time. The wall-clock delay is converted
+// to an esp_timer delay once, so an SNTP step after arming does not move the switch time.
+static void udp_group_schedule(uint32_t set_mask, uint32_t clear_mask, int64_t apply_at_us, int64_t now_us)
+{
+    if (apply_at_us <= now_us) {
+        udp_group_commit(set_mask, clear_mask, apply_at_us);
+        return;
+    }
+
+    for (int i = 0; i < UDP_GROUP_MAX_PENDING; i++) {
+        udp_group_pending_t *pending = &udp_group_pending[i];
+        if (pending->busy || pending->timer == NULL) {
+            continue;
+        }
+        pending->busy = true;
+        pending->set_mask = set_mask;
+        pending->clear_mask = clear_mask;
+        pending->apply_at_us = apply_at_us;
+        if (esp_timer_start_once(pending->timer, apply_at_us - now_us) != ESP_OK) {
+            pending->busy = false;
+            break;
+        }
+        UDP_STATS_INC(group_scheduled);
+        return;
+    }
+
+    ESP_LOGW(TAG, "No free slot for scheduled group command");
+    UDP_STATS_INC(group_rejected);
+}
+
+// Authenticate a group frame and apply the entries addressed to this device. Group frames are
+// never answered; replay protection is the sequence window plus the apply-time window, which
+// requires a synchronized clock.
+static void udp_group_handle_datagram(mbedtls_md_context_t *hmac, uint8_t device_id, const uint8_t *buf, int len)
+{
+    UDP_STATS_INC(group_received);
+
+    int signed_len = len - UDP_CONTROL_MAC_LEN;
+    if (len < UDP_GROUP_HEADER_LEN + UDP_CONTROL_MAC_LEN ||
+        buf[0] != UDP_CONTROL_MAGIC0 || buf[1] != UDP_CONTROL_MAGIC1 ||
+        buf[2] != UDP_CONTROL_VERSION || buf[3] != UDP_CONTROL_TYPE_GROUP ||
+        buf[16] > UDP_GROUP_MAX_ENTRIES ||
+        signed_len != UDP_GROUP_HEADER_LEN + buf[16] * UDP_GROUP_ENTRY_LEN) {
+        UDP_STATS_INC(group_rejected);
+        return;
+    }
+
+    uint8_t mac[UDP_CONTROL_MAC_LEN];
+    udp_control_compute_mac(hmac, buf, signed_len, mac);
+    if (!udp_control_mac_equal(mac, buf + signed_len)) {
+        UDP_STATS_INC(group_rejected);
+        return;
+    }
+
+    int64_t now_us = time_sync_now_us();
+    int64_t apply_at_us = (int64_t)((uint64_t)udp_get_le32(buf + 8) | ((uint64_t)udp_get_le32(buf + 12) << 32));
+    uint32_t previous_highest = udp_group_seq.highest;
+    if (!time_sync_is_synced() ||
+        apply_at_us < now_us - (int64_t)UDP_GROUP_MAX_AGE_MS * 1000 ||
+        apply_at_us > now_us + (int64_t)UDP_GROUP_MAX_LEAD_MS * 1000 ||
+        udp_control_accept_seq(&udp_group_seq, udp_get_le32(buf + 4)) != UDP_CONTROL_STATUS_OK) {
+        UDP_STATS_INC(group_rejected);
+        return;
+    }
+    // Persist before applying: a frame applied but not recorded could be replayed after a reboot
+    if (udp_group_seq.highest != previous_highest && udp_group_save_seq(udp_group_seq.highest) != ESP_OK) {
+        UDP_STATS_INC(group_rejected);
+        return;
+    }
+
+    // Later entries override earlier ones for the same relay
+    uint32_t set_mask = 0;
+    uint32_t clear_mask = 0;
+    bool addressed = false;
+    for (int i = 0; i < buf[16]; i++) {
+        const uint8_t *entry = buf + UDP_GROUP_HEADER_LEN + i * UDP_GROUP_ENTRY_LEN;
+        if ((entry[0] != device_id && entry[0] != UDP_GROUP_DEVICE_ALL) ||
+            (entry[1] & entry[2]) != 0 || ((entry[1] | entry[2]) & ~RELAY_ALL_MASK) != 0) {
+            continue;
+        }
+        set_mask = (set_mask & ~entry[2]) | entry[1];
+        clear_mask = (clear_mask & ~entry[1]) | entry[2];
+        addressed = true;
+    }
+    if (addressed) {
+        udp_group_schedule(set_mask, clear_mask, apply_at_us, now_us);
+    }
+}
+
+static int udp_control_open_socket(uint16_t port, const char *group_addr)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Failed to create socket: errno %d", errno);
+        return -1;
+    }
+
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ESP_LOGE(TAG, "Failed to bind port %u: errno %d", port, errno);
+        close(sock);
+        return -1;
+    }
+
+    if (group_addr != NULL) {
+        // lwIP keeps the membership across STA reconnects and reports it again on link up
+        struct ip_mreq mreq = {
+            .imr_interface.s_addr = htonl(INADDR_ANY),
+        };
+        if (inet_aton(group_addr, &mreq.imr_multiaddr) == 0 ||
+            !IN_MULTICAST(ntohl(mreq.imr_multiaddr.s_addr)) ||
+            setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+            ESP_LOGE(TAG, "Failed to join group %s: errno %d", group_addr, errno);
+            close(sock);
+            return -1;
+        }
+        ESP_LOGI(TAG, "Joined multicast group %s:%u", group_addr, port);
+    } else {
+        ESP_LOGI(TAG, "Listening on UDP port %u (epoch 0x%08lx)", port, (unsigned long)udp_epoch);
+    }
+    return sock;
+}
+
+static void udp_control_close(int *sock)
+{
+    if (*sock >= 0) {
+        close(*sock);
+        *sock = -1;
+    }
+}
+
+static void udp_control_task(void *arg)
+{
+    mbedtls_md_context_t hmac;
+    mbedtls_md_context_t group_hmac;
+    udp_control_config_t config = { 0 };
+    uint32_t generation = 0;
+    bool reopen = false;
+    int sock = -1;
+    int group_sock = -1;
+    uint8_t buf[UDP_GROUP_HEADER_LEN + UDP_GROUP_MAX_ENTRIES * UDP_GROUP_ENTRY_LEN + UDP_CONTROL_MAC_LEN + 1];
+
+    mbedtls_md_init(&hmac);
+    mbedtls_md_init(&group_hmac);
+    if (mbedtls_md_setup(&hmac, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) != 0 ||
+        mbedtls_md_setup(&group_hmac, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) != 0) {
+        ESP_LOGE(TAG, "Failed to set up HMAC");
+        vTaskDelete(NULL);
+        return;
+    }
+
+    while (1) {
+        if (generation != udp_config_generation || reopen) {
+            bool reconfigured = generation != udp_config_generation;
+            generation = udp_config_generation;
+            reopen = false;
+            xSemaphoreTake(udp_config_mutex, portMAX_DELAY);
+            config = udp_config;
+            bool key_changed = udp_key_changed;
+            bool group_key_changed = udp_group_key_changed;
+            udp_key_changed = false;
+            udp_group_key_changed = false;
+            xSemaphoreGive(udp_config_mutex);
+            udp_control_close(&sock);
+            udp_control_close(&group_sock);
+            if (reconfigured) {
+                udp_group_cancel_pending();
+            }
+            // A new key starts a new session; other changes keep the windows and the epoch
+            if (key_changed) {
+                memset(&udp_seq, 0, sizeof(udp_seq));
+                udp_control_new_epoch();
+                ESP_LOGI(TAG, "Key changed, new epoch 0x%08lx", (unsigned long)udp_epoch);
+            }
+            if (group_key_changed) {
+                memset(&udp_group_seq, 0, sizeof(udp_group_seq));
+                udp_group_save_seq(0);
+            }
+            if (config.enabled) {
+                mbedtls_md_hmac_starts(&hmac, config.key, config.key_len);
+                sock = udp_control_open_socket(config.port, NULL);
+            }
+            if (config.group_enabled) {
+                mbedtls_md_hmac_starts(&group_hmac, config.group_key, config.group_key_len);
+                group_sock = udp_control_open_socket(config.group_port, config.group_addr);
+            }
+            memset(config.key, 0, sizeof(config.key));
+            memset(config.group_key, 0, sizeof(config.group_key));
+
+            // Modem sleep holds received frames until the next beacon; stay awake while listening
+            esp_wifi_set_ps((config.enabled || config.group_enabled) ? WIFI_PS_NONE : WIFI_PS_MIN_MODEM);
+        }
+
+        bool want_sock = config.enabled && sock < 0;
+        bool want_group = config.group_enabled && group_sock < 0;
+        if (sock < 0 && group_sock < 0) {
+            // Disabled, or the sockets could not be opened: wait for a config change or retry later
+            ulTaskNotifyTake(pdTRUE, (want_sock || want_group) ? pdMS_TO_TICKS(5000) : portMAX_DELAY);
+            reopen = want_sock || want_group;
+            continue;
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        if (sock >= 0) {
+            FD_SET(sock, &fds);
+        }
+        if (group_sock >= 0) {
+            FD_SET(group_sock, &fds);
+        }
+        struct timeval timeout = {
+            .tv_sec = UDP_CONTROL_RECV_TIMEOUT_MS / 1000,
+            .tv_usec = (UDP_CONTROL_RECV_TIMEOUT_MS % 1000) * 1000,
+        };
+        int ready = select((sock > group_sock ? sock : group_sock) + 1, &fds, NULL, NULL, &timeout);
+        if (ready < 0) {
+            ESP_LOGE(TAG, "select failed: errno %d", errno);
+            udp_control_close(&sock);
+            udp_control_close(&group_sock);
+            continue;
+        }
+
+        if (sock >= 0 && FD_ISSET(sock, &fds)) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            int len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+            if (len >= 0) {
+                udp_control_handle_datagram(sock, &hmac, buf, len, &from);
+            }
+        }
+        if (group_sock >= 0 && FD_ISSET(group_sock, &fds)) {
+            int len = recv(group_sock, buf, sizeof(buf), 0);
+            if (len >= 0) {
+                udp_group_handle_datagram(&group_hmac, config.group_device_id, buf, len);
+            }
+        }
+    }
+}
+
+esp_err_t udp_control_init(void)
+{
+    // Held until the task exists, so a POST /udp that comes in meanwhile waits for the
+    // stored config and has a task to wake
+    SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+    if (mutex == NULL) {
+        ESP_LOGE(TAG, "Failed to create config mutex");
+        return ESP_ERR_NO_MEM;
+    }
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    udp_config_mutex = mutex;
+
+    if (udp_control_load_config(&udp_config) != ESP_OK) {
+        udp_control_default_config(&udp_config);
+    }
+
+    udp_control_new_epoch();
+    udp_group_load_seq();
+
+    for (int i = 0; i < UDP_GROUP_MAX_PENDING; i++) {
+        esp_timer_create_args_t timer_args = {
+            .callback = udp_group_timer_callback,
+            .arg = &udp_group_pending[i],
+            .name = "udp_group",
+        };
+        esp_timer_create(&timer_args, &udp_group_pending[i].timer);
+    }
+
+    if (xTaskCreate(udp_control_task, "udp_control", UDP_CONTROL_TASK_STACK_SIZE, NULL,
+                    UDP_CONTROL_TASK_PRIORITY, &udp_task_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create UDP control task");
+        xSemaphoreGive(udp_config_mutex);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "UDP control %s, multicast group %s", udp_config.enabled ? "enabled" : "disabled",
+             udp_config.group_enabled ? udp_config.group_addr : "disabled");
+    xSemaphoreGive(udp_config_mutex);
+    return ESP_OK;
+}
+
+void udp_control_get_config(udp_control_config_t *config)
+{
+    if (udp_config_mutex == NULL) {
+        udp_control_default_config(config);
+        return;
+    }
+    xSemaphoreTake(udp_config_mutex, portMAX_DELAY);
+    *config = udp_config;
+    xSemaphoreGive(udp_config_mutex);
+}
+
+esp_err_t udp_control_set_config(const udp_control_config_t *config)
+{
+    struct in_addr group;
+    if (config->port == 0 || config->key_len > UDP_CONTROL_KEY_MAX_LEN ||
+        (config->enabled && config->key_len < UDP_CONTROL_KEY_MIN_LEN)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (config->group_enabled &&
+        (config->group_port == 0 || config->group_device_id == UDP_GROUP_DEVICE_ALL ||
+         config->group_key_len < UDP_CONTROL_KEY_MIN_LEN || config->group_key_len > UDP_CONTROL_KEY_MAX_LEN ||
+         memchr(config->group_addr, '\0', sizeof(config->group_addr)) == NULL ||
+         inet_aton(config->group_addr, &group) == 0 || !IN_MULTICAST(ntohl(group.s_addr)))) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (udp_config_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = udp_control_save_config(config);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    xSemaphoreTake(udp_config_mutex, portMAX_DELAY);
+    if (config->key_len != udp_config.key_len || memcmp(config->key, udp_config.key, config->key_len) != 0) {
+        udp_key_changed = true;
+    }
+    if (config->group_key_len != udp_config.group_key_len ||
+        memcmp(config->group_key, udp_config.group_key, config->group_key_len) != 0) {
+        udp_group_key_changed = true;
+    }
+    udp_config = *config;
+    udp_config_generation++;
+    xSemaphoreGive(udp_config_mutex);
+
+    // Wake the task if it is parked; otherwise it notices on its next receive timeout
+    xTaskNotifyGive(udp_task_handle);
+    ESP_LOGI(TAG, "UDP control %s on port %u, multicast group %s", config->enabled ? "enabled" : "disabled",
+             config->port, config->group_enabled ? config->group_addr : "disabled");
+    return ESP_OK;
+}
+
+void udp_control_get_stats(udp_control_stats_t *stats)
+{
+    portENTER_CRITICAL(&udp_stats_lock);
+    *stats = udp_stats;
+    portEXIT_CRITICAL(&udp_stats_lock);
+}
+
+uint32_t udp_control_get_epoch(void)
+{
+    return udp_epoch;
+}
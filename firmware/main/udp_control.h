@@ -0,0 +1,118 @@
+#ifndef UDP_CONTROL_H
+#define UDP_CONTROL_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// UDP control listener configuration
+#ifndef UDP_CONTROL_DEFAULT_PORT
+#define UDP_CONTROL_DEFAULT_PORT 5005
+#endif
+// Above httpd and MQTT so a command is never queued behind a web request
+#ifndef UDP_CONTROL_TASK_PRIORITY
+#define UDP_CONTROL_TASK_PRIORITY 10
+#endif
+#ifndef UDP_CONTROL_TASK_STACK_SIZE
+#define UDP_CONTROL_TASK_STACK_SIZE 4096
+#endif
+// How often the task re-checks its configuration while idle on the socket
+#ifndef UDP_CONTROL_RECV_TIMEOUT_MS
+#define UDP_CONTROL_RECV_TIMEOUT_MS 1000
+#endif
+
+// Multicast group defaults
+#ifndef UDP_GROUP_DEFAULT_ADDR
+#define UDP_GROUP_DEFAULT_ADDR "239.255.76.1"
+#endif
+#ifndef UDP_GROUP_DEFAULT_PORT
+#define UDP_GROUP_DEFAULT_PORT 5006
+#endif
+// Accepted window around now for a group frame's apply time
+#ifndef UDP_GROUP_MAX_AGE_MS
+#define UDP_GROUP_MAX_AGE_MS 2000
+#endif
+#ifndef UDP_GROUP_MAX_LEAD_MS
+#define UDP_GROUP_MAX_LEAD_MS 60000
+#endif
+// Group commands waiting for their apply time
+#ifndef UDP_GROUP_MAX_PENDING
+#define UDP_GROUP_MAX_PENDING 4
+#endif
+
+#define UDP_CONTROL_KEY_MIN_LEN 16
+#define UDP_CONTROL_KEY_MAX_LEN 32
+#define UDP_CONTROL_MAC_LEN 8           // Truncated HMAC-SHA256
+#define UDP_CONTROL_REPLAY_WINDOW 64    // Out-of-order sequence numbers accepted behind the highest
+
+// Datagram layout, all integers little endian:
+//   request: "RU" | version | type | epoch:u32 | seq:u32 | command (0..32 bytes) | mac[8]
+//   reply:   "RU" | version | type | epoch:u32 | seq:u32 | status | mask | 0 0 |
+//            applied_at_us:i64 | mac[8]
+// The command is a binary relay command (raw frame or CBOR, see relay_command.h); an empty
+// command is a state query. The MAC covers everything before it.
+#define UDP_CONTROL_MAGIC0 'R'
+#define UDP_CONTROL_MAGIC1 'U'
+#define UDP_CONTROL_VERSION 1
+#define UDP_CONTROL_TYPE_COMMAND 0x01
+#define UDP_CONTROL_TYPE_STATE 0x81
+#define UDP_CONTROL_HEADER_LEN 12
+#define UDP_CONTROL_MAX_COMMAND_LEN 32
+#define UDP_CONTROL_REPLY_LEN (UDP_CONTROL_HEADER_LEN + 12 + UDP_CONTROL_MAC_LEN)
+
+// Multicast group frame, signed with the group key and never answered:
+//   "RU" | version | type | seq:u32 | apply_at_us:i64 | count | count x (device, set, clear) | mac[8]
+// apply_at_us is Unix time in microseconds (SNTP); a time at or before now applies immediately.
+// Each box applies the entries addressed to its device ID or to UDP_GROUP_DEVICE_ALL, in order.
+#define UDP_CONTROL_TYPE_GROUP 0x02
+#define UDP_GROUP_HEADER_LEN 17
+#define UDP_GROUP_ENTRY_LEN 3
+#define UDP_GROUP_MAX_ENTRIES 32
+#define UDP_GROUP_DEVICE_ALL 0xff
+
+typedef enum {
+    UDP_CONTROL_STATUS_OK = 0,
+    UDP_CONTROL_STATUS_DUPLICATE,       // Sequence already applied; state returned, nothing re-applied
+    UDP_CONTROL_STATUS_STALE_EPOCH,     // Device rebooted; the reply carries the current epoch
+    UDP_CONTROL_STATUS_REPLAY,          // Sequence older than the replay window
+    UDP_CONTROL_STATUS_INVALID,         // Command could not be decoded
+    UDP_CONTROL_STATUS_REJECTED,        // Relay layer refused the command
+} udp_control_status_t;
+
+typedef struct {
+    bool enabled;
+    uint16_t port;
+    uint8_t key_len;
+    uint8_t key[UDP_CONTROL_KEY_MAX_LEN];
+    // Multicast group membership
+    bool group_enabled;
+    uint8_t group_device_id;
+    uint16_t group_port;
+    char group_addr[16];
+    uint8_t group_key_len;
+    uint8_t group_key[UDP_CONTROL_KEY_MAX_LEN];
+} udp_control_config_t;
+
+typedef struct {
+    uint32_t received;
+    uint32_t applied;
+    uint32_t duplicates;
+    uint32_t replays;
+    uint32_t bad_mac;       // Includes malformed datagrams; these are dropped without a reply
+    uint32_t stale_epoch;
+    uint32_t invalid;
+    uint32_t group_received;
+    uint32_t group_applied;
+    uint32_t group_scheduled;
+    uint32_t group_rejected;    // Bad MAC, replayed, outside the time window or clock not synced
+    int32_t group_max_late_us;  // Worst observed delay between apply time and GPIO commit
+} udp_control_stats_t;
+
+// Function declarations
+esp_err_t udp_control_init(void);
+void udp_control_get_config(udp_control_config_t *config);
+esp_err_t udp_control_set_config(const udp_control_config_t *config);
+void udp_control_get_stats(udp_control_stats_t *stats);
+uint32_t udp_control_get_epoch(void);
+
+#endif // UDP_CONTROL_H
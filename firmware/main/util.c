@@ -0,0 +1,29 @@
+#include "util.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+// Append at len, writing only what still fits in buf. Returns the new length, which keeps
+// counting past buf_size so the final result compares against it like snprintf's.
+size_t buf_appendf(char *buf, size_t buf_size, size_t len, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + (len < buf_size ? len : buf_size), len < buf_size ? buf_size - len : 0, format, args);
+    va_end(args);
+    return n > 0 ? len + (size_t)n : len;
+}
+
+// For tasks that wake every step_ms and act every interval_ms (0 = never): true once
+// enough steps have passed, restarting the count
+bool periodic_due(uint32_t *elapsed_ms, uint32_t step_ms, uint32_t interval_ms)
+{
+    if (interval_ms == 0) {
+        return false;
+    }
+    *elapsed_ms += step_ms;
+    if (*elapsed_ms < interval_ms) {
+        return false;
+    }
+    *elapsed_ms = 0;
+    return true;
+}
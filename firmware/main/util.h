@@ -0,0 +1,16 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Small helpers shared by the periodic samplers and the text formatters (JSON read-outs,
+// deferred log lines)
+
+// Function declarations
+size_t buf_appendf(char *buf, size_t buf_size, size_t len, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+bool periodic_due(uint32_t *elapsed_ms, uint32_t step_ms, uint32_t interval_ms);
+
+#endif // UTIL_H
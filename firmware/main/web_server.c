@@ -5,17 +5,82 @@
 #include "esp_timer.h"
 #include "cJSON.h"
 #include "relay_control.h"
+#include "relay_command.h"
 #include "wifi_manager.h"
+#include "wifi_scan.h"
 #include "app_mqtt.h"
+#include "udp_control.h"
+#include "time_sync.h"
+#include "relay_scheduler.h"
+#include "relay_timer.h"
+#include "relay_rules.h"
+#include "relay_persist.h"
+#include "relay_history.h"
+#include "metrics.h"
+#include "trace.h"
+#include "task_stats.h"
+#include "heap_monitor.h"
+#include "log_persist.h"
+#include "log_forward.h"
+#include "boot_timeline.h"
+#include "json_out.h"
+#include <stdlib.h>
 #include <string.h>
 
 static const char *TAG = "WEB_SERVER";
 
 static httpd_handle_t server = NULL;
 
+// Every handler is registered through web_server_register() and reached via
+// web_server_dispatch(), which times it for the request metrics
+typedef struct {
+    esp_err_t (*handler)(httpd_req_t *req);
+    int metrics_route;
+} web_server_route_t;
+
+static web_server_route_t web_server_routes[WEB_SERVER_MAX_URI_HANDLERS];
+static int web_server_route_count = 0;
+
 // Serve index.html from LittleFS
 #include <stdio.h>
 
+// Receive a request body into buf as a NUL-terminated string. On failure an error
+// response has already been sent and -1 is returned.
+static int web_server_recv_body(httpd_req_t *req, char *buf, size_t buf_size)
+{
+    // Check content length
+    if (req->content_len <= 0) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Empty body");
+        return -1;
+    }
+
+    if (req->content_len >= buf_size) {
+        httpd_resp_send_err(req, HTTPD_413_CONTENT_TOO_LARGE, "Body too large");
+        return -1;
+    }
+
+    int total_len = req->content_len;
+    int cur_len = 0;
+    
+    // Read data in smaller chunks to be safer
+    while (cur_len < total_len) {
+        int chunk_size = (total_len - cur_len) > 256 ? 256 : (total_len - cur_len);
+        int received = httpd_req_recv(req, buf + cur_len, chunk_size);
+        
+        if (received <= 0) {
+            if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+                continue;
+            }
+            ESP_LOGE(TAG, "Failed to receive data: %d", received);
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Failed to receive data");
+            return -1;
+        }
+        cur_len += received;
+    }
+    buf[cur_len] = '\0';
+    return cur_len;
+}
+
 esp_err_t web_server_get_root(httpd_req_t *req)
 {
     httpd_resp_set_type(req, "text/html");
@@ -54,9 +119,21 @@ esp_err_t web_server_get_status(httpd_req_t *req)
         cJSON_AddBoolToObject(relays, key, relay_get_state(i));
     }
     cJSON_AddItemToObject(json, "relays", relays);
+
+    // Contact wear: switching cycles and cumulative on-time per relay
+    relay_usage_t usage[NUM_RELAYS];
+    relay_get_usage(usage);
+    cJSON *usage_json = cJSON_AddArrayToObject(json, "relay_usage");
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "cycles", usage[i].cycles);
+        cJSON_AddNumberToObject(item, "on_time_s", (double)(usage[i].on_time_ms / 1000));
+        cJSON_AddItemToArray(usage_json, item);
+    }
     
     // Get system status
     cJSON_AddBoolToObject(json, "wifi_connected", wifi_manager_is_connected());
+    cJSON_AddStringToObject(json, "wifi_state", wifi_sm_state_name(wifi_manager_get_state()));
     
     char ip_str[16];
     if (wifi_manager_get_ip(ip_str, sizeof(ip_str)) == ESP_OK) {
@@ -65,7 +142,7 @@ esp_err_t web_server_get_status(httpd_req_t *req)
         cJSON_AddStringToObject(json, "ip_address", "N/A");
     }
     
-    cJSON_AddBoolToObject(json, "mqtt_connected", false); // TODO: implement MQTT status
+    cJSON_AddBoolToObject(json, "mqtt_connected", mqtt_client_is_connected());
     cJSON_AddNumberToObject(json, "free_heap", esp_get_free_heap_size());
     cJSON_AddNumberToObject(json, "uptime", esp_timer_get_time() / 1000000);
     cJSON_AddStringToObject(json, "firmware_version", "1.0.0");
@@ -85,45 +162,66 @@ esp_err_t web_server_get_status(httpd_req_t *req)
 
 esp_err_t web_server_post_relay(httpd_req_t *req)
 {
+    TRACE_SCOPE(TRACE_HTTP_POST_RELAY);
     ESP_LOGI(TAG, "POST /relay len=%d", (int)req->content_len);
+    int64_t received_us = esp_timer_get_time();
     
-    // Check content length
-    if (req->content_len <= 0) {
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Empty body");
+    // Use a smaller buffer to avoid stack overflow
+    char content[1024];
+    int content_len = web_server_recv_body(req, content, sizeof(content));
+    if (content_len < 0) {
         return ESP_FAIL;
     }
 
-    if (req->content_len >= 1024) { // Reduced from 4096 to 1024
-        httpd_resp_send_err(req, HTTPD_413_CONTENT_TOO_LARGE, "Body too large");
-        return ESP_FAIL;
+    // CBOR and raw binary frames are selected by Content-Type; anything else is JSON
+    char content_type[32] = {0};
+    httpd_req_get_hdr_value_str(req, "Content-Type", content_type, sizeof(content_type));
+    bool binary = strncmp(content_type, RELAY_CONTENT_TYPE_CBOR, strlen(RELAY_CONTENT_TYPE_CBOR)) == 0 ||
+                  strncmp(content_type, RELAY_CONTENT_TYPE_FRAME, strlen(RELAY_CONTENT_TYPE_FRAME)) == 0;
+
+    relay_command_t cmd;
+    relay_ack_t ack;
+    esp_err_t ret;
+    if (binary) {
+        ESP_LOGI(TAG, "Received binary relay control (%d bytes)", content_len);
+        ret = relay_command_parse_binary((const uint8_t *)content, content_len, &cmd);
+    } else {
+        ESP_LOGI(TAG, "Received relay control: %s", content);
+        ret = relay_command_parse_json(content, content_len, &cmd);
+    }
+    if (ret == ESP_OK) {
+        cmd.received_us = received_us;
+        ret = relay_command_execute(&cmd, RELAY_SOURCE_HTTP, &ack);
+    } else {
+        relay_command_reject(ret, &ack);
     }
 
-    // Use a smaller buffer to avoid stack overflow
-    char content[1024];
-    int total_len = req->content_len;
-    int cur_len = 0;
-    
-    // Read data in smaller chunks to be safer
-    while (cur_len < total_len) {
-        int chunk_size = (total_len - cur_len) > 256 ? 256 : (total_len - cur_len);
-        int received = httpd_req_recv(req, content + cur_len, chunk_size);
-        
-        if (received <= 0) {
-            if (received == HTTPD_SOCK_ERR_TIMEOUT) {
-                continue;
-            }
-            ESP_LOGE(TAG, "Failed to receive data: %d", received);
-            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Failed to receive data");
-            return ESP_FAIL;
+    // Commands carrying a correlation ID get the ack as the response body, in CBOR for binary requests
+    if (cmd.id[0] != '\0') {
+        char ack_buf[160];
+        int ack_len;
+        if (binary) {
+            ack_len = relay_command_format_ack_cbor(&cmd, &ack, (uint8_t *)ack_buf, sizeof(ack_buf));
+            httpd_resp_set_type(req, RELAY_CONTENT_TYPE_CBOR);
+        } else {
+            relay_command_format_ack_json(&cmd, &ack, ack_buf, sizeof(ack_buf));
+            ack_len = strlen(ack_buf);
+            httpd_resp_set_type(req, "application/json");
         }
-        cur_len += received;
+        if (ret == ESP_ERR_INVALID_STATE) {
+            httpd_resp_set_status(req, "409 Conflict");
+        } else if (ret != ESP_OK) {
+            httpd_resp_set_status(req, "400 Bad Request");
+        }
+        httpd_resp_send(req, ack_buf, ack_len < 0 ? 0 : ack_len);
+        return ret == ESP_OK ? ESP_OK : ESP_FAIL;
     }
-    content[cur_len] = '\0';
-
-    ESP_LOGI(TAG, "Received relay control: %s", content);
 
-    esp_err_t ret = relay_set_multiple(content);
-    if (ret != ESP_OK) {
+    if (ret == ESP_ERR_INVALID_STATE) {
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_send(req, "Refused by relay interlock or sequence rule", HTTPD_RESP_USE_STRLEN);
+        return ESP_FAIL;
+    } else if (ret != ESP_OK) {
         httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Failed to set relay state");
         return ESP_FAIL;
     }
@@ -132,42 +230,281 @@ esp_err_t web_server_post_relay(httpd_req_t *req)
     return ESP_OK;
 }
 
-esp_err_t web_server_post_wifi(httpd_req_t *req)
+esp_err_t web_server_get_rules(httpd_req_t *req)
 {
-    ESP_LOGI(TAG, "POST /wifi len=%d", (int)req->content_len);
-    
-    // Check content length
-    if (req->content_len <= 0) {
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Empty body");
+    cJSON *json = cJSON_CreateObject();
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create JSON");
         return ESP_FAIL;
     }
 
-    if (req->content_len >= 1024) { // Reduced from 2048 to 1024
-        httpd_resp_send_err(req, HTTPD_413_CONTENT_TOO_LARGE, "Body too large");
+    const relay_interlock_t *interlocks;
+    int interlock_count = relay_rules_get_interlocks(&interlocks);
+    cJSON *interlock_array = cJSON_AddArrayToObject(json, "interlocks");
+    for (int i = 0; i < interlock_count; i++) {
+        cJSON *rule = cJSON_CreateObject();
+        cJSON_AddNumberToObject(rule, "mask", interlocks[i].mask);
+        cJSON_AddNumberToObject(rule, "dead_time_ms", interlocks[i].dead_time_ms);
+        cJSON_AddItemToArray(interlock_array, rule);
+    }
+
+    const relay_sequence_t *sequences;
+    int sequence_count = relay_rules_get_sequences(&sequences);
+    cJSON *sequence_array = cJSON_AddArrayToObject(json, "sequences");
+    for (int i = 0; i < sequence_count; i++) {
+        cJSON *rule = cJSON_CreateObject();
+        cJSON_AddNumberToObject(rule, "relay", sequences[i].relay);
+        cJSON_AddNumberToObject(rule, "requires", sequences[i].requires);
+        cJSON_AddNumberToObject(rule, "delay_ms", sequences[i].delay_ms);
+        cJSON_AddItemToArray(sequence_array, rule);
+    }
+
+    cJSON_AddNumberToObject(json, "stagger_ms", relay_get_stagger_default());
+
+    relay_rules_stats_t stats;
+    relay_rules_get_stats(&stats);
+    cJSON_AddNumberToObject(json, "rejected", stats.rejected);
+    cJSON_AddNumberToObject(json, "deferred", stats.deferred);
+    cJSON_AddNumberToObject(json, "cascaded", stats.cascaded);
+
+    int64_t due_us[NUM_RELAYS];
+    int64_t now_us = esp_timer_get_time();
+    uint32_t pending = relay_get_pending(due_us);
+    cJSON *pending_array = cJSON_AddArrayToObject(json, "pending");
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        if (pending & (1u << i)) {
+            cJSON *item = cJSON_CreateObject();
+            cJSON_AddNumberToObject(item, "relay", i);
+            cJSON_AddNumberToObject(item, "due_in_ms", (double)((due_us[i] - now_us) / 1000));
+            cJSON_AddItemToArray(pending_array, item);
+        }
+    }
+
+    char *json_string = cJSON_PrintUnformatted(json);
+    if (json_string != NULL) {
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_send(req, json_string, strlen(json_string));
+        free(json_string);
+    } else {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to print JSON");
+    }
+
+    cJSON_Delete(json);
+    return ESP_OK;
+}
+
+// {"stagger_ms": n}: default ON spacing for commands that do not carry their own
+esp_err_t web_server_post_rules(httpd_req_t *req)
+{
+    char content[64];
+    int content_len = web_server_recv_body(req, content, sizeof(content));
+    if (content_len < 0) {
+        return ESP_FAIL;
+    }
+
+    cJSON *json = cJSON_ParseWithLength(content, content_len);
+    cJSON *stagger = cJSON_GetObjectItem(json, "stagger_ms");
+    esp_err_t ret = ESP_ERR_INVALID_ARG;
+    if (cJSON_IsNumber(stagger) && stagger->valuedouble >= 0 && stagger->valuedouble <= RELAY_STAGGER_MAX_MS) {
+        ret = relay_set_stagger_default((uint32_t)stagger->valuedouble);
+    }
+    cJSON_Delete(json);
+
+    if (ret == ESP_ERR_INVALID_ARG) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid stagger_ms");
+        return ESP_FAIL;
+    } else if (ret != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to save stagger setting");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_send(req, "OK", 2);
+    return ESP_OK;
+}
+
+esp_err_t web_server_get_power_on(httpd_req_t *req)
+{
+    cJSON *json = cJSON_CreateObject();
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create JSON");
+        return ESP_FAIL;
+    }
+
+    cJSON *modes = cJSON_AddArrayToObject(json, "power_on");
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        cJSON_AddItemToArray(modes, cJSON_CreateString(relay_power_on_name(relay_persist_get_power_on(i))));
+    }
+    relay_persist_stats_t stats;
+    relay_persist_get_stats(&stats);
+    cJSON_AddNumberToObject(json, "saved_mask", stats.saved_mask);
+    cJSON_AddBoolToObject(json, "pending", stats.dirty);
+    cJSON_AddNumberToObject(json, "writes", stats.writes);
+    cJSON_AddNumberToObject(json, "coalesced", stats.coalesced);
+    cJSON_AddNumberToObject(json, "failures", stats.failures);
+    if (stats.last_write_us != 0) {
+        cJSON_AddNumberToObject(json, "last_write_ago_s", (double)((esp_timer_get_time() - stats.last_write_us) / 1000000));
+    }
+
+    char *json_string = cJSON_PrintUnformatted(json);
+    if (json_string != NULL) {
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_send(req, json_string, strlen(json_string));
+        free(json_string);
+    } else {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to print JSON");
+    }
+
+    cJSON_Delete(json);
+    return ESP_OK;
+}
+
+// {"0": "last", "3": "on"}: power-on behaviour per relay, one of "off", "on", "last"
+esp_err_t web_server_post_power_on(httpd_req_t *req)
+{
+    char content[256];
+    int content_len = web_server_recv_body(req, content, sizeof(content));
+    if (content_len < 0) {
+        return ESP_FAIL;
+    }
+
+    cJSON *json = cJSON_ParseWithLength(content, content_len);
+    if (!cJSON_IsObject(json)) {
+        cJSON_Delete(json);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid JSON");
+        return ESP_FAIL;
+    }
+
+    // Validate everything first so a bad entry changes nothing
+    relay_power_on_t modes[NUM_RELAYS];
+    uint32_t given = 0;
+    esp_err_t ret = ESP_OK;
+    for (cJSON *item = json->child; item != NULL && ret == ESP_OK; item = item->next) {
+        char *endptr = NULL;
+        long relay_id = strtol(item->string, &endptr, 10);
+        if (endptr == item->string || *endptr != '\0' || relay_id < 0 || relay_id >= NUM_RELAYS ||
+            !cJSON_IsString(item)) {
+            ret = ESP_ERR_INVALID_ARG;
+        } else {
+            ret = relay_power_on_from_name(item->valuestring, &modes[relay_id]);
+            given |= 1u << relay_id;
+        }
+    }
+    for (int i = 0; i < NUM_RELAYS && ret == ESP_OK; i++) {
+        if (given & (1u << i)) {
+            ret = relay_persist_set_power_on(i, modes[i]);
+        }
+    }
+    cJSON_Delete(json);
+
+    if (ret == ESP_ERR_INVALID_ARG) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected {\"<relay>\": \"off\"|\"on\"|\"last\"}");
+        return ESP_FAIL;
+    } else if (ret != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to save power-on settings");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_send(req, "OK", 2);
+    return ESP_OK;
+}
+
+static void web_server_add_jitter(cJSON *parent, const char *name, const relay_jitter_stats_t *stats)
+{
+    cJSON *item = cJSON_AddObjectToObject(parent, name);
+    cJSON_AddNumberToObject(item, "samples", stats->samples);
+    cJSON_AddNumberToObject(item, "min_us", stats->min_us);
+    cJSON_AddNumberToObject(item, "max_us", stats->max_us);
+    cJSON_AddNumberToObject(item, "mean_us", stats->samples ? (double)stats->sum_us / stats->samples : 0);
+    cJSON_AddNumberToObject(item, "max_commit_us", stats->max_commit_us);
+    cJSON *histogram = cJSON_AddArrayToObject(item, "histogram_log2_us");
+    for (int i = 0; i < RELAY_JITTER_BUCKETS; i++) {
+        cJSON_AddItemToArray(histogram, cJSON_CreateNumber(stats->histogram[i]));
+    }
+}
+
+esp_err_t web_server_get_relay_mode(httpd_req_t *req)
+{
+    static const char *const mode_names[] = { "none", "pulse", "blink", "auto_off" };
+    cJSON *json = cJSON_CreateObject();
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create JSON");
+        return ESP_FAIL;
+    }
+
+    int64_t now_us = esp_timer_get_time();
+    cJSON *relays = cJSON_AddArrayToObject(json, "relays");
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        relay_timer_status_t status;
+        relay_timer_get_status(i, &status);
+        cJSON *relay = cJSON_CreateObject();
+        cJSON_AddStringToObject(relay, "mode", mode_names[status.mode]);
+        cJSON_AddNumberToObject(relay, "auto_off_ms", status.auto_off_ms);
+        if (status.mode == RELAY_TIMER_MODE_BLINK) {
+            cJSON_AddNumberToObject(relay, "on_ms", status.on_ms);
+            cJSON_AddNumberToObject(relay, "off_ms", status.off_ms);
+            cJSON_AddNumberToObject(relay, "remaining", status.remaining);
+        }
+        if (status.mode != RELAY_TIMER_MODE_NONE) {
+            cJSON_AddNumberToObject(relay, "due_in_ms", (double)((status.due_us - now_us) / 1000));
+        }
+        cJSON_AddItemToArray(relays, relay);
+    }
+
+    relay_jitter_stats_t live, bench;
+    relay_timer_bench_t bench_state;
+    relay_timer_get_jitter(&live, &bench, &bench_state);
+    web_server_add_jitter(json, "jitter", &live);
+    web_server_add_jitter(json, "bench", &bench);
+    cJSON *bench_json = cJSON_GetObjectItem(json, "bench");
+    cJSON_AddBoolToObject(bench_json, "running", bench_state.running);
+    cJSON_AddBoolToObject(bench_json, "dry", bench_state.dry);
+    cJSON_AddNumberToObject(bench_json, "period_us", bench_state.period_us);
+
+    char *json_string = cJSON_PrintUnformatted(json);
+    if (json_string != NULL) {
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_send(req, json_string, strlen(json_string));
+        free(json_string);
+    } else {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to print JSON");
+    }
+
+    cJSON_Delete(json);
+    return ESP_OK;
+}
+
+esp_err_t web_server_post_relay_mode(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "POST /relay/mode len=%d", (int)req->content_len);
+
+    char content[256];
+    int content_len = web_server_recv_body(req, content, sizeof(content));
+    if (content_len < 0) {
+        return ESP_FAIL;
+    }
+
+    esp_err_t ret = relay_timer_apply_json(content, content_len);
+    if (ret == ESP_ERR_INVALID_STATE) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Benchmark already running");
+        return ESP_FAIL;
+    } else if (ret != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid relay mode");
         return ESP_FAIL;
     }
 
+    httpd_resp_send(req, "OK", 2);
+    return ESP_OK;
+}
+
+esp_err_t web_server_post_wifi(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "POST /wifi len=%d", (int)req->content_len);
+    
     // Use a smaller buffer to avoid stack overflow
     char content[1024];
-    int total_len = req->content_len;
-    int cur_len = 0;
-    
-    // Read data in smaller chunks to be safer
-    while (cur_len < total_len) {
-        int chunk_size = (total_len - cur_len) > 256 ? 256 : (total_len - cur_len);
-        int received = httpd_req_recv(req, content + cur_len, chunk_size);
-        
-        if (received <= 0) {
-            if (received == HTTPD_SOCK_ERR_TIMEOUT) {
-                continue;
-            }
-            ESP_LOGE(TAG, "Failed to receive data: %d", received);
-            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Failed to receive data");
-            return ESP_FAIL;
-        }
-        cur_len += received;
+    if (web_server_recv_body(req, content, sizeof(content)) < 0) {
+        return ESP_FAIL;
     }
-    content[cur_len] = '\0';
 
     ESP_LOGI(TAG, "Received WiFi config: %s", content);
 
@@ -198,33 +535,907 @@ esp_err_t web_server_post_wifi(httpd_req_t *req)
     return ESP_OK;
 }
 
-esp_err_t web_server_get_ota(httpd_req_t *req)
+esp_err_t web_server_get_wifi_scan(httpd_req_t *req)
 {
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_send(req, "OTA update page", strlen("OTA update page"));
-    return ESP_OK;
-}
+    // Never scans inline: kick off a background refresh if the cache is stale and
+    // answer immediately with whatever is cached
+    wifi_scan_request();
 
-esp_err_t web_server_post_ota(httpd_req_t *req)
-{
-    // TODO: Implement OTA update
-    httpd_resp_send(req, "OTA update not implemented yet", strlen("OTA update not implemented yet"));
+    wifi_scan_result_t results[WIFI_SCAN_MAX_RESULTS];
+    int64_t age_ms = 0;
+    bool in_progress = false;
+    size_t count = wifi_scan_get_results(results, WIFI_SCAN_MAX_RESULTS, &age_ms, &in_progress);
+
+    cJSON *json = cJSON_CreateArray();
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create JSON");
+        return ESP_FAIL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        cJSON *network = cJSON_CreateObject();
+        if (network == NULL) {
+            break;
+        }
+        cJSON_AddStringToObject(network, "ssid", results[i].ssid);
+        cJSON_AddNumberToObject(network, "rssi", results[i].rssi);
+        cJSON_AddNumberToObject(network, "channel", results[i].channel);
+        cJSON_AddNumberToObject(network, "auth", results[i].authmode);
+        cJSON_AddItemToArray(json, network);
+    }
+
+    char age_str[24];
+    snprintf(age_str, sizeof(age_str), "%lld", (long long)age_ms);
+
+    char *json_string = cJSON_PrintUnformatted(json);
+    if (json_string != NULL) {
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+        httpd_resp_set_hdr(req, "X-Scan-Age-Ms", age_str);
+        httpd_resp_set_hdr(req, "X-Scan-In-Progress", in_progress ? "1" : "0");
+        httpd_resp_send(req, json_string, strlen(json_string));
+        free(json_string);
+    } else {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to print JSON");
+    }
+
+    cJSON_Delete(json);
     return ESP_OK;
 }
 
-esp_err_t web_server_init(void)
+esp_err_t web_server_get_mqtt(httpd_req_t *req)
 {
-    ESP_LOGI(TAG, "Initializing web server");
-    
-    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.server_port = WEB_SERVER_PORT;
-    config.max_uri_handlers = WEB_SERVER_MAX_URI_HANDLERS;
-    
-    esp_err_t ret = httpd_start(&server, &config);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to start web server");
-        return ret;
+    app_mqtt_config_t config;
+    mqtt_client_get_config(&config);
+
+    cJSON *json = cJSON_CreateObject();
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create JSON");
+        return ESP_FAIL;
+    }
+
+    cJSON_AddBoolToObject(json, "enabled", config.enabled);
+    cJSON *brokers = cJSON_AddArrayToObject(json, "brokers");
+    for (int i = 0; i < config.broker_count && brokers != NULL; i++) {
+        cJSON_AddItemToArray(brokers, cJSON_CreateString(config.brokers[i]));
+    }
+    cJSON_AddStringToObject(json, "username", config.username);
+    cJSON_AddStringToObject(json, "topic_root", config.topic_root);
+    cJSON_AddNumberToObject(json, "qos", config.qos);
+    cJSON_AddNumberToObject(json, "keepalive", config.keepalive);
+    cJSON_AddNumberToObject(json, "protocol_version", config.protocol_version);
+
+    char *json_string = cJSON_Print(json);
+    if (json_string != NULL) {
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_send(req, json_string, strlen(json_string));
+        free(json_string);
+    } else {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to print JSON");
+    }
+
+    cJSON_Delete(json);
+    return ESP_OK;
+}
+
+static void web_server_copy_json_string(const cJSON *item, char *dst, size_t dst_size)
+{
+    if (cJSON_IsString(item)) {
+        strncpy(dst, item->valuestring, dst_size - 1);
+        dst[dst_size - 1] = '\0';
+    }
+}
+
+esp_err_t web_server_post_mqtt(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "POST /mqtt len=%d", (int)req->content_len);
+
+    char content[1024];
+    if (web_server_recv_body(req, content, sizeof(content)) < 0) {
+        return ESP_FAIL;
+    }
+
+    cJSON *json = cJSON_Parse(content);
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid JSON");
+        return ESP_FAIL;
+    }
+
+    // Fields not present in the request keep their current value
+    app_mqtt_config_t config;
+    mqtt_client_get_config(&config);
+    bool valid = true;
+
+    cJSON *enabled = cJSON_GetObjectItem(json, "enabled");
+    if (cJSON_IsBool(enabled)) {
+        config.enabled = cJSON_IsTrue(enabled);
+    }
+
+    // "brokers": list of URIs tried in order; "broker"/"port": single host as sent by the UI
+    cJSON *brokers = cJSON_GetObjectItem(json, "brokers");
+    cJSON *broker = cJSON_GetObjectItem(json, "broker");
+    if (cJSON_IsArray(brokers)) {
+        config.broker_count = 0;
+        cJSON *item;
+        cJSON_ArrayForEach(item, brokers) {
+            if (config.broker_count >= MQTT_MAX_BROKERS) {
+                break;
+            }
+            if (cJSON_IsString(item)) {
+                web_server_copy_json_string(item, config.brokers[config.broker_count++], MQTT_URI_MAX_LEN);
+            }
+        }
+    } else if (cJSON_IsString(broker) && broker->valuestring[0] != '\0') {
+        cJSON *port = cJSON_GetObjectItem(json, "port");
+        if (port != NULL && (!cJSON_IsNumber(port) || port->valueint < 1 || port->valueint > 65535)) {
+            valid = false;
+        }
+        if (strstr(broker->valuestring, "://") != NULL) {
+            web_server_copy_json_string(broker, config.brokers[0], MQTT_URI_MAX_LEN);
+        } else {
+            snprintf(config.brokers[0], MQTT_URI_MAX_LEN, "mqtt://%s:%d", broker->valuestring,
+                     cJSON_IsNumber(port) ? port->valueint : MQTT_BROKER_PORT);
+        }
+        config.broker_count = 1;
+    }
+
+    web_server_copy_json_string(cJSON_GetObjectItem(json, "username"), config.username, sizeof(config.username));
+    web_server_copy_json_string(cJSON_GetObjectItem(json, "password"), config.password, sizeof(config.password));
+    web_server_copy_json_string(cJSON_GetObjectItem(json, "topic_root"), config.topic_root, sizeof(config.topic_root));
+
+    cJSON *qos = cJSON_GetObjectItem(json, "qos");
+    if (cJSON_IsNumber(qos)) {
+        valid = valid && qos->valueint >= 0 && qos->valueint <= 2;
+        config.qos = (uint8_t)qos->valueint;
+    }
+    cJSON *keepalive = cJSON_GetObjectItem(json, "keepalive");
+    if (cJSON_IsNumber(keepalive)) {
+        valid = valid && keepalive->valueint >= 1 && keepalive->valueint <= 65535;
+        config.keepalive = (uint16_t)keepalive->valueint;
+    }
+    cJSON *protocol_version = cJSON_GetObjectItem(json, "protocol_version");
+    if (cJSON_IsNumber(protocol_version)) {
+        valid = valid && protocol_version->valueint >= 0 && protocol_version->valueint <= UINT8_MAX;
+        config.protocol_version = (uint8_t)protocol_version->valueint;
+    }
+    cJSON_Delete(json);
+
+    esp_err_t ret = valid ? mqtt_client_set_config(&config) : ESP_ERR_INVALID_ARG;
+    if (ret == ESP_ERR_INVALID_ARG || ret == ESP_ERR_NOT_SUPPORTED) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid MQTT settings");
+        return ESP_FAIL;
+    } else if (ret != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to apply MQTT settings");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_send(req, "OK", 2);
+    return ESP_OK;
+}
+
+esp_err_t web_server_get_udp(httpd_req_t *req)
+{
+    udp_control_config_t config;
+    udp_control_stats_t stats;
+    udp_control_get_config(&config);
+    udp_control_get_stats(&stats);
+
+    cJSON *json = cJSON_CreateObject();
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create JSON");
+        return ESP_FAIL;
+    }
+
+    // The key itself is write-only
+    cJSON_AddBoolToObject(json, "enabled", config.enabled);
+    cJSON_AddNumberToObject(json, "port", config.port);
+    cJSON_AddBoolToObject(json, "key_set", config.key_len > 0);
+    cJSON_AddNumberToObject(json, "epoch", udp_control_get_epoch());
+    cJSON_AddBoolToObject(json, "group_enabled", config.group_enabled);
+    cJSON_AddStringToObject(json, "group_addr", config.group_addr);
+    cJSON_AddNumberToObject(json, "group_port", config.group_port);
+    cJSON_AddNumberToObject(json, "group_device_id", config.group_device_id);
+    cJSON_AddBoolToObject(json, "group_key_set", config.group_key_len > 0);
+    cJSON_AddBoolToObject(json, "time_synced", time_sync_is_synced());
+    cJSON *counters = cJSON_AddObjectToObject(json, "stats");
+    if (counters != NULL) {
+        cJSON_AddNumberToObject(counters, "received", stats.received);
+        cJSON_AddNumberToObject(counters, "applied", stats.applied);
+        cJSON_AddNumberToObject(counters, "duplicates", stats.duplicates);
+        cJSON_AddNumberToObject(counters, "replays", stats.replays);
+        cJSON_AddNumberToObject(counters, "bad_mac", stats.bad_mac);
+        cJSON_AddNumberToObject(counters, "stale_epoch", stats.stale_epoch);
+        cJSON_AddNumberToObject(counters, "invalid", stats.invalid);
+        cJSON_AddNumberToObject(counters, "group_received", stats.group_received);
+        cJSON_AddNumberToObject(counters, "group_applied", stats.group_applied);
+        cJSON_AddNumberToObject(counters, "group_scheduled", stats.group_scheduled);
+        cJSON_AddNumberToObject(counters, "group_rejected", stats.group_rejected);
+        cJSON_AddNumberToObject(counters, "group_max_late_us", stats.group_max_late_us);
+    }
+    memset(config.key, 0, sizeof(config.key));
+    memset(config.group_key, 0, sizeof(config.group_key));
+
+    char *json_string = cJSON_Print(json);
+    if (json_string != NULL) {
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_send(req, json_string, strlen(json_string));
+        free(json_string);
+    } else {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to print JSON");
+    }
+
+    cJSON_Delete(json);
+    return ESP_OK;
+}
+
+// Decode a hex string into at most max_len bytes; returns the byte count or -1
+static int web_server_parse_hex(const char *hex, uint8_t *out, size_t max_len)
+{
+    size_t hex_len = strlen(hex);
+    if (hex_len % 2 != 0 || hex_len / 2 > max_len) {
+        return -1;
+    }
+    for (size_t i = 0; i < hex_len / 2; i++) {
+        unsigned int byte;
+        if (sscanf(&hex[i * 2], "%2x", &byte) != 1) {
+            return -1;
+        }
+        out[i] = (uint8_t)byte;
+    }
+    return (int)(hex_len / 2);
+}
+
+esp_err_t web_server_post_udp(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "POST /udp len=%d", (int)req->content_len);
+
+    char content[512];
+    if (web_server_recv_body(req, content, sizeof(content)) < 0) {
+        return ESP_FAIL;
+    }
+
+    cJSON *json = cJSON_Parse(content);
+    memset(content, 0, sizeof(content));
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid JSON");
+        return ESP_FAIL;
+    }
+
+    // Fields not present in the request keep their current value
+    udp_control_config_t config;
+    udp_control_get_config(&config);
+
+    bool valid = true;
+    cJSON *enabled = cJSON_GetObjectItem(json, "enabled");
+    if (cJSON_IsBool(enabled)) {
+        config.enabled = cJSON_IsTrue(enabled);
+    }
+    cJSON *port = cJSON_GetObjectItem(json, "port");
+    if (cJSON_IsNumber(port)) {
+        valid = port->valueint > 0 && port->valueint <= 65535;
+        config.port = (uint16_t)port->valueint;
+    }
+    cJSON *key = cJSON_GetObjectItem(json, "key");
+    if (cJSON_IsString(key)) {
+        int key_len = web_server_parse_hex(key->valuestring, config.key, sizeof(config.key));
+        valid = valid && key_len >= 0;
+        config.key_len = key_len > 0 ? key_len : 0;
+    }
+
+    cJSON *group_enabled = cJSON_GetObjectItem(json, "group_enabled");
+    if (cJSON_IsBool(group_enabled)) {
+        config.group_enabled = cJSON_IsTrue(group_enabled);
+    }
+    web_server_copy_json_string(cJSON_GetObjectItem(json, "group_addr"), config.group_addr, sizeof(config.group_addr));
+    cJSON *group_port = cJSON_GetObjectItem(json, "group_port");
+    if (cJSON_IsNumber(group_port)) {
+        valid = valid && group_port->valueint > 0 && group_port->valueint <= 65535;
+        config.group_port = (uint16_t)group_port->valueint;
+    }
+    cJSON *group_device_id = cJSON_GetObjectItem(json, "group_device_id");
+    if (cJSON_IsNumber(group_device_id)) {
+        valid = valid && group_device_id->valueint >= 0 && group_device_id->valueint < UDP_GROUP_DEVICE_ALL;
+        config.group_device_id = (uint8_t)group_device_id->valueint;
+    }
+    cJSON *group_key = cJSON_GetObjectItem(json, "group_key");
+    if (cJSON_IsString(group_key)) {
+        int key_len = web_server_parse_hex(group_key->valuestring, config.group_key, sizeof(config.group_key));
+        valid = valid && key_len >= 0;
+        config.group_key_len = key_len > 0 ? key_len : 0;
+    }
+    cJSON_Delete(json);
+
+    esp_err_t ret = valid ? udp_control_set_config(&config) : ESP_ERR_INVALID_ARG;
+    memset(config.key, 0, sizeof(config.key));
+    memset(config.group_key, 0, sizeof(config.group_key));
+    if (ret == ESP_ERR_INVALID_ARG) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid UDP settings (keys must be 16-32 hex-encoded bytes, group must be a multicast address)");
+        return ESP_FAIL;
+    } else if (ret != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to apply UDP settings");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_send(req, "OK", 2);
+    return ESP_OK;
+}
+
+// Schedules are streamed in batches so thousands of entries never need one big buffer
+esp_err_t web_server_get_schedule(httpd_req_t *req)
+{
+    relay_scheduler_stats_t stats;
+    relay_scheduler_get_stats(&stats);
+
+    // Room for the longest cron expression plus the id, relays and next fields
+    char buf[RELAY_CRON_MAX_LEN + 192];
+    int len = snprintf(buf, sizeof(buf), "{\"clock_valid\":%s,\"now\":%lld,\"count\":%u,\"fired\":%lu,\"entries\":[",
+                       stats.clock_valid ? "true" : "false", (long long)(time_sync_now_us() / 1000000),
+                       stats.entries, (unsigned long)stats.fired);
+    httpd_resp_set_type(req, "application/json");
+    if (httpd_resp_send_chunk(req, buf, len) != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    relay_schedule_t entries[8];
+    uint32_t next[8];
+    uint16_t start_id = 0;
+    bool first = true;
+    int count;
+    while ((count = relay_scheduler_list(start_id, entries, next, 8)) > 0) {
+        for (int i = 0; i < count; i++) {
+            const relay_schedule_t *e = &entries[i];
+            len = snprintf(buf, sizeof(buf), "%s{\"id\":%u,\"enabled\":%s,", first ? "" : ",", e->id,
+                           e->enabled ? "true" : "false");
+            if (e->type == RELAY_SCHEDULE_ONE_SHOT) {
+                len += snprintf(buf + len, sizeof(buf) - len, "\"at\":%lu,", (unsigned long)e->at);
+            } else {
+                len += snprintf(buf + len, sizeof(buf) - len, "\"cron\":\"");
+                len += relay_cron_format(&e->cron, buf + len, sizeof(buf) - len);
+                len += snprintf(buf + len, sizeof(buf) - len, "\",");
+            }
+            len += snprintf(buf + len, sizeof(buf) - len, "\"relays\":{");
+            const char *sep = "";
+            for (int r = 0; r < NUM_RELAYS; r++) {
+                if ((e->set_mask | e->clear_mask) & (1u << r)) {
+                    len += snprintf(buf + len, sizeof(buf) - len, "%s\"%d\":%s", sep, r,
+                                    (e->set_mask & (1u << r)) ? "true" : "false");
+                    sep = ",";
+                }
+            }
+            len += snprintf(buf + len, sizeof(buf) - len, "},\"next\":%lu}", (unsigned long)next[i]);
+            if (len >= (int)sizeof(buf) || httpd_resp_send_chunk(req, buf, len) != ESP_OK) {
+                httpd_resp_send_chunk(req, NULL, 0);
+                return ESP_FAIL;
+            }
+            first = false;
+        }
+        start_id = entries[count - 1].id + 1;
+    }
+
+    httpd_resp_send_chunk(req, "]}", 2);
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+typedef struct {
+    httpd_req_t *req;
+    char buf[512];
+    int len;
+    bool first;
+    bool failed;
+} web_server_history_ctx_t;
+
+static bool web_server_history_event(const relay_history_event_t *event, void *arg)
+{
+    web_server_history_ctx_t *ctx = arg;
+    if (ctx->len > (int)sizeof(ctx->buf) - 96) {
+        if (httpd_resp_send_chunk(ctx->req, ctx->buf, ctx->len) != ESP_OK) {
+            ctx->failed = true;
+            return false;
+        }
+        ctx->len = 0;
+    }
+    ctx->len += snprintf(ctx->buf + ctx->len, sizeof(ctx->buf) - ctx->len, "%s{\"%s\":%lld,\"mask\":%u,\"source\":\"%s\"}",
+                         ctx->first ? "" : ",", (event->flags & RELAY_HISTORY_FLAG_UPTIME) ? "uptime_ms" : "t",
+                         (long long)event->time_ms, event->mask, relay_source_name((relay_source_t)event->source));
+    ctx->first = false;
+    return true;
+}
+
+// GET /history?since=<unix ms>: relay changes, oldest first. Entries from before the clock
+// was set carry "uptime_ms" instead of "t" and are only listed without since.
+esp_err_t web_server_get_history(httpd_req_t *req)
+{
+    int64_t since_ms = 0;
+    char query[48];
+    char value[24];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "since", value, sizeof(value)) == ESP_OK) {
+        char *end;
+        since_ms = strtoll(value, &end, 10);
+        if (end == value || *end != '\0' || since_ms < 0) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid since");
+            return ESP_FAIL;
+        }
+    }
+
+    relay_history_stats_t stats;
+    relay_history_get_stats(&stats);
+    static web_server_history_ctx_t ctx; // One request at a time on the httpd task
+    ctx.req = req;
+    ctx.first = true;
+    ctx.failed = false;
+    ctx.len = snprintf(ctx.buf, sizeof(ctx.buf),
+                       "{\"now\":%lld,\"clock_valid\":%s,\"recorded\":%lu,\"dropped\":%lu,\"file_bytes\":%lu,\"events\":[",
+                       (long long)(time_sync_now_us() / 1000), time_sync_is_synced() ? "true" : "false",
+                       (unsigned long)stats.recorded, (unsigned long)stats.dropped, (unsigned long)stats.file_bytes);
+    httpd_resp_set_type(req, "application/json");
+    relay_history_read(since_ms, web_server_history_event, &ctx);
+    if (ctx.failed) {
+        httpd_resp_send_chunk(req, NULL, 0);
+        return ESP_FAIL;
+    }
+
+    ctx.len += snprintf(ctx.buf + ctx.len, sizeof(ctx.buf) - ctx.len, "]}");
+    httpd_resp_send_chunk(req, ctx.buf, ctx.len);
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+typedef struct {
+    httpd_req_t *req;
+    const log_persist_range_t *range;
+    bool partial;
+    bool started;
+    char content_range[48];
+} web_server_logs_ctx_t;
+
+// "bytes=first-last", "bytes=first-" or "bytes=-suffix". Anything else, including several
+// ranges, is not understood and the whole log is sent.
+static bool web_server_parse_range(const char *value, log_persist_range_t *range)
+{
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL) {
+        return false;
+    }
+    const char *p = value + 6;
+    char *end;
+    if (*p == '-') {
+        unsigned long suffix = strtoul(p + 1, &end, 10);
+        if (end == p + 1 || *end != '\0' || suffix == 0) {
+            return false;
+        }
+        range->suffix = suffix;
+        return true;
+    }
+    unsigned long first = strtoul(p, &end, 10);
+    if (end == p || *end != '-') {
+        return false;
+    }
+    p = end + 1;
+    range->start = first;
+    if (*p == '\0') {
+        range->end = UINT32_MAX;
+        return true;
+    }
+    unsigned long last = strtoul(p, &end, 10);
+    if (end == p || *end != '\0' || last < first) {
+        return false;
+    }
+    range->end = last;
+    return true;
+}
+
+static esp_err_t web_server_logs_chunk(const char *data, size_t len, void *arg)
+{
+    web_server_logs_ctx_t *ctx = arg;
+    if (!ctx->started) {
+        // The range is resolved against the log size by now
+        if (ctx->partial) {
+            snprintf(ctx->content_range, sizeof(ctx->content_range), "bytes %lu-%lu/%lu",
+                     (unsigned long)ctx->range->start, (unsigned long)ctx->range->end,
+                     (unsigned long)ctx->range->total);
+            httpd_resp_set_status(ctx->req, "206 Partial Content");
+            httpd_resp_set_hdr(ctx->req, "Content-Range", ctx->content_range);
+        }
+        ctx->started = true;
+    }
+    return httpd_resp_send_chunk(ctx->req, data, len);
+}
+
+// GET /logs: the persistent log (see log_persist.h) as text, oldest first, streamed from
+// flash. A single byte range may be asked for with a Range header.
+esp_err_t web_server_get_logs(httpd_req_t *req)
+{
+    log_persist_range_t range = {
+        .start = 0,
+        .end = UINT32_MAX,
+    };
+    web_server_logs_ctx_t ctx = {
+        .req = req,
+        .range = &range,
+    };
+    char value[48];
+    if (httpd_req_get_hdr_value_str(req, "Range", value, sizeof(value)) == ESP_OK) {
+        ctx.partial = web_server_parse_range(value, &range);
+    }
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+    esp_err_t ret = log_persist_read(&range, web_server_logs_chunk, &ctx);
+    if (ret == ESP_ERR_INVALID_SIZE) {
+        if (!ctx.partial) {
+            return httpd_resp_send(req, "", 0);     // Nothing logged yet
+        }
+        snprintf(ctx.content_range, sizeof(ctx.content_range), "bytes */%lu", (unsigned long)range.total);
+        httpd_resp_set_status(req, "416 Range Not Satisfiable");
+        httpd_resp_set_hdr(req, "Content-Range", ctx.content_range);
+        return httpd_resp_send(req, NULL, 0);
+    }
+    if (ret != ESP_OK) {
+        if (!ctx.started) {
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read log");
+        } else {
+            httpd_resp_send_chunk(req, NULL, 0);
+        }
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+esp_err_t web_server_get_log_forward(httpd_req_t *req)
+{
+    log_forward_config_t config;
+    log_forward_stats_t stats;
+    log_forward_get_config(&config);
+    log_forward_get_stats(&stats);
+
+    cJSON *json = cJSON_CreateObject();
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create JSON");
+        return ESP_FAIL;
+    }
+
+    cJSON_AddStringToObject(json, "syslog_host", config.syslog_host);
+    cJSON_AddNumberToObject(json, "syslog_port", config.syslog_port);
+    cJSON_AddStringToObject(json, "syslog_level", log_forward_level_name(config.syslog_level));
+    cJSON_AddNumberToObject(json, "facility", config.facility);
+    cJSON_AddStringToObject(json, "hostname", config.hostname);
+    cJSON_AddStringToObject(json, "mqtt_level", log_forward_level_name(config.mqtt_level));
+    cJSON *counters = cJSON_AddObjectToObject(json, "stats");
+    if (counters != NULL) {
+        cJSON_AddNumberToObject(counters, "queued", stats.queued);
+        cJSON_AddNumberToObject(counters, "dropped", stats.dropped);
+        cJSON_AddNumberToObject(counters, "syslog_sent", stats.syslog_sent);
+        cJSON_AddNumberToObject(counters, "mqtt_sent", stats.mqtt_sent);
+        cJSON_AddNumberToObject(counters, "send_failures", stats.send_failures);
+    }
+
+    char *json_string = cJSON_Print(json);
+    if (json_string != NULL) {
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_send(req, json_string, strlen(json_string));
+        free(json_string);
+    } else {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to print JSON");
+    }
+
+    cJSON_Delete(json);
+    return ESP_OK;
+}
+
+// A string field that must fit dst; absent fields leave dst alone
+static bool web_server_copy_json_string_checked(const cJSON *item, char *dst, size_t dst_size)
+{
+    if (item == NULL) {
+        return true;
+    }
+    if (!cJSON_IsString(item) || strlen(item->valuestring) >= dst_size) {
+        return false;
+    }
+    strcpy(dst, item->valuestring);
+    return true;
+}
+
+static bool web_server_parse_log_level(const cJSON *item, esp_log_level_t *level)
+{
+    if (item == NULL) {
+        return true;
+    }
+    return cJSON_IsString(item) && log_forward_parse_level(item->valuestring, level);
+}
+
+// {"syslog_host": "192.168.1.10", "syslog_port": 514, "syslog_level": "warn",
+//  "mqtt_level": "error", "facility": 16, "hostname": "relay-hall"}; absent fields keep
+// their value, levels are none/error/warn/info/debug/verbose
+esp_err_t web_server_post_log_forward(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "POST /logs/forward len=%d", (int)req->content_len);
+
+    char content[384];
+    if (web_server_recv_body(req, content, sizeof(content)) < 0) {
+        return ESP_FAIL;
+    }
+
+    cJSON *json = cJSON_Parse(content);
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid JSON");
+        return ESP_FAIL;
+    }
+
+    log_forward_config_t config;
+    log_forward_get_config(&config);
+
+    bool valid = web_server_copy_json_string_checked(cJSON_GetObjectItem(json, "syslog_host"), config.syslog_host,
+                                                     sizeof(config.syslog_host));
+    valid = valid && web_server_copy_json_string_checked(cJSON_GetObjectItem(json, "hostname"), config.hostname,
+                                                         sizeof(config.hostname));
+    valid = valid && web_server_parse_log_level(cJSON_GetObjectItem(json, "syslog_level"), &config.syslog_level);
+    valid = valid && web_server_parse_log_level(cJSON_GetObjectItem(json, "mqtt_level"), &config.mqtt_level);
+    cJSON *port = cJSON_GetObjectItem(json, "syslog_port");
+    if (cJSON_IsNumber(port)) {
+        valid = valid && port->valueint > 0 && port->valueint <= 65535;
+        config.syslog_port = (uint16_t)port->valueint;
+    }
+    cJSON *facility = cJSON_GetObjectItem(json, "facility");
+    if (cJSON_IsNumber(facility)) {
+        valid = valid && facility->valueint >= 0 && facility->valueint <= 23;
+        config.facility = (uint8_t)facility->valueint;
+    }
+    cJSON_Delete(json);
+
+    esp_err_t ret = valid ? log_forward_set_config(&config) : ESP_ERR_INVALID_ARG;
+    if (ret == ESP_ERR_INVALID_ARG) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid log forwarding settings");
+        return ESP_FAIL;
+    } else if (ret != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to apply log forwarding settings");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_send(req, "OK", 2);
+    return ESP_OK;
+}
+
+// {"at": <unix>, "relays": {...}} or {"cron": "m h dom mon dow", "relays": {...}} adds an
+// entry; {"id": n, "enabled": bool} enables or disables an existing one
+esp_err_t web_server_post_schedule(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "POST /schedule len=%d", (int)req->content_len);
+
+    char content[512];
+    if (web_server_recv_body(req, content, sizeof(content)) < 0) {
+        return ESP_FAIL;
+    }
+
+    cJSON *json = cJSON_Parse(content);
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid JSON");
+        return ESP_FAIL;
+    }
+
+    esp_err_t ret;
+    relay_schedule_t entry = { .enabled = true };
+    cJSON *id = cJSON_GetObjectItem(json, "id");
+    cJSON *enabled = cJSON_GetObjectItem(json, "enabled");
+    cJSON *at = cJSON_GetObjectItem(json, "at");
+    cJSON *cron = cJSON_GetObjectItem(json, "cron");
+    if (cJSON_IsNumber(id)) {
+        ret = cJSON_IsBool(enabled) ? relay_scheduler_set_enabled((uint16_t)id->valueint, cJSON_IsTrue(enabled))
+                                    : ESP_ERR_INVALID_ARG;
+        entry.id = (uint16_t)id->valueint;
+    } else {
+        relay_command_t cmd;
+        ret = relay_command_parse_json_object(cJSON_GetObjectItem(json, "relays"), &cmd);
+        if (ret == ESP_OK && (cmd.set_mask | cmd.clear_mask) == 0) {
+            ret = ESP_ERR_INVALID_ARG;
+        }
+        entry.set_mask = (uint8_t)cmd.set_mask;
+        entry.clear_mask = (uint8_t)cmd.clear_mask;
+        if (cJSON_IsBool(enabled)) {
+            entry.enabled = cJSON_IsTrue(enabled);
+        }
+        if (cJSON_IsNumber(at) && at->valuedouble > 0 && at->valuedouble < 4294967296.0) {
+            entry.type = RELAY_SCHEDULE_ONE_SHOT;
+            entry.at = (uint32_t)at->valuedouble;
+        } else if (cJSON_IsString(cron)) {
+            entry.type = RELAY_SCHEDULE_RECURRING;
+            if (relay_cron_parse(cron->valuestring, &entry.cron) != ESP_OK) {
+                ret = ESP_ERR_INVALID_ARG;
+            }
+        } else {
+            ret = ESP_ERR_INVALID_ARG;
+        }
+        if (ret == ESP_OK) {
+            ret = relay_scheduler_add(&entry);
+        }
+    }
+    cJSON_Delete(json);
+
+    switch (ret) {
+    case ESP_OK:
+        break;
+    case ESP_ERR_INVALID_ARG:
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                            "Expected \"at\" or \"cron\" with \"relays\", or \"id\" with \"enabled\"");
+        return ESP_FAIL;
+    case ESP_ERR_INVALID_STATE:
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Schedule would never fire");
+        return ESP_FAIL;
+    case ESP_ERR_NOT_FOUND:
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such schedule");
+        return ESP_FAIL;
+    case ESP_ERR_NO_MEM:
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Schedule table full");
+        return ESP_FAIL;
+    default:
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to update schedule");
+        return ESP_FAIL;
+    }
+
+    char resp[32];
+    snprintf(resp, sizeof(resp), "{\"id\":%u}", entry.id);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, resp, strlen(resp));
+    return ESP_OK;
+}
+
+// DELETE /schedule?id=<n>, or ?id=all
+esp_err_t web_server_delete_schedule(httpd_req_t *req)
+{
+    char query[32];
+    char value[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+        httpd_query_key_value(query, "id", value, sizeof(value)) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing id");
+        return ESP_FAIL;
+    }
+
+    if (strcmp(value, "all") == 0) {
+        relay_scheduler_clear();
+    } else {
+        char *end;
+        long id = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || id < 0 || id > UINT16_MAX) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid id");
+            return ESP_FAIL;
+        }
+        if (relay_scheduler_remove((uint16_t)id) != ESP_OK) {
+            httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such schedule");
+            return ESP_FAIL;
+        }
+    }
+
+    httpd_resp_send(req, "OK", 2);
+    return ESP_OK;
+}
+
+esp_err_t web_server_get_ota(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "text/html");
+    httpd_resp_send(req, "OTA update page", strlen("OTA update page"));
+    return ESP_OK;
+}
+
+esp_err_t web_server_post_ota(httpd_req_t *req)
+{
+    // TODO: Implement OTA update
+    httpd_resp_send(req, "OTA update not implemented yet", strlen("OTA update not implemented yet"));
+    return ESP_OK;
+}
+
+// Send a document from json_out_format() and free it; NULL means it could not be formatted
+static esp_err_t web_server_send_formatted(httpd_req_t *req, char *json, int len)
+{
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory or document too large");
+        return ESP_FAIL;
     }
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = httpd_resp_send(req, json, len);
+    free(json);
+    return ret;
+}
+
+// GET /trace[?reset=1]: hot-path latency histograms from trace.c; reset clears them after reading
+esp_err_t web_server_get_trace(httpd_req_t *req)
+{
+    bool reset = false;
+    char query[32];
+    char value[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "reset", value, sizeof(value)) == ESP_OK) {
+        reset = strcmp(value, "1") == 0 || strcmp(value, "true") == 0;
+    }
+
+    int len;
+    char *json = json_out_format(trace_format_json, TRACE_JSON_MAX_LEN, &len);
+    if (reset) {
+        trace_reset();
+    }
+    return web_server_send_formatted(req, json, len);
+}
+
+// GET /tasks: CPU share per task and core over the last sampling interval, stack high-water marks
+esp_err_t web_server_get_tasks(httpd_req_t *req)
+{
+    int len;
+    char *json = json_out_format(task_stats_format_json, TASK_STATS_JSON_MAX_LEN, &len);
+    return web_server_send_formatted(req, json, len);
+}
+
+// GET /heap: free, minimum, largest block and fragmentation per heap region, allocation rates
+esp_err_t web_server_get_heap(httpd_req_t *req)
+{
+    int len;
+    char *json = json_out_format(heap_monitor_format_json, HEAP_MONITOR_JSON_MAX_LEN, &len);
+    return web_server_send_formatted(req, json, len);
+}
+
+// GET /boot: start, end, core and result of every init phase, and the boot milestones
+esp_err_t web_server_get_boot(httpd_req_t *req)
+{
+    int len;
+    char *json = json_out_format(boot_timeline_format_json, BOOT_TIMELINE_JSON_MAX_LEN, &len);
+    return web_server_send_formatted(req, json, len);
+}
+
+static esp_err_t web_server_metrics_sink(const char *text, size_t len, void *ctx)
+{
+    return httpd_resp_send_chunk((httpd_req_t *)ctx, text, len);
+}
+
+// GET /metrics: Prometheus text exposition, streamed in chunks from the counters in metrics.c
+esp_err_t web_server_get_metrics(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "text/plain; version=0.0.4; charset=utf-8");
+    esp_err_t ret = metrics_write(web_server_metrics_sink, req);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to send metrics: %s", esp_err_to_name(ret));
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static esp_err_t web_server_dispatch(httpd_req_t *req)
+{
+    const web_server_route_t *route = req->user_ctx;
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret = route->handler(req);
+    metrics_record_http(route->metrics_route, esp_timer_get_time() - start, ret);
+    return ret;
+}
+
+static esp_err_t web_server_register(const httpd_uri_t *uri)
+{
+    if (web_server_route_count >= WEB_SERVER_MAX_URI_HANDLERS) {
+        ESP_LOGE(TAG, "Too many URI handlers, %s not registered", uri->uri);
+        return ESP_ERR_NO_MEM;
+    }
+    web_server_route_t *route = &web_server_routes[web_server_route_count++];
+    route->handler = uri->handler;
+    route->metrics_route = metrics_register_http_route(uri->uri, http_method_str(uri->method));
+
+    httpd_uri_t wrapped = *uri;
+    wrapped.handler = web_server_dispatch;
+    wrapped.user_ctx = route;
+    return httpd_register_uri_handler(server, &wrapped);
+}
+
+esp_err_t web_server_init(void)
+{
+    ESP_LOGI(TAG, "Initializing web server");
+    
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = WEB_SERVER_PORT;
+    config.max_uri_handlers = WEB_SERVER_MAX_URI_HANDLERS;
+    config.stack_size = WEB_SERVER_STACK_SIZE;
+    
+    esp_err_t ret = httpd_start(&server, &config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start web server");
+        return ret;
+    }
+    web_server_route_count = 0;
     
     // Register URI handlers
     httpd_uri_t root_uri = {
@@ -233,7 +1444,7 @@ esp_err_t web_server_init(void)
         .handler = web_server_get_root,
         .user_ctx = NULL
     };
-    httpd_register_uri_handler(server, &root_uri);
+    web_server_register(&root_uri);
     
     httpd_uri_t status_uri = {
         .uri = "/status",
@@ -241,7 +1452,71 @@ esp_err_t web_server_init(void)
         .handler = web_server_get_status,
         .user_ctx = NULL
     };
-    httpd_register_uri_handler(server, &status_uri);
+    web_server_register(&status_uri);
+    
+    httpd_uri_t metrics_uri = {
+        .uri = "/metrics",
+        .method = HTTP_GET,
+        .handler = web_server_get_metrics,
+        .user_ctx = NULL
+    };
+    web_server_register(&metrics_uri);
+    
+    httpd_uri_t trace_uri = {
+        .uri = "/trace",
+        .method = HTTP_GET,
+        .handler = web_server_get_trace,
+        .user_ctx = NULL
+    };
+    web_server_register(&trace_uri);
+    
+    httpd_uri_t tasks_uri = {
+        .uri = "/tasks",
+        .method = HTTP_GET,
+        .handler = web_server_get_tasks,
+        .user_ctx = NULL
+    };
+    web_server_register(&tasks_uri);
+    
+    httpd_uri_t heap_uri = {
+        .uri = "/heap",
+        .method = HTTP_GET,
+        .handler = web_server_get_heap,
+        .user_ctx = NULL
+    };
+    web_server_register(&heap_uri);
+    
+    httpd_uri_t boot_uri = {
+        .uri = "/boot",
+        .method = HTTP_GET,
+        .handler = web_server_get_boot,
+        .user_ctx = NULL
+    };
+    web_server_register(&boot_uri);
+    
+    httpd_uri_t logs_uri = {
+        .uri = "/logs",
+        .method = HTTP_GET,
+        .handler = web_server_get_logs,
+        .user_ctx = NULL
+    };
+    web_server_register(&logs_uri);
+    
+    httpd_uri_t log_forward_get_uri = {
+        .uri = "/logs/forward",
+        .method = HTTP_GET,
+        .handler = web_server_get_log_forward,
+        .user_ctx = NULL
+    };
+    web_server_register(&log_forward_get_uri);
+    
+    httpd_uri_t log_forward_post_uri = {
+        .uri = "/logs/forward",
+        .method = HTTP_POST,
+        .handler = web_server_post_log_forward,
+        .user_ctx = NULL
+    };
+    web_server_register(&log_forward_post_uri);
     
     httpd_uri_t relay_uri = {
         .uri = "/relay",
@@ -249,7 +1524,55 @@ esp_err_t web_server_init(void)
         .handler = web_server_post_relay,
         .user_ctx = NULL
     };
-    httpd_register_uri_handler(server, &relay_uri);
+    web_server_register(&relay_uri);
+    
+    httpd_uri_t relay_mode_get_uri = {
+        .uri = "/relay/mode",
+        .method = HTTP_GET,
+        .handler = web_server_get_relay_mode,
+        .user_ctx = NULL
+    };
+    web_server_register(&relay_mode_get_uri);
+    
+    httpd_uri_t relay_mode_post_uri = {
+        .uri = "/relay/mode",
+        .method = HTTP_POST,
+        .handler = web_server_post_relay_mode,
+        .user_ctx = NULL
+    };
+    web_server_register(&relay_mode_post_uri);
+    
+    httpd_uri_t power_on_get_uri = {
+        .uri = "/relay/power_on",
+        .method = HTTP_GET,
+        .handler = web_server_get_power_on,
+        .user_ctx = NULL
+    };
+    web_server_register(&power_on_get_uri);
+    
+    httpd_uri_t power_on_post_uri = {
+        .uri = "/relay/power_on",
+        .method = HTTP_POST,
+        .handler = web_server_post_power_on,
+        .user_ctx = NULL
+    };
+    web_server_register(&power_on_post_uri);
+    
+    httpd_uri_t rules_uri = {
+        .uri = "/rules",
+        .method = HTTP_GET,
+        .handler = web_server_get_rules,
+        .user_ctx = NULL
+    };
+    web_server_register(&rules_uri);
+    
+    httpd_uri_t rules_post_uri = {
+        .uri = "/rules",
+        .method = HTTP_POST,
+        .handler = web_server_post_rules,
+        .user_ctx = NULL
+    };
+    web_server_register(&rules_post_uri);
     
     httpd_uri_t wifi_uri = {
         .uri = "/wifi",
@@ -257,7 +1580,79 @@ esp_err_t web_server_init(void)
         .handler = web_server_post_wifi,
         .user_ctx = NULL
     };
-    httpd_register_uri_handler(server, &wifi_uri);
+    web_server_register(&wifi_uri);
+    
+    httpd_uri_t wifi_scan_uri = {
+        .uri = "/wifi/scan",
+        .method = HTTP_GET,
+        .handler = web_server_get_wifi_scan,
+        .user_ctx = NULL
+    };
+    web_server_register(&wifi_scan_uri);
+    
+    httpd_uri_t mqtt_get_uri = {
+        .uri = "/mqtt",
+        .method = HTTP_GET,
+        .handler = web_server_get_mqtt,
+        .user_ctx = NULL
+    };
+    web_server_register(&mqtt_get_uri);
+    
+    httpd_uri_t mqtt_post_uri = {
+        .uri = "/mqtt",
+        .method = HTTP_POST,
+        .handler = web_server_post_mqtt,
+        .user_ctx = NULL
+    };
+    web_server_register(&mqtt_post_uri);
+    
+    httpd_uri_t udp_get_uri = {
+        .uri = "/udp",
+        .method = HTTP_GET,
+        .handler = web_server_get_udp,
+        .user_ctx = NULL
+    };
+    web_server_register(&udp_get_uri);
+    
+    httpd_uri_t udp_post_uri = {
+        .uri = "/udp",
+        .method = HTTP_POST,
+        .handler = web_server_post_udp,
+        .user_ctx = NULL
+    };
+    web_server_register(&udp_post_uri);
+    
+    httpd_uri_t history_uri = {
+        .uri = "/history",
+        .method = HTTP_GET,
+        .handler = web_server_get_history,
+        .user_ctx = NULL
+    };
+    web_server_register(&history_uri);
+    
+    httpd_uri_t schedule_get_uri = {
+        .uri = "/schedule",
+        .method = HTTP_GET,
+        .handler = web_server_get_schedule,
+        .user_ctx = NULL
+    };
+    web_server_register(&schedule_get_uri);
+    
+    httpd_uri_t schedule_post_uri = {
+        .uri = "/schedule",
+        .method = HTTP_POST,
+        .handler = web_server_post_schedule,
+        .user_ctx = NULL
+    };
+    web_server_register(&schedule_post_uri);
+    
+    httpd_uri_t schedule_delete_uri = {
+        .uri = "/schedule",
+        .method = HTTP_DELETE,
+        .handler = web_server_delete_schedule,
+        .user_ctx = NULL
+    };
+    web_server_register(&schedule_delete_uri);
     
     httpd_uri_t ota_uri = {
         .uri = "/ota",
@@ -265,7 +1660,7 @@ esp_err_t web_server_init(void)
         .handler = web_server_get_ota,
         .user_ctx = NULL
     };
-    httpd_register_uri_handler(server, &ota_uri);
+    web_server_register(&ota_uri);
     
     httpd_uri_t ota_post_uri = {
         .uri = "/ota",
@@ -273,7 +1668,7 @@ esp_err_t web_server_init(void)
         .handler = web_server_post_ota,
         .user_ctx = NULL
     };
-    httpd_register_uri_handler(server, &ota_post_uri);
+    web_server_register(&ota_post_uri);
     
     ESP_LOGI(TAG, "Web server initialized successfully");
     return ESP_OK;
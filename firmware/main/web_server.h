@@ -8,7 +8,11 @@
 #endif
 
 #ifndef WEB_SERVER_MAX_URI_HANDLERS
-#define WEB_SERVER_MAX_URI_HANDLERS 16
+#define WEB_SERVER_MAX_URI_HANDLERS 32
+#endif
+
+#ifndef WEB_SERVER_STACK_SIZE
+#define WEB_SERVER_STACK_SIZE 6144
 #endif
 
 esp_err_t web_server_init(void);
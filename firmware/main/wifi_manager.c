@@ -6,6 +6,10 @@
 #include "esp_netif.h"
 #include "nvs_flash.h"
 #include "nvs.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "boot_timeline.h"
 #include <string.h>
 
 static const char *TAG = "WIFI_MANAGER";
@@ -14,7 +18,22 @@ static esp_netif_t *sta_netif = NULL;
 static esp_netif_t *ap_netif = NULL;
 static bool wifi_connected = false;
 static char current_ip[16] = {0};
-static int sta_retry_count = 0;
+
+// Connection state machine; only touched from the default event loop task
+static wifi_sm_t sta_sm;
+static esp_timer_handle_t sta_timer = NULL;
+static bool sta_expect_disconnect = false;
+
+// Credential sets tried in turn: saved (NVS) first, then the compile-time fallback
+static wifi_manager_creds_t sta_creds[2];
+static int sta_creds_count = 0;
+static int sta_creds_index = 0;
+
+static EventGroupHandle_t wifi_events = NULL;
+#define WIFI_CONNECTED_BIT BIT0
+#define WIFI_AP_ACTIVE_BIT BIT1
+
+ESP_EVENT_DEFINE_BASE(WIFI_MANAGER_EVENT);
 
 // NVS keys for WiFi credentials
 #define NVS_NAMESPACE "wifi_config"
@@ -82,6 +101,131 @@ static esp_err_t wifi_manager_load_credentials(char* ssid, char* password, size_
     return ESP_OK;
 }
 
+static void wifi_manager_apply_sta_config(const wifi_manager_creds_t *creds)
+{
+    wifi_config_t wifi_config = {
+        .sta = {
+            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
+            .pmf_cfg = {
+                .capable = true,
+                .required = false
+            },
+        },
+    };
+
+    strncpy((char*)wifi_config.sta.ssid, creds->ssid, sizeof(wifi_config.sta.ssid)-1);
+    strncpy((char*)wifi_config.sta.password, creds->password, sizeof(wifi_config.sta.password)-1);
+
+    esp_err_t err = esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set STA config: %s", esp_err_to_name(err));
+    }
+}
+
+// Bring the AP up next to STA. The radio keeps running, so STA retries continue.
+static void wifi_manager_enable_ap(void)
+{
+    wifi_config_t wifi_config = {
+        .ap = {
+            .ssid_len = strlen(WIFI_AP_SSID),
+            .channel = WIFI_AP_CHANNEL,
+            .max_connection = WIFI_AP_MAX_CONN,
+            .authmode = WIFI_AUTH_WPA_WPA2_PSK,
+            .beacon_interval = WIFI_AP_BEACON_INTERVAL,
+            .pmf_cfg = {
+                .required = false
+            },
+        },
+    };
+
+    strcpy((char*)wifi_config.ap.ssid, WIFI_AP_SSID);
+    strcpy((char*)wifi_config.ap.password, WIFI_AP_PASSWORD);
+
+    if (strlen(WIFI_AP_PASSWORD) == 0) {
+        wifi_config.ap.authmode = WIFI_AUTH_OPEN;
+    }
+
+    esp_err_t err = esp_wifi_set_mode(WIFI_MODE_APSTA);
+    if (err == ESP_OK) {
+        err = esp_wifi_set_config(WIFI_IF_AP, &wifi_config);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to enable AP: %s", esp_err_to_name(err));
+        return;
+    }
+
+    xEventGroupSetBits(wifi_events, WIFI_AP_ACTIVE_BIT);
+    ESP_LOGI(TAG, "AP+STA active, SSID: %s", WIFI_AP_SSID);
+}
+
+static void wifi_manager_disable_ap(void)
+{
+    esp_err_t err = esp_wifi_set_mode(WIFI_MODE_STA);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to disable AP: %s", esp_err_to_name(err));
+        return;
+    }
+
+    xEventGroupClearBits(wifi_events, WIFI_AP_ACTIVE_BIT);
+    ESP_LOGI(TAG, "STA connected; AP disabled");
+}
+
+static void wifi_manager_apply_actions(uint32_t actions)
+{
+    if (actions & (WIFI_SM_ACTION_CANCEL_TIMER | WIFI_SM_ACTION_ARM_TIMER)) {
+        esp_timer_stop(sta_timer);
+    }
+
+    if ((actions & WIFI_SM_ACTION_NEXT_CREDS) && sta_creds_count > 1) {
+        sta_creds_index = (sta_creds_index + 1) % sta_creds_count;
+        ESP_LOGI(TAG, "Switching to credentials for SSID '%s'", sta_creds[sta_creds_index].ssid);
+        wifi_manager_apply_sta_config(&sta_creds[sta_creds_index]);
+    }
+
+    if (actions & WIFI_SM_ACTION_START_AP) {
+        wifi_manager_enable_ap();
+    }
+    if (actions & WIFI_SM_ACTION_STOP_AP) {
+        wifi_manager_disable_ap();
+    }
+
+    if (actions & WIFI_SM_ACTION_DISCONNECT) {
+        esp_wifi_disconnect();
+    }
+    if (actions & WIFI_SM_ACTION_CONNECT) {
+        esp_err_t err = esp_wifi_connect();
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "esp_wifi_connect failed: %s", esp_err_to_name(err));
+        }
+    }
+
+    if (actions & WIFI_SM_ACTION_ARM_TIMER) {
+        esp_timer_start_once(sta_timer, (uint64_t)sta_sm.timer_ms * 1000ULL);
+    }
+}
+
+static void wifi_manager_dispatch(wifi_sm_event_t event)
+{
+    wifi_sm_state_t previous = sta_sm.state;
+    uint32_t actions = wifi_sm_handle_event(&sta_sm, event);
+
+    if (sta_sm.state != previous) {
+        ESP_LOGI(TAG, "STA %s -> %s (failures=%u, next backoff=%ums)",
+                 wifi_sm_state_name(previous), wifi_sm_state_name(sta_sm.state),
+                 (unsigned)sta_sm.failures, (unsigned)sta_sm.backoff_ms);
+    }
+    wifi_manager_apply_actions(actions);
+}
+
+static void wifi_manager_timer_cb(void *arg)
+{
+    // Hand over to the event loop task so all state machine transitions are serialized.
+    // A lost tick would leave the state machine in BACKOFF for good, so try again shortly.
+    if (esp_event_post(WIFI_MANAGER_EVENT, WIFI_MANAGER_EVENT_TIMER, NULL, 0, 0) != ESP_OK) {
+        esp_timer_start_once(sta_timer, WIFI_STA_TIMER_REPOST_MS * 1000);
+    }
+}
+
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
                               int32_t event_id, void* event_data)
 {
@@ -98,17 +242,41 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
         ESP_LOGI(TAG, "Got IP:" IPSTR, IP2STR(&event->ip_info.ip));
         wifi_connected = true;
         snprintf(current_ip, sizeof(current_ip), IPSTR, IP2STR(&event->ip_info.ip));
+        xEventGroupSetBits(wifi_events, WIFI_CONNECTED_BIT);
+        boot_timeline_milestone(BOOT_TIMELINE_WIFI_CONNECTED);
+        wifi_manager_dispatch(WIFI_SM_EVENT_GOT_IP);
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        ESP_LOGI(TAG, "WiFi disconnected");
+        wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
+        ESP_LOGI(TAG, "WiFi disconnected, reason=%d", event->reason);
         wifi_connected = false;
         memset(current_ip, 0, sizeof(current_ip));
-        if (sta_retry_count < WIFI_STA_MAX_RETRIES) {
-            sta_retry_count++;
-            ESP_LOGI(TAG, "Retrying STA connect (%d/%d)", sta_retry_count, WIFI_STA_MAX_RETRIES);
-            esp_wifi_connect();
-        } else {
-            ESP_LOGW(TAG, "STA retries exceeded; staying disconnected");
+        xEventGroupClearBits(wifi_events, WIFI_CONNECTED_BIT);
+        if (sta_expect_disconnect) {
+            // Our own disconnect while switching networks, not a failed attempt
+            sta_expect_disconnect = false;
+            return;
+        }
+        wifi_manager_dispatch(WIFI_SM_EVENT_DISCONNECTED);
+    } else if (event_base == WIFI_MANAGER_EVENT && event_id == WIFI_MANAGER_EVENT_START) {
+        const wifi_manager_creds_t *creds = (const wifi_manager_creds_t *) event_data;
+        if (creds->ssid[0] == '\0') {
+            wifi_manager_dispatch(WIFI_SM_EVENT_NO_CREDENTIALS);
+            return;
+        }
+        if (sta_sm.state == WIFI_SM_STATE_CONNECTED || sta_sm.state == WIFI_SM_STATE_CONNECTING) {
+            sta_expect_disconnect = true;
+            esp_wifi_disconnect();
         }
+        sta_creds[0] = *creds;
+        sta_creds_index = 0;
+        if (sta_creds_count == 0) {
+            sta_creds_count = 1;
+        }
+        wifi_manager_apply_sta_config(creds);
+        ESP_LOGI(TAG, "Connecting to SSID '%s'", creds->ssid);
+        wifi_manager_dispatch(WIFI_SM_EVENT_START);
+    } else if (event_base == WIFI_MANAGER_EVENT && event_id == WIFI_MANAGER_EVENT_TIMER) {
+        wifi_manager_dispatch(WIFI_SM_EVENT_TIMER);
     }
 }
 
@@ -125,6 +293,26 @@ esp_err_t wifi_manager_init(void)
     
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+
+    wifi_events = xEventGroupCreate();
+    if (wifi_events == NULL) {
+        ESP_LOGE(TAG, "Failed to create WiFi event group");
+        return ESP_ERR_NO_MEM;
+    }
+
+    wifi_sm_config_t sm_config = {
+        .backoff_min_ms = WIFI_STA_BACKOFF_MIN_MS,
+        .backoff_max_ms = WIFI_STA_BACKOFF_MAX_MS,
+        .connect_timeout_ms = WIFI_STA_CONNECT_TIMEOUT_MS,
+        .ap_fallback_failures = WIFI_STA_MAX_RETRIES,
+    };
+    wifi_sm_init(&sta_sm, &sm_config);
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = wifi_manager_timer_cb,
+        .name = "wifi_retry",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sta_timer));
     
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
                                                       ESP_EVENT_ANY_ID,
@@ -136,6 +324,15 @@ esp_err_t wifi_manager_init(void)
                                                       &wifi_event_handler,
                                                       NULL,
                                                       NULL));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_MANAGER_EVENT,
+                                                      ESP_EVENT_ANY_ID,
+                                                      &wifi_event_handler,
+                                                      NULL,
+                                                      NULL));
+
+    // The radio stays up from here on; mode changes between STA and AP+STA never stop it
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_start());
     
     ESP_LOGI(TAG, "WiFi manager initialized");
     return ESP_OK;
@@ -156,74 +353,31 @@ esp_err_t wifi_manager_start_sta(const char* ssid, const char* password)
         ESP_LOGW(TAG, "Failed to save WiFi credentials");
     }
     
-    wifi_config_t wifi_config = {
-        .sta = {
-            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
-            .pmf_cfg = {
-                .capable = true,
-                .required = false
-            },
-        },
-    };
-    
-    strncpy((char*)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid)-1);
-    strncpy((char*)wifi_config.sta.password, password, sizeof(wifi_config.sta.password)-1);
-    
-    // Stop WiFi if already running to safely switch modes
-    esp_err_t stop_err = esp_wifi_stop();
-    if (stop_err != ESP_OK && stop_err != ESP_ERR_WIFI_NOT_INIT && stop_err != ESP_ERR_WIFI_NOT_STARTED) {
-        ESP_LOGW(TAG, "esp_wifi_stop returned: %s", esp_err_to_name(stop_err));
-    }
+    wifi_manager_creds_t creds = {0};
+    strncpy(creds.ssid, ssid, sizeof(creds.ssid)-1);
+    strncpy(creds.password, password, sizeof(creds.password)-1);
 
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
-
-    // Explicitly trigger connection attempt
-    ESP_ERROR_CHECK(esp_wifi_connect());
-
-    ESP_LOGI(TAG, "WiFi STA mode started; connecting to SSID '%s'", ssid);
-    return ESP_OK;
+    return esp_event_post(WIFI_MANAGER_EVENT, WIFI_MANAGER_EVENT_START,
+                          &creds, sizeof(creds), portMAX_DELAY);
 }
 
 esp_err_t wifi_manager_start_ap(void)
 {
     ESP_LOGI(TAG, "Starting WiFi AP mode");
-    
-    wifi_config_t wifi_config = {
-        .ap = {
-            .ssid_len = strlen(WIFI_AP_SSID),
-            .channel = WIFI_AP_CHANNEL,
-            .password = WIFI_AP_PASSWORD,
-            .max_connection = WIFI_AP_MAX_CONN,
-            .authmode = WIFI_AUTH_WPA_WPA2_PSK,
-            .pmf_cfg = {
-                .required = false
-            },
-        },
-    };
-    
-    strcpy((char*)wifi_config.ap.ssid, WIFI_AP_SSID);
-    strcpy((char*)wifi_config.ap.password, WIFI_AP_PASSWORD);
-    
-    if (strlen(WIFI_AP_PASSWORD) == 0) {
-        wifi_config.ap.authmode = WIFI_AUTH_OPEN;
-    }
-    
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_AP));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
-    
-    ESP_LOGI(TAG, "WiFi AP mode started, SSID: %s, password: %s", WIFI_AP_SSID, WIFI_AP_PASSWORD);
-    return ESP_OK;
+
+    wifi_manager_creds_t none = {0};
+    return esp_event_post(WIFI_MANAGER_EVENT, WIFI_MANAGER_EVENT_START,
+                          &none, sizeof(none), portMAX_DELAY);
 }
 
 esp_err_t wifi_manager_stop(void)
 {
     ESP_LOGI(TAG, "Stopping WiFi");
+    esp_timer_stop(sta_timer);
     ESP_ERROR_CHECK(esp_wifi_stop());
     wifi_connected = false;
     memset(current_ip, 0, sizeof(current_ip));
+    xEventGroupClearBits(wifi_events, WIFI_CONNECTED_BIT | WIFI_AP_ACTIVE_BIT);
     return ESP_OK;
 }
 
@@ -232,6 +386,11 @@ bool wifi_manager_is_connected(void)
     return wifi_connected;
 }
 
+wifi_sm_state_t wifi_manager_get_state(void)
+{
+    return sta_sm.state;
+}
+
 esp_err_t wifi_manager_get_ip(char* ip_str, size_t len)
 {
     if (ip_str == NULL || len == 0) {
@@ -249,55 +408,48 @@ esp_err_t wifi_manager_get_ip(char* ip_str, size_t len)
 
 esp_err_t wifi_manager_try_connect_saved(void)
 {
-    char ssid[33] = {0};
-    char password[65] = {0};
+    wifi_manager_creds_t creds = {0};
     
-    esp_err_t err = wifi_manager_load_credentials(ssid, password, sizeof(ssid));
+    esp_err_t err = wifi_manager_load_credentials(creds.ssid, creds.password, sizeof(creds.ssid));
     if (err != ESP_OK) {
         ESP_LOGI(TAG, "No saved WiFi credentials found");
         return err;
     }
     
     ESP_LOGI(TAG, "Found saved WiFi credentials, attempting to connect");
-    return wifi_manager_start_sta(ssid, password);
+    return esp_event_post(WIFI_MANAGER_EVENT, WIFI_MANAGER_EVENT_START,
+                          &creds, sizeof(creds), portMAX_DELAY);
 }
 
 esp_err_t wifi_manager_bootstrap(void)
 {
-    // 1) Try saved credentials
-    if (wifi_manager_try_connect_saved() == ESP_OK) {
-        ESP_LOGI(TAG, "Attempting connect with saved credentials");
-        // Wait for connection or timeout
-        int waited = 0;
-        while (!wifi_manager_is_connected() && waited < WIFI_STA_CONNECT_TIMEOUT_MS) {
-            vTaskDelay(pdMS_TO_TICKS(250));
-            waited += 250;
-        }
-        if (wifi_manager_is_connected()) {
-            ESP_LOGI(TAG, "Connected using saved credentials");
-            return ESP_OK;
-        }
-        ESP_LOGW(TAG, "Saved credentials failed to connect within timeout");
+    // Credential sets in order of preference; the state machine rotates through them
+    // every WIFI_STA_MAX_RETRIES failures and brings up the AP if none connect.
+    sta_creds_count = 0;
+    if (wifi_manager_load_credentials(sta_creds[0].ssid, sta_creds[0].password,
+                                      sizeof(sta_creds[0].ssid)) == ESP_OK) {
+        sta_creds_count++;
     }
-
-    // 2) Try fallback credentials if defined
     if (strlen(WIFI_FALLBACK_SSID) > 0) {
-        ESP_LOGI(TAG, "Attempting connect with fallback credentials (SSID='%s')", WIFI_FALLBACK_SSID);
-        if (wifi_manager_start_sta(WIFI_FALLBACK_SSID, WIFI_FALLBACK_PASSWORD) == ESP_OK) {
-            int waited = 0;
-            while (!wifi_manager_is_connected() && waited < WIFI_STA_CONNECT_TIMEOUT_MS) {
-                vTaskDelay(pdMS_TO_TICKS(250));
-                waited += 250;
-            }
-            if (wifi_manager_is_connected()) {
-                ESP_LOGI(TAG, "Connected using fallback credentials");
-                return ESP_OK;
-            }
-            ESP_LOGW(TAG, "Fallback credentials failed to connect within timeout");
-        }
+        wifi_manager_creds_t *fallback = &sta_creds[sta_creds_count++];
+        strncpy(fallback->ssid, WIFI_FALLBACK_SSID, sizeof(fallback->ssid)-1);
+        strncpy(fallback->password, WIFI_FALLBACK_PASSWORD, sizeof(fallback->password)-1);
+    }
+
+    if (sta_creds_count == 0) {
+        ESP_LOGI(TAG, "No STA credentials; starting AP mode");
+        return wifi_manager_start_ap();
     }
 
-    // 3) Start AP mode
-    ESP_LOGI(TAG, "Starting AP mode as fallback");
-    return wifi_manager_start_ap();
+    wifi_manager_creds_t first = sta_creds[0];
+    int count = sta_creds_count;
+    esp_err_t err = esp_event_post(WIFI_MANAGER_EVENT, WIFI_MANAGER_EVENT_START,
+                                   &first, sizeof(first), portMAX_DELAY);
+    if (err != ESP_OK) {
+        return err;
+    }
+    // No waiting here: the state machine connects, retries or falls back to AP+STA on its
+    // own, and everything that needs the network follows the connection events
+    ESP_LOGI(TAG, "Attempting connect with %d credential set(s)", count);
+    return ESP_OK;
 }
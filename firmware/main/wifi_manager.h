@@ -3,6 +3,8 @@
 
 #include "esp_err.h"
 #include "esp_wifi.h"
+#include "esp_event.h"
+#include "wifi_sm.h"
 
 // WiFi Configuration
 #define WIFI_AP_SSID "Waveshare-Relay-AP"
@@ -24,9 +26,33 @@
 #ifndef WIFI_STA_CONNECT_TIMEOUT_MS
 #define WIFI_STA_CONNECT_TIMEOUT_MS 15000
 #endif
+// Consecutive failed attempts before the AP is started alongside STA (retries continue)
 #ifndef WIFI_STA_MAX_RETRIES
 #define WIFI_STA_MAX_RETRIES 5
 #endif
+#ifndef WIFI_STA_BACKOFF_MIN_MS
+#define WIFI_STA_BACKOFF_MIN_MS 500
+#endif
+#ifndef WIFI_STA_BACKOFF_MAX_MS
+#define WIFI_STA_BACKOFF_MAX_MS 30000
+#endif
+// Retry delay for a timer tick that could not be posted because the event queue was full
+#ifndef WIFI_STA_TIMER_REPOST_MS
+#define WIFI_STA_TIMER_REPOST_MS 50
+#endif
+
+// Events posted to the default loop; the connection state machine runs in its handler
+ESP_EVENT_DECLARE_BASE(WIFI_MANAGER_EVENT);
+
+typedef enum {
+    WIFI_MANAGER_EVENT_START,       // data: wifi_manager_creds_t
+    WIFI_MANAGER_EVENT_TIMER,
+} wifi_manager_event_t;
+
+typedef struct {
+    char ssid[33];
+    char password[65];
+} wifi_manager_creds_t;
 
 // Function declarations
 esp_err_t wifi_manager_init(void);
@@ -37,5 +63,6 @@ bool wifi_manager_is_connected(void);
 esp_err_t wifi_manager_get_ip(char* ip_str, size_t len);
 esp_err_t wifi_manager_try_connect_saved(void);
 esp_err_t wifi_manager_bootstrap(void);
+wifi_sm_state_t wifi_manager_get_state(void);
 
 #endif // WIFI_MANAGER_H
@@ -0,0 +1,182 @@
+#include "wifi_scan.h"
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "esp_event.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "WIFI_SCAN";
+
+// Deduplicated, RSSI-sorted results of the last completed scan
+static wifi_scan_result_t scan_cache[WIFI_SCAN_MAX_RESULTS];
+static size_t scan_cache_count = 0;
+static int64_t scan_cache_time_us = 0;     // 0 = never scanned
+
+static bool scan_in_progress = false;
+static int64_t scan_started_us = 0;
+static portMUX_TYPE scan_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Merge one AP record into the result set, keeping the strongest BSS per SSID
+static void wifi_scan_merge(wifi_scan_result_t *results, size_t *count, const wifi_ap_record_t *record)
+{
+    const char *ssid = (const char *)record->ssid;
+    if (ssid[0] == '\0') {
+        return; // Hidden network
+    }
+
+    for (size_t i = 0; i < *count; i++) {
+        if (strcmp(results[i].ssid, ssid) == 0) {
+            if (record->rssi > results[i].rssi) {
+                results[i].rssi = record->rssi;
+                results[i].channel = record->primary;
+                results[i].authmode = record->authmode;
+            }
+            return;
+        }
+    }
+
+    if (*count >= WIFI_SCAN_MAX_RESULTS) {
+        // Full: replace the weakest entry if this one is stronger
+        size_t weakest = 0;
+        for (size_t i = 1; i < *count; i++) {
+            if (results[i].rssi < results[weakest].rssi) {
+                weakest = i;
+            }
+        }
+        if (record->rssi <= results[weakest].rssi) {
+            return;
+        }
+        *count = *count - 1;
+        results[weakest] = results[*count];
+    }
+
+    wifi_scan_result_t *entry = &results[(*count)++];
+    strncpy(entry->ssid, ssid, sizeof(entry->ssid) - 1);
+    entry->ssid[sizeof(entry->ssid) - 1] = '\0';
+    entry->rssi = record->rssi;
+    entry->channel = record->primary;
+    entry->authmode = record->authmode;
+}
+
+static void wifi_scan_sort(wifi_scan_result_t *results, size_t count)
+{
+    // Insertion sort, strongest first; count is small
+    for (size_t i = 1; i < count; i++) {
+        wifi_scan_result_t tmp = results[i];
+        size_t j = i;
+        while (j > 0 && results[j - 1].rssi < tmp.rssi) {
+            results[j] = results[j - 1];
+            j--;
+        }
+        results[j] = tmp;
+    }
+}
+
+static void wifi_scan_done_handler(void* arg, esp_event_base_t event_base,
+                                   int32_t event_id, void* event_data)
+{
+    uint16_t number = WIFI_SCAN_MAX_RECORDS;
+    wifi_ap_record_t *records = calloc(number, sizeof(wifi_ap_record_t));
+    // Static: the default event loop task has a small stack, and only it runs this handler
+    static wifi_scan_result_t results[WIFI_SCAN_MAX_RESULTS];
+    size_t count = 0;
+
+    if (records == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate scan records");
+        esp_wifi_clear_ap_list();
+    } else {
+        esp_err_t err = esp_wifi_scan_get_ap_records(&number, records);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to get scan records: %s", esp_err_to_name(err));
+            number = 0;
+        }
+        for (uint16_t i = 0; i < number; i++) {
+            wifi_scan_merge(results, &count, &records[i]);
+        }
+        free(records);
+        wifi_scan_sort(results, count);
+    }
+
+    portENTER_CRITICAL(&scan_lock);
+    memcpy(scan_cache, results, count * sizeof(results[0]));
+    scan_cache_count = count;
+    scan_cache_time_us = esp_timer_get_time();
+    scan_in_progress = false;
+    portEXIT_CRITICAL(&scan_lock);
+
+    ESP_LOGI(TAG, "Scan done: %u records, %u networks", (unsigned)number, (unsigned)count);
+}
+
+esp_err_t wifi_scan_init(void)
+{
+    esp_err_t err = esp_event_handler_instance_register(WIFI_EVENT,
+                                                        WIFI_EVENT_SCAN_DONE,
+                                                        &wifi_scan_done_handler,
+                                                        NULL,
+                                                        NULL);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register scan handler: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    ESP_LOGI(TAG, "WiFi scan service initialized");
+    return ESP_OK;
+}
+
+// Start a background scan unless the cache is fresh or a scan is already running.
+// Returns ESP_OK if a scan is running (started now or earlier) or the cache is fresh.
+esp_err_t wifi_scan_request(void)
+{
+    int64_t now = esp_timer_get_time();
+    bool start = false;
+
+    portENTER_CRITICAL(&scan_lock);
+    bool fresh = scan_cache_time_us != 0 &&
+                 (now - scan_cache_time_us) < (int64_t)WIFI_SCAN_CACHE_TTL_MS * 1000;
+    bool stuck = scan_in_progress &&
+                 (now - scan_started_us) > (int64_t)WIFI_SCAN_TIMEOUT_MS * 1000;
+    if (!fresh && (!scan_in_progress || stuck)) {
+        scan_in_progress = true;
+        scan_started_us = now;
+        start = true;
+    }
+    portEXIT_CRITICAL(&scan_lock);
+
+    if (!start) {
+        return ESP_OK;
+    }
+
+    // Non-blocking: results arrive with WIFI_EVENT_SCAN_DONE
+    esp_err_t err = esp_wifi_scan_start(NULL, false);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start scan: %s", esp_err_to_name(err));
+        portENTER_CRITICAL(&scan_lock);
+        scan_in_progress = false;
+        portEXIT_CRITICAL(&scan_lock);
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Scan started");
+    return ESP_OK;
+}
+
+size_t wifi_scan_get_results(wifi_scan_result_t *results, size_t max_results,
+                             int64_t *age_ms, bool *in_progress)
+{
+    portENTER_CRITICAL(&scan_lock);
+    size_t count = scan_cache_count < max_results ? scan_cache_count : max_results;
+    memcpy(results, scan_cache, count * sizeof(results[0]));
+    int64_t cache_time = scan_cache_time_us;
+    bool running = scan_in_progress;
+    portEXIT_CRITICAL(&scan_lock);
+
+    if (age_ms != NULL) {
+        *age_ms = cache_time == 0 ? -1 : (esp_timer_get_time() - cache_time) / 1000;
+    }
+    if (in_progress != NULL) {
+        *in_progress = running;
+    }
+    return count;
+}
@@ -0,0 +1,37 @@
+#ifndef WIFI_SCAN_H
+#define WIFI_SCAN_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Scan cache configuration
+#ifndef WIFI_SCAN_MAX_RESULTS
+#define WIFI_SCAN_MAX_RESULTS 20
+#endif
+#ifndef WIFI_SCAN_MAX_RECORDS
+#define WIFI_SCAN_MAX_RECORDS 32
+#endif
+#ifndef WIFI_SCAN_CACHE_TTL_MS
+#define WIFI_SCAN_CACHE_TTL_MS 30000
+#endif
+// A scan that has not reported SCAN_DONE by then is considered lost
+#ifndef WIFI_SCAN_TIMEOUT_MS
+#define WIFI_SCAN_TIMEOUT_MS 10000
+#endif
+
+typedef struct {
+    char ssid[33];
+    int8_t rssi;
+    uint8_t channel;
+    uint8_t authmode;
+} wifi_scan_result_t;
+
+// Function declarations
+esp_err_t wifi_scan_init(void);
+esp_err_t wifi_scan_request(void);
+size_t wifi_scan_get_results(wifi_scan_result_t *results, size_t max_results,
+                             int64_t *age_ms, bool *in_progress);
+
+#endif // WIFI_SCAN_H
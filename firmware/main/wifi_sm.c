@@ -0,0 +1,117 @@
+#include "wifi_sm.h"
+#include <stddef.h>
+
+void wifi_sm_init(wifi_sm_t *sm, const wifi_sm_config_t *config)
+{
+    sm->config = *config;
+    if (sm->config.backoff_min_ms == 0) {
+        sm->config.backoff_min_ms = 1;
+    }
+    if (sm->config.backoff_max_ms < sm->config.backoff_min_ms) {
+        sm->config.backoff_max_ms = sm->config.backoff_min_ms;
+    }
+    if (sm->config.ap_fallback_failures == 0) {
+        sm->config.ap_fallback_failures = 1;
+    }
+    sm->state = WIFI_SM_STATE_IDLE;
+    sm->failures = 0;
+    sm->backoff_ms = sm->config.backoff_min_ms;
+    sm->timer_ms = 0;
+    sm->ap_active = false;
+}
+
+static uint32_t wifi_sm_begin_attempt(wifi_sm_t *sm)
+{
+    sm->state = WIFI_SM_STATE_CONNECTING;
+    sm->timer_ms = sm->config.connect_timeout_ms;
+    return WIFI_SM_ACTION_CONNECT | WIFI_SM_ACTION_ARM_TIMER;
+}
+
+// A connection attempt failed: schedule the next one with exponential backoff and bring up
+// the AP alongside STA once the failure threshold is reached. Retries never stop.
+static uint32_t wifi_sm_attempt_failed(wifi_sm_t *sm)
+{
+    uint32_t actions = WIFI_SM_ACTION_ARM_TIMER;
+
+    sm->failures++;
+    sm->state = WIFI_SM_STATE_BACKOFF;
+    sm->timer_ms = sm->backoff_ms;
+    sm->backoff_ms = (sm->backoff_ms > sm->config.backoff_max_ms / 2) ?
+                     sm->config.backoff_max_ms : sm->backoff_ms * 2;
+
+    if (sm->failures % sm->config.ap_fallback_failures == 0) {
+        actions |= WIFI_SM_ACTION_NEXT_CREDS;
+        if (!sm->ap_active) {
+            sm->ap_active = true;
+            actions |= WIFI_SM_ACTION_START_AP;
+        }
+    }
+    return actions;
+}
+
+uint32_t wifi_sm_handle_event(wifi_sm_t *sm, wifi_sm_event_t event)
+{
+    switch (event) {
+    case WIFI_SM_EVENT_START:
+        sm->failures = 0;
+        sm->backoff_ms = sm->config.backoff_min_ms;
+        return wifi_sm_begin_attempt(sm);
+
+    case WIFI_SM_EVENT_NO_CREDENTIALS:
+        sm->state = WIFI_SM_STATE_IDLE;
+        if (!sm->ap_active) {
+            sm->ap_active = true;
+            return WIFI_SM_ACTION_CANCEL_TIMER | WIFI_SM_ACTION_START_AP;
+        }
+        return WIFI_SM_ACTION_CANCEL_TIMER;
+
+    case WIFI_SM_EVENT_GOT_IP: {
+        uint32_t actions = WIFI_SM_ACTION_CANCEL_TIMER;
+        sm->state = WIFI_SM_STATE_CONNECTED;
+        sm->failures = 0;
+        sm->backoff_ms = sm->config.backoff_min_ms;
+        if (sm->ap_active) {
+            sm->ap_active = false;
+            actions |= WIFI_SM_ACTION_STOP_AP;
+        }
+        return actions;
+    }
+
+    case WIFI_SM_EVENT_DISCONNECTED:
+        if (sm->state == WIFI_SM_STATE_CONNECTED) {
+            // Link loss from a working connection: reconnect immediately, no backoff
+            return wifi_sm_begin_attempt(sm);
+        }
+        if (sm->state == WIFI_SM_STATE_CONNECTING) {
+            return wifi_sm_attempt_failed(sm);
+        }
+        return WIFI_SM_ACTION_NONE;
+
+    case WIFI_SM_EVENT_TIMER:
+        if (sm->state == WIFI_SM_STATE_BACKOFF) {
+            return wifi_sm_begin_attempt(sm);
+        }
+        if (sm->state == WIFI_SM_STATE_CONNECTING) {
+            // Attempt timed out; the DISCONNECTED that follows is ignored in BACKOFF
+            return WIFI_SM_ACTION_DISCONNECT | wifi_sm_attempt_failed(sm);
+        }
+        return WIFI_SM_ACTION_NONE;
+    }
+
+    return WIFI_SM_ACTION_NONE;
+}
+
+const char *wifi_sm_state_name(wifi_sm_state_t state)
+{
+    switch (state) {
+    case WIFI_SM_STATE_IDLE:
+        return "idle";
+    case WIFI_SM_STATE_CONNECTING:
+        return "connecting";
+    case WIFI_SM_STATE_CONNECTED:
+        return "connected";
+    case WIFI_SM_STATE_BACKOFF:
+        return "backoff";
+    }
+    return "unknown";
+}
@@ -0,0 +1,56 @@
+#ifndef WIFI_SM_H
+#define WIFI_SM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Pure STA connection state machine used by wifi_manager.c.
+// It has no ESP-IDF dependencies so it can be driven with synthetic events on the host;
+// the caller executes the returned actions against the Wi-Fi driver.
+
+typedef enum {
+    WIFI_SM_STATE_IDLE = 0,     // No credentials; only the AP is offered
+    WIFI_SM_STATE_CONNECTING,   // esp_wifi_connect() issued, waiting for IP or disconnect
+    WIFI_SM_STATE_CONNECTED,    // Got IP
+    WIFI_SM_STATE_BACKOFF,      // Waiting for the retry timer before the next attempt
+} wifi_sm_state_t;
+
+typedef enum {
+    WIFI_SM_EVENT_START = 0,    // Credentials configured (boot or POST /wifi)
+    WIFI_SM_EVENT_NO_CREDENTIALS,
+    WIFI_SM_EVENT_GOT_IP,
+    WIFI_SM_EVENT_DISCONNECTED,
+    WIFI_SM_EVENT_TIMER,        // Retry timer or connect timeout expired
+} wifi_sm_event_t;
+
+// Actions returned as a bitmask; timer actions use wifi_sm_t.timer_ms
+#define WIFI_SM_ACTION_NONE         0
+#define WIFI_SM_ACTION_CONNECT      (1 << 0)
+#define WIFI_SM_ACTION_DISCONNECT   (1 << 1)
+#define WIFI_SM_ACTION_ARM_TIMER    (1 << 2)
+#define WIFI_SM_ACTION_CANCEL_TIMER (1 << 3)
+#define WIFI_SM_ACTION_START_AP     (1 << 4)
+#define WIFI_SM_ACTION_STOP_AP      (1 << 5)
+#define WIFI_SM_ACTION_NEXT_CREDS   (1 << 6)
+
+typedef struct {
+    uint32_t backoff_min_ms;        // Delay before the first retry after a failed attempt
+    uint32_t backoff_max_ms;        // Upper bound for the exponential backoff
+    uint32_t connect_timeout_ms;    // Abort an attempt that neither connects nor fails
+    uint32_t ap_fallback_failures;  // Consecutive failures before the AP is brought up
+} wifi_sm_config_t;
+
+typedef struct {
+    wifi_sm_config_t config;
+    wifi_sm_state_t state;
+    uint32_t failures;              // Consecutive failed attempts since last GOT_IP
+    uint32_t backoff_ms;            // Delay that will be used for the next retry
+    uint32_t timer_ms;              // Delay for WIFI_SM_ACTION_ARM_TIMER
+    bool ap_active;
+} wifi_sm_t;
+
+void wifi_sm_init(wifi_sm_t *sm, const wifi_sm_config_t *config);
+uint32_t wifi_sm_handle_event(wifi_sm_t *sm, wifi_sm_event_t event);
+const char *wifi_sm_state_name(wifi_sm_state_t state);
+
+#endif // WIFI_SM_H
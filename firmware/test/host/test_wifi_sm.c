@@ -0,0 +1,165 @@
+#include "wifi_sm.h"
+#include <stdio.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK_EQ(actual, expected)                                                              \
+    do {                                                                                        \
+        unsigned long a_ = (unsigned long)(actual), e_ = (unsigned long)(expected);             \
+        if (a_ != e_) {                                                                         \
+            printf("%s:%d: %s is %lu, expected %lu\n", __FILE__, __LINE__, #actual, a_, e_);    \
+            failures++;                                                                         \
+        }                                                                                       \
+    } while (0)
+
+static const wifi_sm_config_t test_config = {
+    .backoff_min_ms = 500,
+    .backoff_max_ms = 4000,
+    .connect_timeout_ms = 15000,
+    .ap_fallback_failures = 3,
+};
+
+static void test_init_sanitizes_config(void)
+{
+    wifi_sm_t sm;
+    wifi_sm_config_t config = { .backoff_min_ms = 0, .backoff_max_ms = 0, .ap_fallback_failures = 0 };
+    wifi_sm_init(&sm, &config);
+    CHECK_EQ(sm.state, WIFI_SM_STATE_IDLE);
+    CHECK_EQ(sm.config.backoff_min_ms, 1);
+    CHECK_EQ(sm.config.backoff_max_ms, 1);
+    CHECK_EQ(sm.config.ap_fallback_failures, 1);
+    CHECK_EQ(sm.ap_active, false);
+}
+
+static void test_start_connects_with_timeout(void)
+{
+    wifi_sm_t sm;
+    wifi_sm_init(&sm, &test_config);
+    CHECK_EQ(wifi_sm_handle_event(&sm, WIFI_SM_EVENT_START), WIFI_SM_ACTION_CONNECT | WIFI_SM_ACTION_ARM_TIMER);
+    CHECK_EQ(sm.state, WIFI_SM_STATE_CONNECTING);
+    CHECK_EQ(sm.timer_ms, 15000);
+}
+
+static void test_backoff_doubles_and_caps(void)
+{
+    wifi_sm_t sm;
+    wifi_sm_init(&sm, &test_config);
+    wifi_sm_handle_event(&sm, WIFI_SM_EVENT_START);
+
+    const uint32_t expected[] = { 500, 1000, 2000, 4000, 4000 };
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        uint32_t actions = wifi_sm_handle_event(&sm, WIFI_SM_EVENT_DISCONNECTED);
+        CHECK_EQ(actions & WIFI_SM_ACTION_ARM_TIMER, WIFI_SM_ACTION_ARM_TIMER);
+        CHECK_EQ(sm.state, WIFI_SM_STATE_BACKOFF);
+        CHECK_EQ(sm.timer_ms, expected[i]);
+        CHECK_EQ(wifi_sm_handle_event(&sm, WIFI_SM_EVENT_TIMER), WIFI_SM_ACTION_CONNECT | WIFI_SM_ACTION_ARM_TIMER);
+        CHECK_EQ(sm.state, WIFI_SM_STATE_CONNECTING);
+    }
+    CHECK_EQ(sm.failures, 5);
+}
+
+static void test_ap_fallback_and_credential_rotation(void)
+{
+    wifi_sm_t sm;
+    wifi_sm_init(&sm, &test_config);
+    wifi_sm_handle_event(&sm, WIFI_SM_EVENT_START);
+
+    for (int i = 1; i <= 6; i++) {
+        uint32_t actions = wifi_sm_handle_event(&sm, WIFI_SM_EVENT_DISCONNECTED);
+        if (i == 3) {
+            CHECK_EQ(actions, WIFI_SM_ACTION_ARM_TIMER | WIFI_SM_ACTION_NEXT_CREDS | WIFI_SM_ACTION_START_AP);
+        } else if (i == 6) {
+            // The AP is already up; only the credentials rotate
+            CHECK_EQ(actions, WIFI_SM_ACTION_ARM_TIMER | WIFI_SM_ACTION_NEXT_CREDS);
+        } else {
+            CHECK_EQ(actions, WIFI_SM_ACTION_ARM_TIMER);
+        }
+        wifi_sm_handle_event(&sm, WIFI_SM_EVENT_TIMER);
+    }
+    CHECK_EQ(sm.ap_active, true);
+
+    CHECK_EQ(wifi_sm_handle_event(&sm, WIFI_SM_EVENT_GOT_IP), WIFI_SM_ACTION_CANCEL_TIMER | WIFI_SM_ACTION_STOP_AP);
+    CHECK_EQ(sm.state, WIFI_SM_STATE_CONNECTED);
+    CHECK_EQ(sm.ap_active, false);
+    CHECK_EQ(sm.failures, 0);
+    CHECK_EQ(sm.backoff_ms, 500);
+}
+
+static void test_link_loss_reconnects_at_once(void)
+{
+    wifi_sm_t sm;
+    wifi_sm_init(&sm, &test_config);
+    wifi_sm_handle_event(&sm, WIFI_SM_EVENT_START);
+    CHECK_EQ(wifi_sm_handle_event(&sm, WIFI_SM_EVENT_GOT_IP), WIFI_SM_ACTION_CANCEL_TIMER);
+    CHECK_EQ(wifi_sm_handle_event(&sm, WIFI_SM_EVENT_DISCONNECTED), WIFI_SM_ACTION_CONNECT | WIFI_SM_ACTION_ARM_TIMER);
+    CHECK_EQ(sm.state, WIFI_SM_STATE_CONNECTING);
+    CHECK_EQ(sm.failures, 0);
+}
+
+static void test_connect_timeout(void)
+{
+    wifi_sm_t sm;
+    wifi_sm_init(&sm, &test_config);
+    wifi_sm_handle_event(&sm, WIFI_SM_EVENT_START);
+    CHECK_EQ(wifi_sm_handle_event(&sm, WIFI_SM_EVENT_TIMER), WIFI_SM_ACTION_DISCONNECT | WIFI_SM_ACTION_ARM_TIMER);
+    CHECK_EQ(sm.state, WIFI_SM_STATE_BACKOFF);
+    CHECK_EQ(sm.failures, 1);
+    // The disconnect caused by the abort is not a second failure
+    CHECK_EQ(wifi_sm_handle_event(&sm, WIFI_SM_EVENT_DISCONNECTED), WIFI_SM_ACTION_NONE);
+    CHECK_EQ(sm.failures, 1);
+}
+
+static void test_no_credentials_starts_ap_once(void)
+{
+    wifi_sm_t sm;
+    wifi_sm_init(&sm, &test_config);
+    CHECK_EQ(wifi_sm_handle_event(&sm, WIFI_SM_EVENT_NO_CREDENTIALS),
+             WIFI_SM_ACTION_CANCEL_TIMER | WIFI_SM_ACTION_START_AP);
+    CHECK_EQ(sm.state, WIFI_SM_STATE_IDLE);
+    CHECK_EQ(wifi_sm_handle_event(&sm, WIFI_SM_EVENT_NO_CREDENTIALS), WIFI_SM_ACTION_CANCEL_TIMER);
+    // Stray events while idle do nothing
+    CHECK_EQ(wifi_sm_handle_event(&sm, WIFI_SM_EVENT_TIMER), WIFI_SM_ACTION_NONE);
+    CHECK_EQ(wifi_sm_handle_event(&sm, WIFI_SM_EVENT_DISCONNECTED), WIFI_SM_ACTION_NONE);
+}
+
+static void test_restart_resets_backoff(void)
+{
+    wifi_sm_t sm;
+    wifi_sm_init(&sm, &test_config);
+    wifi_sm_handle_event(&sm, WIFI_SM_EVENT_START);
+    wifi_sm_handle_event(&sm, WIFI_SM_EVENT_DISCONNECTED);
+    wifi_sm_handle_event(&sm, WIFI_SM_EVENT_TIMER);
+    wifi_sm_handle_event(&sm, WIFI_SM_EVENT_DISCONNECTED);
+    CHECK_EQ(sm.backoff_ms, 2000);
+    wifi_sm_handle_event(&sm, WIFI_SM_EVENT_START);
+    CHECK_EQ(sm.failures, 0);
+    CHECK_EQ(sm.backoff_ms, 500);
+}
+
+static void test_state_names(void)
+{
+    CHECK_EQ(strcmp(wifi_sm_state_name(WIFI_SM_STATE_IDLE), "idle"), 0);
+    CHECK_EQ(strcmp(wifi_sm_state_name(WIFI_SM_STATE_BACKOFF), "backoff"), 0);
+    CHECK_EQ(strcmp(wifi_sm_state_name((wifi_sm_state_t)42), "unknown"), 0);
+}
+
+int main(void)
+{
+    test_init_sanitizes_config();
+    test_start_connects_with_timeout();
+    test_backoff_doubles_and_caps();
+    test_ap_fallback_and_credential_rotation();
+    test_link_loss_reconnects_at_once();
+    test_connect_timeout();
+    test_no_credentials_starts_ap_once();
+    test_restart_resets_backoff();
+    test_state_names();
+
+    if (failures > 0) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All wifi_sm tests passed\n");
+    return 0;
+}